@@ -0,0 +1,438 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Token passing bus arbitration
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_ARBITER
+  #define DEBUG_LEVEL DEBUG_LEVEL_ARBITER
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLPrograms.h"
+
+#include "Fire_Control_Arbiter.h"
+
+/* Position of an address in the list of masters, -1 if it isn't a master */
+static int8_t arb_master_index(bus_arbiter_t *arb, uint16_t address) {
+  for (uint8_t i = 0; i < arb->num_masters; i++) {
+    if (arb->masters[i] == address) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* The next master after position i that has not been found absent */
+static uint8_t arb_next_master(bus_arbiter_t *arb, uint8_t i) {
+  do {
+    i = (i + 1) % arb->num_masters;
+  } while ((i != arb->index) && (arb->absent & (1 << i)));
+  return i;
+}
+
+static void arb_set_state(bus_arbiter_t *arb, uint8_t state,
+                          unsigned long now) {
+  arb->state = state;
+  arb->since = now;
+  arb->burst = 0;
+  arb->retries = 0;
+}
+
+boolean arb_init(bus_arbiter_t *arb, uint16_t address,
+                 const uint16_t *masters, uint8_t num_masters,
+                 unsigned long now) {
+  memset(arb, 0, sizeof (*arb));
+
+  for (uint8_t i = 0; (i < num_masters) && (i < ARB_MAX_MASTERS); i++) {
+    if (masters[i] == 0) {
+      break;
+    }
+    arb->masters[arb->num_masters++] = masters[i];
+  }
+
+  int8_t index = arb_master_index(arb, address);
+  if (index < 0) {
+    arb->num_masters = 0;
+    return false;
+  }
+  arb->index = index;
+  arb->last_heard = now;
+
+  /* The first master starts with the token */
+  arb_set_state(arb, (index == 0) ? ARB_HOLDING : ARB_WAITING, now);
+  return true;
+}
+
+uint8_t arb_pending(bus_arbiter_t *arb, uint8_t priority) {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+    if (arb->queue[i].used && (arb->queue[i].priority >= priority)) {
+      count++;
+    }
+  }
+  for (uint8_t i = 0; i < ARB_SAFETY_FRAMES; i++) {
+    if (arb->safety[i].used) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Oldest queued frame of the highest priority, NULL if the queue is empty */
+static arb_frame_t *arb_select(bus_arbiter_t *arb) {
+  arb_frame_t *best = NULL;
+  for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+    arb_frame_t *frame = &arb->queue[i];
+    if (!frame->used) {
+      continue;
+    }
+    if ((best == NULL) || (frame->priority > best->priority) ||
+        ((frame->priority == best->priority) &&
+         ((int16_t)(frame->seq - best->seq) < 0))) {
+      best = frame;
+    }
+  }
+  return best;
+}
+
+/* Oldest queued off or cancel frame, NULL if there are none */
+static arb_safety_t *arb_select_safety(bus_arbiter_t *arb) {
+  arb_safety_t *best = NULL;
+  for (uint8_t i = 0; i < ARB_SAFETY_FRAMES; i++) {
+    arb_safety_t *safety = &arb->safety[i];
+    if (safety->used &&
+        ((best == NULL) || ((int16_t)(safety->seq - best->seq) < 0))) {
+      best = safety;
+    }
+  }
+  return best;
+}
+
+/* Returns true for a frame turning an output off or cancelling its program */
+static boolean arb_is_safety(const byte *data, uint8_t len) {
+  const msg_hdr_t *msg_hdr = (const msg_hdr_t *)data;
+  if ((len <= ARB_SAFETY_HEAD) || (len > ARB_SAFETY_MAX_LEN) ||
+      (msg_hdr->type != MSG_TYPE_OUTPUT)) {
+    return false;
+  }
+
+  const msg_output_hdr_t *out_hdr =
+          (const msg_output_hdr_t *)(data + sizeof (msg_hdr_t));
+  switch (out_hdr->type) {
+    case HMTL_OUTPUT_VALUE:
+      return ((len == sizeof (msg_hdr_t) + sizeof (msg_value_t)) &&
+              (((const msg_value_t *)out_hdr)->value == 0));
+    case HMTL_OUTPUT_PROGRAM:
+      /* The program's values are ignored when cancelling */
+      return (((const msg_program_t *)out_hdr)->type == HMTL_PROGRAM_NONE);
+  }
+  return false;
+}
+
+/*
+ * Drop queued frames to the same output that an off or cancel frame undoes,
+ * a value by an off and a program by a cancel.
+ */
+static void arb_supersede(bus_arbiter_t *arb, const byte *data) {
+  const msg_hdr_t *msg_hdr = (const msg_hdr_t *)data;
+  const msg_output_hdr_t *out_hdr =
+          (const msg_output_hdr_t *)(data + sizeof (msg_hdr_t));
+
+  for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+    arb_frame_t *frame = &arb->queue[i];
+    if (!frame->used || (frame->priority == ARB_PRIORITY_SAFETY) ||
+        (frame->len <= ARB_SAFETY_HEAD)) {
+      continue;
+    }
+
+    const msg_hdr_t *queued_hdr = (const msg_hdr_t *)frame->data;
+    const msg_output_hdr_t *queued_out =
+            (const msg_output_hdr_t *)(frame->data + sizeof (msg_hdr_t));
+    if ((queued_hdr->type == MSG_TYPE_OUTPUT) &&
+        (queued_hdr->address == msg_hdr->address) &&
+        (queued_out->type == out_hdr->type) &&
+        ((queued_out->output == out_hdr->output) ||
+         (out_hdr->output == HMTL_ALL_OUTPUTS))) {
+      frame->used = false;
+      arb->stats.superseded++;
+    }
+  }
+}
+
+/* Returns true if the same off or cancel frame is already queued */
+static boolean arb_is_queued(bus_arbiter_t *arb, uint16_t dest,
+                             const byte *data, uint8_t len) {
+  for (uint8_t i = 0; i < ARB_SAFETY_FRAMES; i++) {
+    arb_safety_t *safety = &arb->safety[i];
+    if (safety->used && (safety->dest == dest) && (safety->len == len) &&
+        (memcmp(safety->head, data, ARB_SAFETY_HEAD) == 0)) {
+      return true;
+    }
+  }
+  for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+    arb_frame_t *frame = &arb->queue[i];
+    if (frame->used && (frame->priority == ARB_PRIORITY_SAFETY) &&
+        (frame->dest == dest) && (frame->len == len) &&
+        (memcmp(frame->data, data, ARB_SAFETY_HEAD) == 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Queue an off or cancel frame in a slot of its own if one is free */
+static boolean arb_queue_safety(bus_arbiter_t *arb, uint16_t dest,
+                                const byte *data, uint8_t len,
+                                unsigned long now) {
+  for (uint8_t i = 0; i < ARB_SAFETY_FRAMES; i++) {
+    arb_safety_t *safety = &arb->safety[i];
+    if (!safety->used) {
+      safety->used = true;
+      safety->len = len;
+      safety->dest = dest;
+      safety->seq = arb->seq++;
+      safety->queued = now;
+      memcpy(safety->head, data, ARB_SAFETY_HEAD);
+      return true;
+    }
+  }
+  return false;
+}
+
+boolean arb_queue(bus_arbiter_t *arb, uint16_t dest,
+                  const byte *data, uint8_t len, uint8_t priority,
+                  unsigned long now) {
+  if (len > ARB_FRAME_SIZE) {
+    arb->stats.dropped++;
+    return false;
+  }
+
+  if (arb_is_safety(data, len)) {
+    priority = ARB_PRIORITY_SAFETY;
+    arb_supersede(arb, data);
+    if (arb_is_queued(arb, dest, data, len)) {
+      arb->stats.merged++;
+      return true;
+    }
+    if (arb_queue_safety(arb, dest, data, len, now)) {
+      return true;
+    }
+  }
+
+  arb_frame_t *slot = NULL;
+  arb_frame_t *replace = NULL;
+  for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+    arb_frame_t *frame = &arb->queue[i];
+    if (!frame->used) {
+      slot = frame;
+      break;
+    }
+    if ((frame->priority < priority) &&
+        ((replace == NULL) || (frame->priority < replace->priority) ||
+         ((frame->priority == replace->priority) &&
+          ((int16_t)(frame->seq - replace->seq) < 0)))) {
+      replace = frame;
+    }
+  }
+
+  if (slot == NULL) {
+    /* Full, replace the oldest frame of the lowest priority below this */
+    arb->stats.dropped++;
+    if (replace == NULL) {
+      DEBUG3_VALUELN("Arb drop to:", dest);
+      return false;
+    }
+    slot = replace;
+  }
+
+  slot->used = true;
+  slot->priority = priority;
+  slot->len = len;
+  slot->dest = dest;
+  slot->seq = arb->seq++;
+  slot->queued = now;
+  memcpy(slot->data, data, len);
+  return true;
+}
+
+void arb_observe(bus_arbiter_t *arb, uint16_t source, uint16_t dest,
+                 uint8_t type, unsigned long now) {
+  if (arb->num_masters == 0) {
+    return;
+  }
+
+  int8_t index = arb_master_index(arb, source);
+  if ((index >= 0) && (index != arb->index)) {
+    arb->last_heard = now;
+    arb->absent &= ~(1 << index);
+
+    switch (arb->state) {
+      case ARB_PASSING:
+        if (index == arb->pass_to) {
+          /* The pass was accepted */
+          arb_set_state(arb, ARB_WAITING, now);
+        }
+        break;
+      case ARB_HOLDING:
+        /* Two masters think they have the token, the later one yields */
+        arb->stats.collisions++;
+        DEBUG2_VALUELN("Arb collision with:", source);
+        if (index < arb->index) {
+          arb_set_state(arb, ARB_WAITING, now);
+        }
+        break;
+    }
+  }
+
+  if ((type == MSG_TYPE_FIRE_TOKEN) && (dest == arb->masters[arb->index])) {
+    arb->stats.tokens++;
+    arb_set_state(arb, ARB_HOLDING, now);
+  }
+}
+
+/* Record a queued frame being sent */
+static void arb_sent(bus_arbiter_t *arb, unsigned long queued,
+                     unsigned long now) {
+  uint32_t wait = now - queued;
+  arb->stats.sent++;
+  arb->stats.wait_total += wait;
+  if (wait > arb->stats.wait_max) {
+    arb->stats.wait_max = wait;
+  }
+}
+
+/* Format a token frame for the master being passed to */
+static const byte *arb_token(bus_arbiter_t *arb, uint16_t *dest,
+                             uint8_t *len) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)arb->token;
+  msg_hdr->startcode = HMTL_MSG_START;
+  msg_hdr->crc = 0;
+  msg_hdr->version = HMTL_MSG_VERSION;
+  msg_hdr->length = sizeof (msg_hdr_t);
+  msg_hdr->type = MSG_TYPE_FIRE_TOKEN;
+  msg_hdr->flags = 0;
+  msg_hdr->address = arb->masters[arb->pass_to];
+
+  *dest = msg_hdr->address;
+  *len = sizeof (msg_hdr_t);
+  return arb->token;
+}
+
+static const byte *arb_pass(bus_arbiter_t *arb, unsigned long now,
+                            uint16_t *dest, uint8_t *len) {
+  arb->pass_to = arb_next_master(arb, arb->index);
+  if (arb->pass_to == arb->index) {
+    /* Every other master is absent, keep sending */
+    arb_set_state(arb, ARB_HOLDING, now);
+    return NULL;
+  }
+
+  arb_set_state(arb, ARB_PASSING, now);
+  arb->stats.passes++;
+  return arb_token(arb, dest, len);
+}
+
+const byte *arb_next(bus_arbiter_t *arb, unsigned long now,
+                     uint16_t *dest, uint8_t *len) {
+  if (arb->num_masters == 0) {
+    return NULL;
+  }
+
+  switch (arb->state) {
+    case ARB_WAITING: {
+      /* Masters earlier in the list recreate a lost token first */
+      unsigned long lost = (unsigned long)arb->num_masters *
+              ARB_PASS_TIMEOUT_MS * (ARB_PASS_RETRIES + 1) +
+              arb->index * ARB_PASS_TIMEOUT_MS;
+      if ((now - arb->last_heard < lost) || (now - arb->since < lost)) {
+        return NULL;
+      }
+      DEBUG2_PRINTLN("Arb token lost");
+      arb->stats.regenerated++;
+      arb_set_state(arb, ARB_HOLDING, now);
+      break;
+    }
+
+    case ARB_PASSING: {
+      if (now - arb->since < ARB_PASS_TIMEOUT_MS) {
+        return NULL;
+      }
+      if (arb->retries < ARB_PASS_RETRIES) {
+        arb->retries++;
+        arb->stats.retries++;
+        arb->since = now;
+        return arb_token(arb, dest, len);
+      }
+
+      /* Skip the master and pass to the following one */
+      DEBUG2_VALUELN("Arb absent:", arb->masters[arb->pass_to]);
+      if (arb->absent == 0) {
+        arb->absent_since = now;
+      }
+      arb->absent |= (1 << arb->pass_to);
+      return arb_pass(arb, now, dest, len);
+    }
+  }
+
+  /* Holding the token, off and cancel frames are sent first */
+  arb_safety_t *safety = arb_select_safety(arb);
+  arb_frame_t *frame = arb_select(arb);
+  unsigned long held = now - arb->since;
+
+  if (safety && frame && (frame->priority == ARB_PRIORITY_SAFETY) &&
+      ((int16_t)(frame->seq - safety->seq) < 0)) {
+    /* One that didn't fit in its own slots was queued earlier */
+    safety = NULL;
+  }
+
+  if (safety && (arb->burst < ARB_MAX_BURST)) {
+    safety->used = false;
+    arb->burst++;
+    arb_sent(arb, safety->queued, now);
+
+    memset(arb->safety_frame, 0, sizeof (arb->safety_frame));
+    memcpy(arb->safety_frame, safety->head, ARB_SAFETY_HEAD);
+    *dest = safety->dest;
+    *len = safety->len;
+    return arb->safety_frame;
+  }
+
+  if (frame && (arb->burst < ARB_MAX_BURST) &&
+      ((frame->priority >= ARB_PRIORITY_FIRE) || (held < ARB_HOLD_MS))) {
+    frame->used = false;
+    arb->burst++;
+    arb_sent(arb, frame->queued, now);
+
+    *dest = frame->dest;
+    *len = frame->len;
+    return frame->data;
+  }
+
+  if ((frame == NULL) && (safety == NULL) && (held < ARB_IDLE_HOLD_MS)) {
+    return NULL;
+  }
+
+  if (arb_next_master(arb, arb->index) == arb->index) {
+    /* Alone on the bus, periodically check if the others have returned */
+    if (now - arb->absent_since < ARB_REJOIN_MS) {
+      arb_set_state(arb, ARB_HOLDING, now);
+      return NULL;
+    }
+
+    /* A single attempt is made so that fire frames aren't held up */
+    arb->absent = 0;
+    const byte *token = arb_pass(arb, now, dest, len);
+    arb->retries = ARB_PASS_RETRIES;
+    return token;
+  }
+
+  return arb_pass(arb, now, dest, len);
+}
@@ -0,0 +1,159 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Token passing arbitration for several controllers sharing one RS485 segment.
+ *
+ * The controllers ("masters") are listed in the same order in each one's
+ * settings.  Only the master holding the token transmits, and it passes the
+ * token to the next master in the list once it has nothing left to send, has
+ * sent ARB_MAX_BURST frames, or has held the token for ARB_HOLD_MS.  Fire
+ * frames are sent before any cosmetic frames and are not subject to the hold
+ * time, so a master waits at most for each other master's burst before it can
+ * fire.  Frames turning an output off or cancelling it are sent before either
+ * and are never dropped, see arb_queue().
+ *
+ * A pass is confirmed by hearing any frame from the receiving master.  A pass
+ * that isn't confirmed is retried and the master is then skipped as absent.
+ * If the token is lost entirely the first master to time out, in list order,
+ * creates a new one.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_ARBITER_H
+#define FIRE_CONTROL_ARBITER_H
+
+#include "Arduino.h"
+#include "HMTLMessaging.h"
+
+/* Message passing the token to the addressed master */
+#define MSG_TYPE_FIRE_TOKEN 0x21
+
+#define ARB_MAX_MASTERS     4
+
+#define ARB_HOLD_MS         20   // Time cosmetic frames may be sent per token
+#define ARB_IDLE_HOLD_MS    5    // Time an idle master keeps the token
+#define ARB_MAX_BURST       4    // Frames sent per token
+#define ARB_PASS_TIMEOUT_MS 50   // Time to wait for a pass to be confirmed
+#define ARB_PASS_RETRIES    2
+#define ARB_REJOIN_MS       1000 // Time between passes when the others are absent
+
+#define ARB_FRAME_SIZE      64   // Matches the RS485 send buffer
+#ifdef ESP32
+  #define ARB_QUEUE_FRAMES  16
+#else
+  #define ARB_QUEUE_FRAMES  3
+#endif
+
+#define ARB_PRIORITY_COSMETIC 0
+#define ARB_PRIORITY_FIRE     1
+#define ARB_PRIORITY_SAFETY   2 // Turning an output off or cancelling it
+
+/*
+ * Off and cancel frames are kept apart from the queue as just their message
+ * and output headers, the rest of either frame is zero.  There is room for a
+ * cancel and an off to the poofer group and to each valve.
+ */
+#define ARB_SAFETY_HEAD    (sizeof (msg_hdr_t) + sizeof (msg_output_hdr_t))
+#define ARB_SAFETY_MAX_LEN (sizeof (msg_hdr_t) + sizeof (msg_program_t))
+#ifdef ESP32
+  #define ARB_SAFETY_FRAMES 16
+#else
+  #define ARB_SAFETY_FRAMES 12
+#endif
+
+#define ARB_WAITING 0
+#define ARB_HOLDING 1
+#define ARB_PASSING 2
+
+typedef struct {
+  uint32_t sent;        // Frames sent
+  uint32_t dropped;     // Frames dropped with the queue full
+  uint32_t merged;      // Off or cancel frames that were already queued
+  uint32_t superseded;  // Frames dropped for a later off or cancel
+  uint32_t tokens;      // Tokens received
+  uint32_t passes;      // Tokens passed
+  uint32_t retries;     // Passes repeated after no response
+  uint32_t regenerated; // Tokens created after one was lost
+  uint32_t collisions;  // Frames heard from another master while holding
+  uint32_t wait_total;  // Total ms frames spent queued
+  uint32_t wait_max;    // Longest ms a frame spent queued
+} arb_stats_t;
+
+typedef struct {
+  uint8_t  used;
+  uint8_t  priority;
+  uint8_t  len;
+  uint16_t dest;
+  uint16_t seq;
+  unsigned long queued;
+  byte     data[ARB_FRAME_SIZE];
+} arb_frame_t;
+
+typedef struct {
+  uint8_t  used;
+  uint8_t  len;
+  uint16_t dest;
+  uint16_t seq;
+  unsigned long queued;
+  byte     head[ARB_SAFETY_HEAD];
+} arb_safety_t;
+
+typedef struct {
+  uint16_t masters[ARB_MAX_MASTERS];
+  uint8_t  num_masters;
+  uint8_t  index;    // Position of this master in the list
+  uint8_t  pass_to;  // Position of the master the token is passed to
+  uint8_t  absent;   // Mask of masters that did not accept the token
+
+  uint8_t  state;
+  uint8_t  retries;
+  uint8_t  burst;
+  unsigned long since;      // Time of the last state change
+  unsigned long last_heard; // Time another master was last heard
+  unsigned long absent_since;
+
+  uint16_t seq;
+  byte token[sizeof (msg_hdr_t)];
+  arb_frame_t queue[ARB_QUEUE_FRAMES];
+  arb_safety_t safety[ARB_SAFETY_FRAMES];
+  byte safety_frame[ARB_SAFETY_MAX_LEN]; // Off or cancel frame being sent
+
+  arb_stats_t stats;
+} bus_arbiter_t;
+
+/*
+ * Setup an arbiter for the master at address, returns false if the address
+ * is not in the list of masters.
+ */
+boolean arb_init(bus_arbiter_t *arb, uint16_t address,
+                 const uint16_t *masters, uint8_t num_masters,
+                 unsigned long now);
+
+/*
+ * Queue a frame to be sent when the token is held.  Off and cancel frames are
+ * recognized whatever the priority they're queued with.
+ */
+boolean arb_queue(bus_arbiter_t *arb, uint16_t dest,
+                  const byte *data, uint8_t len, uint8_t priority,
+                  unsigned long now);
+
+/* Record a frame heard on the bus */
+void arb_observe(bus_arbiter_t *arb, uint16_t source, uint16_t dest,
+                 uint8_t type, unsigned long now);
+
+/*
+ * Return the next frame that may be sent, or NULL if nothing may be sent now.
+ * The frame remains valid until the arbiter is next called.
+ */
+const byte *arb_next(bus_arbiter_t *arb, unsigned long now,
+                     uint16_t *dest, uint8_t *len);
+
+/* Number of frames of at least the given priority waiting to be sent */
+uint8_t arb_pending(bus_arbiter_t *arb,
+                    uint8_t priority = ARB_PRIORITY_COSMETIC);
+
+/* The controller's arbiter, setup by bus_arbiter_init() */
+extern bus_arbiter_t bus_arbiter;
+
+#endif
@@ -0,0 +1,199 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * USB host to RS485 bridge
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_BRIDGE
+  #define DEBUG_LEVEL DEBUG_LEVEL_BRIDGE
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Bridge.h"
+#include "modes.h"
+
+bridge_stats_t bridge_stats;
+
+/*
+ * Frames are read from the host directly into a ring of slots and forwarded
+ * from there.  A frame that arrives when every slot is full is read into the
+ * overflow slot and dropped.
+ */
+byte bridge_slots[BRIDGE_SLOTS + 1][SEND_DATA_SIZE];
+#define BRIDGE_OVERFLOW BRIDGE_SLOTS
+
+byte bridge_head = 0;        // Oldest complete frame
+byte bridge_count = 0;       // Number of complete frames
+uint16_t bridge_rx_pos = 0;  // Bytes received of the frame being read
+byte bridge_credits_owed = 0;
+
+boolean bridge_enabled() {
+  return (fire_config.flags & FIRE_FLAG_USB_BRIDGE);
+}
+
+void bridge_grant(byte credits) {
+  Serial.print(F(BRIDGE_CREDIT_PREFIX));
+  Serial.println(credits);
+}
+
+void bridge_init() {
+  if (!bridge_enabled()) {
+    return;
+  }
+
+  uint32_t baud = fire_config.usb_baud ? fire_config.usb_baud : BRIDGE_USB_BAUD;
+  if (baud != BAUD) {
+    DEBUG2_VALUELN("Bridge USB baud:", baud);
+    Serial.flush();
+    Serial.begin(baud);
+  }
+
+  memset(&bridge_stats, 0, sizeof (bridge_stats));
+  bridge_head = 0;
+  bridge_count = 0;
+  bridge_rx_pos = 0;
+  bridge_credits_owed = 0;
+
+  bridge_grant(BRIDGE_SLOTS);
+}
+
+/* Longest frame that can be forwarded */
+uint16_t bridge_frame_limit() {
+  if (rs485.send_data_size < SEND_DATA_SIZE) {
+    return rs485.send_data_size;
+  }
+  return SEND_DATA_SIZE;
+}
+
+void bridge_receive() {
+  if (!bridge_enabled()) {
+    return;
+  }
+
+  byte slot = BRIDGE_OVERFLOW;
+  if (bridge_count < BRIDGE_SLOTS) {
+    slot = (bridge_head + bridge_count) % BRIDGE_SLOTS;
+  }
+  byte *frame = bridge_slots[slot];
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)frame;
+
+  while (Serial.available()) {
+    byte c = Serial.read();
+    if ((bridge_rx_pos == 0) && (c != HMTL_MSG_START)) {
+      /* Skip anything between frames */
+      continue;
+    }
+
+    frame[bridge_rx_pos++] = c;
+    if (bridge_rx_pos < sizeof (msg_hdr_t)) {
+      continue;
+    }
+
+    if ((bridge_rx_pos == sizeof (msg_hdr_t)) &&
+        ((msg_hdr->length < sizeof (msg_hdr_t)) ||
+         (msg_hdr->length > bridge_frame_limit()))) {
+      DEBUG2_VALUELN("Bridge bad len:", msg_hdr->length);
+      bridge_stats.malformed++;
+      bridge_rx_pos = 0;
+      continue;
+    }
+
+    if (bridge_rx_pos < msg_hdr->length) {
+      continue;
+    }
+
+    /* Frame complete */
+    bridge_rx_pos = 0;
+    bridge_stats.frames++;
+    if (slot == BRIDGE_OVERFLOW) {
+      bridge_stats.overruns++;
+      continue;
+    }
+
+    bridge_count++;
+    if (bridge_count == BRIDGE_SLOTS) {
+      slot = BRIDGE_OVERFLOW;
+    } else {
+      slot = (bridge_head + bridge_count) % BRIDGE_SLOTS;
+    }
+    frame = bridge_slots[slot];
+    msg_hdr = (msg_hdr_t *)frame;
+  }
+}
+
+void bridge_report() {
+  static unsigned long last_report = 0;
+  static uint32_t last_bytes = 0;
+  if (millis() - last_report < BRIDGE_REPORT_PERIOD_MS) {
+    return;
+  }
+
+  bridge_stats.rate = (bridge_stats.bytes - last_bytes) * 1000 /
+                      (millis() - last_report);
+  last_report = millis();
+  last_bytes = bridge_stats.bytes;
+
+  DEBUG3_VALUE("Bridge frames:", bridge_stats.frames);
+  DEBUG3_VALUE(" fwd:", bridge_stats.forwarded);
+  DEBUG3_VALUE(" local:", bridge_stats.local);
+  DEBUG3_VALUE(" B/s:", bridge_stats.rate);
+  DEBUG3_VALUE(" overrun:", bridge_stats.overruns);
+  DEBUG3_VALUELN(" bad:", bridge_stats.malformed);
+}
+
+/*
+ * Forward received frames onto the bus.  This is called once the messages
+ * generated locally during the pass have been sent, and a limited number of
+ * frames are forwarded per pass so that the sensors are not starved.
+ */
+void bridge_forward() {
+  if (!bridge_enabled()) {
+    return;
+  }
+
+  byte sent = 0;
+  while (bridge_count && (sent < BRIDGE_FORWARD_LIMIT) && !bus_busy()) {
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)bridge_slots[bridge_head];
+
+    if (msg_hdr->address != config.address) {
+      /* The frame is copied once, into the send buffer or arbiter queue */
+      bus_send(msg_hdr->address, (byte *)msg_hdr, msg_hdr->length,
+               bus_priority(msg_hdr->address));
+      bridge_stats.forwarded++;
+      bridge_stats.bytes += msg_hdr->length;
+      sent++;
+    }
+
+    if ((msg_hdr->address == config.address) ||
+        (msg_hdr->address == SOCKET_ADDR_ANY)) {
+      handle_local_msg(msg_hdr);
+      bridge_stats.local++;
+    }
+
+    bridge_head = (bridge_head + 1) % BRIDGE_SLOTS;
+    bridge_count--;
+    bridge_credits_owed++;
+  }
+
+  /* Return credits in batches unless the host has run dry */
+  if (bridge_credits_owed &&
+      ((bridge_count == 0) || (bridge_credits_owed >= BRIDGE_SLOTS / 2))) {
+    bridge_grant(bridge_credits_owed);
+    bridge_credits_owed = 0;
+  }
+
+  bridge_report();
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Bridge mode, forwarding HMTL frames from the USB host onto the RS485 bus.
+ *
+ * The host must not send more frames than it has been granted credits for.
+ * Credits are granted with a line of the form "credit <n>", one credit for
+ * each receive slot, and a further credit is granted each time a slot is
+ * freed by forwarding its frame.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_BRIDGE_H
+#define FIRE_CONTROL_BRIDGE_H
+
+#include "Arduino.h"
+
+#ifdef ESP32
+  #define BRIDGE_USB_BAUD      921600
+  #define BRIDGE_SLOTS         16
+  #define BRIDGE_FORWARD_LIMIT 4  // Frames forwarded per pass through the loop
+#else
+  #define BRIDGE_USB_BAUD      BAUD
+  #define BRIDGE_SLOTS         3
+  #define BRIDGE_FORWARD_LIMIT 1
+#endif
+
+#define BRIDGE_CREDIT_PREFIX "credit "
+#define BRIDGE_REPORT_PERIOD_MS (30 * 1000L)
+
+typedef struct {
+  uint32_t frames;    // Complete frames received from the host
+  uint32_t local;     // Frames handled by this controller
+  uint32_t forwarded; // Frames sent onto the bus
+  uint32_t bytes;     // Bytes sent onto the bus
+  uint32_t overruns;  // Frames dropped due to the host exceeding its credits
+  uint32_t malformed; // Frames dropped due to a bad header
+  uint32_t rate;      // Bytes per second sent onto the bus, over the last report
+} bridge_stats_t;
+
+extern bridge_stats_t bridge_stats;
+
+/* Switch the host serial port to the bridge rate and grant initial credits */
+void bridge_init();
+boolean bridge_enabled();
+
+/* Read any available bytes from the host */
+void bridge_receive();
+
+/* Forward completed frames, called after local messages have been sent */
+void bridge_forward();
+
+#endif
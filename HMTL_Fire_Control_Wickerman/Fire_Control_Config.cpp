@@ -0,0 +1,98 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Fire control settings storage
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_CONFIG
+  #define DEBUG_LEVEL DEBUG_LEVEL_CONFIG
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+#include "EEPROM.h"
+#include "EEPromUtils.h"
+#include "RS485Utils.h"
+
+#include "Fire_Control_Config.h"
+
+fire_config_t fire_config;
+
+/* EEPROM address of the settings, -1 if they can't be stored */
+int fire_config_offset = -1;
+
+/* Default send rate limits, indexed by RATE_CLASS_* */
+const fire_rate_t default_rates[NUM_RATE_CLASSES] = {
+  {  2,  2 }, // Igniter
+  {  2,  2 }, // Pilot
+  { 20,  5 }, // Accumulator
+  { 25, 10 }  // Lights
+};
+
+void fire_config_defaults() {
+  memset(&fire_config, 0, sizeof (fire_config));
+  fire_config.magic = FIRE_CONFIG_MAGIC;
+  fire_config.version = FIRE_CONFIG_VERSION;
+  fire_config.bus_baud = RS485Socket::DEFAULT_BAUD;
+  fire_config.max_baud = RS485Socket::DEFAULT_BAUD;
+  memcpy(fire_config.rate_limits, default_rates, sizeof (default_rates));
+}
+
+void fire_config_init(int offset) {
+  fire_config_offset = offset;
+
+  if ((offset < 0) ||
+      (eeprom_read_objects(offset, (byte *)&fire_config,
+                           sizeof (fire_config)) < 0) ||
+      (fire_config.magic != FIRE_CONFIG_MAGIC) ||
+      (fire_config.version != FIRE_CONFIG_VERSION)) {
+    DEBUG2_PRINTLN("No fire config, using defaults");
+    fire_config_defaults();
+  }
+
+  if (fire_config.bus_baud == 0) {
+    fire_config.bus_baud = RS485Socket::DEFAULT_BAUD;
+  }
+  if (fire_config.max_baud < fire_config.bus_baud) {
+    fire_config.max_baud = fire_config.bus_baud;
+  }
+
+  DEBUG2_VALUE("Fire config: flags=", fire_config.flags);
+  DEBUG2_VALUE(" baud=", fire_config.bus_baud);
+  DEBUG2_VALUELN(" max=", fire_config.max_baud);
+}
+
+boolean fire_config_save() {
+  if (fire_config_offset < 0) {
+    return false;
+  }
+
+  return (eeprom_write_objects(fire_config_offset, (byte *)&fire_config,
+                               sizeof (fire_config)) >= 0);
+}
+
+uint16_t fire_group_address(uint8_t role) {
+  if ((role >= NUM_GROUP_ROLES) || (fire_config.group_roles[role] == 0) ||
+      (fire_config.group_roles[role] >= FIRE_MAX_GROUPS)) {
+    return SOCKET_ADDR_INVALID;
+  }
+  return FIRE_GROUP_ADDRESS(fire_config.group_roles[role]);
+}
+
+uint8_t fire_group_outputs(uint8_t group) {
+  if (group == 0) {
+    return 0;
+  }
+
+  for (uint8_t i = 0; i < FIRE_MAX_GROUP_MEMBERS; i++) {
+    if (fire_config.group_members[i].group == group) {
+      return fire_config.group_members[i].outputs;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Fire control specific settings, stored in EEPROM immediately after the
+ * HMTL configuration.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_CONFIG_H
+#define FIRE_CONTROL_CONFIG_H
+
+#include "Arduino.h"
+
+#define FIRE_CONFIG_MAGIC   0x5F
+#define FIRE_CONFIG_VERSION 5
+
+/* Flags */
+#define FIRE_FLAG_BAUD_NEGOTIATE 0x01 // Probe the bus for its fastest rate
+#define FIRE_FLAG_USB_BRIDGE     0x04 // Forward host frames with flow control
+#define FIRE_FLAG_PRESSURE       0x08 // Lights follow the pressure on a sensor
+
+/*
+ * Group addresses let a single frame drive outputs on several nodes.  A node
+ * lists the groups it belongs to along with a mask of its outputs driven by
+ * each group, a message sent to a group with HMTL_ALL_OUTPUTS is applied to
+ * every output in the mask.
+ */
+#define FIRE_GROUP_BASE        0xFF00
+#define FIRE_MAX_GROUPS        16 // Group 0 is reserved as "no group"
+#define FIRE_GROUP_ADDRESS(g)  (FIRE_GROUP_BASE + (g))
+#define IS_FIRE_GROUP(a)       (((a) > FIRE_GROUP_BASE) && \
+                                ((a) < FIRE_GROUP_BASE + FIRE_MAX_GROUPS))
+#define FIRE_GROUP_NUMBER(a)   ((uint8_t)((a) - FIRE_GROUP_BASE))
+
+#define FIRE_MAX_GROUP_MEMBERS 4
+
+typedef struct {
+  uint8_t group;
+  uint8_t outputs; // Mask of local outputs driven by the group
+} fire_group_member_t;
+
+/* Groups used by the controller when sending, 0 if not configured */
+#define GROUP_ROLE_POOFERS 0 // Every accumulator, used when disabling
+#define GROUP_ROLE_PULSE_1 1 // Poofer 1 first accumulator plus lights
+#define GROUP_ROLE_PULSE_2 2 // Poofer 1 second accumulator plus lights
+#define NUM_GROUP_ROLES    3
+
+/* Controllers sharing the bus, in token passing order, see Fire_Control_Arbiter.h */
+#define FIRE_MAX_MASTERS   4
+
+/*
+ * Send rate limits for each class of output, see Fire_Control_Limit.h.  A
+ * rate of 0 disables limiting for the class.
+ */
+#define RATE_CLASS_IGNITER     0
+#define RATE_CLASS_PILOT       1
+#define RATE_CLASS_ACCUMULATOR 2
+#define RATE_CLASS_LIGHTS      3
+#define NUM_RATE_CLASSES       4
+
+typedef struct {
+  uint8_t per_second; // Sustained messages per second
+  uint8_t burst;      // Messages that may be sent back to back
+} fire_rate_t;
+
+typedef struct {
+  uint8_t  magic;
+  uint8_t  version;
+  uint8_t  flags;
+  uint8_t  frame_rate; // Most pixel frames a second, 0 for the default
+
+  uint32_t bus_baud; // Rate the RS485 bus is started at
+  uint32_t max_baud; // Highest rate tried when negotiating
+  uint32_t usb_baud; // Host serial rate in bridge mode, 0 for the default
+
+  uint8_t  group_roles[NUM_GROUP_ROLES];
+  fire_group_member_t group_members[FIRE_MAX_GROUP_MEMBERS];
+
+  uint16_t masters[FIRE_MAX_MASTERS]; // Unused entries are 0
+
+  fire_rate_t rate_limits[NUM_RATE_CLASSES];
+} fire_config_t;
+
+extern fire_config_t fire_config;
+
+/* Read the settings from the EEPROM offset following the HMTL config */
+void fire_config_init(int offset);
+void fire_config_defaults();
+
+/* Write the current settings back to EEPROM */
+boolean fire_config_save();
+
+/* Address of the group used for a role, SOCKET_ADDR_INVALID if unset */
+uint16_t fire_group_address(uint8_t role);
+
+/* Mask of this node's outputs that belong to a group */
+uint8_t fire_group_outputs(uint8_t group);
+
+#endif
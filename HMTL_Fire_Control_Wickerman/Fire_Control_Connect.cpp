@@ -38,14 +38,260 @@
 #include "MPR121.h"
 
 #include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Arbiter.h"
+#include "Fire_Control_Limit.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Stagger.h"
+#include "Fire_Control_Quantize.h"
+#include "Fire_Control_Sensors.h"
 
+/*******************************************************************************
+ * Bus access
+ *
+ * With more than one master configured, frames are queued with the arbiter and
+ * sent from bus_service() while this controller holds the token.
+ */
+
+bus_arbiter_t bus_arbiter;
+boolean bus_arbitrating = false;
+
+void bus_arbiter_init() {
+  bus_arbitrating = arb_init(&bus_arbiter, config.address,
+                             fire_config.masters, FIRE_MAX_MASTERS,
+                             millis()) &&
+                    (bus_arbiter.num_masters > 1);
+  if (bus_arbitrating) {
+    DEBUG2_VALUE("Bus arbitration, masters:", bus_arbiter.num_masters);
+    DEBUG2_VALUELN(" index:", bus_arbiter.index);
+  }
+}
+
+/* Frames to the poofers are sent ahead of lighting frames */
+uint8_t bus_priority(uint16_t address) {
+  if ((address == poofer1_address) || (address == poofer2_address) ||
+      IS_FIRE_GROUP(address)) {
+    return ARB_PRIORITY_FIRE;
+  }
+  return ARB_PRIORITY_COSMETIC;
+}
+
+/*
+ * Time spent handing frames to the RS485 socket.  With the direction switched
+ * in software this includes waiting for the frame to go out, with the UART
+ * switching it only the copy into the transmit FIFO is counted.
+ */
+uint32_t bus_tx_frames = 0;
+uint32_t bus_tx_micros = 0;
+uint32_t bus_tx_max_micros = 0;
+
+void bus_tx_time(unsigned long start) {
+  uint32_t elapsed = micros() - start;
+  bus_tx_frames++;
+  bus_tx_micros += elapsed;
+  if (elapsed > bus_tx_max_micros) {
+    bus_tx_max_micros = elapsed;
+  }
+}
+
+/* Defined with rate negotiation below */
+static uint32_t bus_known_rate();
+static void bus_probe_rate(uint32_t baud);
+
+static void bus_write(uint16_t address, const byte *data, uint8_t len) {
+  unsigned long start = micros();
+  if (data != rs485.send_buffer) {
+    memcpy(rs485.send_buffer, data, len);
+  }
+  rs485.sendMsgTo(address, rs485.send_buffer, len);
+  bus_tx_time(start);
+}
+
+/* Time a frame for the poofers, other than a poll, was last sent */
+static unsigned long bus_fire_sent = 0;
+
+static void bus_fire_check(uint16_t address, const byte *data) {
+  if ((bus_priority(address) == ARB_PRIORITY_FIRE) &&
+      (((msg_hdr_t *)data)->type != MSG_TYPE_POLL)) {
+    bus_fire_sent = millis();
+  }
+}
+
+void bus_transmit(uint16_t address, const byte *data, uint8_t len) {
+  uint32_t baud = bus_known_rate();
+  bus_write(address, data, len);
+  bus_fire_check(address, rs485.send_buffer);
+  bus_probe_rate(baud);
+}
+
+/* Returns true if a frame can be transmitted without waiting */
+boolean bus_tx_ready() {
+#ifdef BUS_UART_DE
+  return (RS485_HARDWARE_SERIAL.availableForWrite() >=
+          (int)RS485_BUFFER_TOTAL(ARB_FRAME_SIZE));
+#else
+  return true;
+#endif
+}
+
+/* Send a complete frame, or queue it until the token is held */
+void bus_send(uint16_t address, const byte *data, uint8_t len,
+              uint8_t priority) {
+  if (bus_arbitrating) {
+    arb_queue(&bus_arbiter, address, data, len, priority, millis());
+    return;
+  }
+
+  bus_transmit(address, data, len);
+}
+
+/*
+ * Returns true if a frame can't be queued for sending, or shouldn't be as the
+ * bus rate is being negotiated
+ */
+boolean bus_busy() {
+  if (bus_negotiating()) {
+    return true;
+  }
+  return (bus_arbitrating &&
+          (arb_pending(&bus_arbiter) >= ARB_QUEUE_FRAMES));
+}
+
+/* Send any queued frames this controller is allowed to */
+void bus_service() {
+  if (!bus_arbitrating) {
+    return;
+  }
+
+  const byte *data;
+  uint16_t address;
+  uint8_t len;
+  while (bus_tx_ready() &&
+         ((data = arb_next(&bus_arbiter, millis(), &address, &len)) != NULL)) {
+    bus_transmit(address, data, len);
+  }
+
+  DEBUG_COMMAND(DEBUG_MID,
+                static unsigned long last_report = 0;
+                if (millis() - last_report > BUS_CHECK_PERIOD_MS) {
+                  last_report = millis();
+                  DEBUG3_VALUE("Arb sent:", bus_arbiter.stats.sent);
+                  DEBUG3_VALUE(" drop:", bus_arbiter.stats.dropped);
+                  DEBUG3_VALUE(" tok:", bus_arbiter.stats.tokens);
+                  DEBUG3_VALUE(" retry:", bus_arbiter.stats.retries);
+                  DEBUG3_VALUE(" regen:", bus_arbiter.stats.regenerated);
+                  DEBUG3_VALUE(" coll:", bus_arbiter.stats.collisions);
+                  DEBUG3_VALUELN(" wait max:", bus_arbiter.stats.wait_max);
+                }
+                );
+}
+
+
+/* Maximum length of a single formatted message */
+#define TX_MSG_MAX (sizeof (msg_hdr_t) + sizeof (msg_max_t))
+
+/* Queue a message formatted locally for the arbiter */
+static void tx_queue(const byte *msg, uint16_t len) {
+  if (len == 0) {
+    return;
+  }
+  uint16_t address = ((msg_hdr_t *)msg)->address;
+  bus_send(address, msg, len, bus_priority(address));
+}
+
+/*
+ * Returns true while fire frames or held bursts are waiting for the bus, or a
+ * fire frame is being sent
+ */
+boolean bus_fire_pending() {
+  if (stagger.count || quant.count) {
+    return true;
+  }
+  /* One just sent may still be going out at the bus rate */
+  if (millis() - bus_fire_sent < disc_window_ms(bus_baud)) {
+    return true;
+  }
+  return (bus_arbitrating &&
+          arb_pending(&bus_arbiter, ARB_PRIORITY_FIRE));
+}
+
+/*
+ * Returns false for messages to nodes that didn't answer discovery.  Turning
+ * outputs off and cancelling them never check this, a node that missed its
+ * poll may still be firing, and neither does keeping the pilot and igniter
+ * lit.
+ */
+boolean tx_node_alive(uint16_t address) {
+  if (disc_alive(address)) {
+    return true;
+  }
+  disc.dropped++;
+  DEBUG4_VALUELN("Not sent, no node:", address);
+  return false;
+}
 
 void sendHMTLValue(uint16_t address, uint8_t output, int value) {
   DEBUG3_VALUE("sendValue:", value);
   DEBUG3_VALUE(" a:", address);
   DEBUG3_VALUELN(" o:", output);
+
+  /* Turning an output off drops any burst waiting on its supply */
+  if (value == 0) {
+    stagger_cancel(address, output);
+  }
+
+  /* Turning an output off is never limited */
+  if ((value != 0) &&
+      (!tx_node_alive(address) || !rate_allow(address, output, millis()))) {
+    return;
+  }
+
+  if (bus_arbitrating) {
+    byte msg[TX_MSG_MAX];
+    tx_queue(msg, hmtl_value_fmt(msg, sizeof (msg),
+                                 address, output, value));
+    return;
+  }
+
+  uint32_t baud = bus_known_rate();
+  unsigned long start = micros();
   hmtl_send_value(&rs485, rs485.send_buffer, SEND_BUFFER_SIZE,
 		  address, output, value);
+  bus_tx_time(start);
+  bus_fire_check(address, rs485.send_buffer);
+  bus_probe_rate(baud);
+}
+
+static void tx_timed_change(uint16_t address, uint8_t output,
+                            uint32_t change_period,
+                            uint32_t start_color,
+                            uint32_t stop_color,
+                            boolean keepalive) {
+  if ((!keepalive && !tx_node_alive(address)) ||
+      !rate_allow(address, output, millis())) {
+    return;
+  }
+
+  if (bus_arbitrating) {
+    byte msg[TX_MSG_MAX];
+    tx_queue(msg, hmtl_timed_change_fmt(msg, sizeof (msg),
+                                        address, output,
+                                        change_period,
+                                        start_color,
+                                        stop_color));
+    return;
+  }
+
+  uint32_t baud = bus_known_rate();
+  unsigned long start = micros();
+  hmtl_send_timed_change(&rs485, rs485.send_buffer, SEND_BUFFER_SIZE,
+			 address, output,
+			 change_period,
+			 start_color,
+			 stop_color);
+  bus_tx_time(start);
+  bus_fire_check(address, rs485.send_buffer);
+  bus_probe_rate(baud);
 }
 
 void sendHMTLTimedChange(uint16_t address, uint8_t output,
@@ -56,19 +302,63 @@ void sendHMTLTimedChange(uint16_t address, uint8_t output,
   DEBUG3_VALUE(" a:", address);
   DEBUG3_VALUELN(" o:", output);
 
-  hmtl_send_timed_change(&rs485, rs485.send_buffer, SEND_BUFFER_SIZE,
-			 address, output,
-			 change_period,
-			 start_color,
-			 stop_color);
+  /* Bursts may wait for a valve on their supply to close */
+  if ((start_color == 0xFFFFFFFF) && (stop_color == 0) &&
+      stagger_defer(address, output, change_period, millis())) {
+    return;
+  }
+
+  tx_timed_change(address, output, change_period, start_color, stop_color,
+                  false);
+}
+
+void sendHMTLKeepalive(uint16_t address, uint8_t output, uint32_t period) {
+  DEBUG3_VALUE("sendKeepalive:", period);
+  DEBUG3_VALUE(" a:", address);
+  DEBUG3_VALUELN(" o:", output);
+
+  tx_timed_change(address, output, period, 0xFFFFFFFF, 0, true);
+}
+
+/* Send the bursts held by stagger_defer() that are now due */
+void tx_stagger_service() {
+  stagger_burst_t burst;
+  while (stagger.count) {
+    if (!poofers_armed()) {
+      /* Nothing held while poofing is off goes out once it's back on */
+      stagger_clear();
+      return;
+    }
+    if (!stagger_next(millis(), &burst)) {
+      return;
+    }
+    DEBUG4_VALUELN("Staggered a:", burst.address);
+    tx_timed_change(burst.address, burst.output, burst.duration,
+                    0xFFFFFFFF, 0, false);
+  }
 }
 
 void sendHMTLCancel(uint16_t address, uint8_t output) {
   DEBUG3_VALUE("sendCancel: a:", address);
   DEBUG3_VALUELN(" o:", output);
 
+  /* Bursts still waiting on the supply are dropped along with programs */
+  stagger_cancel(address, output);
+
+  if (bus_arbitrating) {
+    byte msg[TX_MSG_MAX];
+    tx_queue(msg, hmtl_program_cancel_fmt(msg, sizeof (msg),
+                                          address, output));
+    return;
+  }
+
+  uint32_t baud = bus_known_rate();
+  unsigned long start = micros();
   hmtl_send_cancel(&rs485, rs485.send_buffer, SEND_BUFFER_SIZE,
                    address, output);
+  bus_tx_time(start);
+  bus_fire_check(address, rs485.send_buffer);
+  bus_probe_rate(baud);
 }
 
 void sendHMTLBlink(uint16_t address, uint8_t output,
@@ -79,8 +369,359 @@ void sendHMTLBlink(uint16_t address, uint8_t output,
   DEBUG3_VALUE(" a:", address);
   DEBUG3_VALUELN(" o:", output);
 
+  if (!tx_node_alive(address) || !rate_allow(address, output, millis())) {
+    return;
+  }
+
+  if (bus_arbitrating) {
+    byte msg[TX_MSG_MAX];
+    tx_queue(msg, hmtl_program_blink_fmt(msg, sizeof (msg),
+                                         address, output,
+                                         onperiod, oncolor,
+                                         offperiod, offcolor));
+    return;
+  }
+
+  uint32_t baud = bus_known_rate();
+  unsigned long start = micros();
   hmtl_send_blink(&rs485, rs485.send_buffer, SEND_BUFFER_SIZE,
                   address, output,
                   onperiod, oncolor,
                   offperiod, offcolor);
-}
\ No newline at end of file
+  bus_tx_time(start);
+  bus_fire_check(address, rs485.send_buffer);
+  bus_probe_rate(baud);
+}
+
+/*******************************************************************************
+ * RS485 bus rate negotiation
+ */
+
+/* Candidate bus rates, fastest first */
+const uint32_t bus_rates[] = {
+#ifdef ESP32
+  460800, 230400, 115200,
+#endif
+  57600, 38400, 19200,
+  RS485Socket::DEFAULT_BAUD
+};
+#define NUM_BUS_RATES (sizeof (bus_rates) / sizeof (uint32_t))
+
+#define NUM_BUS_NODES 3
+
+uint32_t bus_baud = RS485Socket::DEFAULT_BAUD;
+
+/* Mask of known nodes that answered at the negotiated rate */
+byte bus_nodes = 0;
+
+uint16_t bus_node_address(byte node) {
+  switch (node) {
+    case 0: return poofer1_address;
+    case 1: return poofer2_address;
+    default: return lights_address;
+  }
+}
+
+#ifdef ESP32
+#ifdef BUS_UART_DE
+/* Set from the UART event task when the line goes idle after receiving */
+volatile boolean bus_rx_event = true;
+
+void bus_uart_rx() {
+  bus_rx_event = true;
+}
+#endif
+
+/* Start the UART used for the bus */
+void bus_uart_begin(uint32_t baud) {
+#ifdef BUS_UART_DE
+  RS485_HARDWARE_SERIAL.setRxBufferSize(BUS_UART_BUFFER_SIZE);
+  RS485_HARDWARE_SERIAL.setTxBufferSize(BUS_UART_BUFFER_SIZE);
+#endif
+
+  RS485_HARDWARE_SERIAL.begin(baud, SERIAL_8N1, RS485_RX_PIN, RS485_TX_PIN);
+  bus_baud = baud;
+
+#ifdef BUS_UART_DE
+  /* RTS drives DE/RE, asserted by the UART only while it is transmitting */
+  RS485_HARDWARE_SERIAL.setPins(RS485_RX_PIN, RS485_TX_PIN, -1,
+                                RS485_UART_DE_PIN);
+  RS485_HARDWARE_SERIAL.setMode(UART_MODE_RS485_HALF_DUPLEX);
+  RS485_HARDWARE_SERIAL.setRxTimeout(BUS_UART_RX_TIMEOUT);
+  RS485_HARDWARE_SERIAL.onReceive(bus_uart_rx, true);
+  DEBUG2_VALUELN("Bus UART half duplex, DE:", RS485_UART_DE_PIN);
+#endif
+}
+#endif
+
+void bus_set_baud(uint32_t baud) {
+#ifdef BUS_BAUD_ADJUSTABLE
+  if (baud == bus_baud) {
+    return;
+  }
+
+  RS485_HARDWARE_SERIAL.flush();
+#ifdef ESP32
+  RS485_HARDWARE_SERIAL.updateBaudRate(baud);
+#else
+  RS485_HARDWARE_SERIAL.begin(baud);
+#endif
+  bus_baud = baud;
+
+  DEBUG2_VALUELN("Bus baud:", bus_baud);
+#endif
+}
+
+/*
+ * Probing of the known nodes.  A probe is a poll written straight to the bus
+ * at the rate being checked, its answer is passed back by the FireSocket as
+ * it's received, and the main loop moves on once it's answered or its window has
+ * passed, so nothing waits on the bus.
+ */
+#define BUS_PROBE_IDLE     0
+#define BUS_PROBE_WAITING  1
+#define BUS_PROBE_ANSWERED 2
+#define BUS_PROBE_SILENT   3
+
+typedef struct {
+  uint8_t  state;
+  uint16_t address;     // Address being probed
+  unsigned long sent;
+  uint32_t known_baud;  // Rate the nodes answered at before negotiating
+
+  /* Negotiation, a probe of each known node at each rate */
+  boolean  negotiating;
+  byte     rate;        // Index of the rate being tried
+  byte     node;        // Next node to probe at this rate
+  byte     responded;   // Nodes that answered at this rate
+  boolean  repeated;    // The node's probe was already repeated
+  byte     best_nodes;
+  uint32_t best_baud;
+
+  /* Periodic checks */
+  unsigned long last_check;
+  byte     failures;
+  byte     check_node;
+} bus_probe_t;
+
+static bus_probe_t bus_probing;
+
+static void bus_probe_send(uint16_t address) {
+  byte frame[sizeof (msg_hdr_t)];
+  hmtl_msg_fmt((msg_hdr_t *)frame, address, sizeof (msg_hdr_t),
+               MSG_TYPE_POLL, MSG_FLAG_RESPONSE);
+  /* Probing is never done while arbitrating, see bus_negotiate_baud() */
+  bus_write(address, frame, sizeof (msg_hdr_t));
+
+  bus_probing.state = BUS_PROBE_WAITING;
+  bus_probing.address = address;
+  bus_probing.sent = millis();
+}
+
+boolean bus_probe_response(uint16_t source) {
+  if ((bus_probing.state == BUS_PROBE_WAITING) &&
+      (source == bus_probing.address)) {
+    bus_probing.state = BUS_PROBE_ANSWERED;
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Frames other than probes are sent at the last rate known to reach the nodes
+ * while another is being tried, switching back afterwards.  A probe waiting
+ * for its answer is repeated once, as the answer may have been missed.
+ */
+static uint32_t bus_known_rate() {
+  uint32_t baud = bus_baud;
+  if (bus_probing.negotiating) {
+    bus_set_baud(bus_probing.known_baud);
+  }
+  return baud;
+}
+
+static void bus_probe_rate(uint32_t baud) {
+  if (bus_probing.negotiating) {
+    bus_set_baud(baud);
+    if ((bus_probing.state == BUS_PROBE_WAITING) && !bus_probing.repeated) {
+      bus_probing.state = BUS_PROBE_IDLE;
+      bus_probing.repeated = true;
+    }
+  }
+}
+
+/* Returns the state of the outstanding probe, timing it out if it's silent */
+static uint8_t bus_probe_state(unsigned long now) {
+  if ((bus_probing.state == BUS_PROBE_WAITING) &&
+      (now - bus_probing.sent >= disc_window_ms(bus_baud))) {
+    DEBUG3_VALUE("No probe response a:", bus_probing.address);
+    DEBUG3_VALUELN(" baud:", bus_baud);
+    bus_probing.state = BUS_PROBE_SILENT;
+  }
+  return bus_probing.state;
+}
+
+/* Returns true if a node's address was already given to an earlier node */
+static boolean bus_node_duplicate(byte node) {
+  for (byte prev = 0; prev < node; prev++) {
+    if (bus_node_address(prev) == bus_node_address(node)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+byte count_bits(byte mask) {
+  byte count = 0;
+  for (; mask; mask >>= 1) {
+    count += (mask & 0x1);
+  }
+  return count;
+}
+
+boolean bus_negotiating() {
+  return bus_probing.negotiating;
+}
+
+/* Move negotiation to the next rate at or under the maximum, false if none */
+static boolean bus_negotiate_rate(byte first) {
+  for (byte i = first; i < NUM_BUS_RATES; i++) {
+    if (bus_rates[i] <= fire_config.max_baud) {
+      bus_probing.rate = i;
+      bus_probing.node = 0;
+      bus_probing.responded = 0;
+      bus_probing.repeated = false;
+      bus_set_baud(bus_rates[i]);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Probe the known nodes at each candidate rate up to the configured maximum
+ * and settle on the fastest rate at which the most nodes answer.  Nodes keep
+ * their own configured rate, so this finds the rate the segment is running
+ * at rather than commanding nodes to change.  The probes are sent from
+ * bus_check() in the main loop.
+ */
+void bus_negotiate_baud() {
+#ifdef BUS_BAUD_ADJUSTABLE
+  if (bus_arbitrating) {
+    /* Probing would transmit without holding the token */
+    return;
+  }
+
+  bus_probing.known_baud = bus_baud;
+  bus_probing.best_nodes = 0;
+  bus_probing.best_baud = bus_baud;
+  bus_probing.state = BUS_PROBE_IDLE;
+  bus_probing.negotiating = bus_negotiate_rate(0);
+#endif
+}
+
+static void bus_negotiate_finish() {
+  uint32_t previous = bus_baud;
+  bus_probing.negotiating = false;
+
+  bus_set_baud(bus_probing.best_baud);
+  bus_nodes = bus_probing.best_nodes;
+  bus_probing.failures = 0;
+  bus_probing.last_check = millis();
+
+  DEBUG1_VALUE("Negotiated bus baud:", bus_baud);
+  DEBUG1_VALUELN(" nodes:", bus_nodes);
+
+  /* Start at this rate next time */
+  if (bus_nodes && (fire_config.bus_baud != bus_baud)) {
+    fire_config.bus_baud = bus_baud;
+    fire_config_save();
+  }
+
+  /* Nodes found at the old rate may not answer at this one */
+  if (bus_baud != previous) {
+    disc_start(config.address, millis());
+  }
+}
+
+/* Probe the next node at the rate being tried */
+static void bus_negotiate_service(unsigned long now) {
+  uint8_t state = bus_probe_state(now);
+  if (state == BUS_PROBE_WAITING) {
+    return;
+  }
+  if (state == BUS_PROBE_ANSWERED) {
+    bus_probing.responded |= (1 << bus_probing.node);
+  }
+  if (state != BUS_PROBE_IDLE) {
+    bus_probing.node++;
+    bus_probing.state = BUS_PROBE_IDLE;
+    bus_probing.repeated = false;
+  }
+
+  /* Don't poll the same node twice */
+  while ((bus_probing.node < NUM_BUS_NODES) &&
+         bus_node_duplicate(bus_probing.node)) {
+    bus_probing.node++;
+  }
+
+  if (bus_probing.node < NUM_BUS_NODES) {
+    bus_probe_send(bus_node_address(bus_probing.node));
+    return;
+  }
+
+  /* Every node has been probed at this rate */
+  if (count_bits(bus_probing.responded) >
+      count_bits(bus_probing.best_nodes)) {
+    bus_probing.best_nodes = bus_probing.responded;
+    bus_probing.best_baud = bus_rates[bus_probing.rate];
+  }
+  if (!bus_negotiate_rate(bus_probing.rate + 1)) {
+    bus_negotiate_finish();
+  }
+}
+
+/*
+ * Periodically poll one of the nodes found during negotiation.  If they
+ * repeatedly fail to answer the bus goes back to the saved rate and the rate
+ * is negotiated again, which recovers once the nodes are reachable.
+ */
+void bus_check() {
+  unsigned long now = millis();
+
+  if (bus_probing.negotiating) {
+    bus_negotiate_service(now);
+    return;
+  }
+
+  uint8_t state = bus_probe_state(now);
+  if (state == BUS_PROBE_WAITING) {
+    return;
+  }
+  bus_probing.state = BUS_PROBE_IDLE;
+
+  if (state == BUS_PROBE_ANSWERED) {
+    bus_probing.failures = 0;
+  } else if ((state == BUS_PROBE_SILENT) &&
+             (++bus_probing.failures >= BUS_CHECK_FAILURES)) {
+    DEBUG_ERR("Bus failing, renegotiating rate");
+    bus_probing.failures = 0;
+    bus_set_baud(fire_config.bus_baud);
+    bus_negotiate_baud();
+    return;
+  }
+
+  if ((bus_nodes == 0) || bus_arbitrating ||
+      (now - bus_probing.last_check < BUS_CHECK_PERIOD_MS)) {
+    return;
+  }
+  bus_probing.last_check = now;
+
+  byte node = bus_probing.check_node;
+  do {
+    node = (node + 1) % NUM_BUS_NODES;
+  } while (!(bus_nodes & (1 << node)));
+  bus_probing.check_node = node;
+
+  bus_probe_send(bus_node_address(node));
+}
@@ -0,0 +1,276 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Discovery of the nodes on the bus
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_DISCOVERY
+  #define DEBUG_LEVEL DEBUG_LEVEL_DISCOVERY
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Arbiter.h"
+#include "Fire_Control_Discovery.h"
+
+#if DISC_NUM_ADDRESSES > 16
+  #error "Discovery range must be at most 16 addresses"
+#endif
+
+#define DISC_BIT(address) ((uint16_t)1 << ((address) - DISC_FIRST_ADDRESS))
+
+disc_state_t disc;
+
+static boolean disc_in_range(uint16_t address) {
+  return ((address >= DISC_FIRST_ADDRESS) && (address <= DISC_LAST_ADDRESS));
+}
+
+void disc_poll(uint16_t address) {
+  byte frame[sizeof (msg_hdr_t)];
+  hmtl_msg_fmt((msg_hdr_t *)frame, address, sizeof (msg_hdr_t),
+               MSG_TYPE_POLL, MSG_FLAG_RESPONSE);
+  bus_send(address, frame, sizeof (msg_hdr_t), ARB_PRIORITY_COSMETIC);
+}
+
+uint16_t disc_window_ms(uint32_t baud) {
+  uint32_t bits = (uint32_t)DISC_EXCHANGE_BYTES * 10 * 1000;
+  return (bits + baud - 1) / baud + DISC_TURNAROUND_MS;
+}
+
+static void disc_begin(uint16_t self, boolean reviving, unsigned long now) {
+  disc.state = DISC_POLLING;
+  disc.reviving = reviving;
+  disc.self = self;
+  disc.next = DISC_FIRST_ADDRESS;
+  disc.answered = false;
+  disc.tries = 0;
+  disc.window = disc_window_ms(bus_baud);
+  disc.sent = 0;
+  disc.started = now;
+  disc.seen = 0;
+
+  DEBUG3_VALUE("Discovery start:", now);
+  DEBUG3_VALUE(" reviving:", reviving);
+  DEBUG3_VALUELN(" window:", disc.window);
+}
+
+void disc_start(uint16_t self, unsigned long now) {
+  disc_begin(self, false, now);
+}
+
+void disc_heard(uint16_t source) {
+  if (disc_in_range(source)) {
+    disc.alive |= DISC_BIT(source);
+    disc.seen |= DISC_BIT(source);
+  }
+}
+
+boolean disc_response(uint16_t source, const msg_hdr_t *msg_hdr) {
+  disc_heard(source);
+  if ((disc.state != DISC_POLLING) || !disc_in_range(source) ||
+      (msg_hdr->length < sizeof (msg_hdr_t) + sizeof (msg_poll_response_t))) {
+    return false;
+  }
+  const msg_poll_response_t *poll = (const msg_poll_response_t *)(msg_hdr + 1);
+
+  boolean expected = ((source == disc.next) && (disc.sent != 0));
+  if (expected) {
+    disc.answered = true;
+  }
+
+  disc_node_t *node = (disc_node_t *)disc_node(source);
+  if (node == NULL) {
+    if (disc.num_nodes >= DISC_MAX_NODES) {
+      DEBUG1_VALUELN("Discovery full, a:", source);
+      return expected;
+    }
+    node = &disc.nodes[disc.num_nodes++];
+  }
+
+  node->address = source;
+  node->object_type = poll->object_type;
+  node->num_outputs = poll->config.num_outputs;
+  node->output_types = 0;
+
+  /* The response data holds the type of each output */
+  uint8_t types = poll->data_len;
+  if (msg_hdr->length < sizeof (msg_hdr_t) + sizeof (msg_poll_response_t) +
+                        types) {
+    types = 0;
+  }
+  for (uint8_t i = 0; i < types; i++) {
+    if (poll->data[i] < 8) {
+      node->output_types |= (1 << poll->data[i]);
+    }
+  }
+
+  DEBUG3_VALUE("Discovered a:", source);
+  DEBUG3_VALUE(" type:", node->object_type);
+  DEBUG3_VALUE(" outputs:", node->num_outputs);
+  DEBUG3_VALUELN(" mask:", node->output_types);
+  return expected;
+}
+
+/*
+ * Drop nodes that didn't answer a full pass and bind unset roles to those left,
+ * a pass polling the absent addresses only adds those that answered.
+ */
+static void disc_finish(unsigned long now) {
+  if (disc.reviving) {
+    disc.alive |= disc.seen;
+  } else {
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < disc.num_nodes; i++) {
+      if (disc.seen & DISC_BIT(disc.nodes[i].address)) {
+        disc.nodes[kept++] = disc.nodes[i];
+      }
+    }
+    disc.num_nodes = kept;
+    disc.alive = disc.seen;
+  }
+
+  disc.valid = true;
+  disc.state = DISC_IDLE;
+  disc.finished = now;
+  disc.passes++;
+
+  DEBUG2_VALUE("Discovery nodes:", disc.num_nodes);
+  DEBUG2_VALUELN(" ms:", now - disc.started);
+
+  disc_bind_roles();
+}
+
+void disc_service(unsigned long now) {
+  if (disc.state != DISC_POLLING) {
+    if (!disc.valid || (now - disc.finished < DISC_REVIVE_MS)) {
+      return;
+    }
+    disc_begin(disc.self, true, now);
+  }
+
+  if (disc.sent != 0) {
+    /* Move on as soon as the node answers */
+    if (!disc.answered && (now - disc.sent < disc.window)) {
+      return;
+    }
+    disc.sent = 0;
+    if (disc.answered || (disc.tries > DISC_RETRIES)) {
+      disc.next++;
+      disc.answered = false;
+      disc.tries = 0;
+    }
+  }
+
+  while ((disc.next <= DISC_LAST_ADDRESS) &&
+         ((disc.next == disc.self) ||
+          (disc.reviving && (disc.alive & DISC_BIT(disc.next))))) {
+    disc.next++;
+  }
+  if (disc.next > DISC_LAST_ADDRESS) {
+    disc_finish(now);
+    return;
+  }
+
+  if (bus_busy()) {
+    return;
+  }
+  disc_poll(disc.next);
+  disc.tries++;
+  disc.sent = now ? now : 1;
+}
+
+boolean disc_alive(uint16_t address) {
+  if (!disc.valid || !disc_in_range(address)) {
+    return true;
+  }
+  return (disc.alive & DISC_BIT(address));
+}
+
+const disc_node_t *disc_node(uint16_t address) {
+  for (uint8_t i = 0; i < disc.num_nodes; i++) {
+    if (disc.nodes[i].address == address) {
+      return &disc.nodes[i];
+    }
+  }
+  return NULL;
+}
+
+uint16_t disc_next_alive(uint16_t address) {
+  for (uint8_t i = 0; i < DISC_NUM_ADDRESSES; i++) {
+    address++;
+    if (!disc_in_range(address)) {
+      address = DISC_FIRST_ADDRESS;
+    }
+    if (disc_alive(address)) {
+      break;
+    }
+  }
+  return address;
+}
+
+#define DISC_ROLE_POOFER 0
+#define DISC_ROLE_LIGHTS 1
+
+/* Returns true if a node is suitable for a role */
+static boolean disc_suits(const disc_node_t *node, uint8_t role) {
+  if ((node == NULL) ||
+      (node->object_type == OBJECT_TYPE_FIRE_CONTROLLER) ||
+      (node->object_type == OBJECT_TYPE_TOUCH_CONTROLLER)) {
+    return false;
+  }
+
+  const uint8_t lights = (1 << HMTL_OUTPUT_PIXELS) | (1 << HMTL_OUTPUT_RGB);
+  if (role == DISC_ROLE_LIGHTS) {
+    return (node->output_types & lights);
+  }
+  return ((node->output_types & (1 << HMTL_OUTPUT_VALUE)) &&
+          !(node->output_types & lights));
+}
+
+/*
+ * Bind a role without an address to the lowest suitable node not already
+ * bound to another role.  An address that's set is never moved, that's left
+ * to the operator on the address page.
+ */
+static void disc_bind(uint16_t *address, uint8_t role, uint16_t taken) {
+  if ((*address != 0) && (*address != SOCKET_ADDR_INVALID)) {
+    if (!disc_suits(disc_node(*address), role)) {
+      DEBUG2_VALUE("No node for role:", role);
+      DEBUG2_VALUELN(" a:", *address);
+    }
+    return;
+  }
+
+  const disc_node_t *best = NULL;
+  for (uint8_t i = 0; i < disc.num_nodes; i++) {
+    const disc_node_t *node = &disc.nodes[i];
+    if ((node->address != taken) && disc_suits(node, role) &&
+        ((best == NULL) || (node->address < best->address))) {
+      best = node;
+    }
+  }
+
+  if (best != NULL) {
+    DEBUG2_VALUE("Bound role:", role);
+    DEBUG2_VALUE(" from:", *address);
+    DEBUG2_VALUELN(" to:", best->address);
+    *address = best->address;
+  }
+}
+
+void disc_bind_roles() {
+  disc_bind(&poofer1_address, DISC_ROLE_POOFER, poofer2_address);
+  disc_bind(&poofer2_address, DISC_ROLE_POOFER, poofer1_address);
+  disc_bind(&lights_address, DISC_ROLE_LIGHTS, 0);
+}
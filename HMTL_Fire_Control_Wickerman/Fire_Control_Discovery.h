@@ -0,0 +1,124 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Discovery of the nodes on the bus.
+ *
+ * A discovery pass polls each address in the range in turn, moving on as soon
+ * as the node answers, and runs from the main loop so the controller remains
+ * responsive.  The window for an answer is sized for the poll and response to
+ * cross the bus at its current rate, and a silent address is polled again
+ * before it's taken to be absent.  Answering nodes are cached along with
+ * their object type and outputs, and once the pass completes any poofer or
+ * lights role without an address is bound to a suitable live node.  Messages to addresses in the
+ * range that didn't answer are then dropped rather than sent.  Any frame heard
+ * from such an address marks it alive again, and the addresses that didn't
+ * answer are polled again every DISC_REVIVE_MS.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_DISCOVERY_H
+#define FIRE_CONTROL_DISCOVERY_H
+
+#include "Arduino.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+
+/* Range of addresses that are polled, at most 16 */
+#ifndef DISC_FIRST_ADDRESS
+  #define DISC_FIRST_ADDRESS 64
+#endif
+#ifndef DISC_LAST_ADDRESS
+  #define DISC_LAST_ADDRESS  79
+#endif
+#define DISC_NUM_ADDRESSES (DISC_LAST_ADDRESS - DISC_FIRST_ADDRESS + 1)
+
+/*
+ * Bytes in a poll and its response with the socket headers, at 10 bits each on
+ * the wire.  At 9600 baud the exchange alone takes the better part of 50ms.
+ */
+#define DISC_EXCHANGE_BYTES \
+  (2 * (sizeof (rs485_socket_hdr_t) + sizeof (msg_hdr_t)) + \
+   sizeof (msg_poll_response_t) + HMTL_MAX_OUTPUTS)
+#define DISC_TURNAROUND_MS 4 // Time for a node to start its response
+#define DISC_RETRIES       1 // Extra polls to an address that didn't answer
+#define DISC_REVIVE_MS 30000 // Time between polls of addresses that are absent
+
+#ifdef ESP32
+  #define DISC_MAX_NODES 16
+#else
+  #define DISC_MAX_NODES 8
+#endif
+
+typedef struct {
+  uint16_t address;
+  uint16_t object_type;
+  uint8_t  num_outputs;
+  uint8_t  output_types; // Mask of (1 << HMTL_OUTPUT_*)
+} disc_node_t;
+
+#define DISC_IDLE    0
+#define DISC_POLLING 1
+
+typedef struct {
+  uint8_t  state;
+  boolean  valid;      // A pass has completed
+  boolean  reviving;   // Only addresses that aren't alive are being polled
+  uint16_t self;       // This controller's address, which isn't polled
+  uint16_t next;       // Address being polled
+  boolean  answered;   // The address being polled has answered
+  uint8_t  tries;      // Polls sent to the address without an answer
+  uint16_t window;     // Time to wait for each answer
+  unsigned long sent;  // Time the current poll was sent
+  unsigned long started;
+  unsigned long finished;
+
+  uint16_t alive;      // Mask of addresses that answered the last pass
+  uint16_t seen;       // Mask of addresses that answered this pass
+
+  uint8_t num_nodes;
+  disc_node_t nodes[DISC_MAX_NODES];
+
+  uint16_t passes;
+  uint16_t dropped;    // Messages not sent to addresses that didn't answer
+} disc_state_t;
+
+extern disc_state_t disc;
+
+/* Send a poll to an address */
+void disc_poll(uint16_t address);
+
+/* Time to wait for a node's answer at a bus rate */
+uint16_t disc_window_ms(uint32_t baud);
+
+/* Begin a discovery pass, restarting any pass in progress */
+void disc_start(uint16_t self, unsigned long now);
+
+/*
+ * Handle a poll response received from a node, returns true if it answers the
+ * poll being waited on
+ */
+boolean disc_response(uint16_t source, const msg_hdr_t *msg_hdr);
+
+/* Record any frame received from a node, which shows it's alive */
+void disc_heard(uint16_t source);
+
+/* Send the next poll and complete the pass, or start polling absent nodes */
+void disc_service(unsigned long now);
+
+/*
+ * Returns false for an address in the range that didn't answer the last pass,
+ * other addresses and any address before the first pass are assumed alive.
+ */
+boolean disc_alive(uint16_t address);
+
+/* Returns the cached node at an address, or NULL */
+const disc_node_t *disc_node(uint16_t address);
+
+/* Returns the next live address after this one, wrapping within the range */
+uint16_t disc_next_alive(uint16_t address);
+
+/* Bind any unset poofer and lights addresses to suitable live nodes */
+void disc_bind_roles();
+
+#endif
@@ -0,0 +1,192 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Frame rate limited output of the local pixels
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_FRAME
+  #define DEBUG_LEVEL DEBUG_LEVEL_FRAME
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+
+#ifdef ESP32
+  #include <driver/spi_master.h>
+  #include <esp_heap_caps.h>
+#endif
+
+#include "Fire_Control_Frame.h"
+
+frame_state_t frame;
+
+#ifdef FRAME_SPI_DMA
+static spi_device_handle_t frame_spi = NULL;
+static byte *frame_buffers[2] = { NULL, NULL };
+static spi_transaction_t frame_trans[2];
+
+static boolean frame_dma_init(uint16_t length) {
+  spi_bus_config_t bus;
+  memset(&bus, 0, sizeof (bus));
+  bus.mosi_io_num = FRAME_SPI_DATA_PIN;
+  bus.miso_io_num = -1;
+  bus.sclk_io_num = FRAME_SPI_CLOCK_PIN;
+  bus.quadwp_io_num = -1;
+  bus.quadhd_io_num = -1;
+  bus.max_transfer_sz = length;
+  if (spi_bus_initialize(HSPI_HOST, &bus, SPI_DMA_CH_AUTO) != ESP_OK) {
+    return false;
+  }
+
+  spi_device_interface_config_t device;
+  memset(&device, 0, sizeof (device));
+  device.clock_speed_hz = FRAME_SPI_HZ;
+  device.mode = 0;
+  device.spics_io_num = -1;
+  device.queue_size = 2;
+  if (spi_bus_add_device(HSPI_HOST, &device, &frame_spi) != ESP_OK) {
+    spi_bus_free(HSPI_HOST);
+    return false;
+  }
+
+  for (uint8_t i = 0; i < 2; i++) {
+    frame_buffers[i] = (byte *)heap_caps_malloc(length, MALLOC_CAP_DMA);
+    if (frame_buffers[i] == NULL) {
+      /* Give the pins back to be written without DMA */
+      heap_caps_free(frame_buffers[0]);
+      frame_buffers[0] = NULL;
+      spi_bus_remove_device(frame_spi);
+      spi_bus_free(HSPI_HOST);
+      return false;
+    }
+    memset(frame_buffers[i], 0, length);
+  }
+
+  frame.length = length;
+  frame.front = 0;
+  frame.in_flight = 0;
+  return true;
+}
+
+/* Collect the transfers the SPI master has finished with */
+static void frame_dma_reclaim() {
+  spi_transaction_t *done;
+  while (frame.in_flight &&
+         (spi_device_get_trans_result(frame_spi, &done, 0) == ESP_OK)) {
+    frame.in_flight--;
+  }
+}
+
+/*
+ * Queue a frame from the buffer that isn't being sent, returns false if both
+ * are still busy.
+ */
+static boolean frame_dma_send(const byte *data, uint16_t length) {
+  frame_dma_reclaim();
+  if (frame.in_flight >= 2) {
+    return false;
+  }
+  if (length > frame.length) {
+    length = frame.length;
+  }
+
+  if (frame.sent_any &&
+      (memcmp(data, frame_buffers[frame.front], length) == 0)) {
+    frame.same++;
+    return true;
+  }
+
+  uint8_t back = frame.front ^ 1;
+  memcpy(frame_buffers[back], data, length);
+
+  spi_transaction_t *trans = &frame_trans[back];
+  memset(trans, 0, sizeof (spi_transaction_t));
+  trans->length = (size_t)length * 8;
+  trans->tx_buffer = frame_buffers[back];
+  if (spi_device_queue_trans(frame_spi, trans, 0) != ESP_OK) {
+    return false;
+  }
+
+  frame.in_flight++;
+  frame.front = back;
+  frame.sent++;
+  return true;
+}
+#endif
+
+void frame_set_rate(uint8_t rate) {
+  if (rate == 0) {
+    rate = FRAME_RATE_DEFAULT;
+  }
+  if (rate > FRAME_RATE_MAX) {
+    rate = FRAME_RATE_MAX;
+  }
+  frame.interval = 1000 / rate;
+}
+
+void frame_init(uint8_t rate, uint16_t length) {
+  frame_set_rate(rate);
+  frame.sent_any = false;
+
+#ifdef FRAME_SPI_DMA
+  frame.dma = false;
+  if (length > 0) {
+    frame.dma = frame_dma_init(length);
+    if (!frame.dma) {
+      DEBUG_ERR("Pixel SPI DMA failed");
+    }
+  }
+#endif
+  DEBUG3_VALUELN("Pixel frame ms:", frame.interval);
+}
+
+boolean frame_output(output_hdr_t *output, void *object,
+                     const byte *data, uint16_t length, unsigned long now) {
+  if (frame.sent_any && (now - frame.last < frame.interval)) {
+    frame.held++;
+    return false;
+  }
+
+  unsigned long start = micros();
+
+#ifdef FRAME_SPI_DMA
+  if (frame.dma) {
+    boolean done = frame_dma_send(data, length);
+    if (done) {
+      frame.sent_any = true;
+      frame.last = now;
+    } else {
+      frame.held++;
+    }
+    frame.micros += micros() - start;
+    return done;
+  }
+#endif
+
+  hmtl_update_output(output, object);
+  frame.sent++;
+  frame.sent_any = true;
+  frame.last = now;
+
+  frame.micros += micros() - start;
+  return true;
+}
+
+void frame_second() {
+  frame.sent_per_sec = frame.sent;
+  frame.same_per_sec = frame.same;
+  frame.held_per_sec = frame.held;
+  frame.micros_per_sec = frame.micros;
+
+  frame.sent = 0;
+  frame.same = 0;
+  frame.held = 0;
+  frame.micros = 0;
+}
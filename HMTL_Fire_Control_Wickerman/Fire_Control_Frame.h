@@ -0,0 +1,89 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Frame rate limited output of the local pixels.
+ *
+ * Writing out the pixel strip used to happen on every pass that changed it,
+ * which during sparkle is nearly every pass through the loop.  Frames are now
+ * sent no more often than the configured rate, a change made before the next
+ * frame is due is held and sent with it.
+ *
+ * On the ESP32 the WS2801 strip on HSPI is driven by the SPI master with DMA.
+ * The frame is copied into whichever of two buffers isn't being sent and
+ * queued, so the loop carries on while the strip is written.  The buffers are
+ * sent as-is, which matches the WS2801's RGB order, and a frame the same as
+ * the last one queued is dropped.  Elsewhere, or if the SPI bus couldn't be
+ * set up, there's no room to keep a copy of the last frame, so every frame
+ * offered is written with hmtl_update_output().  Frames are only offered once
+ * pixels have been written.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_FRAME_H
+#define FIRE_CONTROL_FRAME_H
+
+#include "Arduino.h"
+#include "HMTLTypes.h"
+
+#define FRAME_RATE_DEFAULT  50  // Frames per second when not configured
+#define FRAME_RATE_MAX      100 // Leaves the WS2801 time to latch each frame
+
+#ifdef ESP32
+  #define FRAME_SPI_DMA
+  #ifndef FRAME_SPI_DATA_PIN
+    #define FRAME_SPI_DATA_PIN  13
+  #endif
+  #ifndef FRAME_SPI_CLOCK_PIN
+    #define FRAME_SPI_CLOCK_PIN 14
+  #endif
+  #ifndef FRAME_SPI_HZ
+    #define FRAME_SPI_HZ        2000000
+  #endif
+#endif
+
+typedef struct {
+  uint16_t interval;        // Minimum time between frames
+  unsigned long last;       // Time the last frame was sent
+  boolean  sent_any;        // A frame has been sent since starting
+
+#ifdef FRAME_SPI_DMA
+  boolean  dma;             // Frames are sent by the SPI master
+  uint16_t length;          // Size of each buffer
+  uint8_t  front;           // Buffer holding the last frame queued
+  uint8_t  in_flight;       // Transfers queued and not yet completed
+#endif
+
+  /* Measurements, counted over each second */
+  uint16_t sent;
+  uint16_t same;            // Frames dropped as unchanged, with DMA
+  uint16_t held;            // Passes where a change waited for the next frame
+  uint32_t micros;          // Time spent checking and sending frames
+
+  uint16_t sent_per_sec;
+  uint16_t same_per_sec;
+  uint16_t held_per_sec;
+  uint32_t micros_per_sec;
+} frame_state_t;
+
+extern frame_state_t frame;
+
+/*
+ * Set the maximum frame rate, 0 for the default, and on the ESP32 start the
+ * SPI bus for frames of up to length bytes.
+ */
+void frame_init(uint8_t rate, uint16_t length);
+void frame_set_rate(uint8_t rate);
+
+/*
+ * Output a frame of the pixels after they were written, if one is due.
+ * Returns false if the frame was held for later, in which case it should be
+ * offered again.
+ */
+boolean frame_output(output_hdr_t *output, void *object,
+                     const byte *data, uint16_t length, unsigned long now);
+
+/* Move the counts into the per second measurements, called once a second */
+void frame_second();
+
+#endif
@@ -0,0 +1,133 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Shadow framebuffer for the 16x2 LCD
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_LCD
+  #define DEBUG_LEVEL DEBUG_LEVEL_LCD
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_LCD.h"
+
+/* Never printed, so a cell holding it is always redrawn */
+#define LCD_UNKNOWN 0
+
+LCDFrame lcd_frame;
+
+LCDFrame::LCDFrame() {
+  cells = 0;
+  moves = 0;
+  write_micros = 0;
+  clear();
+  invalidate();
+}
+
+void LCDFrame::clear() {
+  memset(shadow, ' ', sizeof (shadow));
+  col = 0;
+  row = 0;
+}
+
+void LCDFrame::invalidate() {
+  memset(glass, LCD_UNKNOWN, sizeof (glass));
+}
+
+void LCDFrame::setCursor(uint8_t c, uint8_t r) {
+  col = c;
+  row = r;
+}
+
+void LCDFrame::put(char c) {
+  if ((row < LCD_ROWS) && (col < LCD_COLS)) {
+    shadow[row][col] = c;
+  }
+  col++;
+}
+
+void LCDFrame::print(const char *str) {
+  while (*str) {
+    put(*str++);
+  }
+}
+
+void LCDFrame::print_number(unsigned long value, boolean negative) {
+  char digits[10];
+  uint8_t len = 0;
+  do {
+    digits[len++] = '0' + (value % 10);
+    value /= 10;
+  } while (value);
+
+  if (negative) {
+    put('-');
+  }
+  while (len) {
+    put(digits[--len]);
+  }
+}
+
+void LCDFrame::print(int value) {
+  print((long)value);
+}
+
+void LCDFrame::print(unsigned int value) {
+  print_number(value, false);
+}
+
+void LCDFrame::print(long value) {
+  if (value < 0) {
+    print_number(-(unsigned long)value, true);
+  } else {
+    print_number(value, false);
+  }
+}
+
+void LCDFrame::print(unsigned long value) {
+  print_number(value, false);
+}
+
+uint8_t LCDFrame::flush() {
+  unsigned long start = micros();
+  uint8_t written = 0;
+
+  for (uint8_t r = 0; r < LCD_ROWS; r++) {
+    /* Column the LCD's cursor is at on this row, past the end if elsewhere */
+    uint8_t at = LCD_COLS;
+    for (uint8_t c = 0; c < LCD_COLS; c++) {
+      if (shadow[r][c] == glass[r][c]) {
+        continue;
+      }
+      if (c != at) {
+        lcd.setCursor(c, r);
+        moves++;
+      }
+      lcd.write((uint8_t)shadow[r][c]);
+      glass[r][c] = shadow[r][c];
+      at = c + 1;
+      written++;
+    }
+  }
+
+  if (written) {
+    cells += written;
+    write_micros += micros() - start;
+  }
+  return written;
+}
+
+uint16_t LCDFrame::cell_micros() {
+  if (!cells) {
+    return 0;
+  }
+  return write_micros / cells;
+}
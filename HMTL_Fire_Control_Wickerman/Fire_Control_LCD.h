@@ -0,0 +1,73 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Shadow framebuffer for the 16x2 LCD.
+ *
+ * Display pages print into a copy of the screen held in memory with the
+ * same setCursor() and print() calls they used on the LCD, which costs
+ * nothing but formatting.  flush() then compares it against what is known to
+ * be on the glass and writes only the cells that differ, moving the cursor
+ * only at the start of each run of changed cells since the LCD advances it
+ * on every write.  On the ESP32 each character is several PCF8574 writes over
+ * I2C, so a page that hasn't changed no longer costs any bus traffic.
+ *
+ * Contents written straight to the LCD, such as the startup message, aren't
+ * known to the frame, so invalidate() makes the next flush redraw every cell.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_LCD_H
+#define FIRE_CONTROL_LCD_H
+
+#include "Arduino.h"
+
+#define LCD_COLS  16
+#define LCD_ROWS  2
+#define LCD_CELLS (LCD_COLS * LCD_ROWS)
+
+class LCDFrame {
+ public:
+  LCDFrame();
+
+  /* Blank the frame, the glass is cleared on the next flush */
+  void clear();
+
+  /* The glass contents are unknown, redraw every cell on the next flush */
+  void invalidate();
+
+  /* Position and print as on the LCD, output past the row's end is dropped */
+  void setCursor(uint8_t col, uint8_t row);
+  void print(const char *str);
+  void print(int value);
+  void print(unsigned int value);
+  void print(long value);
+  void print(unsigned long value);
+
+  /* Write the changed cells to the LCD, returns the number written */
+  uint8_t flush();
+
+  /* Character in a cell of the frame */
+  char cell(uint8_t col, uint8_t row) { return shadow[row][col]; }
+
+  /* Measurements */
+  uint32_t cells;         // Cells written to the glass
+  uint32_t moves;         // Cursor moves sent
+  uint32_t write_micros;  // Time spent writing to the LCD
+
+  /* Average time to write a cell, including its share of the cursor moves */
+  uint16_t cell_micros();
+
+ private:
+  void put(char c);
+  void print_number(unsigned long value, boolean negative);
+
+  char    shadow[LCD_ROWS][LCD_COLS];
+  char    glass[LCD_ROWS][LCD_COLS];
+  uint8_t col;
+  uint8_t row;
+};
+
+extern LCDFrame lcd_frame;
+
+#endif
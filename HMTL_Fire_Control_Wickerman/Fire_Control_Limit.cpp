@@ -0,0 +1,140 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Per-output send rate limiting
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_LIMIT
+  #define DEBUG_LEVEL DEBUG_LEVEL_LIMIT
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+#include "RS485Utils.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Limit.h"
+
+/* Longest burst window in ms, keeping bucket times comparable in 16 bits */
+#define RATE_MAX_WINDOW 30000
+
+/* Period at which full buckets are brought up to date */
+#define RATE_REFRESH_MS 10000
+
+/*
+ * Time, in the low 16 bits of millis(), at which each bucket will be full
+ * again.  A bucket is full when this is in the past.
+ */
+uint16_t rate_full_at[RATE_NUM_NODES * RATE_NODE_OUTPUTS];
+
+uint16_t rate_drops[NUM_RATE_CLASSES];
+uint16_t rate_drop_address = 0;
+uint8_t rate_drop_output = 0;
+
+void rate_reset() {
+  memset(rate_full_at, 0, sizeof (rate_full_at));
+  memset(rate_drops, 0, sizeof (rate_drops));
+}
+
+uint8_t rate_class(uint16_t address, uint8_t output) {
+  if (address == poofer1_address) {
+    if (output == POOFER1_IGNITER) return RATE_CLASS_IGNITER;
+    if (output == POOFER1_PILOT) return RATE_CLASS_PILOT;
+    return RATE_CLASS_ACCUMULATOR;
+  }
+
+  if (address == poofer2_address) {
+#ifdef POOFER2_IGNITER
+    if (output == POOFER2_IGNITER) return RATE_CLASS_IGNITER;
+    if (output == POOFER2_PILOT) return RATE_CLASS_PILOT;
+#endif
+    return RATE_CLASS_ACCUMULATOR;
+  }
+
+  if (IS_FIRE_GROUP(address)) {
+    return RATE_CLASS_ACCUMULATOR;
+  }
+
+  return RATE_CLASS_LIGHTS;
+}
+
+static uint8_t rate_index(uint16_t address, uint8_t output) {
+  uint8_t node;
+  if (address == poofer1_address) {
+    node = RATE_NODE_POOFER1;
+  } else if (address == poofer2_address) {
+    node = RATE_NODE_POOFER2;
+  } else if (address == lights_address) {
+    node = RATE_NODE_LIGHTS;
+  } else {
+    node = RATE_NODE_OTHER;
+  }
+
+  if (output >= RATE_NODE_OUTPUTS) {
+    output = RATE_NODE_OUTPUTS - 1;
+  }
+  return node * RATE_NODE_OUTPUTS + output;
+}
+
+/*
+ * Move the time of any full bucket up to now, so that it can't wrap around to
+ * appear in the future.
+ */
+void rate_refresh(unsigned long now) {
+  static unsigned long last_refresh = 0;
+  if (now - last_refresh < RATE_REFRESH_MS) {
+    return;
+  }
+  last_refresh = now;
+
+  uint16_t time = (uint16_t)now;
+  for (uint8_t i = 0; i < RATE_NUM_NODES * RATE_NODE_OUTPUTS; i++) {
+    if ((int16_t)(rate_full_at[i] - time) <= 0) {
+      rate_full_at[i] = time;
+    }
+  }
+}
+
+boolean rate_allow(uint16_t address, uint8_t output, unsigned long now) {
+  uint8_t rate_cls = rate_class(address, output);
+  fire_rate_t *limit = &fire_config.rate_limits[rate_cls];
+  if (limit->per_second == 0) {
+    return true;
+  }
+
+  /* Each message moves the bucket's full time one interval later */
+  uint16_t interval = 1000 / limit->per_second;
+  uint32_t window = (uint32_t)interval * (limit->burst ? limit->burst - 1 : 0);
+  if (window > RATE_MAX_WINDOW) {
+    window = RATE_MAX_WINDOW;
+  }
+
+  uint16_t *full_at = &rate_full_at[rate_index(address, output)];
+  uint16_t time = (uint16_t)now;
+  int16_t ahead = (int16_t)(*full_at - time);
+  if ((ahead <= 0) || ((uint16_t)ahead > window + interval)) {
+    /* Full, or the bucket went untouched without being refreshed */
+    *full_at = time;
+    ahead = 0;
+  }
+
+  if ((uint16_t)ahead > window) {
+    rate_drops[rate_cls]++;
+    rate_drop_address = address;
+    rate_drop_output = output;
+    DEBUG3_VALUE("Rate limited a:", address);
+    DEBUG3_VALUELN(" o:", output);
+    return false;
+  }
+
+  *full_at += interval;
+  return true;
+}
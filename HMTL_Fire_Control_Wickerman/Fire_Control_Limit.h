@@ -0,0 +1,51 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Per-output send rate limiting.
+ *
+ * Each (address, output) pair has a token bucket whose rate and burst come
+ * from the output's class in fire_config.rate_limits.  Buckets are stored as a
+ * single 16-bit "earliest time the bucket is full" value, so a check is a few
+ * comparisons and each output costs two bytes.  rate_refresh() keeps idle
+ * buckets from wrapping around.  Commands turning an output off are never
+ * limited, the caller doesn't check them.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_LIMIT_H
+#define FIRE_CONTROL_LIMIT_H
+
+#include "Arduino.h"
+#include "Fire_Control_Config.h"
+
+/* Buckets are kept for each output of the poofers and lights */
+#define RATE_NODE_POOFER1 0
+#define RATE_NODE_POOFER2 1
+#define RATE_NODE_LIGHTS  2
+#define RATE_NODE_OTHER   3 // Groups and any other address
+#define RATE_NUM_NODES    4
+
+/* Outputs past the last are limited together, including HMTL_ALL_OUTPUTS */
+#define RATE_NODE_OUTPUTS 5
+
+/* Messages dropped for each class, and the last output to be limited */
+extern uint16_t rate_drops[NUM_RATE_CLASSES];
+extern uint16_t rate_drop_address;
+extern uint8_t rate_drop_output;
+
+/* Returns the class used to limit messages to an output */
+uint8_t rate_class(uint16_t address, uint8_t output);
+
+/*
+ * Returns true if a message may be sent to the output, counting it against
+ * the output's bucket.
+ */
+boolean rate_allow(uint16_t address, uint8_t output, unsigned long now);
+
+void rate_reset();
+
+/* Must be called at least every 30 seconds, the work is done periodically */
+void rate_refresh(unsigned long now);
+
+#endif
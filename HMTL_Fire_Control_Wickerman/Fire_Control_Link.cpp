@@ -0,0 +1,190 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Link quality of the nodes on the bus
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_LINK
+  #define DEBUG_LEVEL DEBUG_LEVEL_LINK
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Link.h"
+
+#if LINK_WINDOW > 8
+  #error "Losses are kept in an 8 bit mask"
+#endif
+
+link_state_t link_stats;
+
+const link_node_t *link_node(uint16_t address) {
+  for (uint8_t i = 0; i < LINK_MAX_NODES; i++) {
+    if ((address != 0) && (link_stats.nodes[i].address == address)) {
+      return &link_stats.nodes[i];
+    }
+  }
+  return NULL;
+}
+
+/* Flag the first degraded node for display */
+static void link_update_warning() {
+  link_stats.warning = 0;
+  for (uint8_t i = 0; i < LINK_MAX_NODES; i++) {
+    if (link_stats.nodes[i].address && link_stats.nodes[i].degraded) {
+      link_stats.warning = link_stats.nodes[i].address;
+      return;
+    }
+  }
+}
+
+/* Stats for an address, reusing those of a node discovery no longer knows */
+static link_node_t *link_entry(uint16_t address) {
+  link_node_t *node = (link_node_t *)link_node(address);
+  if (node != NULL) {
+    return node;
+  }
+
+  for (uint8_t i = 0; i < LINK_MAX_NODES; i++) {
+    node = &link_stats.nodes[i];
+    if ((node->address == 0) || (disc_node(node->address) == NULL)) {
+      memset(node, 0, sizeof (link_node_t));
+      node->address = address;
+      link_update_warning();
+      return node;
+    }
+  }
+  return NULL;
+}
+
+uint8_t link_lost(const link_node_t *node) {
+  uint8_t count = 0;
+  for (uint8_t mask = node->lost; mask; mask >>= 1) {
+    count += (mask & 0x1);
+  }
+  return count;
+}
+
+uint16_t link_timeout_ms() {
+  return disc_window_ms(bus_baud) + 2 * LINK_SLACK_MS;
+}
+
+uint16_t link_warn_rtt() {
+  return (disc_window_ms(bus_baud) + LINK_SLACK_MS) *
+    (1000 / LINK_RTT_UNIT_US);
+}
+
+uint16_t link_rtt(const link_node_t *node) {
+  uint32_t total = 0;
+  uint8_t samples = 0;
+  for (uint8_t i = 0; i < node->count; i++) {
+    if (!(node->lost & (1 << i))) {
+      total += node->rtt[i];
+      samples++;
+    }
+  }
+  return samples ? total / samples : 0;
+}
+
+static void link_record(link_node_t *node, boolean lost, uint16_t rtt) {
+  uint8_t bit = (1 << node->head);
+  if (lost) {
+    node->lost |= bit;
+    node->rtt[node->head] = 0;
+  } else {
+    node->lost &= ~bit;
+    node->rtt[node->head] = rtt;
+
+    if (node->last) {
+      uint16_t change = (rtt > node->last) ? rtt - node->last : node->last - rtt;
+      if (change > 255) change = 255;
+      /*
+       * Average over 4 samples.  Kept scaled so changes smaller than the
+       * divisor still move it, then rounded.
+       */
+      node->jitter_x4 += change - ((node->jitter_x4 + 2) >> 2);
+      node->jitter = (node->jitter_x4 + 2) >> 2;
+    }
+    node->last = rtt;
+  }
+
+  node->head = (node->head + 1) % LINK_WINDOW;
+  if (node->count < LINK_WINDOW) {
+    node->count++;
+  }
+
+  boolean degraded = ((link_lost(node) >= LINK_WARN_LOST) ||
+                      (link_rtt(node) >= link_warn_rtt()) ||
+                      (node->jitter >= LINK_WARN_JITTER));
+  if (degraded != node->degraded) {
+    node->degraded = degraded;
+    DEBUG2_VALUE("Link a:", node->address);
+    DEBUG2_VALUE(" degraded:", degraded);
+    DEBUG2_VALUE(" lost:", link_lost(node));
+    DEBUG2_VALUE(" rtt:", link_rtt(node));
+    DEBUG2_VALUELN(" jitter:", node->jitter);
+    link_update_warning();
+  }
+}
+
+boolean link_response(uint16_t source, unsigned long now_us) {
+  if ((link_stats.probing == 0) || (source != link_stats.probing)) {
+    return false;
+  }
+  link_stats.probing = 0;
+
+  unsigned long rtt = (now_us - link_stats.sent_us) / LINK_RTT_UNIT_US;
+  if (rtt < 1) rtt = 1;
+  if (rtt > 0xFFFF) rtt = 0xFFFF;
+
+  link_node_t *node = link_entry(source);
+  if (node != NULL) {
+    link_record(node, false, rtt);
+  }
+  return true;
+}
+
+void link_service(unsigned long now_ms, unsigned long now_us) {
+  if (link_stats.probing) {
+    if (now_ms - link_stats.sent_ms < link_timeout_ms()) {
+      return;
+    }
+    link_node_t *node = link_entry(link_stats.probing);
+    if (node != NULL) {
+      link_record(node, true, 0);
+    }
+    link_stats.probing = 0;
+  }
+
+  if ((disc.num_nodes == 0) || (disc.state == DISC_POLLING) ||
+      (now_ms - link_stats.last_probe < LINK_PROBE_PERIOD_MS)) {
+    return;
+  }
+
+  /* Probes never delay firing */
+  if (bus_fire_pending() || bus_busy()) {
+    link_stats.deferred++;
+    return;
+  }
+  link_stats.last_probe = now_ms;
+
+  if (link_stats.next >= disc.num_nodes) {
+    link_stats.next = 0;
+  }
+  link_stats.probing = disc.nodes[link_stats.next++].address;
+  link_stats.sent_ms = now_ms;
+  link_stats.sent_us = now_us;
+  disc_poll(link_stats.probing);
+}
@@ -0,0 +1,97 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Link quality of the nodes on the bus.
+ *
+ * The nodes found by discovery are polled in turn at a low rate, recording
+ * the round trip time of each poll or its loss in a small rolling window per
+ * node, along with a smoothed jitter.  The round trip includes queueing on the
+ * controller and the node's own handling, so comparing nodes shows whether a
+ * slow response comes from the bus, one node, or the controller.  A node whose
+ * loss, round trip or jitter passes its limit is flagged as degraded.
+ *
+ * The probe timeout and round trip limit follow the exchange time at the bus
+ * rate.  No probe is sent while fire frames are waiting for the bus or still
+ * going out, or while bursts are held to be sent shortly.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_LINK_H
+#define FIRE_CONTROL_LINK_H
+
+#include "Arduino.h"
+
+#define LINK_PROBE_PERIOD_MS 250 // Time between probes, one node per probe
+#define LINK_SLACK_MS        10  // Handling and queueing beyond the exchange
+#define LINK_WINDOW          8   // Probes kept per node, at most 8
+
+#ifdef ESP32
+  #define LINK_MAX_NODES     8
+#else
+  #define LINK_MAX_NODES     4
+#endif
+
+/*
+ * Times are kept in 100us units.  Round trips saturate at 6.5s, jitter at
+ * 25.5ms.
+ */
+#define LINK_RTT_UNIT_US     100
+
+/* Limits past which a node is degraded, the round trip limit is link_warn_rtt() */
+#define LINK_WARN_LOST       2   // Lost probes in the window
+#define LINK_WARN_JITTER     30  // 3ms
+
+typedef struct {
+  uint16_t address;
+  uint16_t rtt[LINK_WINDOW];
+  uint8_t  lost;     // Mask of lost probes in the window
+  uint8_t  head;     // Position of the next sample
+  uint8_t  count;    // Samples in the window
+  uint16_t last;     // Most recent round trip
+  uint8_t  jitter;   // Smoothed change between round trips
+  uint16_t jitter_x4; // The same scaled by 4, keeping the fraction
+  boolean  degraded;
+} link_node_t;
+
+typedef struct {
+  link_node_t nodes[LINK_MAX_NODES];
+
+  uint16_t probing;        // Address of the outstanding probe, 0 if none
+  unsigned long sent_ms;
+  unsigned long sent_us;
+  unsigned long last_probe;
+  uint8_t  next;           // Position in the discovery cache to probe next
+
+  uint16_t warning;        // Address of a degraded node, 0 if none
+  uint16_t deferred;       // Probes held back for fire frames
+} link_state_t;
+
+extern link_state_t link_stats;
+
+/* Probe the next node when due */
+void link_service(unsigned long now_ms, unsigned long now_us);
+
+/*
+ * Handle a poll response received from a node, returns true if it answers the
+ * outstanding probe
+ */
+boolean link_response(uint16_t source, unsigned long now_us);
+
+/*
+ * Time after which a probe is lost, the exchange at the bus rate plus twice
+ * the slack
+ */
+uint16_t link_timeout_ms();
+
+/* Average round trip past which a node is degraded, in LINK_RTT_UNIT_US */
+uint16_t link_warn_rtt();
+
+/* Returns the stats kept for an address, or NULL */
+const link_node_t *link_node(uint16_t address);
+
+/* Stats over the window, times in LINK_RTT_UNIT_US */
+uint16_t link_rtt(const link_node_t *node);
+uint8_t link_lost(const link_node_t *node);
+
+#endif
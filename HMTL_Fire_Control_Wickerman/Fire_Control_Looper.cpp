@@ -0,0 +1,191 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Live loop recorder for touch performances
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_LOOPER
+  #define DEBUG_LEVEL DEBUG_LEVEL_LOOPER
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "Fire_Control_Tempo.h"
+#include "Fire_Control_Quantize.h"
+#include "Fire_Control_Looper.h"
+
+/* Events played in a single pass, no more than could be touched live */
+#define LOOPER_MAX_PER_RUN 12
+
+#if LOOPER_EVENTS > 255
+  #error "Event indexes are kept in a byte"
+#endif
+
+looper_state_t looper;
+
+void looper_clear() {
+  looper.state = LOOPER_IDLE;
+  looper.head = 0;
+  looper.count = 0;
+  looper.length = 0;
+  looper.grid = 0;
+  looper.overwritten = 0;
+}
+
+void looper_arm() {
+  looper_clear();
+  looper.state = LOOPER_ARMED;
+  DEBUG3_PRINTLN("Looper armed");
+}
+
+static looper_event_t *looper_event(uint8_t index) {
+  return &looper.events[(looper.head + index) % LOOPER_EVENTS];
+}
+
+static void looper_add(uint8_t delay, uint8_t sensor) {
+  if (looper.count >= LOOPER_EVENTS) {
+    /* The oldest event goes, the next is then timed from its time */
+    looper.start += (unsigned long)looper.events[looper.head].delay *
+                    LOOPER_TICK_MS;
+    looper.head = (looper.head + 1) % LOOPER_EVENTS;
+    looper.count--;
+    looper.overwritten++;
+  }
+
+  looper_event_t *event = looper_event(looper.count);
+  event->delay = delay;
+  event->sensor = sensor;
+  looper.count++;
+}
+
+void looper_record(uint16_t pressed, unsigned long now) {
+  if ((looper.state == LOOPER_ARMED) && pressed) {
+    DEBUG3_PRINTLN("Looper recording");
+    looper.state = LOOPER_RECORDING;
+    looper.start = now;
+    looper.last = now;
+  }
+  if ((looper.state != LOOPER_RECORDING) || !pressed) {
+    return;
+  }
+
+  /* The recorded time only moves by whole ticks so rounding doesn't add up */
+  uint32_t ticks = (now - looper.last) / LOOPER_TICK_MS;
+  looper.last += ticks * LOOPER_TICK_MS;
+  while (ticks > 0xFF) {
+    looper_add(0xFF, LOOPER_WAIT);
+    ticks -= 0xFF;
+  }
+
+  for (uint8_t sensor = 0; sensor < 16; sensor++) {
+    if (pressed & (1 << sensor)) {
+      looper_add(ticks, sensor);
+      ticks = 0;
+    }
+  }
+}
+
+/* End a recording, its length running until now */
+static void looper_finish(unsigned long now) {
+  looper.state = LOOPER_IDLE;
+  looper.length = now - looper.start;
+
+  looper.grid = quant_period();
+  if (looper.grid) {
+    /* Whole beats, long enough to hold every press */
+    uint32_t beats = (looper.length + tempo.period / 2) / tempo.period;
+    if (beats == 0) {
+      beats = 1;
+    }
+    looper.length = beats * tempo.period;
+    while (looper.length <= looper.last - looper.start) {
+      looper.length += tempo.period;
+    }
+  } else if (looper.length < LOOPER_TICK_MS) {
+    looper.length = LOOPER_TICK_MS;
+  }
+
+  DEBUG3_VALUE("Looper events:", looper.count);
+  DEBUG3_VALUE(" len:", looper.length);
+  DEBUG3_VALUELN(" grid:", looper.grid);
+}
+
+boolean looper_play(unsigned long now) {
+  if (looper.state == LOOPER_RECORDING) {
+    looper_finish(now);
+  }
+  if ((looper.count == 0) || (looper.state == LOOPER_ARMED)) {
+    return false;
+  }
+
+  looper.pass_start = now;
+  if (looper.grid && quant_period()) {
+    looper.pass_start = quant_next_tick(now);
+  }
+  looper.index = 0;
+  looper.due = looper.pass_start +
+               (unsigned long)looper_event(0)->delay * LOOPER_TICK_MS;
+  looper.state = LOOPER_PLAYING;
+  return true;
+}
+
+void looper_stop(unsigned long now) {
+  if (looper.state == LOOPER_RECORDING) {
+    looper_finish(now);
+  } else if (looper.state == LOOPER_PLAYING) {
+    DEBUG3_VALUELN("Looper stopped plays:", looper.plays);
+    looper.state = LOOPER_IDLE;
+  }
+}
+
+/* Time an event is played, on the nearest tick when quantized */
+static unsigned long looper_snap(unsigned long due) {
+  if (!looper.grid) {
+    return due;
+  }
+  uint32_t offset = due - looper.pass_start;
+  offset = (offset + looper.grid / 2) / looper.grid * looper.grid;
+  return looper.pass_start + offset;
+}
+
+uint16_t looper_run(unsigned long now) {
+  uint16_t pressed = 0;
+  if (looper.state != LOOPER_PLAYING) {
+    return pressed;
+  }
+
+  for (uint8_t i = 0; i < LOOPER_MAX_PER_RUN; i++) {
+    if ((long)(now - looper_snap(looper.due)) < 0) {
+      break;
+    }
+
+    /* Presses a whole loop late are stale and passed over */
+    looper_event_t *event = looper_event(looper.index);
+    if ((event->sensor != LOOPER_WAIT) &&
+        ((long)(now - looper.due) < (long)looper.length)) {
+      pressed |= (1 << event->sensor);
+    }
+
+    looper.index++;
+    if (looper.index >= looper.count) {
+      /* Repetitions are a whole length apart, any missed entirely skipped */
+      looper.index = 0;
+      looper.plays++;
+      looper.pass_start += looper.length;
+      while ((long)(now - (looper.pass_start + looper.length)) >= 0) {
+        looper.pass_start += looper.length;
+      }
+      looper.due = looper.pass_start;
+    }
+    looper.due += (unsigned long)looper_event(looper.index)->delay *
+                  LOOPER_TICK_MS;
+  }
+
+  return pressed;
+}
@@ -0,0 +1,90 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Live loop recorder for touch performances.
+ *
+ * Once armed, the sensors pressed while controlling the poofers directly are
+ * recorded from the first press.  Each press is two bytes, the ticks since
+ * the previous press and the sensor, with waits inserted for gaps too long
+ * for a single delay.  The recording is a ring so a long performance keeps
+ * its latest presses.  Recording ends when the loop starts playing, the time
+ * from the first press until then is the length of the loop.
+ *
+ * Playback produces a mask of sensors pressed on each pass which is handled
+ * exactly as live touches are.  Each repetition starts a whole loop length
+ * after the previous one and presses are timed from that start, so late
+ * passes never accumulate into drift.
+ *
+ * With a grid selected on the tap tempo (see Fire_Control_Quantize.h) when
+ * the recording ends, the length is rounded to whole beats, each press is
+ * played on the nearest tick and playback begins on a tick.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_LOOPER_H
+#define FIRE_CONTROL_LOOPER_H
+
+#include "Arduino.h"
+
+#define LOOPER_TICK_MS   10    // Unit of the delays between presses
+#define LOOPER_WAIT      0xFF  // Sensor of an event that's only a delay
+
+#ifndef LOOPER_EVENTS
+  #ifdef ESP32
+    #define LOOPER_EVENTS 128
+  #else
+    #define LOOPER_EVENTS 32
+  #endif
+#endif
+
+/* States */
+#define LOOPER_IDLE      0
+#define LOOPER_ARMED     1 // Recording starts with the next press
+#define LOOPER_RECORDING 2
+#define LOOPER_PLAYING   3
+
+typedef struct {
+  uint8_t delay;  // Ticks after the previous event
+  uint8_t sensor;
+} looper_event_t;
+
+typedef struct {
+  uint8_t  state;
+
+  /* Recording, as a ring starting at head */
+  looper_event_t events[LOOPER_EVENTS];
+  uint8_t  head;
+  uint8_t  count;
+  unsigned long start;    // Time the first event's delay is from
+  unsigned long last;     // Time of the last event recorded
+  uint32_t length;        // Loop length in ms
+  uint16_t grid;          // Spacing presses are played on, 0 if not quantized
+  uint16_t overwritten;   // Oldest events lost when the ring was full
+
+  /* Playback */
+  uint8_t  index;         // Events played this repetition
+  unsigned long pass_start;
+  unsigned long due;      // Time of the next event as recorded
+  uint16_t plays;
+} looper_state_t;
+
+extern looper_state_t looper;
+
+/* Drop any recording and record from the next press */
+void looper_arm();
+void looper_clear();
+
+/* Record a mask of sensors pressed */
+void looper_record(uint16_t pressed, unsigned long now);
+
+/* End a recording and start playing it, returns false if there's nothing */
+boolean looper_play(unsigned long now);
+
+/* Stop playing or recording, a recording in progress is kept */
+void looper_stop(unsigned long now);
+
+/* Mask of the recorded sensors pressed by now */
+uint16_t looper_run(unsigned long now);
+
+#endif
@@ -0,0 +1,353 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Interpreter for compact light and poofer patterns
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_PATTERN
+  #define DEBUG_LEVEL DEBUG_LEVEL_PATTERN
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "HMTLPrograms.h"
+#include "PixelUtil.h"
+
+#include "HMTL_Fire_Control.h"
+#include "modes.h"
+#include "Fire_Control_Sensors.h"
+#include "Fire_Control_Pattern.h"
+
+pattern_vm_t pattern;
+byte pattern_code[PATTERN_SIZE];
+
+#define PATTERN_HEADER ((pattern_header_t *)pattern_code)
+#define PATTERN_CODE   (pattern_code + sizeof (pattern_header_t))
+
+/* Result of an instruction */
+#define PAT_NEXT_OP    0 // Carry on with the next instruction
+#define PAT_YIELD      1 // Wait until due
+#define PAT_STOPPED    2 // The pattern has ended
+#define PAT_FAULT      3 // Bad operands
+
+/* Set by the instructions that write pixels */
+static boolean pattern_drawn;
+
+boolean pattern_valid() {
+  return ((PATTERN_HEADER->magic == PATTERN_MAGIC) &&
+          (PATTERN_HEADER->length > 0) &&
+          (PATTERN_HEADER->length <= PATTERN_SIZE - sizeof (pattern_header_t)));
+}
+
+boolean pattern_start(unsigned long now) {
+  if (!pattern_valid()) {
+    DEBUG1_PRINTLN("No pattern loaded");
+    return false;
+  }
+
+  pattern.length = PATTERN_HEADER->length;
+  pattern.pc = 0;
+  memset(pattern.regs, 0, sizeof (pattern.regs));
+  memset(pattern.color, 0, sizeof (pattern.color));
+  pattern.depth = 0;
+  pattern.due = now;
+  pattern.running = true;
+
+  DEBUG3_VALUELN("Pattern start len:", pattern.length);
+  return true;
+}
+
+void pattern_stop() {
+  if (pattern.running) {
+    DEBUG3_VALUELN("Pattern stop at:", pattern.pc);
+  }
+  pattern.running = false;
+}
+
+/*******************************************************************************
+ * Instructions, each given its operands with the pc already past them
+ */
+
+static const pattern_target_t *pattern_target(uint8_t index) {
+  if (index >= PATTERN_MAX_TARGETS) {
+    return NULL;
+  }
+  return &PATTERN_HEADER->targets[index];
+}
+
+static uint8_t op_end(const byte *args) {
+  pattern_stop();
+  return PAT_STOPPED;
+}
+
+static uint8_t op_wait(const byte *args) {
+  pattern.due += (unsigned long)args[0] * PATTERN_TICK_MS;
+  return PAT_YIELD;
+}
+
+static uint8_t op_wait_reg(const byte *args) {
+  if (args[0] >= PATTERN_REGISTERS) {
+    return PAT_FAULT;
+  }
+  pattern.due += (unsigned long)pattern.regs[args[0]] * PATTERN_TICK_MS;
+  return PAT_YIELD;
+}
+
+static uint8_t op_loop(const byte *args) {
+  if (pattern.depth >= PATTERN_LOOP_DEPTH) {
+    return PAT_FAULT;
+  }
+  pattern.loops[pattern.depth].pc = pattern.pc;
+  pattern.loops[pattern.depth].remaining = args[0];
+  pattern.depth++;
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_next(const byte *args) {
+  if (pattern.depth == 0) {
+    return PAT_FAULT;
+  }
+  pattern_loop_t *loop = &pattern.loops[pattern.depth - 1];
+  if ((loop->remaining == 0) || (--loop->remaining > 0)) {
+    pattern.pc = loop->pc;
+  } else {
+    pattern.depth--;
+  }
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_set(const byte *args) {
+  if (args[0] >= PATTERN_REGISTERS) {
+    return PAT_FAULT;
+  }
+  pattern.regs[args[0]] = args[1];
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_add(const byte *args) {
+  if (args[0] >= PATTERN_REGISTERS) {
+    return PAT_FAULT;
+  }
+  pattern.regs[args[0]] += args[1];
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_rgb(const byte *args) {
+  memcpy(pattern.color, args, sizeof (pattern.color));
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_scale(const byte *args) {
+  for (uint8_t i = 0; i < 3; i++) {
+    pattern.color[i] = ((uint16_t)pattern.color[i] * (args[0] + 1)) >> 8;
+  }
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_add_rgb(const byte *args) {
+  for (uint8_t i = 0; i < 3; i++) {
+    uint16_t value = pattern.color[i] + args[i];
+    pattern.color[i] = (value > 255) ? 255 : value;
+  }
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_pixel(const byte *args) {
+  if (args[0] >= PATTERN_REGISTERS) {
+    return PAT_FAULT;
+  }
+  uint8_t led = pattern.regs[args[0]];
+  if ((local_pixels_output != HMTL_NO_OUTPUT) && (led < pixels.numPixels())) {
+    pixel_set(led, pattern.color[0], pattern.color[1], pattern.color[2]);
+    pattern_drawn = true;
+  }
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_fill(const byte *args) {
+  if (local_pixels_output == HMTL_NO_OUTPUT) {
+    return PAT_NEXT_OP;
+  }
+  for (uint16_t led = 0; led < pixels.numPixels(); led++) {
+    pixel_set(led, pattern.color[0], pattern.color[1], pattern.color[2]);
+  }
+  pattern_drawn = true;
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_value(const byte *args) {
+  const pattern_target_t *target = pattern_target(args[0]);
+  if ((target == NULL) || (args[1] >= PATTERN_REGISTERS)) {
+    return PAT_FAULT;
+  }
+  uint8_t value = pattern.regs[args[1]];
+  if ((value != 0) && poofer_address(target->address) && !poofers_armed()) {
+    /* Like bursts, values never open a poofer while it's disarmed */
+    return PAT_NEXT_OP;
+  }
+  sendHMTLValue(target->address, target->output, value);
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_burst(const byte *args) {
+  const pattern_target_t *target = pattern_target(args[0]);
+  if (target == NULL) {
+    return PAT_FAULT;
+  }
+  if (poofers_armed()) {
+    sendHMTLTimedChange(target->address, target->output,
+                        (uint32_t)args[1] * PATTERN_TICK_MS, 0xFFFFFFFF, 0);
+  }
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_off(const byte *args) {
+  const pattern_target_t *target = pattern_target(args[0]);
+  if (target == NULL) {
+    return PAT_FAULT;
+  }
+  sendHMTLCancel(target->address, target->output);
+  sendHMTLValue(target->address, target->output, 0);
+  return PAT_NEXT_OP;
+}
+
+static uint8_t op_if_touch(const byte *args);
+
+typedef struct {
+  uint8_t operands;
+  uint8_t (*execute)(const byte *args);
+} pattern_op_t;
+
+/* Indexed by opcode */
+static const pattern_op_t pattern_ops[PAT_OPCODES] = {
+  { 0, op_end },       // PAT_END
+  { 1, op_wait },      // PAT_WAIT
+  { 1, op_wait_reg },  // PAT_WAIT_REG
+  { 1, op_loop },      // PAT_LOOP
+  { 0, op_next },      // PAT_NEXT
+  { 2, op_set },       // PAT_SET
+  { 2, op_add },       // PAT_ADD
+  { 3, op_rgb },       // PAT_RGB
+  { 1, op_scale },     // PAT_SCALE
+  { 3, op_add_rgb },   // PAT_ADD_RGB
+  { 1, op_pixel },     // PAT_PIXEL
+  { 0, op_fill },      // PAT_FILL
+  { 2, op_value },     // PAT_VALUE
+  { 2, op_burst },     // PAT_BURST
+  { 1, op_off },       // PAT_OFF
+  { 1, op_if_touch },  // PAT_IF_TOUCH
+};
+
+static uint8_t op_if_touch(const byte *args) {
+  if ((args[0] < 16) && (touch_states & (1 << args[0]))) {
+    return PAT_NEXT_OP;
+  }
+
+  /* Step over the next instruction, which is checked when it would run */
+  if (pattern.pc < pattern.length) {
+    uint8_t opcode = PATTERN_CODE[pattern.pc];
+    if (opcode >= PAT_OPCODES) {
+      return PAT_FAULT;
+    }
+    pattern.pc += 1 + pattern_ops[opcode].operands;
+  }
+  return PAT_NEXT_OP;
+}
+
+/******************************************************************************/
+
+boolean pattern_run(unsigned long now) {
+  pattern_drawn = false;
+
+  if (pattern.running && !poofers_armed()) {
+    /* Nothing more is sent once the poofers are disarmed */
+    DEBUG2_PRINTLN("Pattern stopped, not armed");
+    pattern_stop();
+    return false;
+  }
+
+  for (uint8_t i = 0; pattern.running; i++) {
+    if ((long)(now - pattern.due) < 0) {
+      break;
+    }
+    if (i >= PATTERN_BUDGET) {
+      /* The rest is left for the next pass */
+      pattern.yields++;
+      break;
+    }
+
+    uint8_t result = PAT_FAULT;
+    uint8_t opcode = PAT_OPCODES;
+    if (pattern.pc < pattern.length) {
+      opcode = PATTERN_CODE[pattern.pc];
+    }
+    if ((opcode < PAT_OPCODES) &&
+        (pattern.pc + 1 + pattern_ops[opcode].operands <= pattern.length)) {
+      const byte *args = &PATTERN_CODE[pattern.pc + 1];
+      pattern.pc += 1 + pattern_ops[opcode].operands;
+      pattern.executed++;
+      result = pattern_ops[opcode].execute(args);
+    }
+
+    if (result == PAT_FAULT) {
+      DEBUG1_VALUE("Pattern fault op:", opcode);
+      DEBUG1_VALUELN(" pc:", pattern.pc);
+      pattern.faults++;
+      pattern_stop();
+    }
+  }
+
+  return pattern_drawn;
+}
+
+void pattern_host_msg(const msg_hdr_t *msg_hdr) {
+  if (msg_hdr->length < sizeof (msg_hdr_t) + sizeof (msg_fire_pattern_t)) {
+    return;
+  }
+  const msg_fire_pattern_t *msg = (const msg_fire_pattern_t *)(msg_hdr + 1);
+  uint16_t len = msg_hdr->length - sizeof (msg_hdr_t) -
+                 sizeof (msg_fire_pattern_t);
+  if ((uint32_t)msg->offset + len > PATTERN_SIZE) {
+    DEBUG1_VALUELN("Pattern write past end:", msg->offset);
+    return;
+  }
+
+  /* The code is changing underneath any running pattern */
+  pattern_stop();
+  memcpy(pattern_code + msg->offset, msg->data, len);
+
+  DEBUG4_VALUE("Pattern write off:", msg->offset);
+  DEBUG4_VALUELN(" len:", len);
+}
+
+/*******************************************************************************
+ * Pattern program, the machine is the program state so none is allocated
+ */
+
+boolean program_pattern(output_hdr_t *output, void *object,
+                        program_tracker_t *tracker) {
+  boolean drawn = false;
+  if (pattern.running) {
+    drawn = pattern_run(millis());
+  }
+
+  if (!pattern.running) {
+    tracker->done = true;
+  }
+  return drawn;
+}
+
+boolean program_pattern_init(msg_program_t *msg, program_tracker_t *tracker,
+                             output_hdr_t *output, void *object,
+                             ProgramManager *manager) {
+  tracker->state = NULL;
+  return pattern_start(millis());
+}
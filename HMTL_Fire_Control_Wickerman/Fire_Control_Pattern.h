@@ -0,0 +1,142 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Interpreter for compact light and poofer patterns.
+ *
+ * A pattern is a short bytecode program written into RAM by the host with
+ * MSG_TYPE_FIRE_PATTERN messages, in the same way as a stored sequence, and
+ * run as the FIRE_PROGRAM_PATTERN program.  New patterns can then be tried
+ * without adding a program to the firmware.
+ *
+ * Each instruction is an opcode byte followed by a fixed number of operand
+ * bytes given by the opcode table.  The machine has a few byte registers, a
+ * color, a small stack of loops and a wait time.  Waits are timed from when
+ * the previous wait ended so a looped pattern doesn't drift.  At most
+ * PATTERN_BUDGET instructions run on each pass, a pattern that loops without
+ * waiting is just carried on next pass so it can never hold up the sensors.
+ *
+ * Targets are listed once in the header and referred to by index.  Bursts
+ * are only sent while the poofers are enabled with the pilot open.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_PATTERN_H
+#define FIRE_CONTROL_PATTERN_H
+
+#include "Arduino.h"
+#include "HMTLMessaging.h"
+#include "HMTLPrograms.h"
+
+#define MSG_TYPE_FIRE_PATTERN 0x24
+
+typedef struct {
+  uint16_t offset; // Offset into the pattern, starting with the header
+  byte     data[0];
+} msg_fire_pattern_t;
+
+/* Program type for running the loaded pattern */
+#define FIRE_PROGRAM_PATTERN  0x41
+
+#ifndef PATTERN_SIZE
+  #ifdef ESP32
+    #define PATTERN_SIZE 512
+  #else
+    #define PATTERN_SIZE 96
+  #endif
+#endif
+
+#define PATTERN_MAGIC        0x50
+#define PATTERN_MAX_TARGETS  4
+#define PATTERN_REGISTERS    4
+#define PATTERN_LOOP_DEPTH   4
+#define PATTERN_TICK_MS      10 // Unit of waits and burst lengths
+#define PATTERN_BUDGET       32 // Instructions run in a single pass
+
+typedef struct {
+  uint16_t address;
+  uint8_t  output;
+  uint8_t  reserved;
+} pattern_target_t;
+
+typedef struct {
+  uint8_t  magic;
+  uint8_t  reserved;
+  uint16_t length;  // Bytes of code following the header
+  pattern_target_t targets[PATTERN_MAX_TARGETS];
+} pattern_header_t;
+
+/*
+ * Opcodes, with their operands.  r is a register index, t a target index and
+ * ticks are PATTERN_TICK_MS.
+ */
+#define PAT_END       0x00 //                Stop the pattern
+#define PAT_WAIT      0x01 // ticks
+#define PAT_WAIT_REG  0x02 // r              Wait for the register's ticks
+#define PAT_LOOP      0x03 // count          Repeat to NEXT, 0 is forever
+#define PAT_NEXT      0x04 //
+#define PAT_SET       0x05 // r value
+#define PAT_ADD       0x06 // r value        Wraps
+#define PAT_RGB       0x07 // red green blue Set the color
+#define PAT_SCALE     0x08 // level          Scale the color, 255 is unchanged
+#define PAT_ADD_RGB   0x09 // red green blue Add to the color, saturating
+#define PAT_PIXEL     0x0A // r              Set the register's pixel
+#define PAT_FILL      0x0B //                Set every pixel
+#define PAT_VALUE     0x0C // t r            Send the register as a value
+#define PAT_BURST     0x0D // t ticks
+#define PAT_OFF       0x0E // t              Cancel programs and turn off
+#define PAT_IF_TOUCH  0x0F // sensor         Skip the next unless touched
+#define PAT_OPCODES   0x10
+
+typedef struct {
+  uint16_t pc;
+  uint8_t  remaining;  // Repeats left, 0 if forever
+} pattern_loop_t;
+
+typedef struct {
+  boolean  running;
+  uint16_t length;              // Length of the loaded code
+
+  uint16_t pc;                  // Offset into the code
+  uint8_t  regs[PATTERN_REGISTERS];
+  uint8_t  color[3];
+  pattern_loop_t loops[PATTERN_LOOP_DEPTH];
+  uint8_t  depth;
+  unsigned long due;            // Time the next instruction may run
+
+  /* Measurements */
+  uint32_t executed;
+  uint16_t yields;              // Passes ended by the instruction budget
+  uint16_t faults;              // Bad instructions that stopped a pattern
+} pattern_vm_t;
+
+extern pattern_vm_t pattern;
+
+/* Header then code, as written by the host */
+extern byte pattern_code[PATTERN_SIZE];
+
+/* Returns true if a valid pattern is loaded */
+boolean pattern_valid();
+
+/* Start the loaded pattern from the beginning */
+boolean pattern_start(unsigned long now);
+void pattern_stop();
+
+/*
+ * Run the pattern until it waits or the budget is used, returns true if it
+ * changed any pixels.  The pattern is stopped once the poofers are no longer
+ * armed and has to be started again.
+ */
+boolean pattern_run(unsigned long now);
+
+/* Handle a pattern message from the host */
+void pattern_host_msg(const msg_hdr_t *msg_hdr);
+
+/* Program functions for the ProgramManager */
+boolean program_pattern(output_hdr_t *output, void *object,
+                        program_tracker_t *tracker);
+boolean program_pattern_init(msg_program_t *msg, program_tracker_t *tracker,
+                             output_hdr_t *output, void *object,
+                             ProgramManager *manager);
+
+#endif
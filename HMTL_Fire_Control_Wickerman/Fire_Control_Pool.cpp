@@ -0,0 +1,357 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Fixed pool of program trackers for local programs
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_POOL
+  #define DEBUG_LEVEL DEBUG_LEVEL_POOL
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "Fire_Control_Pool.h"
+
+#if POOL_SLOTS >= POOL_NONE
+  #error "Slots are indexed by a byte"
+#endif
+#if HMTL_MAX_OUTPUTS > 16
+  #error "Outputs with programs due are kept in a 16 bit mask"
+#endif
+
+#define POOL_WHEEL_MASK (POOL_WHEEL_SIZE - 1)
+
+pool_state_t pool;
+
+void pool_init() {
+  for (uint8_t i = 0; i < POOL_SLOTS; i++) {
+    pool.slots[i].next = i + 1;
+  }
+  pool.slots[POOL_SLOTS - 1].next = POOL_NONE;
+  pool.free = 0;
+
+  for (uint8_t i = 0; i < HMTL_MAX_OUTPUTS; i++) {
+    pool.heads[i] = POOL_NONE;
+  }
+  for (uint8_t i = 0; i < POOL_WHEEL_SIZE; i++) {
+    pool.wheel[i] = POOL_NONE;
+  }
+  pool.used = 0;
+}
+
+/*******************************************************************************
+ * Timer wheel
+ */
+
+/* Bucket of the tick a wake time ends in, which is never one already run */
+static uint8_t pool_bucket(unsigned long wake) {
+  uint32_t tick = (wake + POOL_TICK_MS - 1) / POOL_TICK_MS;
+  if ((int32_t)(tick - pool.tick) <= 0) {
+    tick = pool.tick + 1;
+  }
+  return tick & POOL_WHEEL_MASK;
+}
+
+static void pool_schedule(uint8_t index, unsigned long wake) {
+  uint8_t bucket = pool_bucket(wake);
+  pool.slots[index].wake = wake;
+  pool.slots[index].bucket = bucket;
+  pool.slots[index].wheel_next = pool.wheel[bucket];
+  pool.wheel[bucket] = index;
+}
+
+static void pool_unschedule(uint8_t index) {
+  uint8_t *link = &pool.wheel[pool.slots[index].bucket];
+  while (*link != POOL_NONE) {
+    if (*link == index) {
+      *link = pool.slots[index].wheel_next;
+      return;
+    }
+    link = &pool.slots[*link].wheel_next;
+  }
+}
+
+/* Take the programs that are due out of a bucket, returning their outputs */
+static uint16_t pool_take_due(uint8_t bucket, unsigned long now) {
+  uint16_t outputs = 0;
+  uint8_t *link = &pool.wheel[bucket];
+  while (*link != POOL_NONE) {
+    pool_slot_t *slot = &pool.slots[*link];
+    if ((long)(now - slot->wake) >= 0) {
+      slot->flags |= POOL_SLOT_DUE;
+      outputs |= (1 << slot->output);
+      *link = slot->wheel_next;
+    } else {
+      /* Due on a later turn of the wheel */
+      link = &slot->wheel_next;
+    }
+  }
+  return outputs;
+}
+
+/* Next wake time of a program that's just run */
+static unsigned long pool_next_wake(pool_slot_t *slot, boolean changed,
+                                    unsigned long now) {
+  if (slot->flags & POOL_SLOT_WOKEN) {
+    slot->flags &= ~POOL_SLOT_WOKEN;
+    return slot->wake;
+  }
+
+  if (changed) {
+    if (slot->flags & POOL_SLOT_CHANGED) {
+      uint32_t interval = now - slot->changed;
+      if ((interval > 0) && (interval <= 0xFFFF) &&
+          ((slot->interval == 0) || (interval < slot->interval))) {
+        slot->interval = interval;
+      }
+    }
+    slot->flags |= POOL_SLOT_CHANGED;
+    slot->changed = now;
+    if (slot->interval) {
+      return now + slot->interval;
+    }
+  }
+
+  /* Not known to be due yet, so look again on the next tick */
+  return now + POOL_TICK_MS;
+}
+
+/*******************************************************************************
+ * Slots
+ */
+
+static uint8_t pool_alloc() {
+  uint8_t index = pool.free;
+  if (index == POOL_NONE) {
+    pool.exhausted++;
+    return POOL_NONE;
+  }
+  pool.free = pool.slots[index].next;
+
+  pool.used++;
+  if (pool.used > pool.peak) {
+    pool.peak = pool.used;
+  }
+  return index;
+}
+
+/*
+ * Release any state the program's setup allocated itself, as the HMTL
+ * programs do, before the slot is reused or freed.
+ */
+static void pool_release_state(pool_slot_t *slot) {
+  if (slot->tracker.state && (slot->tracker.state != slot->state)) {
+    free(slot->tracker.state);
+  }
+  slot->tracker.state = NULL;
+}
+
+static void pool_free(uint8_t index) {
+  if (!(pool.slots[index].flags & POOL_SLOT_DUE)) {
+    pool_unschedule(index);
+  }
+  pool_release_state(&pool.slots[index]);
+  pool.slots[index].next = pool.free;
+  pool.free = index;
+  pool.used--;
+}
+
+/* Take a slot off an output's list, prev is the slot before it */
+static void pool_unlink(uint8_t output, uint8_t prev, uint8_t index) {
+  if (prev == POOL_NONE) {
+    pool.heads[output] = pool.slots[index].next;
+  } else {
+    pool.slots[prev].next = pool.slots[index].next;
+  }
+  pool_free(index);
+}
+
+program_tracker_t *pool_find(uint8_t output, uint8_t layer) {
+  if (output >= HMTL_MAX_OUTPUTS) {
+    return NULL;
+  }
+  for (uint8_t i = pool.heads[output]; i != POOL_NONE;
+       i = pool.slots[i].next) {
+    if (pool.slots[i].layer == layer) {
+      return &pool.slots[i].tracker;
+    }
+  }
+  return NULL;
+}
+
+void *pool_state(program_tracker_t *tracker) {
+  return ((pool_slot_t *)tracker)->state;
+}
+
+void pool_wake(program_tracker_t *tracker, unsigned long when) {
+  pool_slot_t *slot = (pool_slot_t *)tracker;
+  if ((slot < &pool.slots[0]) || (slot >= &pool.slots[POOL_SLOTS])) {
+    return;
+  }
+  slot->wake = when;
+  slot->flags |= POOL_SLOT_WOKEN;
+}
+
+boolean pool_start(uint8_t output, uint8_t layer, hmtl_program_t *program,
+                   msg_program_t *msg, output_hdr_t *output_hdr, void *object,
+                   ProgramManager *manager) {
+  if ((output >= HMTL_MAX_OUTPUTS) || (program == NULL) ||
+      (program->setup == NULL)) {
+    return false;
+  }
+
+  /* Restarting a layer keeps its slot and place */
+  pool_slot_t *slot = (pool_slot_t *)pool_find(output, layer);
+  uint8_t index;
+  if (slot) {
+    index = slot - pool.slots;
+    if (!(slot->flags & POOL_SLOT_DUE)) {
+      pool_unschedule(index);
+    }
+    pool_release_state(slot);
+  } else {
+    index = pool_alloc();
+    if (index == POOL_NONE) {
+      DEBUG1_VALUELN("Pool full, no program on:", output);
+      return false;
+    }
+    slot = &pool.slots[index];
+    slot->output = output;
+    slot->layer = layer;
+
+    /* Insert after the lower layers */
+    uint8_t prev = POOL_NONE;
+    uint8_t next = pool.heads[output];
+    while ((next != POOL_NONE) && (pool.slots[next].layer < layer)) {
+      prev = next;
+      next = pool.slots[next].next;
+    }
+    slot->next = next;
+    if (prev == POOL_NONE) {
+      pool.heads[output] = index;
+    } else {
+      pool.slots[prev].next = index;
+    }
+  }
+
+  slot->tracker.program = program;
+  slot->tracker.state = NULL;
+  slot->tracker.done = false;
+  slot->flags = 0;
+  slot->interval = 0;
+  pool.starts++;
+
+  /* A new program runs on the next tick */
+  pool_schedule(index, millis());
+
+  if (!program->setup(msg, &slot->tracker, output_hdr, object, manager)) {
+    DEBUG1_VALUELN("Program setup failed on:", output);
+    pool_cancel(output, layer);
+    return false;
+  }
+  return true;
+}
+
+void pool_cancel(uint8_t output, uint8_t layer) {
+  if (output >= HMTL_MAX_OUTPUTS) {
+    return;
+  }
+
+  uint8_t prev = POOL_NONE;
+  uint8_t i = pool.heads[output];
+  while (i != POOL_NONE) {
+    uint8_t next = pool.slots[i].next;
+    if ((layer == POOL_ALL_LAYERS) || (pool.slots[i].layer == layer)) {
+      pool_unlink(output, prev, i);
+    } else {
+      prev = i;
+    }
+    i = next;
+  }
+}
+
+boolean pool_run(output_hdr_t **outputs, void **objects, unsigned long now) {
+  uint32_t tick = now / POOL_TICK_MS;
+  if (tick == pool.tick) {
+    return false;
+  }
+
+  /* Every bucket of the ticks passed, but no more than once each */
+  uint32_t ticks = tick - pool.tick;
+  if (ticks > POOL_WHEEL_SIZE) {
+    ticks = POOL_WHEEL_SIZE;
+  }
+  uint16_t due = 0;
+  for (uint32_t t = tick - ticks + 1; t != tick + 1; t++) {
+    due |= pool_take_due(t & POOL_WHEEL_MASK, now);
+  }
+  pool.tick = tick;
+
+  /*
+   * The due programs on each output run in increasing layer.  Once one has
+   * changed the output every layer above it runs too, so it's drawn over.
+   */
+  boolean changed = false;
+  for (uint8_t output = 0; due; output++, due >>= 1) {
+    if (!(due & 0x1)) {
+      continue;
+    }
+
+    boolean redraw = false;
+    uint8_t prev = POOL_NONE;
+    uint8_t i = pool.heads[output];
+    while (i != POOL_NONE) {
+      pool_slot_t *slot = &pool.slots[i];
+      uint8_t next = slot->next;
+
+      boolean is_due = (slot->flags & POOL_SLOT_DUE);
+      if (is_due || redraw) {
+        unsigned long wake = slot->wake;
+        if (is_due) {
+          slot->flags &= ~POOL_SLOT_DUE;
+        } else {
+          pool_unschedule(i);
+        }
+
+        pool.calls++;
+        boolean updated = slot->tracker.program->program(outputs[output],
+                                                         objects[output],
+                                                         &slot->tracker);
+        if (updated) {
+          changed = true;
+          redraw = true;
+        }
+
+        if (slot->tracker.done) {
+          DEBUG4_VALUE("Program done o:", output);
+          DEBUG4_VALUELN(" layer:", slot->layer);
+          pool_unlink(output, prev, i);
+          i = next;
+          continue;
+        }
+
+        if (is_due) {
+          pool_schedule(i, pool_next_wake(slot, updated, now));
+        } else {
+          /* Drawn over a lower layer, its own timing is left as it was */
+          if (slot->flags & POOL_SLOT_WOKEN) {
+            slot->flags &= ~POOL_SLOT_WOKEN;
+            wake = slot->wake;
+          }
+          pool_schedule(i, wake);
+        }
+      }
+
+      prev = i;
+      i = next;
+    }
+  }
+
+  return changed;
+}
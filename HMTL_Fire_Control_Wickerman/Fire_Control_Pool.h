@@ -0,0 +1,126 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Fixed pool of program trackers for local programs.
+ *
+ * The ProgramManager keeps a single program per output for programs sent
+ * over the bus.  Programs started locally instead take a slot from this pool,
+ * which lets several run on an output at once as layers.  The programs due on
+ * an output in a pass run in increasing layer, and once one changes the
+ * output every layer above it is run as well, due or not, so a higher layer
+ * draws over a lower one.  Running a layer early leaves its own wake time as
+ * it was.  Programs on the layers above the lowest should draw their current
+ * state whenever they're run, the HMTL programs only draw when their own
+ * timing says to so they belong on the lowest layer.  The ProgramManager's
+ * program for the output runs after the pool and finally followup_actions()
+ * lights the touched sensors.
+ *
+ * Slots are kept on a free list so taking and returning one is a constant
+ * time operation and never touches the heap.  Each slot has a small block of
+ * state for programs written for the firmware, see pool_state().  Starting a
+ * program on a layer that already has one reuses its slot.
+ *
+ * Programs are only run when they are due, with each waiting in a hashed
+ * timer wheel bucket for the tick its wake time falls in.  A pass through
+ * pool_run() returns immediately unless a new tick has started, and then only
+ * looks at the buckets of the ticks passed.  Programs written for the firmware
+ * set their next wake time with pool_wake().  The HMTL programs don't say
+ * when they next change, so each is woken after the shortest time seen
+ * between its changes and then on every tick until it changes again.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_POOL_H
+#define FIRE_CONTROL_POOL_H
+
+#include "Arduino.h"
+#include "HMTLTypes.h"
+#include "HMTLPrograms.h"
+
+#ifndef POOL_SLOTS
+  #ifdef ESP32
+    #define POOL_SLOTS 16
+  #else
+    #define POOL_SLOTS 4
+  #endif
+#endif
+
+#define POOL_STATE_SIZE  16   // Bytes of state in each slot
+#define POOL_NONE        0xFF // End of a list of slots
+
+#define POOL_TICK_MS     8    // Time covered by a bucket, a power of two
+#define POOL_WHEEL_SIZE  8    // Buckets, a power of two
+
+/* Slot flags */
+#define POOL_SLOT_WOKEN   0x01 // The program set its own wake time
+#define POOL_SLOT_CHANGED 0x02 // The program has changed its output
+#define POOL_SLOT_DUE     0x04 // Taken from the wheel to run this pass
+
+/* Layers, in the order they are drawn */
+#define POOL_LAYER_MODE      0 // Sparkle and blink showing the control mode
+#define POOL_LAYER_SEQUENCE  1 // Stored sequence, see Fire_Control_Sequence.h
+#define POOL_ALL_LAYERS      0xFF
+
+typedef struct {
+  program_tracker_t tracker;
+  uint8_t output;
+  uint8_t layer;
+  uint8_t next;     // Next slot on the output, or on the free list
+  byte    state[POOL_STATE_SIZE];
+
+  unsigned long wake;     // Time the program next needs to run
+  unsigned long changed;  // Time it last changed its output
+  uint16_t interval;      // Shortest time seen between changes, 0 if unknown
+  uint8_t  bucket;        // Wheel bucket it waits in
+  uint8_t  wheel_next;    // Next slot in the same bucket
+  uint8_t  flags;
+} pool_slot_t;
+
+typedef struct {
+  pool_slot_t slots[POOL_SLOTS];
+  uint8_t  heads[HMTL_MAX_OUTPUTS]; // Each output's programs, lowest layer first
+  uint8_t  free;
+
+  uint8_t  wheel[POOL_WHEEL_SIZE];  // Slots waiting in each bucket
+  uint32_t tick;                    // Last tick run
+
+  uint8_t  used;
+  uint8_t  peak;
+  uint16_t starts;
+  uint16_t exhausted;               // Starts refused with no free slot
+  uint32_t calls;                   // Program functions run
+} pool_state_t;
+
+extern pool_state_t pool;
+
+/* Put every slot on the free list */
+void pool_init();
+
+/*
+ * Start a program on a layer of an output, replacing any already on that
+ * layer.  Returns false if there's no free slot or the program's setup fails.
+ */
+boolean pool_start(uint8_t output, uint8_t layer, hmtl_program_t *program,
+                   msg_program_t *msg, output_hdr_t *output_hdr, void *object,
+                   ProgramManager *manager);
+
+/* Stop the program on a layer of an output, or on all of its layers */
+void pool_cancel(uint8_t output, uint8_t layer);
+
+/* Program running on a layer of an output, NULL if there's none */
+program_tracker_t *pool_find(uint8_t output, uint8_t layer);
+
+/* State block of the slot holding a tracker */
+void *pool_state(program_tracker_t *tracker);
+
+/*
+ * Set when a running program is next needed, ignored for a tracker that
+ * isn't in the pool.
+ */
+void pool_wake(program_tracker_t *tracker, unsigned long when);
+
+/* Run the programs that are due, returns true if any changed its output */
+boolean pool_run(output_hdr_t **outputs, void **objects, unsigned long now);
+
+#endif
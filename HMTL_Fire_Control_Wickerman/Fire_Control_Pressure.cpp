@@ -0,0 +1,167 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Pressure-proportional output from a touch sensor
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_PRESSURE
+  #define DEBUG_LEVEL DEBUG_LEVEL_PRESSURE
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+#include <Wire.h>
+#include "MPR121.h"
+
+#include "HMTLTypes.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Pressure.h"
+
+/* MPR121 registers, filtered data is 10 bits and baselines the top 8 */
+#define MPR121_FILTERED_DATA  0x04
+#define MPR121_BASELINE_DATA  0x1E
+
+/*
+ * Below a few counts is noise on an untouched electrode, past that a light
+ * touch moves quickly off zero and a firm palm saturates.
+ */
+const pressure_point_t pressure_curve[PRESSURE_CURVE_POINTS] = {
+  {   0,   0 },
+  {   4,   0 },
+  {  12,  48 },
+  {  40, 160 },
+  { 100, 255 },
+};
+
+pressure_state_t pressure;
+
+uint8_t pressure_map(uint16_t delta) {
+  const pressure_point_t *low = &pressure_curve[0];
+  for (uint8_t i = 1; i < PRESSURE_CURVE_POINTS; i++) {
+    const pressure_point_t *high = &pressure_curve[i];
+    if (delta < high->delta) {
+      return low->value + (int32_t)(high->value - low->value) *
+                          (delta - low->delta) / (high->delta - low->delta);
+    }
+    low = high;
+  }
+  return low->value;
+}
+
+boolean pressure_update(uint16_t delta, unsigned long now) {
+  uint8_t value = pressure_map(delta);
+  uint8_t change = (value > pressure.value) ? value - pressure.value :
+                                              pressure.value - value;
+
+  /* Small changes are dropped unless they reach fully off or on */
+  if ((change < PRESSURE_HYSTERESIS) &&
+      !((change != 0) && ((value == 0) || (value == 255)))) {
+    pressure.pending = false;
+    return false;
+  }
+
+  if (!pressure.pending) {
+    pressure.pending = true;
+    pressure.changed = now;
+  }
+  if (pressure.updates && ((now - pressure.sent) < PRESSURE_PERIOD_MS)) {
+    return false;
+  }
+
+  uint16_t latency = now - pressure.changed;
+  pressure.latency_total += latency;
+  if (latency > pressure.latency_max) {
+    pressure.latency_max = latency;
+  }
+
+  pressure.value = value;
+  pressure.pending = false;
+  pressure.sent = now;
+  pressure.updates++;
+  pressure.window++;
+  return true;
+}
+
+/* Read consecutive registers, returns false if they weren't all read */
+static boolean pressure_read(uint8_t reg, uint8_t length, byte *data) {
+  Wire.beginTransmission(START_ADDRESS);
+  Wire.write(reg);
+  if (Wire.endTransmission() != 0) {
+    return false;
+  }
+  if (Wire.requestFrom((uint8_t)START_ADDRESS, length) != length) {
+    return false;
+  }
+  for (uint8_t i = 0; i < length; i++) {
+    data[i] = Wire.read();
+  }
+  return true;
+}
+
+int16_t pressure_read_delta(uint8_t sensor) {
+  byte data[2];
+  if (!pressure_read(MPR121_FILTERED_DATA + 2 * sensor, 2, data)) {
+    return PRESSURE_NO_READING;
+  }
+  uint16_t filtered = data[0] | ((uint16_t)(data[1] & 0x03) << 8);
+
+  if (!pressure_read(MPR121_BASELINE_DATA + sensor, 1, data)) {
+    return PRESSURE_NO_READING;
+  }
+  uint16_t baseline = (uint16_t)data[0] << 2;
+
+  /* A touch only ever pulls the filtered reading down */
+  if (filtered >= baseline) {
+    return 0;
+  }
+  return baseline - filtered;
+}
+
+void pressure_service(unsigned long now) {
+  if ((now - pressure.window_start) >= 1000) {
+    pressure.rate = pressure.window;
+    pressure.window = 0;
+    pressure.window_start = now;
+    if (pressure.rate) {
+      DEBUG4_VALUE("Pressure rate:", pressure.rate);
+      DEBUG4_VALUELN(" lat:", pressure_latency_average());
+    }
+  }
+
+  if ((now - pressure.sampled) < PRESSURE_SAMPLE_MS) {
+    return;
+  }
+  pressure.sampled = now;
+
+  int16_t delta = pressure_read_delta(PRESSURE_SENSOR);
+  if (delta == PRESSURE_NO_READING) {
+    return;
+  }
+
+  if (pressure_update(delta, now)) {
+    DEBUG5_VALUE("Pressure d:", delta);
+    DEBUG5_VALUELN(" v:", pressure.value);
+    sendHMTLValue(PRESSURE_ADDRESS, PRESSURE_OUTPUT, pressure.value);
+  }
+}
+
+void pressure_stop() {
+  if (pressure.value) {
+    sendHMTLValue(PRESSURE_ADDRESS, PRESSURE_OUTPUT, 0);
+  }
+  pressure.value = 0;
+  pressure.pending = false;
+}
+
+uint16_t pressure_latency_average() {
+  if (pressure.updates == 0) {
+    return 0;
+  }
+  return pressure.latency_total / pressure.updates;
+}
@@ -0,0 +1,87 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Pressure-proportional output from a touch sensor.
+ *
+ * A touch is normally only on or off, but the MPR121 also reports how far
+ * each electrode's filtered reading has dropped below its baseline, which
+ * grows with the area of the hand pressed against it.  When FIRE_FLAG_PRESSURE
+ * is set that delta on PRESSURE_SENSOR is sampled, mapped to a value through
+ * a piecewise-linear calibration curve and sent as a value to an output that
+ * can use it, the lights by default.  Set PRESSURE_ADDRESS and PRESSURE_OUTPUT
+ * to drive something else such as a proportional valve, which is then only
+ * driven while the poofers are armed.  While in pressure mode touches of the
+ * sensor don't fire the poofers, on the touch controller every electrode has
+ * a fire action.
+ *
+ * Only changes of at least PRESSURE_HYSTERESIS are sent, except for reaching
+ * fully off or on, and no more often than every PRESSURE_PERIOD_MS so a
+ * noisy electrode can't flood the bus.  The rate of updates and the latency
+ * from a reading first differing by enough to when its value is sent are
+ * recorded.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_PRESSURE_H
+#define FIRE_CONTROL_PRESSURE_H
+
+#include "Arduino.h"
+
+#ifndef PRESSURE_ADDRESS
+  #define PRESSURE_ADDRESS    lights_address
+  #define PRESSURE_OUTPUT     HMTL_ALL_OUTPUTS
+#endif
+
+#define PRESSURE_SAMPLE_MS    10 // Time between reads of the electrode
+#define PRESSURE_PERIOD_MS    40 // Minimum time between value updates
+#define PRESSURE_HYSTERESIS    6 // Smallest change of value that's sent
+
+#define PRESSURE_CURVE_POINTS  5
+#define PRESSURE_NO_READING   -1
+
+typedef struct {
+  uint16_t delta;
+  uint8_t  value;
+} pressure_point_t;
+
+/* Calibration curve, in increasing delta */
+extern const pressure_point_t pressure_curve[PRESSURE_CURVE_POINTS];
+
+typedef struct {
+  uint8_t  value;          // Last value sent
+  boolean  pending;        // A change is waiting on the update period
+  unsigned long changed;   // Time the pending change was first read
+  unsigned long sent;      // Time of the last update
+  unsigned long sampled;   // Time of the last read
+
+  /* Measurements */
+  uint16_t updates;
+  uint16_t window;         // Updates since the rate was last computed
+  unsigned long window_start;
+  uint8_t  rate;           // Updates in the last second
+  uint32_t latency_total;
+  uint16_t latency_max;
+} pressure_state_t;
+
+extern pressure_state_t pressure;
+
+/* Value for a delta, per the calibration curve */
+uint8_t pressure_map(uint16_t delta);
+
+/* Record a reading, returns true if its value should be sent now */
+boolean pressure_update(uint16_t delta, unsigned long now);
+
+/* Filtered reading below baseline of a sensor, or PRESSURE_NO_READING */
+int16_t pressure_read_delta(uint8_t sensor);
+
+/* Sample the pressure sensor and send its value when due */
+void pressure_service(unsigned long now);
+
+/* Turn the output off when leaving pressure mode */
+void pressure_stop();
+
+/* Average ms from a change being read to its update */
+uint16_t pressure_latency_average();
+
+#endif
@@ -0,0 +1,269 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Configuration streaming to nodes
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_PROVISION
+  #define DEBUG_LEVEL DEBUG_LEVEL_PROVISION
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Arbiter.h"
+#include "Fire_Control_Provision.h"
+
+/* Time to wait for the host to supply a requested chunk before asking again */
+#define CFG_HOST_TIMEOUT_MS 1000
+
+cfg_xfer_t cfg_xfer;
+unsigned long cfg_requested_at = 0;
+
+uint16_t cfg_crc(const byte *data, uint16_t len, uint16_t crc) {
+  for (uint16_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+/* Send a configuration message to the target node */
+static void cfg_send(uint8_t op, uint16_t offset, uint16_t length,
+                     uint16_t crc, const byte *data, uint8_t datalen) {
+  byte frame[sizeof (msg_hdr_t) + sizeof (msg_fire_config_t) + CFG_CHUNK_SIZE];
+  uint8_t len = sizeof (msg_hdr_t) + sizeof (msg_fire_config_t) + datalen;
+
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)frame;
+  hmtl_msg_fmt(msg_hdr, cfg_xfer.target, len, MSG_TYPE_FIRE_CONFIG, 0);
+
+  msg_fire_config_t *cfg = (msg_fire_config_t *)(msg_hdr + 1);
+  cfg->op = op;
+  cfg->status = CFG_STATUS_OK;
+  cfg->target = cfg_xfer.target;
+  cfg->offset = offset;
+  cfg->length = length;
+  cfg->crc = crc;
+  if (datalen) {
+    memcpy(cfg->data, data, datalen);
+  }
+
+  bus_send(cfg_xfer.target, frame, len, ARB_PRIORITY_COSMETIC);
+}
+
+static uint8_t cfg_chunk_len(uint16_t offset) {
+  uint16_t remaining = cfg_xfer.total - offset;
+  return (remaining < CFG_CHUNK_SIZE) ? remaining : CFG_CHUNK_SIZE;
+}
+
+static byte *cfg_window_slot(uint16_t offset) {
+  return cfg_xfer.window[(offset / CFG_CHUNK_SIZE) % CFG_WINDOW];
+}
+
+static void cfg_send_chunk(uint16_t offset) {
+  byte *data = cfg_window_slot(offset);
+  uint8_t len = cfg_chunk_len(offset);
+  cfg_send(CFG_OP_CHUNK, offset, len, cfg_crc(data, len), data, len);
+  cfg_xfer.chunks++;
+}
+
+static void cfg_finish(uint8_t status) {
+  if (status == CFG_STATUS_OK) {
+    Serial.print(F("cfg done "));
+    Serial.println(millis() - cfg_xfer.started);
+  } else {
+    Serial.print(F("cfg fail "));
+    Serial.println(status);
+  }
+
+  DEBUG2_VALUE("Cfg end a:", cfg_xfer.target);
+  DEBUG2_VALUE(" status:", status);
+  DEBUG2_VALUE(" chunks:", cfg_xfer.chunks);
+  DEBUG2_VALUELN(" resends:", cfg_xfer.resends);
+  cfg_xfer.state = CFG_IDLE;
+}
+
+static void cfg_commit() {
+  cfg_xfer.state = CFG_COMMITTING;
+  cfg_xfer.retries = 0;
+  cfg_xfer.progress = millis();
+  cfg_send(CFG_OP_COMMIT, 0, cfg_xfer.total, cfg_xfer.crc, NULL, 0);
+}
+
+void cfg_host_msg(const msg_hdr_t *msg_hdr) {
+  if (msg_hdr->length < sizeof (msg_hdr_t) + sizeof (msg_fire_config_t)) {
+    return;
+  }
+  const msg_fire_config_t *cfg = (const msg_fire_config_t *)(msg_hdr + 1);
+
+  switch (cfg->op) {
+    case CFG_OP_START: {
+      if ((cfg_xfer.state != CFG_IDLE) && (cfg->target != cfg_xfer.target)) {
+        Serial.print(F("cfg fail "));
+        Serial.println(CFG_STATUS_BUSY);
+        return;
+      }
+
+      memset(&cfg_xfer, 0, sizeof (cfg_xfer));
+      cfg_xfer.state = CFG_STARTING;
+      cfg_xfer.target = cfg->target;
+      cfg_xfer.total = cfg->length;
+      cfg_xfer.crc = cfg->crc;
+      cfg_xfer.started = millis();
+      cfg_xfer.progress = cfg_xfer.started;
+
+      DEBUG2_VALUE("Cfg start a:", cfg_xfer.target);
+      DEBUG2_VALUELN(" len:", cfg_xfer.total);
+      cfg_send(CFG_OP_START, 0, cfg_xfer.total, cfg_xfer.crc, NULL, 0);
+      break;
+    }
+
+    case CFG_OP_CHUNK: {
+      /* Only the chunk that was requested is accepted */
+      if ((cfg_xfer.state != CFG_STREAMING) ||
+          (cfg->offset != cfg_xfer.sent) ||
+          (cfg->length != cfg_chunk_len(cfg->offset)) ||
+          (msg_hdr->length < sizeof (msg_hdr_t) + sizeof (msg_fire_config_t) +
+                             cfg->length)) {
+        return;
+      }
+      if (cfg_crc(cfg->data, cfg->length) != cfg->crc) {
+        /* Ask again */
+        cfg_xfer.requested = 0;
+        return;
+      }
+
+      if (cfg_xfer.sent == cfg_xfer.acked) {
+        cfg_xfer.progress = millis();
+      }
+      memcpy(cfg_window_slot(cfg->offset), cfg->data, cfg->length);
+      cfg_send_chunk(cfg->offset);
+      cfg_xfer.sent += cfg->length;
+      cfg_xfer.requested = 0;
+      break;
+    }
+
+    case CFG_OP_ABORT: {
+      if (cfg_xfer.state != CFG_IDLE) {
+        cfg_send(CFG_OP_ABORT, 0, 0, 0, NULL, 0);
+        cfg_xfer.state = CFG_IDLE;
+      }
+      break;
+    }
+  }
+}
+
+void cfg_node_msg(uint16_t source, const msg_hdr_t *msg_hdr) {
+  if ((cfg_xfer.state == CFG_IDLE) || (source != cfg_xfer.target) ||
+      (msg_hdr->length < sizeof (msg_hdr_t) + sizeof (msg_fire_config_t))) {
+    return;
+  }
+  const msg_fire_config_t *cfg = (const msg_fire_config_t *)(msg_hdr + 1);
+  if (cfg->op != CFG_OP_ACK) {
+    return;
+  }
+
+  switch (cfg_xfer.state) {
+    case CFG_STARTING: {
+      if (cfg->status != CFG_STATUS_OK) {
+        cfg_finish(cfg->status);
+        return;
+      }
+
+      /* Resume from the last complete chunk the node holds */
+      uint16_t resume = cfg->offset - (cfg->offset % CFG_CHUNK_SIZE);
+      if (resume > cfg_xfer.total) {
+        resume = 0;
+      }
+      DEBUG3_VALUELN("Cfg resume:", resume);
+      cfg_xfer.acked = resume;
+      cfg_xfer.sent = resume;
+      cfg_xfer.state = CFG_STREAMING;
+      cfg_xfer.retries = 0;
+      cfg_xfer.progress = millis();
+      if (cfg_xfer.acked == cfg_xfer.total) {
+        cfg_commit();
+      }
+      break;
+    }
+
+    case CFG_STREAMING: {
+      if ((cfg->offset > cfg_xfer.acked) && (cfg->offset <= cfg_xfer.sent)) {
+        cfg_xfer.acked = cfg->offset;
+        cfg_xfer.retries = 0;
+        cfg_xfer.progress = millis();
+      }
+      if (cfg->status != CFG_STATUS_OK) {
+        /* A chunk was damaged, resend on the next service */
+        cfg_xfer.progress = millis() - CFG_ACK_TIMEOUT_MS;
+      }
+      if (cfg_xfer.acked == cfg_xfer.total) {
+        cfg_commit();
+      }
+      break;
+    }
+
+    case CFG_COMMITTING: {
+      cfg_finish(cfg->status);
+      break;
+    }
+  }
+}
+
+void cfg_service(unsigned long now) {
+  if (cfg_xfer.state == CFG_IDLE) {
+    return;
+  }
+
+  boolean waiting = ((cfg_xfer.state != CFG_STREAMING) ||
+                     (cfg_xfer.sent != cfg_xfer.acked));
+  if (waiting && (now - cfg_xfer.progress >= CFG_ACK_TIMEOUT_MS)) {
+    if (++cfg_xfer.retries > CFG_MAX_RETRIES) {
+      cfg_send(CFG_OP_ABORT, 0, 0, 0, NULL, 0);
+      cfg_finish(CFG_STATUS_TIMEOUT);
+      return;
+    }
+    cfg_xfer.progress = now;
+
+    switch (cfg_xfer.state) {
+      case CFG_STARTING:
+        cfg_send(CFG_OP_START, 0, cfg_xfer.total, cfg_xfer.crc, NULL, 0);
+        break;
+      case CFG_STREAMING:
+        /* Go back to the first unacknowledged chunk */
+        for (uint16_t offset = cfg_xfer.acked; offset < cfg_xfer.sent;
+             offset += CFG_CHUNK_SIZE) {
+          cfg_send_chunk(offset);
+          cfg_xfer.resends++;
+        }
+        break;
+      case CFG_COMMITTING:
+        cfg_send(CFG_OP_COMMIT, 0, cfg_xfer.total, cfg_xfer.crc, NULL, 0);
+        break;
+    }
+  }
+
+  /* Ask the host for the next chunk while there is room in the window */
+  if ((cfg_xfer.state == CFG_STREAMING) &&
+      (cfg_xfer.sent < cfg_xfer.total) &&
+      (cfg_xfer.sent - cfg_xfer.acked < CFG_WINDOW * CFG_CHUNK_SIZE) &&
+      ((cfg_xfer.requested == 0) ||
+       (now - cfg_requested_at >= CFG_HOST_TIMEOUT_MS))) {
+    cfg_xfer.requested = cfg_xfer.sent + cfg_chunk_len(cfg_xfer.sent);
+    cfg_requested_at = now;
+    Serial.print(F("cfg "));
+    Serial.println(cfg_xfer.sent);
+  }
+}
@@ -0,0 +1,101 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Streaming configuration blobs from the USB host to nodes on the bus.
+ *
+ * The host starts a transfer by sending the controller a CFG_OP_START naming
+ * the target node, the blob's length and its CRC.  The controller forwards the
+ * start to the node, which acknowledges with the offset it wants to resume
+ * from (0 unless it holds part of a blob with the same CRC).  The controller
+ * then asks the host for one chunk at a time with a "cfg <offset>" line,
+ * forwarding each chunk as it arrives, and keeps up to CFG_WINDOW chunks in
+ * flight.  Nodes acknowledge the contiguous number of bytes received, and
+ * unacknowledged chunks are resent from the window if no progress is made.
+ * Once the whole blob is acknowledged the controller sends CFG_OP_COMMIT and
+ * the node verifies the CRC before writing its configuration.
+ *
+ * Only the window is buffered, the blob itself never is.  The controller
+ * reports "cfg done <ms>" or "cfg fail <status>" to the host when finished.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_PROVISION_H
+#define FIRE_CONTROL_PROVISION_H
+
+#include "Arduino.h"
+#include "HMTLMessaging.h"
+
+#define MSG_TYPE_FIRE_CONFIG 0x22
+
+#define CFG_OP_START  1
+#define CFG_OP_CHUNK  2
+#define CFG_OP_ACK    3
+#define CFG_OP_COMMIT 4
+#define CFG_OP_ABORT  5
+
+#define CFG_STATUS_OK      0
+#define CFG_STATUS_CRC     1 // Blob or chunk CRC mismatch
+#define CFG_STATUS_TIMEOUT 2 // Node stopped responding
+#define CFG_STATUS_BUSY    3 // A transfer is already in progress
+#define CFG_STATUS_WRITE   4 // Node failed to store the configuration
+
+typedef struct {
+  uint8_t  op;
+  uint8_t  status;
+  uint16_t target; // Node being configured
+  uint16_t offset;
+  uint16_t length; // Blob length for a start, data length for a chunk
+  uint16_t crc;    // Blob CRC for a start, data CRC for a chunk
+  byte     data[0];
+} msg_fire_config_t;
+
+#define CFG_CHUNK_SIZE 32
+#ifdef ESP32
+  #define CFG_WINDOW   8
+#else
+  #define CFG_WINDOW   2
+#endif
+#define CFG_ACK_TIMEOUT_MS 100
+#define CFG_MAX_RETRIES    5
+
+#define CFG_IDLE      0
+#define CFG_STARTING  1 // Waiting for the node's resume offset
+#define CFG_STREAMING 2
+#define CFG_COMMITTING 3
+
+typedef struct {
+  uint8_t  state;
+  uint8_t  retries;
+  uint16_t target;
+  uint16_t total;
+  uint16_t crc;
+
+  uint16_t acked;     // Bytes acknowledged by the node
+  uint16_t sent;      // Bytes sent to the node
+  uint16_t requested; // End of the chunk requested from the host, 0 if none
+
+  unsigned long progress; // Time of the last send or acknowledgement
+  unsigned long started;
+
+  byte window[CFG_WINDOW][CFG_CHUNK_SIZE];
+
+  uint16_t chunks;      // Chunks sent, including resends
+  uint16_t resends;
+} cfg_xfer_t;
+
+extern cfg_xfer_t cfg_xfer;
+
+/* CRC-16/CCITT, continuing from crc */
+uint16_t cfg_crc(const byte *data, uint16_t len, uint16_t crc = 0xFFFF);
+
+/* Handle a configuration message from the host */
+void cfg_host_msg(const msg_hdr_t *msg_hdr);
+
+/* Handle a configuration message from a node */
+void cfg_node_msg(uint16_t source, const msg_hdr_t *msg_hdr);
+
+/* Resend on timeouts and request further chunks */
+void cfg_service(unsigned long now);
+
+#endif
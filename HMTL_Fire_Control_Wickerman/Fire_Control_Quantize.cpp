@@ -0,0 +1,181 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Quantization of manual bursts to the beat grid
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_QUANTIZE
+  #define DEBUG_LEVEL DEBUG_LEVEL_QUANTIZE
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Tempo.h"
+#include "Fire_Control_Quantize.h"
+
+quant_state_t quant;
+
+uint16_t quant_period() {
+  if ((quant.grid == QUANT_OFF) || quant.immediate || !tempo.period) {
+    return 0;
+  }
+  return (uint32_t)tempo.period * QUANT_QUARTER / quant.grid;
+}
+
+unsigned long quant_next_tick(unsigned long now) {
+  uint16_t period = quant_period();
+
+  /* Every beat is a tick, so the grid is measured from any of them */
+  long phase = (long)(now - tempo.next_beat) % (long)period;
+  if (phase < 0) {
+    phase += period;
+  }
+  if (phase == 0) {
+    return now;
+  }
+  return now + (period - phase);
+}
+
+static void quant_send(const quant_burst_t *burst, unsigned long now) {
+  uint16_t late = now - burst->tick;
+  uint16_t wait = now - burst->touched;
+
+  quant.stats.released++;
+  quant.stats.wait_total += wait;
+  if (wait > quant.stats.wait_max) {
+    quant.stats.wait_max = wait;
+  }
+  quant.stats.late_total += late;
+  if (late > quant.stats.late_max) {
+    quant.stats.late_max = late;
+  }
+
+  DEBUG4_VALUE("Quant send a:", burst->address);
+  DEBUG4_VALUE(" o:", burst->output);
+  DEBUG4_VALUE(" wait:", wait);
+  DEBUG4_VALUELN(" late:", late);
+
+  sendHMTLTimedChange(burst->address, burst->output, burst->duration,
+                      0xFFFFFFFF, 0);
+}
+
+boolean quant_hold(uint16_t address, uint8_t output, uint32_t duration,
+                   unsigned long now) {
+  if (!quant_period()) {
+    quant.stats.immediate++;
+    return false;
+  }
+
+  unsigned long tick = quant_next_tick(now);
+  if (tick == now) {
+    /* Already on the grid, nothing gained by holding it */
+    quant_burst_t burst = { address, output, duration, now, tick };
+    quant_send(&burst, now);
+    return true;
+  }
+
+  for (uint8_t i = 0; i < quant.count; i++) {
+    quant_burst_t *held = &quant.held[i];
+    if ((held->address == address) && (held->output == output)) {
+      if (duration > held->duration) {
+        held->duration = duration;
+      }
+      return true;
+    }
+  }
+
+  if (quant.count >= QUANT_SLOTS) {
+    DEBUG1_VALUELN("Quant full, sent a:", address);
+    quant.stats.immediate++;
+    return false;
+  }
+
+  quant_burst_t *held = &quant.held[quant.count++];
+  held->address = address;
+  held->output = output;
+  held->duration = duration;
+  held->touched = now;
+  held->tick = tick;
+  return true;
+}
+
+void quant_release(unsigned long now) {
+  uint8_t i = 0;
+  while (i < quant.count) {
+    quant_burst_t *held = &quant.held[i];
+    if ((long)(now - held->tick) < 0) {
+      i++;
+      continue;
+    }
+
+    quant_send(held, now);
+
+    /* Order isn't kept, the last held burst fills the gap */
+    quant.count--;
+    quant.held[i] = quant.held[quant.count];
+  }
+}
+
+void quant_cancel() {
+  if (quant.count) {
+    DEBUG3_VALUELN("Quant dropped:", quant.count);
+  }
+  quant.stats.dropped += quant.count;
+  quant.count = 0;
+}
+
+void quant_step_grid() {
+  switch (quant.grid) {
+    case QUANT_OFF: {
+      quant.grid = QUANT_QUARTER;
+      break;
+    }
+    case QUANT_QUARTER: {
+      quant.grid = QUANT_EIGHTH;
+      break;
+    }
+    case QUANT_EIGHTH: {
+      quant.grid = QUANT_SIXTEENTH;
+      break;
+    }
+    default: {
+      quant.grid = QUANT_OFF;
+      break;
+    }
+  }
+  DEBUG3_VALUELN("Quant grid:", quant.grid);
+}
+
+void quant_set_immediate(boolean immediate, unsigned long now) {
+  quant.immediate = immediate;
+  if (!immediate) {
+    return;
+  }
+
+  /* Everything held goes out now rather than on its tick */
+  for (uint8_t i = 0; i < quant.count; i++) {
+    quant.held[i].tick = now;
+  }
+  quant_release(now);
+}
+
+uint16_t quant_wait_average() {
+  if (!quant.stats.released) {
+    return 0;
+  }
+  return quant.stats.wait_total / quant.stats.released;
+}
+
+uint16_t quant_late_average() {
+  if (!quant.stats.released) {
+    return 0;
+  }
+  return quant.stats.late_total / quant.stats.released;
+}
@@ -0,0 +1,102 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Quantization of manual bursts to the tap tempo's beat grid.
+ *
+ * With a grid selected and a tempo set, a touch-triggered burst is held until
+ * the next tick of the grid, a subdivision of the beat from a quarter note
+ * (every beat) down to a sixteenth (four per beat).  Ticks are counted from
+ * the beat clock in Fire_Control_Tempo.h so bursts land in phase with pulses.
+ * A burst touched exactly on a tick goes out on that pass.
+ *
+ * Held bursts are released from the main loop on the first pass at or after
+ * their tick.  The immediate override sends bursts as soon as they're
+ * touched, as does having no grid or no tempo.
+ *
+ * For each released burst the time it was held and how late it went out
+ * after its tick are recorded, the first bounded by the grid spacing and the
+ * second by the loop time.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_QUANTIZE_H
+#define FIRE_CONTROL_QUANTIZE_H
+
+#include "Arduino.h"
+
+/* Grids, as the note value of each tick with the beat as a quarter note */
+#define QUANT_OFF        0
+#define QUANT_QUARTER    4
+#define QUANT_EIGHTH     8
+#define QUANT_SIXTEENTH  16
+
+/* Bursts that may be held at once, more are sent immediately */
+#ifndef QUANT_SLOTS
+  #ifdef ESP32
+    #define QUANT_SLOTS  8
+  #else
+    #define QUANT_SLOTS  4
+  #endif
+#endif
+
+typedef struct {
+  uint16_t address;
+  uint8_t  output;
+  uint32_t duration;
+  unsigned long touched;
+  unsigned long tick;     // Time the burst is due
+} quant_burst_t;
+
+typedef struct {
+  uint32_t released;      // Bursts held and then sent
+  uint32_t immediate;     // Bursts sent without being held
+  uint32_t dropped;       // Held bursts cancelled before their tick
+  uint32_t wait_total;    // Time from the touch until sent
+  uint16_t wait_max;
+  uint32_t late_total;    // Time sent after the tick
+  uint16_t late_max;
+} quant_stats_t;
+
+typedef struct {
+  uint8_t  grid;          // Note value of a tick, QUANT_OFF for none
+  boolean  immediate;     // Override sending every burst when touched
+
+  uint8_t  count;
+  quant_burst_t held[QUANT_SLOTS];
+
+  quant_stats_t stats;
+} quant_state_t;
+
+extern quant_state_t quant;
+
+/* Spacing of the grid in ms, 0 when bursts aren't held */
+uint16_t quant_period();
+
+/* Time of the first tick at or after now, only valid with a period */
+unsigned long quant_next_tick(unsigned long now);
+
+/*
+ * Hold a burst for the next tick, returns false if it wasn't held and should
+ * be sent now.  A burst to an output that's already held is combined with it.
+ */
+boolean quant_hold(uint16_t address, uint8_t output, uint32_t duration,
+                   unsigned long now);
+
+/* Send the held bursts whose tick has been reached */
+void quant_release(unsigned long now);
+
+/* Drop every held burst */
+void quant_cancel();
+
+/* Step the grid through off, 1/4, 1/8 and 1/16 */
+void quant_step_grid();
+
+/* Set the immediate override, sending any held bursts when engaged */
+void quant_set_immediate(boolean immediate, unsigned long now);
+
+/* Average time held and lateness of released bursts */
+uint16_t quant_wait_average();
+uint16_t quant_late_average();
+
+#endif
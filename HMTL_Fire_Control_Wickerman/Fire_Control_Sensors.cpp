@@ -21,8 +21,19 @@
 #include "HMTLPoofer.h"
 
 #include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
 #include "modes.h"
 #include "Fire_Control_Sensors.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Link.h"
+#include "Fire_Control_Sequence.h"
+#include "Fire_Control_Pattern.h"
+#include "Fire_Control_Tempo.h"
+#include "Fire_Control_Quantize.h"
+#include "Fire_Control_Stagger.h"
+#include "Fire_Control_Looper.h"
+#include "Fire_Control_Pressure.h"
+#include "Fire_Control_LCD.h"
 
 bool data_changed = true;
 
@@ -67,9 +78,26 @@ void sensor_switches(void) {
 
 /******* Capacitive Sensors ***************************************************/
 
+/* Masks of the sensors touched and those that changed on the last read */
+uint16_t touch_states = 0;
+uint16_t touch_edges = 0;
+
 void sensor_cap(void) 
 {
+  touch_edges = 0;
   if (touch_sensor.readTouchInputs()) {
+    for (uint8_t i = 0; i < MPR121::MAX_SENSORS; i++) {
+      uint16_t bit = (1 << i);
+      if (touch_sensor.changed(i)) {
+        touch_edges |= bit;
+      }
+      if (touch_sensor.touched(i)) {
+        touch_states |= bit;
+      } else {
+        touch_states &= ~bit;
+      }
+    }
+
     DEBUG_COMMAND(DEBUG_TRACE,
                   DEBUG5_PRINT("Cap:");
                   for (uint8_t i = 0; i < MPR121::MAX_SENSORS; i++) {
@@ -112,13 +140,69 @@ uint8_t led_mode = LED_MODE_ON;
 uint8_t led_mode_value = 50;
 uint8_t brightness = 96;
 
+/* Off period of a channel locked to the beat clock */
+uint16_t tempo_pulse_delay(uint8_t channel, uint16_t length) {
+  uint16_t period = tempo_channel_period(channel);
+  return (period > length) ? period - length : 0;
+}
+
+/*
+ * Rate a channel is pulsing at.  The set rates are kept while locked to the
+ * beat clock so the channels return to them when the tempo is cleared.
+ */
+uint16_t pulse_bpm(uint8_t channel, uint16_t bpm) {
+  if (tempo.period) {
+    return tempo_channel_bpm(channel);
+  }
+  return bpm;
+}
+
 void calculate_pulse() {
+  if (tempo.period) {
+    /* Every channel runs at a multiple or division of the beat */
+    pulse_delay_1 = tempo_pulse_delay(0, pulse_length_1);
+    pulse_delay_2 = tempo_pulse_delay(1, pulse_length_2);
+    pulse_delay_3 = tempo_pulse_delay(2, pulse_length_3);
+    pulse_delay_4 = tempo_pulse_delay(3, pulse_length_4);
+    return;
+  }
+
   pulse_delay_1 = ((uint16_t)1000 * (uint16_t)60 / pulse_bpm_1) - pulse_length_1;
   pulse_delay_2 = ((uint16_t)1000 * (uint16_t)60 / pulse_bpm_2) - pulse_length_2;
   pulse_delay_3 = ((uint16_t)1000 * (uint16_t)60 / pulse_bpm_3) - pulse_length_3;
   pulse_delay_4 = ((uint16_t)1000 * (uint16_t)60 / pulse_bpm_4) - pulse_length_4;
 }
 
+/*
+ * With a beat clock, touches that start pulses wait for the next beat so that
+ * every channel starts in phase.  Sensors touched and not yet released are
+ * pending, those whose beat arrived this pass are started.
+ */
+uint16_t pulse_pending = 0;
+uint16_t pulse_starting = 0;
+
+void align_pulses(unsigned long now) {
+  if (!tempo.period) {
+    pulse_pending = 0;
+    pulse_starting = 0;
+    return;
+  }
+
+  pulse_pending |= (touch_edges & touch_states);
+  pulse_pending &= touch_states;
+
+  pulse_starting = tempo_beat(now) ? pulse_pending : 0;
+  pulse_pending &= ~pulse_starting;
+}
+
+/* Returns true if a pulse for the sensor should be started on this pass */
+boolean pulse_start(uint8_t sensor) {
+  if (!tempo.period) {
+    return (touch_sensor.changed(sensor) && touch_sensor.touched(sensor));
+  }
+  return (pulse_starting & (1 << sensor));
+}
+
 void sendOn(uint16_t address, uint8_t output) {
   sendHMTLValue(address, output, 255);
 }
@@ -132,6 +216,13 @@ void sendBurst(uint16_t address, uint8_t output, uint32_t duration) {
                       output, duration, 0xFFFFFFFF, 0);
 }
 
+/* Bursts from a touch may be held for the beat grid, see Fire_Control_Quantize.h */
+void sendManualBurst(uint16_t address, uint8_t output, uint32_t duration) {
+  if (!quant_hold(address, output, duration, millis())) {
+    sendBurst(address, output, duration);
+  }
+}
+
 void sendCancel(uint16_t address, uint8_t output) {
   sendHMTLCancel(address, output);
 }
@@ -169,27 +260,85 @@ void resetLights() {
   sendLEDMode();
 }
 
+/*
+ * Cancel any programs on and turn off every accumulator, using a single group
+ * message if one is configured.
+ */
+void sendCancelAndOffPoofers() {
+  /*
+   * The group frame shuts everything at once, but every valve is still
+   * addressed directly in case a module is missing from the group.
+   */
+  uint16_t group = fire_group_address(GROUP_ROLE_POOFERS);
+  if (group != SOCKET_ADDR_INVALID) {
+    sendCancelAndOff(group, HMTL_ALL_OUTPUTS);
+  }
+
+#if CONTROL_MODE == CONTROL_SINGLE_QUINT
+  sendCancelAndOff(poofer1_address, POOFER1_LARGE);
+  sendCancelAndOff(poofer2_address, POOFER2_POOF1);
+  sendCancelAndOff(poofer2_address, POOFER2_POOF2);
+  sendCancelAndOff(poofer2_address, POOFER2_POOF3);
+  sendCancelAndOff(poofer2_address, POOFER2_POOF4);
+#else
+  sendCancelAndOff(poofer1_address, POOFER1_POOF1);
+  sendCancelAndOff(poofer1_address, POOFER1_POOF2);
+
+#if CONTROL_MODE == CONTROL_DOUBLE_DOUBLE
+  sendCancelAndOff(poofer2_address, POOFER2_POOF1);
+  sendCancelAndOff(poofer2_address, POOFER2_POOF2);
+#endif
+
+#endif
+}
+
+/*
+ * Pulse a poofer along with the lights, as a single group message if the
+ * group for the role is configured.  The poofer is still addressed directly,
+ * as it is when cancelling, in case it's missing from the group.
+ */
+void sendPulseWithLights(uint8_t role, uint16_t address, uint8_t output,
+                         uint16_t onperiod, uint16_t offperiod) {
+  uint16_t group = fire_group_address(role);
+  if (group != SOCKET_ADDR_INVALID) {
+    sendPulse(group, HMTL_ALL_OUTPUTS, onperiod, offperiod);
+    sendPulse(address, output, onperiod, offperiod);
+  } else {
+    sendPulse(address, output, onperiod, offperiod);
+    sendPulse(lights_address, HMTL_ALL_OUTPUTS, onperiod, offperiod);
+  }
+}
+
+/* Stop a pulse started by sendPulseWithLights() */
+void cancelPulseWithLights(uint8_t role, uint16_t address, uint8_t output) {
+  uint16_t group = fire_group_address(role);
+  if (group != SOCKET_ADDR_INVALID) {
+    sendCancelAndOff(group, HMTL_ALL_OUTPUTS);
+    sendCancelAndOff(address, output);
+    sendLEDMode();
+  } else {
+    sendCancelAndOff(address, output);
+    resetLights();
+  }
+}
+
 /*
  * Check a sensor to see if a BPM pulse should be triggered
  */
 void checkPulse(uint8_t sensor, uint16_t address, uint8_t output,
                 uint16_t onperiod, uint16_t offperiod) {
-  if (touch_sensor.changed(sensor)) {
-    if (touch_sensor.touched(sensor)) {
-      sendPulse(address, output, onperiod, offperiod);
-      //sendPulse(lights_address, HMTL_ALL_OUTPUTS,  onperiod, offperiod);
-    } else if (touch_sensor.changed(sensor)) {
-      sendCancelAndOff(address, output);
-      //resetLights();
-    }
+  if (pulse_start(sensor) && sensor_fires(sensor)) {
+    sendPulse(address, output, onperiod, offperiod);
+    //sendPulse(lights_address, HMTL_ALL_OUTPUTS,  onperiod, offperiod);
+  } else if (touch_sensor.changed(sensor) && !touch_sensor.touched(sensor)) {
+    sendCancelAndOff(address, output);
+    //resetLights();
   }
 }
 
 
-/* Convert between a sensor number and the LED associated with it */
-uint8_t sensor_to_led(uint8_t sensor) {
-  uint8_t led = 0;
-
+/* LED associated with each sensor */
+const uint8_t sensor_led_map[MPR121::MAX_SENSORS] = {
 #if OBJECT_TYPE == OBJECT_TYPE_TOUCH_CONTROLLER
   /*
    * Sensor  LED
@@ -206,16 +355,15 @@ uint8_t sensor_to_led(uint8_t sensor) {
    *  1       7
    *  0       6
    */
-  if (sensor > 5) {
-    led = (uint8_t)11 - sensor;
-  } else {
-    led = sensor + (uint8_t)6;
-  }
+  6, 7, 8, 9, 10, 11, 5, 4, 3, 2, 1, 0
 #else
-  led = sensor;
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
 #endif
+};
 
-  return led;
+/* Convert between a sensor number and the LED associated with it */
+uint8_t sensor_to_led(uint8_t sensor) {
+  return sensor_led_map[sensor];
 }
 
 
@@ -243,6 +391,23 @@ void handle_lights() {
 #endif
 }
 
+/*
+ * Stream the pressure on a sensor to a proportional output when enabled
+ */
+void handle_pressure() {
+  static boolean pressure_on = false;
+
+  /* Pressure driving a valve needs the poofers armed like any other burst */
+  if ((fire_config.flags & FIRE_FLAG_PRESSURE) &&
+      (poofers_armed() || !poofer_address(PRESSURE_ADDRESS))) {
+    pressure_on = true;
+    pressure_service(millis());
+  } else if (pressure_on) {
+    pressure_on = false;
+    pressure_stop();
+  }
+}
+
 
 /*
  * Everything to do with the hot-surface igniter and related switches
@@ -255,9 +420,9 @@ void handle_ignition() {
       if (switch_changed[POOFER_IGNITER_SWITCH]) {
         DEBUG2_PRINTLN("IGNITE ON");
       }
-      sendBurst(poofer1_address, POOFER1_IGNITER, 30 * 1000);
+      sendHMTLKeepalive(poofer1_address, POOFER1_IGNITER, 30 * 1000);
 #if CONTROL_MODE == CONTROL_DOUBLE_DOUBLE
-      sendBurst(poofer2_address, POOFER2_IGNITER, 30 * 1000);
+      sendHMTLKeepalive(poofer2_address, POOFER2_IGNITER, 30 * 1000);
 #endif
       last_on = millis();
     }
@@ -282,9 +447,9 @@ void handle_pilot() {
       if (switch_changed[POOFER_PILOT_SWITCH]) {
         DEBUG1_PRINTLN("PILOT ON");
       }
-      sendBurst(poofer1_address, POOFER1_PILOT, 30 * 1000);
+      sendHMTLKeepalive(poofer1_address, POOFER1_PILOT, 30 * 1000);
 #if CONTROL_MODE == CONTROL_DOUBLE_DOUBLE
-      sendBurst(poofer2_address, POOFER2_PILOT, 30 * 1000);
+      sendHMTLKeepalive(poofer2_address, POOFER2_PILOT, 30 * 1000);
 #endif
       last_on = millis();
     }
@@ -297,6 +462,27 @@ void handle_pilot() {
   }
 }
 
+boolean poofers_armed() {
+  return (switch_states[POOFER_ENABLE_SWITCH] &&
+          switch_states[POOFER_PILOT_SWITCH]);
+}
+
+uint16_t fire_sensors() {
+  if (fire_config.flags & FIRE_FLAG_PRESSURE) {
+    return ~(uint16_t)(1 << PRESSURE_SENSOR);
+  }
+  return 0xFFFF;
+}
+
+boolean sensor_fires(uint8_t sensor) {
+  return (fire_sensors() & (1 << sensor));
+}
+
+boolean poofer_address(uint16_t address) {
+  return ((address == poofer1_address) || (address == poofer2_address) ||
+          (address == SOCKET_ADDR_ANY) || IS_FIRE_GROUP(address));
+}
+
 /*
  * Enable and disable the poofers
  */
@@ -312,26 +498,16 @@ void handle_poof_enable() {
       /* Cancel all poofing programs and ensure all poofers are disabled */
       DEBUG1_PRINTLN("POOFERS DISABLED");
 
-#if CONTROL_MODE == CONTROL_SINGLE_QUINT
-      sendCancelAndOff(poofer1_address, POOFER1_LARGE);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF1);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF2);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF3);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF4);
-#else
-      sendCancelAndOff(poofer1_address, POOFER1_POOF1);
-      sendCancelAndOff(poofer1_address, POOFER1_POOF2);
-
-#if CONTROL_MODE == CONTROL_DOUBLE_DOUBLE
-      sendCancelAndOff(poofer2_address, POOFER2_POOF1);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF2);
-#endif
-
-#endif
+      cancelSequence();
+      pattern_stop();
+      sendCancelAndOffPoofers();
 
       /* Set lights for non-poof mode */
       setSparkle();
     }
+  } else if (!switch_states[POOFER_ENABLE_SWITCH] && seq.running) {
+    /* A sequence started by the host never runs while disabled */
+    cancelSequence();
   }
 }
 
@@ -378,8 +554,13 @@ void handle_settings() {
   /* Change display mode */
   if (touch_sensor.changed(SENSOR_DISPLAY_MODE) &&
       touch_sensor.touched(SENSOR_DISPLAY_MODE)) {
-    lcd.clear();
+    lcd_frame.clear();
     display_mode = (display_mode + 1) % NUM_DISPLAY_MODES;
+
+    if (display_mode == DISPLAY_ADDRESS_MODE) {
+      /* Refresh the live nodes the addresses can be set to */
+      disc_start(config.address, millis());
+    }
   }
 
   /*
@@ -388,14 +569,22 @@ void handle_settings() {
   if (display_mode == DISPLAY_ADJUST_BPM1_1) {
     if (touch_sensor.changed(SENSOR_LCD_UP)) {
       if (touch_sensor.touched(SENSOR_LCD_UP)) {
-        pulse_bpm_1++;
+        if (tempo.period) {
+          tempo_step_ratio(0, true);
+        } else {
+          pulse_bpm_1++;
+        }
         calculate_pulse();
       }
     }
 
     if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
       if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
-        pulse_bpm_1--;
+        if (tempo.period) {
+          tempo_step_ratio(0, false);
+        } else {
+          pulse_bpm_1--;
+        }
         calculate_pulse();
       }
     }
@@ -420,14 +609,22 @@ void handle_settings() {
   if (display_mode == DISPLAY_ADJUST_BPM2_1) {
     if (touch_sensor.changed(SENSOR_LCD_UP)) {
       if (touch_sensor.touched(SENSOR_LCD_UP)) {
-        pulse_bpm_2++;
+        if (tempo.period) {
+          tempo_step_ratio(1, true);
+        } else {
+          pulse_bpm_2++;
+        }
         calculate_pulse();
       }
     }
 
     if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
       if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
-        pulse_bpm_2--;
+        if (tempo.period) {
+          tempo_step_ratio(1, false);
+        } else {
+          pulse_bpm_2--;
+        }
         calculate_pulse();
       }
     }
@@ -452,14 +649,22 @@ void handle_settings() {
   if (display_mode == DISPLAY_ADJUST_BPM3_1) {
     if (touch_sensor.changed(SENSOR_LCD_UP)) {
       if (touch_sensor.touched(SENSOR_LCD_UP)) {
-        pulse_bpm_3++;
+        if (tempo.period) {
+          tempo_step_ratio(2, true);
+        } else {
+          pulse_bpm_3++;
+        }
         calculate_pulse();
       }
     }
 
     if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
       if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
-        pulse_bpm_3--;
+        if (tempo.period) {
+          tempo_step_ratio(2, false);
+        } else {
+          pulse_bpm_3--;
+        }
         calculate_pulse();
       }
     }
@@ -484,14 +689,22 @@ void handle_settings() {
   if (display_mode == DISPLAY_ADJUST_BPM4_1) {
     if (touch_sensor.changed(SENSOR_LCD_UP)) {
       if (touch_sensor.touched(SENSOR_LCD_UP)) {
-        pulse_bpm_4++;
+        if (tempo.period) {
+          tempo_step_ratio(3, true);
+        } else {
+          pulse_bpm_4++;
+        }
         calculate_pulse();
       }
     }
 
     if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
       if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
-        pulse_bpm_4--;
+        if (tempo.period) {
+          tempo_step_ratio(3, false);
+        } else {
+          pulse_bpm_4--;
+        }
         calculate_pulse();
       }
     }
@@ -546,35 +759,159 @@ void handle_settings() {
     }
   }
 
-  if (display_mode == DISPLAY_ADDRESS_MODE) {
+  if (display_mode == DISPLAY_TAP_TEMPO) {
     if (touch_sensor.changed(SENSOR_LCD_UP)) {
       if (touch_sensor.touched(SENSOR_LCD_UP)) {
-        poofer1_address++;
-        if (poofer1_address > 72) {
-          poofer1_address = 64;
+        if (tempo_tap(millis())) {
+          calculate_pulse();
         }
       }
     }
 
     if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
       if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
-        lights_address++;
-        if (lights_address > 72) {
-          lights_address = 64;
+        tempo_clear();
+        calculate_pulse();
+      }
+    }
+  }
+
+  if (display_mode == DISPLAY_QUANTIZE) {
+    if (touch_sensor.changed(SENSOR_LCD_UP)) {
+      if (touch_sensor.touched(SENSOR_LCD_UP)) {
+        quant_step_grid();
+      }
+    }
+
+    if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
+      if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
+        quant_set_immediate(!quant.immediate, millis());
+      }
+    }
+  }
+
+  if (display_mode == DISPLAY_LOOPER) {
+    if (touch_sensor.changed(SENSOR_LCD_UP)) {
+      if (touch_sensor.touched(SENSOR_LCD_UP)) {
+        if (looper.state == LOOPER_ARMED) {
+          looper.state = LOOPER_IDLE;
+        } else {
+          looper_arm();
         }
       }
     }
+
+    if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
+      if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
+        looper_clear();
+      }
+    }
+  }
+
+  if (display_mode == DISPLAY_PRESSURE) {
+    if (touch_sensor.changed(SENSOR_LCD_UP)) {
+      if (touch_sensor.touched(SENSOR_LCD_UP)) {
+        fire_config.flags ^= FIRE_FLAG_PRESSURE;
+      }
+    }
+  }
+
+  if (display_mode == DISPLAY_ADDRESS_MODE) {
+    if (touch_sensor.changed(SENSOR_LCD_UP)) {
+      if (touch_sensor.touched(SENSOR_LCD_UP)) {
+        poofer1_address = disc_next_alive(poofer1_address);
+      }
+    }
+
+    if (touch_sensor.changed(SENSOR_LCD_DOWN)) {
+      if (touch_sensor.touched(SENSOR_LCD_DOWN)) {
+        lights_address = disc_next_alive(lights_address);
+      }
+    }
   }
 }
 
 #if (CONTROL_MODE == CONTROL_SINGLE_QUINT)
+/* Returns true if a sensor is in a mask of presses */
+boolean sensor_pressed(uint16_t pressed, int8_t sensor) {
+  return ((sensor >= 0) && (pressed & (1 << sensor)));
+}
+
+/*
+ * Bursts for a mask of the sensors pressed, either touched live or played
+ * back by the looper.
+ */
+void quint_bursts(uint16_t pressed) {
+  if (sensor_pressed(pressed, POOFER1_QUICK_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF1, short_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER2_QUICK_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF2, short_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER3_QUICK_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF3, short_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER4_QUICK_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF4, short_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER5_QUICK_SENSOR)) {
+    sendManualBurst(poofer1_address, POOFER1_LARGE, short_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER1_LONG_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF1, long_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER2_LONG_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF2, long_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER3_LONG_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF3, long_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER4_LONG_SENSOR)) {
+    sendManualBurst(poofer2_address, POOFER2_POOF4, long_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER5_LONG_SENSOR)) {
+    sendManualBurst(poofer1_address, POOFER1_LARGE, long_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER_PROGRAM_1_SENSOR)) {
+    /* All on quick burst */
+    sendManualBurst(poofer2_address, POOFER2_POOF1, minimum_burst);
+    sendManualBurst(poofer2_address, POOFER2_POOF2, minimum_burst);
+    sendManualBurst(poofer2_address, POOFER2_POOF3, minimum_burst);
+    sendManualBurst(poofer2_address, POOFER2_POOF4, minimum_burst);
+//    sendBurst(poofer1_address, POOFER1_LARGE, minimum_burst);
+  }
+
+  if (sensor_pressed(pressed, POOFER_PROGRAM_2_SENSOR)) {
+    /* All on large burst */
+    sendManualBurst(poofer2_address, POOFER2_POOF1, full_burst);
+    sendManualBurst(poofer2_address, POOFER2_POOF2, full_burst);
+    sendManualBurst(poofer2_address, POOFER2_POOF3, full_burst);
+    sendManualBurst(poofer2_address, POOFER2_POOF4, full_burst);
+//    sendBurst(poofer1_address, POOFER1_LARGE, full_burst);
+  }
+}
+
 void handle_single_quint() {
   if (switch_states[PROGRAM_MODE_SWITCH]) {
     /* Capacitive touch runs programs */
 
     if (switch_changed[PROGRAM_MODE_SWITCH]) {
       DEBUG2_PRINTLN("Programs on");
+      quant_cancel();
       setBlink(pixel_color(0, 0, 255));
+
+      /* A recording ends here and starts looping */
+      looper_play(millis());
     }
 
     checkPulse(POOFER1_QUICK_SENSOR,poofer2_address,POOFER2_POOF1,
@@ -616,115 +953,68 @@ void handle_single_quint() {
     checkPulse(POOFER_PROGRAM_1_SENSOR,poofer2_address,POOFER2_POOF4,
                pulse_length_1, pulse_delay_1);
 
-    checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF1,
-               pulse_length_3, pulse_delay_3);
-    checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF2,
-               pulse_delay_3, pulse_length_3);
-    checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF3,
-               pulse_length_3, pulse_delay_3);
-    checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF4,
-               pulse_delay_3, pulse_length_3);
+    if (seq_valid()) {
+      /*
+       * A stored sequence replaces the second program's pulses, which must
+       * not start on a later beat either
+       */
+      if (touch_sensor.changed(POOFER_PROGRAM_2_SENSOR) &&
+          touch_sensor.touched(POOFER_PROGRAM_2_SENSOR) &&
+          sensor_fires(POOFER_PROGRAM_2_SENSOR)) {
+        setSequence();
+      }
+    } else {
+      checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF1,
+                 pulse_length_3, pulse_delay_3);
+      checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF2,
+                 pulse_delay_3, pulse_length_3);
+      checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF3,
+                 pulse_length_3, pulse_delay_3);
+      checkPulse(POOFER_PROGRAM_2_SENSOR,poofer2_address,POOFER2_POOF4,
+                 pulse_delay_3, pulse_length_3);
+    }
+
+    /* Looped presses fire as they would have live */
+    quint_bursts(looper_run(millis()));
   } else {
     /* Capacitive touch controls directly */
 
     if (switch_changed[PROGRAM_MODE_SWITCH]) {
       DEBUG3_PRINTLN("Programs off");
 
-      sendCancelAndOff(poofer1_address, POOFER1_LARGE);
-      //sendCancelAndOff(poofer1_address, POOFER1_UNUSED);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF1);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF2);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF3);
-      sendCancelAndOff(poofer2_address, POOFER2_POOF4);
+      cancelSequence();
+      quant_cancel();
+      looper_stop(millis());
+      sendCancelAndOffPoofers();
 
       setBlink(pixel_color(255,0,0));
     }
 
-    if (touch_sensor.changed(POOFER1_QUICK_SENSOR) &&
-        touch_sensor.touched(POOFER1_QUICK_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF1, short_burst);
-    }
-
-    if (touch_sensor.changed(POOFER2_QUICK_SENSOR) &&
-        touch_sensor.touched(POOFER2_QUICK_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF2, short_burst);
-    }
-
-    if (touch_sensor.changed(POOFER3_QUICK_SENSOR) &&
-        touch_sensor.touched(POOFER3_QUICK_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF3, short_burst);
-    }
-
-    if (touch_sensor.changed(POOFER4_QUICK_SENSOR) &&
-        touch_sensor.touched(POOFER4_QUICK_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF4, short_burst);
-    }
-
-    if (touch_sensor.changed(POOFER5_QUICK_SENSOR) &&
-        touch_sensor.touched(POOFER5_QUICK_SENSOR)) {
-      sendBurst(poofer1_address, POOFER1_LARGE, short_burst);
-    }
-
-    if (touch_sensor.changed(POOFER1_LONG_SENSOR) &&
-        touch_sensor.touched(POOFER1_LONG_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF1, long_burst);
-    }
-
-    if (touch_sensor.changed(POOFER2_LONG_SENSOR) &&
-        touch_sensor.touched(POOFER2_LONG_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF2, long_burst);
-    }
-
-    if (touch_sensor.changed(POOFER3_LONG_SENSOR) &&
-        touch_sensor.touched(POOFER3_LONG_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF3, long_burst);
-    }
-
-    if (touch_sensor.changed(POOFER4_LONG_SENSOR) &&
-        touch_sensor.touched(POOFER4_LONG_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF4, long_burst);
-    }
-
-    if (touch_sensor.changed(POOFER5_LONG_SENSOR) &&
-        touch_sensor.touched(POOFER5_LONG_SENSOR)) {
-      sendBurst(poofer1_address, POOFER1_LARGE, long_burst);
-    }
-
-    if (touch_sensor.changed(POOFER_PROGRAM_1_SENSOR) &&
-        touch_sensor.touched(POOFER_PROGRAM_1_SENSOR)) {
-      /* All on quick burst */
-      sendBurst(poofer2_address, POOFER2_POOF1, minimum_burst);
-      sendBurst(poofer2_address, POOFER2_POOF2, minimum_burst);
-      sendBurst(poofer2_address, POOFER2_POOF3, minimum_burst);
-      sendBurst(poofer2_address, POOFER2_POOF4, minimum_burst);
-//      sendBurst(poofer1_address, POOFER1_LARGE, minimum_burst);
-    }
-
-    if (touch_sensor.changed(POOFER_PROGRAM_2_SENSOR) &&
-        touch_sensor.touched(POOFER_PROGRAM_2_SENSOR)) {
-      /* All on large burst */
-      sendBurst(poofer2_address, POOFER2_POOF1, full_burst);
-      sendBurst(poofer2_address, POOFER2_POOF2, full_burst);
-      sendBurst(poofer2_address, POOFER2_POOF3, full_burst);
-      sendBurst(poofer2_address, POOFER2_POOF4, full_burst);
-//      sendBurst(poofer1_address, POOFER1_LARGE, full_burst);
-    }
+    /* Presses are recorded when the looper is armed */
+    uint16_t pressed = touch_edges & touch_states & fire_sensors();
+    looper_record(pressed, millis());
+    quint_bursts(pressed);
   }
 }
 #endif
 
 void handle_sensors() {
 
+  /* Hold pulses started by touches until the next beat */
+  align_pulses(millis());
+
   /* Handlers for external devices */
   handle_lights();
+  handle_pressure();
   handle_ignition();
   handle_pilot();
   handle_poof_enable();
 
-  if (switch_states[POOFER_ENABLE_SWITCH] &&
-      switch_states[POOFER_PILOT_SWITCH]) {
+  if (poofers_armed()) {
     /* Poofers are enabled and the pilot is open */
 
+    /* Bursts held for the beat grid go out on their tick */
+    quant_release(millis());
 
 #if (CONTROL_MODE == CONTROL_SINGLE_QUINT)
     handle_single_quint();
@@ -739,24 +1029,25 @@ void handle_sensors() {
     /* Brief burst */
     if (touch_sensor.changed(POOFER1_POOF1_QUICK_SENSOR) &&
         touch_sensor.touched(POOFER1_POOF1_QUICK_SENSOR)) {
-      sendBurst(poofer1_address, POOFER1_POOF1, 50);
+      sendManualBurst(poofer1_address, POOFER1_POOF1, 50);
     }
 
     if (touch_sensor.changed(POOFER1_POOF2_QUICK_SENSOR) &&
         touch_sensor.touched(POOFER1_POOF2_QUICK_SENSOR)) {
-      sendBurst(poofer1_address, POOFER1_POOF2, 50);
+      sendManualBurst(poofer1_address, POOFER1_POOF2, 50);
     }
 #endif
 
 #if OBJECT_TYPE == OBJECT_TYPE_TOUCH_CONTROLLER
     if (touch_sensor.changed(POOFER2_POOF1_QUICK_SENSOR) &&
-        touch_sensor.touched(POOFER2_POOF1_QUICK_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF1, 50);
+        touch_sensor.touched(POOFER2_POOF1_QUICK_SENSOR) &&
+        sensor_fires(POOFER2_POOF1_QUICK_SENSOR)) {
+      sendManualBurst(poofer2_address, POOFER2_POOF1, 50);
     }
 
     if (touch_sensor.changed(POOFER2_POOF2_QUICK_SENSOR) &&
         touch_sensor.touched(POOFER2_POOF2_QUICK_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF2, 50);
+      sendManualBurst(poofer2_address, POOFER2_POOF2, 50);
     }
 #endif
 
@@ -771,12 +1062,12 @@ void handle_sensors() {
 
     if (touch_sensor.changed(POOFER1_POOF1_LONG_SENSOR) &&
         touch_sensor.touched(POOFER1_POOF1_LONG_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF1, 50);
+      sendManualBurst(poofer2_address, POOFER2_POOF1, 50);
     }
 
     if (touch_sensor.changed(POOFER1_POOF2_LONG_SENSOR) &&
         touch_sensor.touched(POOFER1_POOF2_LONG_SENSOR)) {
-      sendBurst(poofer2_address, POOFER2_POOF2, 50);
+      sendManualBurst(poofer2_address, POOFER2_POOF2, 50);
     }
 #elif 0
     /* On for length of touch */
@@ -888,41 +1179,31 @@ void handle_sensors() {
      */
 
     /* Pulse the poofers */
-    if (touch_sensor.changed(SENSOR_EXTERNAL_1)) {
-      if (touch_sensor.touched(SENSOR_EXTERNAL_1)) {
-        sendPulse(poofer1_address, POOFER1_POOF1,
-                /*on period*/ pulse_length_1, /*off period*/ pulse_delay_1);
-        sendPulse(lights_address, HMTL_ALL_OUTPUTS,
-                /*on period*/ pulse_length_1, /*off period*/ pulse_delay_1);
-      } else if (touch_sensor.changed(SENSOR_EXTERNAL_1)) {
-        sendCancelAndOff(poofer1_address, POOFER1_POOF1);
-
-        resetLights();
-      }
+    if (pulse_start(SENSOR_EXTERNAL_1)) {
+      sendPulseWithLights(GROUP_ROLE_PULSE_1, poofer1_address, POOFER1_POOF1,
+              /*on period*/ pulse_length_1, /*off period*/ pulse_delay_1);
+    } else if (touch_sensor.changed(SENSOR_EXTERNAL_1) &&
+               !touch_sensor.touched(SENSOR_EXTERNAL_1)) {
+      cancelPulseWithLights(GROUP_ROLE_PULSE_1, poofer1_address, POOFER1_POOF1);
     }
 
-    if (touch_sensor.changed(SENSOR_EXTERNAL_4)) {
-      if (touch_sensor.touched(SENSOR_EXTERNAL_4)) {
-        sendPulse(poofer1_address, POOFER1_POOF2,
-                /*on period*/ pulse_length_2, /*off period*/ pulse_delay_2);
-        sendPulse(lights_address, HMTL_ALL_OUTPUTS,
-                /*on period*/ pulse_length_2, /*off period*/ pulse_delay_2);
-      } else if (touch_sensor.changed(SENSOR_EXTERNAL_4)) {
-        sendCancelAndOff(poofer1_address, POOFER1_POOF2);
-
-        resetLights();
-      }
+    if (pulse_start(SENSOR_EXTERNAL_4)) {
+      sendPulseWithLights(GROUP_ROLE_PULSE_2, poofer1_address, POOFER1_POOF2,
+              /*on period*/ pulse_length_2, /*off period*/ pulse_delay_2);
+    } else if (touch_sensor.changed(SENSOR_EXTERNAL_4) &&
+               !touch_sensor.touched(SENSOR_EXTERNAL_4)) {
+      cancelPulseWithLights(GROUP_ROLE_PULSE_2, poofer1_address, POOFER1_POOF2);
     }
 
     /* Minimal burst */
     if (touch_sensor.changed(SENSOR_EXTERNAL_2) &&
         touch_sensor.touched(SENSOR_EXTERNAL_2)) {
-      sendBurst(poofer1_address, POOFER1_POOF1, 25);
+      sendManualBurst(poofer1_address, POOFER1_POOF1, 25);
     }
 
     if (touch_sensor.changed(SENSOR_EXTERNAL_3) &&
         touch_sensor.touched(SENSOR_EXTERNAL_3)) {
-      sendBurst(poofer1_address, POOFER1_POOF2, 25);
+      sendManualBurst(poofer1_address, POOFER1_POOF2, 25);
     }
 
 #endif
@@ -942,6 +1223,11 @@ void handle_sensors() {
 #endif
 
 #endif
+  } else {
+    /* Nothing held while poofing is off goes out once it's back on */
+    quant_cancel();
+    stagger_clear();
+    looper_stop(millis());
   }
   // END: Poofer controls
 
@@ -963,78 +1249,162 @@ void initialize_display() {
 }
 
 
-void update_lcd() {
+/* A degraded link is shown in place of the display for part of each cycle */
+#define LINK_WARN_CYCLE_MS 4000
+#define LINK_WARN_SHOW_MS  1000
+
+/* Returns true while the warning is shown */
+boolean lcd_link_warning() {
+  static boolean showing = false;
+  boolean show = (link_stats.warning &&
+                  (millis() % LINK_WARN_CYCLE_MS < LINK_WARN_SHOW_MS));
+  if (show != showing) {
+    lcd_frame.clear();
+    showing = show;
+    data_changed = true;
+  }
+  if (!show) {
+    return false;
+  }
+
+  const link_node_t *node = link_node(link_stats.warning);
+  if (node == NULL) {
+    return true;
+  }
+
+  lcd_frame.setCursor(0, 0);
+  lcd_frame.print("LINK ");
+  lcd_frame.print(node->address);
+  lcd_frame.print(" DEGRADED");
+
+  /* Lost probes, then average round trip and jitter in ms */
+  lcd_frame.setCursor(0, 1);
+  lcd_frame.print("L");
+  lcd_frame.print(link_lost(node));
+  lcd_frame.print("/");
+  lcd_frame.print(node->count);
+  lcd_frame.print(" R");
+  lcd_frame.print(link_rtt(node) / 10);
+  lcd_frame.print(".");
+  lcd_frame.print(link_rtt(node) % 10);
+  lcd_frame.print(" J");
+  lcd_frame.print(node->jitter / 10);
+  lcd_frame.print(".");
+  lcd_frame.print(node->jitter % 10);
+  return true;
+}
+
+/* Rate of a channel locked to the beat clock, as x2 or /2 */
+void lcd_print_ratio(uint8_t channel) {
+  if (!tempo.period) {
+    return;
+  }
+  int8_t ratio = tempo_channel_ratio(channel);
+  if (ratio > 0) {
+    lcd_frame.print(" x");
+    lcd_frame.print(ratio);
+  } else {
+    lcd_frame.print(" /");
+    lcd_frame.print(-ratio);
+  }
+}
+
+/*
+ * Average time each page saves on a pass by only writing the cells that
+ * changed, rather than both lines as it used to.  Shown in us on the sensor
+ * page.
+ */
+uint16_t lcd_saved_micros[NUM_DISPLAY_MODES];
+#define LCD_SAVED_SHOW_MS 1000
+
+/* Render the current page into the frame */
+void lcd_render_page() {
   switch (display_mode) {
     case DISPLAY_CAP_SENSORS: {
       /* Display the value of sensors and switches */
       if (data_changed) {
-        lcd.setCursor(0, 0);
-        lcd.print("C:");
+        lcd_frame.setCursor(0, 0);
+        lcd_frame.print("C:");
         for (uint8_t i = 0; i < MPR121::MAX_SENSORS; i++) {
-          lcd.print(touch_sensor.touched(i));
+          lcd_frame.print(touch_sensor.touched(i));
         }
-        lcd.print("    ");
+        lcd_frame.print("    ");
 
-        lcd.setCursor(0, 1);
-        lcd.print("S:");
+        lcd_frame.setCursor(0, 1);
+        lcd_frame.print("S:");
         for (uint8_t i = 0; i < NUM_SWITCHES; i++) {
-          lcd.print(switch_states[i]);
+          lcd_frame.print(switch_states[i]);
         }
-        lcd.print("      ");
-    
-        data_changed = false;
+        lcd_frame.print("  ");
+      }
+
+      /*
+       * Time saved each pass by only writing changed cells, refreshed at
+       * most once a second so showing it doesn't use it up
+       */
+      static unsigned long saved_shown = 0;
+      if (data_changed || (millis() - saved_shown >= LCD_SAVED_SHOW_MS)) {
+        saved_shown = millis();
+        lcd_frame.setCursor(8, 1);
+        lcd_frame.print("LCD");
+        lcd_frame.print(lcd_saved_micros[display_mode]);
+        lcd_frame.print("     ");
       }
+      data_changed = false;
       break;
     }
 
     case DISPLAY_ADJUST_BPM1_1:
     case DISPLAY_ADJUST_BPM1_2:
     {
-      lcd.setCursor(0, 0);
-      lcd.print("BPM1:");
-      lcd.print(pulse_bpm_1);
-      lcd.print("    ");
-
-      lcd.setCursor(0, 1);
-      lcd.print("Len:");
-      lcd.print(pulse_length_1);
-      lcd.print(" D:");
-      lcd.print(pulse_delay_1);
-      lcd.print("    ");
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("BPM1:");
+      lcd_frame.print(pulse_bpm(0, pulse_bpm_1));
+      lcd_print_ratio(0);
+      lcd_frame.print("    ");
+
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("Len:");
+      lcd_frame.print(pulse_length_1);
+      lcd_frame.print(" D:");
+      lcd_frame.print(pulse_delay_1);
+      lcd_frame.print("    ");
       break;
     }
 
     case DISPLAY_ADJUST_BPM2_1:
     case DISPLAY_ADJUST_BPM2_2:
     {
-      lcd.setCursor(0, 0);
-      lcd.print("BPM2:");
-      lcd.print(pulse_bpm_2);
-      lcd.print("    ");
-
-      lcd.setCursor(0, 1);
-      lcd.print("Len:");
-      lcd.print(pulse_length_2);
-      lcd.print(" D:");
-      lcd.print(pulse_delay_2);
-      lcd.print("    ");
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("BPM2:");
+      lcd_frame.print(pulse_bpm(1, pulse_bpm_2));
+      lcd_print_ratio(1);
+      lcd_frame.print("    ");
+
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("Len:");
+      lcd_frame.print(pulse_length_2);
+      lcd_frame.print(" D:");
+      lcd_frame.print(pulse_delay_2);
+      lcd_frame.print("    ");
       break;
     }
 
     case DISPLAY_ADJUST_BPM3_1:
     case DISPLAY_ADJUST_BPM3_2:
     {
-      lcd.setCursor(0, 0);
-      lcd.print("BPM3:");
-      lcd.print(pulse_bpm_3);
-      lcd.print("    ");
-
-      lcd.setCursor(0, 1);
-      lcd.print("Len:");
-      lcd.print(pulse_length_3);
-      lcd.print(" D:");
-      lcd.print(pulse_delay_3);
-      lcd.print("    ");
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("BPM3:");
+      lcd_frame.print(pulse_bpm(2, pulse_bpm_3));
+      lcd_print_ratio(2);
+      lcd_frame.print("    ");
+
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("Len:");
+      lcd_frame.print(pulse_length_3);
+      lcd_frame.print(" D:");
+      lcd_frame.print(pulse_delay_3);
+      lcd_frame.print("    ");
       break;
     }
 
@@ -1042,59 +1412,192 @@ void update_lcd() {
     case DISPLAY_ADJUST_BPM4_1:
     case DISPLAY_ADJUST_BPM4_2:
     {
-      lcd.setCursor(0, 0);
-      lcd.print("BPM4:");
-      lcd.print(pulse_bpm_4);
-      lcd.print("    ");
-
-      lcd.setCursor(0, 1);
-      lcd.print("Len:");
-      lcd.print(pulse_length_4);
-      lcd.print(" D:");
-      lcd.print(pulse_delay_4);
-      lcd.print("    ");
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("BPM4:");
+      lcd_frame.print(pulse_bpm(3, pulse_bpm_4));
+      lcd_print_ratio(3);
+      lcd_frame.print("    ");
+
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("Len:");
+      lcd_frame.print(pulse_length_4);
+      lcd_frame.print(" D:");
+      lcd_frame.print(pulse_delay_4);
+      lcd_frame.print("    ");
       break;
     }
 
     case DISPLAY_ADJUST_BRIGHTNESS: {
-      lcd.setCursor(0, 0);
-      lcd.print("BRIGHTNESS:");
-      lcd.print(brightness);
-      lcd.print("       ");
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("BRIGHTNESS:");
+      lcd_frame.print(brightness);
+      lcd_frame.print("       ");
       break;
     }
 
     case DISPLAY_LED_MODE: {
-      lcd.setCursor(0, 0);
-      lcd.print("LEDs:");
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("LEDs:");
       switch (led_mode) {
         case LED_MODE_ON: {
-          lcd.print("ON");
+          lcd_frame.print("ON");
           break;
         }
         case LED_MODE_BLINK: {
-          lcd.print("BLINK");
+          lcd_frame.print("BLINK");
           break;
         }
       }
-      lcd.print("       ");
+      lcd_frame.print("       ");
 
-      lcd.setCursor(0, 1);
-      lcd.print("VALUE:");
-      lcd.print(led_mode_value);
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("VALUE:");
+      lcd_frame.print(led_mode_value);
       break;
     }
 
-    case DISPLAY_ADDRESS_MODE: {
-      lcd.setCursor(0, 0);
-      lcd.print("POOF1_ADDR:");
-      lcd.print(poofer1_address);
+    case DISPLAY_TAP_TEMPO: {
+      /* Up taps the tempo, down clears it */
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("TAP BPM:");
+      if (tempo.period) {
+        lcd_frame.print(tempo_bpm());
+      } else {
+        lcd_frame.print("--");
+      }
+      lcd_frame.print("     ");
 
-      lcd.setCursor(0, 1);
-      lcd.print("POOF2_ADDR:");
-      lcd.print(lights_address);
+      lcd_frame.setCursor(0, 1);
+      for (uint8_t i = 0; i < TEMPO_CHANNELS; i++) {
+        lcd_print_ratio(i);
+      }
+      lcd_frame.print("    ");
+      break;
+    }
+
+    case DISPLAY_QUANTIZE: {
+      /* Up steps the grid, down toggles sending bursts immediately */
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("QUANT:");
+      if (quant.grid == QUANT_OFF) {
+        lcd_frame.print("OFF ");
+      } else {
+        lcd_frame.print("1/");
+        lcd_frame.print(quant.grid);
+        lcd_frame.print(" ");
+      }
+      if (quant.immediate) {
+        lcd_frame.print("NOW");
+      } else if (!tempo.period) {
+        lcd_frame.print("TAP");
+      }
+      lcd_frame.print("      ");
+
+      /* Average and maximum time held, and lateness past the tick */
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("W:");
+      lcd_frame.print(quant_wait_average());
+      lcd_frame.print("/");
+      lcd_frame.print(quant.stats.wait_max);
+      lcd_frame.print(" L:");
+      lcd_frame.print(quant_late_average());
+      lcd_frame.print("/");
+      lcd_frame.print(quant.stats.late_max);
+      lcd_frame.print("   ");
+      break;
+    }
+
+    case DISPLAY_LOOPER: {
+      /* Up arms recording, down clears it */
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("LOOP:");
+      switch (looper.state) {
+        case LOOPER_ARMED: {
+          lcd_frame.print("ARM ");
+          break;
+        }
+        case LOOPER_RECORDING: {
+          lcd_frame.print("REC ");
+          break;
+        }
+        case LOOPER_PLAYING: {
+          lcd_frame.print("PLAY");
+          break;
+        }
+        default: {
+          lcd_frame.print("OFF ");
+          break;
+        }
+      }
+      lcd_frame.print(" EV:");
+      lcd_frame.print(looper.count);
+      lcd_frame.print("   ");
+
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("LEN:");
+      lcd_frame.print(looper.length / 1000);
+      lcd_frame.print(".");
+      lcd_frame.print((looper.length / 100) % 10);
+      lcd_frame.print(looper.grid ? "s Q " : "s   ");
+      lcd_frame.print(looper.plays);
+      lcd_frame.print("    ");
+      break;
+    }
+
+    case DISPLAY_PRESSURE: {
+      /* Up turns pressure mode on or off */
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("PRES:");
+      lcd_frame.print((fire_config.flags & FIRE_FLAG_PRESSURE) ? "ON  V:" : "OFF V:");
+      lcd_frame.print(pressure.value);
+      lcd_frame.print("   ");
+
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("R:");
+      lcd_frame.print(pressure.rate);
+      lcd_frame.print("/s L:");
+      lcd_frame.print(pressure_latency_average());
+      lcd_frame.print("/");
+      lcd_frame.print(pressure.latency_max);
+      lcd_frame.print("    ");
       break;
     }
 
+    case DISPLAY_ADDRESS_MODE: {
+      /* Addresses that didn't answer discovery are marked */
+      lcd_frame.setCursor(0, 0);
+      lcd_frame.print("P1:");
+      lcd_frame.print(poofer1_address);
+      lcd_frame.print(disc_alive(poofer1_address) ? "  " : "? ");
+      lcd_frame.print("P2:");
+      lcd_frame.print(poofer2_address);
+      lcd_frame.print(disc_alive(poofer2_address) ? " " : "?");
+
+      lcd_frame.setCursor(0, 1);
+      lcd_frame.print("LT:");
+      lcd_frame.print(lights_address);
+      lcd_frame.print(disc_alive(lights_address) ? "  " : "? ");
+      if (disc.state == DISC_POLLING) {
+        lcd_frame.print("SCAN    ");
+      } else {
+        lcd_frame.print("NODES:");
+        lcd_frame.print(disc.num_nodes);
+        lcd_frame.print(" ");
+      }
+      break;
+    }
+
+  }
+}
+
+
+void update_lcd() {
+  if (!lcd_link_warning()) {
+    lcd_render_page();
   }
+
+  uint8_t written = lcd_frame.flush();
+  uint32_t saved = (uint32_t)(LCD_CELLS - written) * lcd_frame.cell_micros();
+  lcd_saved_micros[display_mode] =
+    ((uint32_t)lcd_saved_micros[display_mode] * 7 + saved) / 8;
 }
\ No newline at end of file
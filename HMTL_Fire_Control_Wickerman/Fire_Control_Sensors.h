@@ -21,17 +21,55 @@
 #define DISPLAY_ADJUST_BRIGHTNESS 9
 #define DISPLAY_LED_MODE          10
 #define DISPLAY_ADDRESS_MODE      11
-#define DISPLAY_MAX              (11 + 1)
+#define DISPLAY_TAP_TEMPO         12
+#define DISPLAY_QUANTIZE          13
+#define DISPLAY_LOOPER            14
+#define DISPLAY_PRESSURE          15
+#define DISPLAY_MAX              (15 + 1)
 
 extern uint8_t display_mode;
 #define NUM_DISPLAY_MODES DISPLAY_MAX
 
+/* Average microseconds a pass saves on each page by only writing changes */
+extern uint16_t lcd_saved_micros[NUM_DISPLAY_MODES];
+
 #define LED_MODE_ON    0
 #define LED_MODE_BLINK 1
 #define LED_MODE_MAX (1 + 1)
 extern uint8_t led_mode;
 extern uint8_t led_mode_value;
 
+/* Masks of the sensors touched and those that changed on the last read */
+extern uint16_t touch_states;
+extern uint16_t touch_edges;
+
+/* Returns true if the poofers are enabled and the pilot is open */
+boolean poofers_armed();
+
+/*
+ * Mask of the sensors whose touches fire the poofers.  In pressure mode the
+ * pressure sensor only drives its output, even on the touch controller where
+ * it's otherwise one of the fire sensors.
+ */
+uint16_t fire_sensors();
+boolean sensor_fires(uint8_t sensor);
+
+/*
+ * Returns true if messages to an address may reach a poofer, which includes
+ * broadcasts and any group
+ */
+boolean poofer_address(uint16_t address);
+
+/* LED associated with each sensor, fixed for the object type */
+extern const uint8_t sensor_led_map[];
 byte sensor_to_led(byte sensor);
 
+/*
+ * Hold pulses started by touches until the next beat of the tap tempo, see
+ * Fire_Control_Tempo.h.  pulse_start() is true on the pass a sensor's pulse
+ * should be sent.
+ */
+void align_pulses(unsigned long now);
+boolean pulse_start(uint8_t sensor);
+
 #endif
@@ -0,0 +1,219 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Pre-programmed sequences of poofer and light actions
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_SEQUENCE
+  #define DEBUG_LEVEL DEBUG_LEVEL_SEQUENCE
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+#include <stddef.h>
+#include "EEPROM.h"
+
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "HMTLPrograms.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Sequence.h"
+#include "Fire_Control_Sensors.h"
+#include "Fire_Control_Pool.h"
+
+#if SEQ_MAX_TARGETS > 16
+  #error "Step targets are kept in a nibble"
+#endif
+
+seq_cursor_t seq;
+
+/* Steps that fit between the sequence address and the end of the EEPROM */
+static uint16_t seq_capacity() {
+  if (EEPROM.length() <= SEQ_EEPROM_ADDR + sizeof (seq_header_t)) {
+    return 0;
+  }
+  return (EEPROM.length() - SEQ_EEPROM_ADDR - sizeof (seq_header_t)) /
+         sizeof (seq_step_t);
+}
+
+void seq_config_end(int end) {
+  seq.overlapped = (end > SEQ_EEPROM_ADDR);
+  if (seq.overlapped) {
+    DEBUG_ERR("Config overlaps stored sequence");
+  }
+}
+
+boolean seq_valid() {
+  if (seq.overlapped) {
+    return false;
+  }
+  if (EEPROM.read(SEQ_EEPROM_ADDR + offsetof(seq_header_t, magic)) !=
+      SEQ_MAGIC) {
+    return false;
+  }
+
+  uint16_t num_steps;
+  EEPROM.get(SEQ_EEPROM_ADDR + offsetof(seq_header_t, num_steps), num_steps);
+  return ((num_steps > 0) && (num_steps <= seq_capacity()));
+}
+
+/* Delay before the cursor's next step */
+static unsigned long seq_delay() {
+  return (unsigned long)EEPROM.read(SEQ_STEP_ADDR(seq.step)) * SEQ_TICK_MS;
+}
+
+boolean seq_start(unsigned long now) {
+  if (!seq_valid()) {
+    DEBUG1_PRINTLN("No sequence stored");
+    return false;
+  }
+
+  seq.flags = EEPROM.read(SEQ_EEPROM_ADDR + offsetof(seq_header_t, flags));
+  EEPROM.get(SEQ_EEPROM_ADDR + offsetof(seq_header_t, num_steps),
+             seq.num_steps);
+  seq.step = 0;
+  seq.due = now + seq_delay();
+  seq.sent = 0;
+  seq.running = true;
+
+  DEBUG3_VALUELN("Sequence start steps:", seq.num_steps);
+  return true;
+}
+
+void seq_stop() {
+  if (seq.running) {
+    DEBUG3_VALUELN("Sequence stop at:", seq.step);
+  }
+  seq.running = false;
+}
+
+static void seq_send(const seq_step_t *step) {
+  uint8_t index = SEQ_OP_TARGET(step->op);
+  if ((SEQ_OP_ACTION(step->op) == SEQ_ACTION_WAIT) ||
+      (index >= SEQ_MAX_TARGETS)) {
+    return;
+  }
+
+  seq_target_t target;
+  EEPROM.get(SEQ_EEPROM_ADDR + offsetof(seq_header_t, targets) +
+             index * sizeof (seq_target_t), target);
+
+  switch (SEQ_OP_ACTION(step->op)) {
+    case SEQ_ACTION_VALUE: {
+      sendHMTLValue(target.address, target.output, step->value);
+      break;
+    }
+    case SEQ_ACTION_BURST: {
+      sendHMTLTimedChange(target.address, target.output,
+                          (uint32_t)step->value * SEQ_TICK_MS, 0xFFFFFFFF, 0);
+      break;
+    }
+    case SEQ_ACTION_CANCEL: {
+      sendHMTLCancel(target.address, target.output);
+      sendHMTLValue(target.address, target.output, 0);
+      break;
+    }
+    default: {
+      return;
+    }
+  }
+  seq.sent++;
+}
+
+boolean seq_run(unsigned long now) {
+  if (seq.running && !poofers_armed()) {
+    /* Nothing more is sent once the poofers are disarmed */
+    DEBUG2_PRINTLN("Sequence stopped, not armed");
+    seq_stop();
+    return false;
+  }
+
+  for (uint8_t i = 0; seq.running && (i < SEQ_MAX_PER_RUN); i++) {
+    if ((long)(now - seq.due) < 0) {
+      break;
+    }
+
+    seq_step_t step;
+    EEPROM.get(SEQ_STEP_ADDR(seq.step), step);
+    seq_send(&step);
+
+    seq.step++;
+    if (seq.step >= seq.num_steps) {
+      seq.plays++;
+      if (!(seq.flags & SEQ_FLAG_LOOP)) {
+        DEBUG3_VALUELN("Sequence done sent:", seq.sent);
+        seq.running = false;
+        break;
+      }
+      seq.step = 0;
+    }
+
+    /* Steps are timed from the previous step's due time, not when it went */
+    seq.due += seq_delay();
+  }
+
+  return seq.running;
+}
+
+void seq_host_msg(const msg_hdr_t *msg_hdr) {
+  if (msg_hdr->length < sizeof (msg_hdr_t) + sizeof (msg_fire_sequence_t)) {
+    return;
+  }
+  if (seq.overlapped) {
+    DEBUG1_PRINTLN("Sequence not written, config overlaps");
+    return;
+  }
+  const msg_fire_sequence_t *msg = (const msg_fire_sequence_t *)(msg_hdr + 1);
+  uint16_t len = msg_hdr->length - sizeof (msg_hdr_t) -
+                 sizeof (msg_fire_sequence_t);
+  if ((uint32_t)SEQ_EEPROM_ADDR + msg->offset + len > EEPROM.length()) {
+    DEBUG1_VALUELN("Sequence write past end:", msg->offset);
+    return;
+  }
+
+  /* The stored steps are changing underneath any running sequence */
+  seq_stop();
+
+  for (uint16_t i = 0; i < len; i++) {
+    int address = SEQ_EEPROM_ADDR + msg->offset + i;
+    if (EEPROM.read(address) != msg->data[i]) {
+      EEPROM.write(address, msg->data[i]);
+    }
+  }
+#ifdef ESP32
+  EEPROM.commit();
+#endif
+
+  DEBUG4_VALUE("Sequence write off:", msg->offset);
+  DEBUG4_VALUELN(" len:", len);
+}
+
+/*******************************************************************************
+ * Sequence program, the cursor is the program state so none is allocated.
+ * When run from the pool it's next woken when the next step is due.
+ */
+
+boolean program_sequence(output_hdr_t *output, void *object,
+                         program_tracker_t *tracker) {
+  if (!seq_run(millis())) {
+    tracker->done = true;
+  } else {
+    pool_wake(tracker, seq.due);
+  }
+
+  /* Only messages are sent, the output itself never changes */
+  return false;
+}
+
+boolean program_sequence_init(msg_program_t *msg, program_tracker_t *tracker,
+                              output_hdr_t *output, void *object,
+                              ProgramManager *manager) {
+  tracker->state = NULL;
+  return seq_start(millis());
+}
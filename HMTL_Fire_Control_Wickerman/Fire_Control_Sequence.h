@@ -0,0 +1,127 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Pre-programmed sequences of poofer and light actions.
+ *
+ * A sequence is a list of steps stored in EEPROM, each a delay after the
+ * previous step, a target (address and output) and an action.  Targets are
+ * listed once in the sequence header and referred to by index, so each step
+ * is three bytes.  The sequence runs as a program on the controller's RS485
+ * output, reading each step from EEPROM only when it is due and sending its
+ * message immediately, so the only RAM used is the cursor.
+ *
+ * Sequences are written by the host with MSG_TYPE_FIRE_SEQUENCE messages
+ * holding raw bytes at an offset into the stored sequence, the header should
+ * be written last as it validates the sequence.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_SEQUENCE_H
+#define FIRE_CONTROL_SEQUENCE_H
+
+#include "Arduino.h"
+#include "HMTLMessaging.h"
+#include "HMTLPrograms.h"
+
+#define MSG_TYPE_FIRE_SEQUENCE 0x23
+
+typedef struct {
+  uint16_t offset; // Offset into the stored sequence, starting with the header
+  byte     data[0];
+} msg_fire_sequence_t;
+
+/* Program type for running the stored sequence */
+#define FIRE_PROGRAM_SEQUENCE  0x40
+
+/* EEPROM address of the sequence, which runs to the end of the EEPROM */
+#ifndef SEQ_EEPROM_ADDR
+  #define SEQ_EEPROM_ADDR 384
+#endif
+
+#define SEQ_MAGIC        0x53
+#define SEQ_MAX_TARGETS  8
+#define SEQ_TICK_MS      10 // Unit of step delays and burst lengths
+#define SEQ_MAX_PER_RUN  8  // Steps sent in a single pass
+
+/* Flags */
+#define SEQ_FLAG_LOOP    0x01 // Restart from the first step when done
+
+typedef struct {
+  uint16_t address;
+  uint8_t  output;
+  uint8_t  reserved;
+} seq_target_t;
+
+typedef struct {
+  uint8_t  magic;
+  uint8_t  flags;
+  uint16_t num_steps;
+  seq_target_t targets[SEQ_MAX_TARGETS];
+} seq_header_t;
+
+/* Actions */
+#define SEQ_ACTION_VALUE  0 // Set the output to the value
+#define SEQ_ACTION_BURST  1 // Turn the output on for value ticks
+#define SEQ_ACTION_CANCEL 2 // Cancel programs and turn the output off
+#define SEQ_ACTION_WAIT   3 // Nothing, extends the delay before the next step
+
+typedef struct {
+  uint8_t delay;  // Ticks after the previous step
+  uint8_t op;     // Target index in the high nibble, action in the low
+  uint8_t value;
+} seq_step_t;
+
+#define SEQ_OP(target, action) (uint8_t)(((target) << 4) | (action))
+#define SEQ_OP_TARGET(op)      ((op) >> 4)
+#define SEQ_OP_ACTION(op)      ((op) & 0x0F)
+
+#define SEQ_STEP_ADDR(step) \
+  (SEQ_EEPROM_ADDR + sizeof (seq_header_t) + (step) * sizeof (seq_step_t))
+
+typedef struct {
+  boolean  running;
+  uint8_t  flags;
+  uint16_t step;       // Index of the next step
+  uint16_t num_steps;
+  unsigned long due;   // Time the next step is due
+
+  uint16_t sent;       // Steps sent since started
+  uint16_t plays;
+
+  boolean  overlapped; // The config runs into the sequence, which is unusable
+} seq_cursor_t;
+
+extern seq_cursor_t seq;
+
+/*
+ * Set the end of the config stored before the sequence.  If it runs past
+ * SEQ_EEPROM_ADDR no sequence is run or written, as the config holds the
+ * bytes there.
+ */
+void seq_config_end(int end);
+
+/* Returns true if a valid sequence is stored */
+boolean seq_valid();
+
+/* Start the stored sequence from the first step */
+boolean seq_start(unsigned long now);
+void seq_stop();
+
+/*
+ * Send the steps that are due, returns false once the sequence has ended or
+ * the poofers are no longer armed
+ */
+boolean seq_run(unsigned long now);
+
+/* Handle a sequence message from the host */
+void seq_host_msg(const msg_hdr_t *msg_hdr);
+
+/* Program functions for the ProgramManager */
+boolean program_sequence(output_hdr_t *output, void *object,
+                         program_tracker_t *tracker);
+boolean program_sequence_init(msg_program_t *msg, program_tracker_t *tracker,
+                              output_hdr_t *output, void *object,
+                              ProgramManager *manager);
+
+#endif
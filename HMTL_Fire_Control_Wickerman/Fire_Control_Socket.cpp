@@ -0,0 +1,232 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Socket wrapper for the RS485 bus
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_CONNECT
+  #define DEBUG_LEVEL DEBUG_LEVEL_CONNECT
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Socket.h"
+#include "Fire_Control_Arbiter.h"
+#include "Fire_Control_Provision.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Link.h"
+#include "modes.h"
+
+FireSocket::FireSocket(RS485Socket *_socket) {
+  socket = _socket;
+  group_msg = NULL;
+  group_len = 0;
+  group_outputs = 0;
+  memset(&stats, 0, sizeof (stats));
+}
+
+void FireSocket::setup() {
+  socket->setup();
+}
+
+boolean FireSocket::initialized() {
+  return socket->initialized();
+}
+
+byte *FireSocket::initBuffer(byte *data, uint16_t data_size) {
+  return socket->initBuffer(data, data_size);
+}
+
+/*
+ * Messages sent by the handler, such as responses and forwarded messages, are
+ * queued by the arbiter like any other frame when the bus is shared.
+ */
+void FireSocket::sendMsgTo(uint16_t address, const byte *data,
+                           const byte datalength) {
+  bus_send(address, data, datalength, bus_priority(address));
+}
+
+const byte *FireSocket::getMsg(unsigned int *retlen) {
+  return socket->getMsg(retlen);
+}
+
+/*
+ * Return the next message for this address.  In addition to messages sent
+ * directly to the address, messages sent to any group this node belongs to
+ * are returned with the address rewritten so they are handled as if sent
+ * directly.
+ */
+const byte *FireSocket::getMsg(uint16_t address, unsigned int *retlen) {
+  const byte *msg = nextMsg(address, retlen);
+  if (msg != NULL) {
+    /* Outputs the message may change are updated once it's been handled */
+    output_dirty_msg((const msg_hdr_t *)msg);
+  }
+  return msg;
+}
+
+const byte *FireSocket::nextMsg(uint16_t address, unsigned int *retlen) {
+  if (group_outputs) {
+    return nextGroupOutput(retlen);
+  }
+
+#ifdef BUS_UART_DE
+  /* Only read from the socket once the UART has signalled received data */
+  if (!bus_rx_event) {
+    return NULL;
+  }
+  bus_rx_event = false;
+#endif
+
+  const byte *data = socket->getMsg(retlen);
+  if (data == NULL) {
+    return NULL;
+  }
+  stats.received++;
+#ifdef BUS_UART_DE
+  /* Further frames may be waiting */
+  bus_rx_event = true;
+#endif
+
+  /*
+   * Check the destination in the socket header before looking at the message
+   * itself, traffic for other nodes is dropped without further decoding.
+   */
+  socket_addr_t dest = socket->destFromData((void *)data);
+
+  if (bus_arbitrating && (*retlen >= sizeof (msg_hdr_t))) {
+    /* Every frame is seen by the arbiter to track the other controllers */
+    uint8_t type = ((msg_hdr_t *)data)->type;
+    arb_observe(&bus_arbiter, socket->sourceFromData((void *)data), dest,
+                type, millis());
+    if (type == MSG_TYPE_FIRE_TOKEN) {
+      return NULL;
+    }
+  }
+
+  if (!isForNode(address, dest)) {
+    stats.filtered++;
+    return NULL;
+  }
+
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)data;
+  if ((*retlen < sizeof (msg_hdr_t)) || (msg_hdr->length > *retlen)) {
+    stats.malformed++;
+    return NULL;
+  }
+
+  /* Anything received from a node shows it's alive */
+  disc_heard(socket->sourceFromData((void *)data));
+
+  if ((dest == address) && (msg_hdr->type == MSG_TYPE_POLL) &&
+      (msg_hdr->flags & MSG_FLAG_RESPONSE)) {
+    /*
+     * Answers to this controller's discovery, link and bus probes are used
+     * here, any other, such as to a poll forwarded for the host, is passed on
+     */
+    uint16_t source = socket->sourceFromData((void *)data);
+    boolean expected = link_response(source, micros());
+    expected |= disc_response(source, msg_hdr);
+    expected |= bus_probe_response(source);
+    if (expected) {
+      return NULL;
+    }
+  }
+
+  if ((dest == address) && (msg_hdr->type == MSG_TYPE_FIRE_CONFIG)) {
+    /* Acknowledgement from a node being configured */
+    cfg_node_msg(socket->sourceFromData((void *)data), msg_hdr);
+    return NULL;
+  }
+
+  return acceptMsg(address, dest, data, retlen);
+}
+
+/* Check if a destination is this node, broadcast, or a group it belongs to */
+boolean FireSocket::isForNode(uint16_t address, socket_addr_t dest) {
+  if ((dest == address) || (dest == SOCKET_ADDR_ANY)) {
+    return true;
+  }
+  return (IS_FIRE_GROUP(dest) &&
+          (fire_group_outputs(FIRE_GROUP_NUMBER(dest)) != 0));
+}
+
+/*
+ * Return a message for this node in place, or NULL if it should be dropped.
+ */
+const byte *FireSocket::acceptMsg(uint16_t address, socket_addr_t dest,
+                                  const byte *data, unsigned int *retlen) {
+  if ((dest == address) || (dest == SOCKET_ADDR_ANY)) {
+    stats.accepted++;
+    return data;
+  }
+
+  if (*retlen < sizeof (msg_hdr_t) + sizeof (msg_output_hdr_t)) {
+    stats.malformed++;
+    return NULL;
+  }
+
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)data;
+  msg_hdr->address = address;
+
+  msg_output_hdr_t *out_hdr = (msg_output_hdr_t *)(msg_hdr + 1);
+  if ((msg_hdr->type != MSG_TYPE_OUTPUT) ||
+      (out_hdr->output != HMTL_ALL_OUTPUTS)) {
+    /* The sender picked a specific output */
+    stats.accepted++;
+    return data;
+  }
+
+  /* Deliver the message once for each member output */
+  uint8_t outputs = fire_group_outputs(FIRE_GROUP_NUMBER(dest));
+  DEBUG4_VALUE("Group msg g:", FIRE_GROUP_NUMBER(dest));
+  DEBUG4_VALUELN(" outputs:", outputs);
+  group_msg = (byte *)data;
+  group_len = *retlen;
+  group_outputs = outputs;
+  return nextGroupOutput(retlen);
+}
+
+const byte *FireSocket::nextGroupOutput(unsigned int *retlen) {
+  uint8_t output = 0;
+  while (!(group_outputs & (1 << output))) {
+    output++;
+  }
+  group_outputs &= ~(1 << output);
+
+  msg_output_hdr_t *out_hdr =
+          (msg_output_hdr_t *)(group_msg + sizeof (msg_hdr_t));
+  out_hdr->output = output;
+
+  *retlen = group_len;
+  stats.accepted++;
+  return group_msg;
+}
+
+byte FireSocket::getLength() {
+  return socket->getLength();
+}
+
+void *FireSocket::headerFromData(const void *data) {
+  return socket->headerFromData(data);
+}
+
+socket_addr_t FireSocket::sourceFromData(void *data) {
+  return socket->sourceFromData(data);
+}
+
+socket_addr_t FireSocket::destFromData(void *data) {
+  return socket->destFromData(data);
+}
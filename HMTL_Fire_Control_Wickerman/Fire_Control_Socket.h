@@ -0,0 +1,60 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Socket wrapper for the RS485 bus that applies fire control addressing to
+ * received messages before they reach the MessageHandler.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_SOCKET_H
+#define FIRE_CONTROL_SOCKET_H
+
+#include "Socket.h"
+#include "RS485Utils.h"
+
+typedef struct {
+  uint32_t received;  // Frames read from the bus
+  uint32_t accepted;  // Messages handed on for handling
+  uint32_t filtered;  // Messages for other nodes, dropped before decoding
+  uint32_t malformed; // Messages dropped due to bad lengths
+} fire_socket_stats_t;
+
+class FireSocket : public Socket {
+ public:
+  FireSocket(RS485Socket *socket);
+
+  void setup();
+  boolean initialized();
+  byte *initBuffer(byte *data, uint16_t data_size);
+
+  void sendMsgTo(uint16_t address, const byte *data, const byte datalength);
+
+  const byte *getMsg(unsigned int *retlen);
+  const byte *getMsg(uint16_t address, unsigned int *retlen);
+  byte getLength();
+
+  void *headerFromData(const void *data);
+  socket_addr_t sourceFromData(void *data);
+  socket_addr_t destFromData(void *data);
+
+  fire_socket_stats_t stats;
+
+ private:
+  RS485Socket *socket;
+
+  /* Group message still being delivered to member outputs */
+  byte *group_msg;
+  unsigned int group_len;
+  uint8_t group_outputs;
+
+  const byte *nextMsg(uint16_t address, unsigned int *retlen);
+  boolean isForNode(uint16_t address, socket_addr_t dest);
+  const byte *acceptMsg(uint16_t address, socket_addr_t dest,
+                        const byte *data, unsigned int *retlen);
+  const byte *nextGroupOutput(unsigned int *retlen);
+};
+
+extern FireSocket bus_socket;
+
+#endif
@@ -0,0 +1,187 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Staggering of bursts on a shared supply
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_STAGGER
+  #define DEBUG_LEVEL DEBUG_LEVEL_STAGGER
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "HMTLTypes.h"
+
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Stagger.h"
+
+stagger_state_t stagger;
+
+uint8_t stagger_supply(uint16_t address, uint8_t output) {
+#if CONTROL_MODE == CONTROL_SINGLE_QUINT
+  if ((address == poofer1_address) && (output == POOFER1_LARGE)) {
+    return 0;
+  }
+  if ((address == poofer2_address) && (output <= POOFER2_POOF4)) {
+    return 0;
+  }
+#else
+  if ((address == poofer1_address) &&
+      ((output == POOFER1_POOF1) || (output == POOFER1_POOF2))) {
+    return 0;
+  }
+  if ((address == poofer2_address) &&
+      ((output == POOFER2_POOF1) || (output == POOFER2_POOF2))) {
+    return STAGGER_SUPPLIES - 1;
+  }
+#endif
+  return STAGGER_NO_SUPPLY;
+}
+
+/* Returns true if a slot or burst is for the output, or all of them */
+static boolean stagger_match(uint16_t address, uint8_t output,
+                             uint16_t match_address, uint8_t match_output) {
+  if (IS_FIRE_GROUP(match_address)) {
+    return true;
+  }
+  return ((address == match_address) &&
+          ((output == match_output) || (match_output == HMTL_ALL_OUTPUTS)));
+}
+
+/* Burst held for an output, NULL if none */
+static stagger_burst_t *stagger_held(uint16_t address, uint8_t output) {
+  for (uint8_t i = 0; i < stagger.count; i++) {
+    if ((stagger.held[i].address == address) &&
+        (stagger.held[i].output == output)) {
+      return &stagger.held[i];
+    }
+  }
+  return NULL;
+}
+
+boolean stagger_defer(uint16_t address, uint8_t output, uint32_t duration,
+                      unsigned long now) {
+#if STAGGER_MAX_OPEN > 0
+  uint8_t supply = stagger_supply(address, output);
+  if (supply == STAGGER_NO_SUPPLY) {
+    return false;
+  }
+
+  /* The output's own slot if it's open, otherwise the first to free up */
+  stagger_slot_t *slots = stagger.slots[supply];
+  stagger_slot_t *slot = &slots[0];
+  boolean open = false;
+  for (uint8_t i = 0; i < STAGGER_MAX_OPEN; i++) {
+    if ((slots[i].address == address) && (slots[i].output == output) &&
+        ((long)(slots[i].close - now) > 0)) {
+      slot = &slots[i];
+      open = true;
+      break;
+    }
+    if ((long)(slots[i].close - slot->close) < 0) {
+      slot = &slots[i];
+    }
+  }
+
+  if (open) {
+    /* Lengthen the burst the output already has rather than add another */
+    stagger_burst_t *held = stagger_held(address, output);
+    unsigned long start = now;
+    if (held) {
+      start = held->start;
+      if (duration > held->duration) {
+        held->duration = duration;
+      }
+    }
+    if ((long)(start + duration - slot->close) > 0) {
+      slot->close = start + duration;
+    }
+    return (held != NULL);
+  }
+
+  unsigned long start = now;
+  if ((long)(slot->close - now) > 0) {
+    if (stagger.count >= STAGGER_HELD) {
+      DEBUG1_VALUELN("Stagger full, sent a:", address);
+      stagger.overflow++;
+      return false;
+    }
+
+    start = slot->close;
+    stagger_burst_t *held = &stagger.held[stagger.count++];
+    held->address = address;
+    held->output = output;
+    held->duration = duration;
+    held->start = start;
+
+    uint16_t offset = start - now;
+    stagger.deferred++;
+    if (offset > stagger.offset_max) {
+      stagger.offset_max = offset;
+    }
+    DEBUG4_VALUE("Stagger a:", address);
+    DEBUG4_VALUE(" o:", output);
+    DEBUG4_VALUELN(" offset:", offset);
+  }
+
+  slot->address = address;
+  slot->output = output;
+  slot->close = start + duration;
+
+  return (start != now);
+#else
+  return false;
+#endif
+}
+
+boolean stagger_next(unsigned long now, stagger_burst_t *burst) {
+  for (uint8_t i = 0; i < stagger.count; i++) {
+    if ((long)(now - stagger.held[i].start) >= 0) {
+      *burst = stagger.held[i];
+      stagger.count--;
+      stagger.held[i] = stagger.held[stagger.count];
+      return true;
+    }
+  }
+  return false;
+}
+
+void stagger_cancel(uint16_t address, uint8_t output) {
+  uint8_t i = 0;
+  while (i < stagger.count) {
+    if (stagger_match(stagger.held[i].address, stagger.held[i].output,
+                      address, output)) {
+      stagger.count--;
+      stagger.held[i] = stagger.held[stagger.count];
+    } else {
+      i++;
+    }
+  }
+
+#if STAGGER_MAX_OPEN > 0
+  for (uint8_t s = 0; s < STAGGER_SUPPLIES; s++) {
+    for (uint8_t j = 0; j < STAGGER_MAX_OPEN; j++) {
+      stagger_slot_t *slot = &stagger.slots[s][j];
+      if (stagger_match(slot->address, slot->output, address, output)) {
+        /* Closed now, so free for the next burst */
+        slot->close = millis();
+      }
+    }
+  }
+#endif
+}
+
+void stagger_clear() {
+  if (stagger.count) {
+    DEBUG3_VALUELN("Stagger dropped:", stagger.count);
+  }
+  stagger.dropped += stagger.count;
+  stagger.count = 0;
+}
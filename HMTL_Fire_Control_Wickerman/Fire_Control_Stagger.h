@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Staggering of bursts so that accumulators sharing a fuel supply don't all
+ * open at once and pull its pressure down.
+ *
+ * Each supply has a slot for every valve that may be open on it at a time,
+ * holding the output last given the slot and when its burst ends.  A burst
+ * takes the slot that frees up first, if that slot is still open the burst is
+ * held and sent as soon as it frees, the smallest delay that keeps within the
+ * limit.  A burst to an output that's already open just extends it.  Checking
+ * a burst only looks at the slots of its supply and the held bursts, both
+ * fixed in size.
+ *
+ * Held bursts are never dropped for lack of a slot, if too many are already
+ * held the burst is sent immediately instead.  Cancelling an output or
+ * turning it off drops its held bursts and frees its slot, and disarming the
+ * poofers drops all of them.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_STAGGER_H
+#define FIRE_CONTROL_STAGGER_H
+
+#include "Arduino.h"
+#include "HMTL_Fire_Control.h"
+
+/*
+ * Supplies and the valves that may be open on each, for each control mode.
+ * A limit of 0 disables staggering.
+ */
+#if CONTROL_MODE == CONTROL_SINGLE_QUINT
+  /* All five accumulators are fed from the one tank */
+  #define STAGGER_SUPPLIES     1
+  #ifndef STAGGER_MAX_OPEN
+    #define STAGGER_MAX_OPEN   3
+  #endif
+#elif CONTROL_MODE == CONTROL_SINGLE_QUAD
+  /* Four accumulators on two modules, behind the single pilot's supply */
+  #define STAGGER_SUPPLIES     1
+  #ifndef STAGGER_MAX_OPEN
+    #define STAGGER_MAX_OPEN   3
+  #endif
+#elif CONTROL_MODE == CONTROL_DOUBLE_DOUBLE
+  /* Each device has its own supply for its two accumulators */
+  #define STAGGER_SUPPLIES     2
+  #ifndef STAGGER_MAX_OPEN
+    #define STAGGER_MAX_OPEN   2
+  #endif
+#else
+  #define STAGGER_SUPPLIES     1
+  #ifndef STAGGER_MAX_OPEN
+    #define STAGGER_MAX_OPEN   2
+  #endif
+#endif
+
+#define STAGGER_NO_SUPPLY 0xFF
+
+/* Bursts that may be held at once */
+#ifndef STAGGER_HELD
+  #ifdef ESP32
+    #define STAGGER_HELD 8
+  #else
+    #define STAGGER_HELD 4
+  #endif
+#endif
+
+typedef struct {
+  uint16_t address;
+  uint8_t  output;
+  unsigned long close;   // Time the valve's burst ends
+} stagger_slot_t;
+
+typedef struct {
+  uint16_t address;
+  uint8_t  output;
+  uint32_t duration;
+  unsigned long start;
+} stagger_burst_t;
+
+typedef struct {
+#if STAGGER_MAX_OPEN > 0
+  stagger_slot_t slots[STAGGER_SUPPLIES][STAGGER_MAX_OPEN];
+#endif
+
+  uint8_t count;
+  stagger_burst_t held[STAGGER_HELD];
+
+  uint32_t deferred;     // Bursts held for a slot
+  uint32_t overflow;     // Bursts sent over the limit as none could be held
+  uint32_t dropped;      // Held bursts dropped by stagger_clear()
+  uint16_t offset_max;   // Longest a burst was held
+} stagger_state_t;
+
+extern stagger_state_t stagger;
+
+/* Supply feeding an output, STAGGER_NO_SUPPLY if it isn't an accumulator */
+uint8_t stagger_supply(uint16_t address, uint8_t output);
+
+/* Returns true if a burst was held to be sent later by stagger_next() */
+boolean stagger_defer(uint16_t address, uint8_t output, uint32_t duration,
+                      unsigned long now);
+
+/* Remove a held burst that's due, returns false if there are none */
+boolean stagger_next(unsigned long now, stagger_burst_t *burst);
+
+/* An output was cancelled or turned off */
+void stagger_cancel(uint16_t address, uint8_t output);
+
+/* Drop every held burst, such as when the poofers are disarmed */
+void stagger_clear();
+
+#endif
@@ -0,0 +1,157 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Tap tempo and the beat clock
+ ******************************************************************************/
+
+#ifdef DEBUG_LEVEL_TEMPO
+  #define DEBUG_LEVEL DEBUG_LEVEL_TEMPO
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <Arduino.h>
+
+#include "Fire_Control_Tempo.h"
+
+tempo_state_t tempo;
+
+static uint16_t tempo_average() {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < tempo.count; i++) {
+    total += tempo.intervals[i];
+  }
+  return total / tempo.count;
+}
+
+static void tempo_add(uint16_t interval) {
+  tempo.intervals[tempo.head] = interval;
+  tempo.head = (tempo.head + 1) % TEMPO_TAPS;
+  if (tempo.count < TEMPO_TAPS) {
+    tempo.count++;
+  }
+}
+
+/* Returns true if an interval is within the tolerance of another */
+static boolean tempo_close(uint16_t interval, uint16_t estimate) {
+  uint16_t diff = (interval > estimate) ? interval - estimate :
+                                          estimate - interval;
+  return (diff <= estimate / TEMPO_TOLERANCE);
+}
+
+boolean tempo_tap(unsigned long now) {
+  unsigned long interval = now - tempo.last_tap;
+  boolean first = (tempo.last_tap == 0) || (interval > TEMPO_MAX_MS);
+
+  if (!first && (interval < TEMPO_MIN_MS)) {
+    /* A bounce or double touch, ignored entirely */
+    tempo.rejected++;
+    return false;
+  }
+  tempo.last_tap = now;
+
+  if (first) {
+    tempo.count = 0;
+    tempo.head = 0;
+    tempo.outlier = 0;
+    return false;
+  }
+
+  if (tempo.count > 0) {
+    if (!tempo_close(interval, tempo_average())) {
+      if (tempo.outlier && tempo_close(interval, tempo.outlier)) {
+        /* Two intervals in a row agree, the tempo has changed */
+        tempo.count = 0;
+        tempo.head = 0;
+        tempo_add(tempo.outlier);
+      } else {
+        tempo.outlier = interval;
+        tempo.rejected++;
+        DEBUG4_VALUELN("Tap rejected:", interval);
+        return false;
+      }
+    }
+  }
+  tempo_add(interval);
+  tempo.outlier = 0;
+
+  if (tempo.count < 2) {
+    return false;
+  }
+
+  tempo.period = tempo_average();
+  tempo.next_beat = now; // The tap is a beat
+  DEBUG3_VALUELN("Tempo bpm:", tempo_bpm());
+  return true;
+}
+
+void tempo_clear() {
+  tempo.period = 0;
+  tempo.last_tap = 0;
+  tempo.count = 0;
+  tempo.head = 0;
+  tempo.outlier = 0;
+}
+
+uint16_t tempo_bpm() {
+  if (tempo.period == 0) {
+    return 0;
+  }
+  return (60000UL + tempo.period / 2) / tempo.period;
+}
+
+/* Ratios of 0 and -1 are the same as x1 */
+int8_t tempo_channel_ratio(uint8_t channel) {
+  int8_t ratio = tempo.ratio[channel];
+  return ((ratio == 0) || (ratio == -1)) ? 1 : ratio;
+}
+
+uint16_t tempo_channel_period(uint8_t channel) {
+  int8_t ratio = tempo_channel_ratio(channel);
+  if (ratio > 0) {
+    return tempo.period / ratio;
+  }
+  return tempo.period * -ratio;
+}
+
+uint16_t tempo_channel_bpm(uint8_t channel) {
+  uint16_t period = tempo_channel_period(channel);
+  if (period == 0) {
+    return 0;
+  }
+  return (60000UL + period / 2) / period;
+}
+
+void tempo_step_ratio(uint8_t channel, boolean up) {
+  int8_t ratio = tempo_channel_ratio(channel);
+  if (up) {
+    if (ratio == -2) {
+      ratio = 1;
+    } else if (ratio < TEMPO_MAX_RATIO) {
+      ratio++;
+    }
+  } else {
+    if (ratio == 1) {
+      ratio = -2;
+    } else if (ratio > -TEMPO_MAX_RATIO) {
+      ratio--;
+    }
+  }
+  tempo.ratio[channel] = ratio;
+}
+
+boolean tempo_beat(unsigned long now) {
+  if ((tempo.period == 0) || ((long)(now - tempo.next_beat) < 0)) {
+    return false;
+  }
+
+  /* Beats missed while the loop was busy are skipped */
+  do {
+    tempo.next_beat += tempo.period;
+  } while ((long)(now - tempo.next_beat) >= 0);
+  return true;
+}
@@ -0,0 +1,70 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: Create Commons Attribution-Non-Commercial
+ * Copyright: 2016
+ *
+ * Tap tempo and the beat clock the pulse channels are locked to.
+ *
+ * The beat period is the average of the recent intervals between taps.  An
+ * interval too far from the current estimate is rejected as a missed or extra
+ * tap, unless the next interval agrees with it in which case the tempo has
+ * changed and the estimate restarts from the two.  Each tap is a beat, with
+ * later beats following at the period.
+ *
+ * Each pulse channel runs at an integer multiple or division of the beat, and
+ * pulses are started on a beat so channels at related tempos stay in phase.
+ ******************************************************************************/
+
+#ifndef FIRE_CONTROL_TEMPO_H
+#define FIRE_CONTROL_TEMPO_H
+
+#include "Arduino.h"
+
+#define TEMPO_MIN_MS    250  // Shorter intervals are bounces, 240 BPM
+#define TEMPO_MAX_MS    2000 // Longer intervals start a new run of taps, 30 BPM
+#define TEMPO_TAPS      4    // Intervals averaged
+#define TEMPO_TOLERANCE 8    // Intervals may differ by 1/8 of the estimate
+
+#define TEMPO_CHANNELS  4
+#define TEMPO_MAX_RATIO 4
+
+typedef struct {
+  uint16_t period;             // Beat period in ms, 0 without a tempo
+  unsigned long next_beat;
+  unsigned long last_tap;
+
+  uint16_t intervals[TEMPO_TAPS];
+  uint8_t  count;
+  uint8_t  head;
+  uint16_t outlier;            // Last rejected interval, 0 if none
+  uint16_t rejected;
+
+  /*
+   * Rate of each channel relative to the beat, a positive ratio is pulses
+   * per beat and a negative one is beats per pulse.
+   */
+  int8_t   ratio[TEMPO_CHANNELS];
+} tempo_state_t;
+
+extern tempo_state_t tempo;
+
+/* Record a tap, returns true if the tempo was updated */
+boolean tempo_tap(unsigned long now);
+
+/* Drop the tempo, channels return to their own rates */
+void tempo_clear();
+
+uint16_t tempo_bpm();
+
+/* Ratio, period and rate of a channel locked to the beat */
+int8_t tempo_channel_ratio(uint8_t channel);
+uint16_t tempo_channel_period(uint8_t channel);
+uint16_t tempo_channel_bpm(uint8_t channel);
+
+/* Step a channel's ratio up or down through ... /2, x1, x2 ... */
+void tempo_step_ratio(uint8_t channel, boolean up);
+
+/* Returns true if a beat has been reached since the last call */
+boolean tempo_beat(unsigned long now);
+
+#endif
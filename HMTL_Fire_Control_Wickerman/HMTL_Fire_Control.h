@@ -85,6 +85,7 @@ extern uint32_t sensor_state;
 void initialize_switches();
 void sensor_switches();
 void calculate_pulse();
+uint16_t pulse_bpm(uint8_t channel, uint16_t bpm);
 
 extern MPR121 touch_sensor;
 void sensor_cap();
@@ -154,6 +155,9 @@ void handle_sensors();
 
   #define SENSOR_DISPLAY_MODE             SENSOR_LCD_NEXT
 
+  /* Sensor whose pressure drives a proportional output */
+  #define PRESSURE_SENSOR                11
+
 #elif OBJECT_TYPE == OBJECT_TYPE_FIRE_CONTROLLER
   #define SENSOR_FAR_LEFT              0
   #define SENSOR_MID_LEFT              1
@@ -202,6 +206,9 @@ void handle_sensors();
   #define SENSOR_BOTTOM               11
 
   #define SENSOR_DISPLAY_MODE         SENSOR_LCD_LEFT
+
+  /* Sensor whose pressure drives a proportional output */
+  #define PRESSURE_SENSOR             SENSOR_BOTTOM
 #endif
 
 /***** Connectivity ***********************************************************/
@@ -253,14 +260,93 @@ extern uint16_t poofer1_address;
 extern uint16_t poofer2_address;
 extern uint16_t lights_address;
 
+/*
+ * RS485 bus rate.  The rate can only be changed at runtime when the bus is on
+ * a hardware serial port.
+ */
+#ifdef RS485_HARDWARE_SERIAL
+  #define BUS_BAUD_ADJUSTABLE
+#endif
+
+#ifdef ESP32
+  #ifndef RS485_RX_PIN
+    #define RS485_RX_PIN 16
+  #endif
+  #ifndef RS485_TX_PIN
+    #define RS485_TX_PIN 17
+  #endif
+
+  /*
+   * With RS485_UART_DE_PIN set the UART runs in RS485 half duplex mode and
+   * drives the transceiver's DE/RE from its RTS line, so sends only fill the
+   * transmit FIFO and received frames are signalled by a UART event.
+   */
+  #ifdef RS485_UART_DE_PIN
+    #define BUS_UART_DE
+    #define BUS_UART_BUFFER_SIZE 512
+    #define BUS_UART_RX_TIMEOUT  2 // Idle symbols that end a received frame
+  #endif
+#endif
+
+#define BUS_CHECK_PERIOD_MS   (10 * 1000L) // Time between link checks
+#define BUS_CHECK_FAILURES    3         // Failed checks before renegotiating
+
+extern uint32_t bus_baud;
+
+/* Frames handed to the socket and the time it took, in microseconds */
+extern uint32_t bus_tx_frames;
+extern uint32_t bus_tx_micros;
+extern uint32_t bus_tx_max_micros;
+
+#ifdef ESP32
+void bus_uart_begin(uint32_t baud);
+#endif
+#ifdef BUS_UART_DE
+extern volatile boolean bus_rx_event;
+#endif
+
+void bus_set_baud(uint32_t baud);
+
+/*
+ * Rate negotiation and link checks poll the known nodes, the answers are
+ * passed to bus_probe_response() as they're received and the next poll is
+ * sent from bus_check() in the main loop.  It returns true for the answer to
+ * the outstanding poll.  Anything else sent while a rate is being tried goes
+ * out at the rate the nodes last answered at.
+ */
+void bus_negotiate_baud();
+boolean bus_negotiating();
+boolean bus_probe_response(uint16_t source);
+void bus_check();
+
+/*
+ * Shared bus access, frames are queued while another controller holds the
+ * token when several are configured.  See Fire_Control_Arbiter.h.
+ */
+extern boolean bus_arbitrating;
+
+void bus_arbiter_init();
+uint8_t bus_priority(uint16_t address);
+void bus_send(uint16_t address, const byte *data, uint8_t len,
+              uint8_t priority);
+boolean bus_busy();
+boolean bus_fire_pending();
+void bus_service();
+
 /* Communication prototypes */
 void sendHMTLValue(uint16_t address, uint8_t output, int value);
 void sendHMTLTimedChange(uint16_t address, uint8_t output,
 			 uint32_t change_period,
 			 uint32_t start_color,
 			 uint32_t stop_color);
+/*
+ * Burst that keeps the pilot or igniter lit, sent without waiting on other
+ * valves and whether or not the node answered discovery
+ */
+void sendHMTLKeepalive(uint16_t address, uint8_t output, uint32_t period);
 void sendHMTLCancel(uint16_t address, uint8_t output);
 void sendHMTLBlink(uint16_t address, uint8_t output,
                    uint16_t onperiod, uint32_t oncolor,
                    uint16_t offperiod, uint32_t offcolor);
+void tx_stagger_service();
 #endif
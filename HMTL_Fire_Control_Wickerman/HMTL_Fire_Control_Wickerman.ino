@@ -48,6 +48,11 @@
 
 
 #include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Socket.h"
+#include "Fire_Control_Bridge.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Sequence.h"
 #include "modes.h"
 
 /*
@@ -84,6 +89,9 @@ RS485Socket rs485;
 #define SEND_BUFFER_SIZE 64 // The data size for transmission buffers
 byte rs485_data_buffer[RS485_BUFFER_TOTAL(SEND_BUFFER_SIZE)];
 
+/* Wrapper that handles group addressed messages received over RS485 */
+FireSocket bus_socket(&rs485);
+
 #define MAX_SOCKETS 2
 Socket *sockets[MAX_SOCKETS] = { NULL, NULL };
 
@@ -126,6 +134,10 @@ void setup() {
   DEBUG4_VALUE("Config size:", configOffset - HMTL_CONFIG_ADDR);
   DEBUG4_VALUELN(" end:", configOffset);
 
+  /* Fire control settings follow the HMTL config */
+  fire_config_init(configOffset);
+  seq_config_end(configOffset + (int)sizeof (fire_config_t));
+
   if (!(outputs_found & (1 << HMTL_OUTPUT_RS485))) {
     DEBUG_ERR("No RS485 config found");
     DEBUG_ERR_STATE(1);
@@ -146,11 +158,21 @@ void setup() {
 
   /* Setup the RS485 connection */
 #ifdef ESP32
-  Serial2.begin(RS485Socket::DEFAULT_BAUD, SERIAL_8N1, 16, 17);
+  bus_uart_begin(fire_config.bus_baud);
 #endif
   rs485.setup();
   rs485.initBuffer(rs485_data_buffer, SEND_BUFFER_SIZE);
-  sockets[num_sockets++] = &rs485;
+  sockets[num_sockets++] = &bus_socket;
+
+  /* Share the bus with any other controllers */
+  bus_arbiter_init();
+
+  if (fire_config.flags & FIRE_FLAG_BAUD_NEGOTIATE) {
+    bus_negotiate_baud();
+  }
+
+  /* Find the nodes on the bus, this completes from the main loop */
+  disc_start(config.address, millis());
 
   if (num_sockets == 0) {
     DEBUG_ERR("No sockets configured");
@@ -180,9 +202,13 @@ void setup() {
   DEBUG2_VALUE("POOF1_ADDRESS=", poofer1_address);
   DEBUG2_VALUE(" POOF2_ADDRESS=", poofer2_address);
   DEBUG2_VALUELN(" LIGHTS_ADDRESS=", lights_address);
+  DEBUG2_VALUELN("BUS_BAUD=", bus_baud);
 
   // Send the ready signal to the serial port
   Serial.println(F(HMTL_READY));
+
+  /* Switch to bridge mode if configured, this grants the host its credits */
+  bridge_init();
 }
 
 void loop() {
@@ -199,5 +225,8 @@ void loop() {
    * Check for messages and handle output states
    */
   messages_and_modes();
+
+  /* Verify the bus is still working at the negotiated rate */
+  bus_check();
 }
 
@@ -29,19 +29,156 @@
 
 #include "HMTL_Fire_Control.h"
 #include "modes.h"
+#include "Fire_Control_Config.h"
 #include "Fire_Control_Sensors.h"
+#include "Fire_Control_Socket.h"
+#include "Fire_Control_Bridge.h"
+#include "Fire_Control_Limit.h"
+#include "Fire_Control_Provision.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Link.h"
+#include "Fire_Control_Sequence.h"
+#include "Fire_Control_Pool.h"
+#include "Fire_Control_Pattern.h"
+#include "Fire_Control_Frame.h"
+#include "Fire_Control_LCD.h"
+
+/*******************************************************************************
+ * Dirty outputs
+ *
+ * Outputs are only written out when something has changed them: a message
+ * to the output, a program reporting a change, or a local override.
+ */
+
+#if HMTL_MAX_OUTPUTS > 16
+  #error "Dirty outputs are kept in a 16 bit mask"
+#endif
+
+uint16_t outputs_dirty = 0;
+
+/*
+ * Outputs changed during this pass.  Unlike outputs_dirty this doesn't keep
+ * outputs whose frame was held, which haven't been redrawn since.
+ */
+uint16_t outputs_changed = 0;
+
+/* Outputs left alone in passes that updated another output */
+uint16_t outputs_skipped = 0;
+uint16_t outputs_skipped_per_sec = 0;
+
+void output_dirty(uint8_t output) {
+  if (output == HMTL_ALL_OUTPUTS) {
+    outputs_dirty = 0xFFFF;
+    outputs_changed = 0xFFFF;
+  } else if (output < HMTL_MAX_OUTPUTS) {
+    outputs_dirty |= (1 << output);
+    outputs_changed |= (1 << output);
+  }
+}
+
+void output_dirty_msg(const msg_hdr_t *msg_hdr) {
+  if ((msg_hdr->type == MSG_TYPE_OUTPUT) &&
+      (msg_hdr->length >= sizeof (msg_hdr_t) + sizeof (msg_output_hdr_t))) {
+    output_dirty(((const msg_output_hdr_t *)(msg_hdr + 1))->output);
+  }
+}
+
+/*
+ * Span of local pixels written since the last flush, first > last when empty.
+ * PixelUtil always sends the whole strip, the span is traced to show what the
+ * local writes changed.
+ */
+uint16_t pixels_dirty_first = 0xFFFF;
+uint16_t pixels_dirty_last = 0;
+
+void pixel_set(uint16_t led, byte r, byte g, byte b) {
+  pixels.setPixelRGB(led, r, g, b);
+  if (led < pixels_dirty_first) pixels_dirty_first = led;
+  if (led > pixels_dirty_last) pixels_dirty_last = led;
+  output_dirty(local_pixels_output);
+}
+
+/* Write out the dirty outputs */
+void output_flush() {
+  static unsigned long second_start = 0;
+  if (millis() - second_start >= 1000) {
+    second_start = millis();
+    outputs_skipped_per_sec = outputs_skipped;
+    outputs_skipped = 0;
+    frame_second();
+  }
+
+  /* The next pass starts with nothing changed */
+  outputs_changed = 0;
+
+  if (!outputs_dirty) {
+    return;
+  }
+
+  /* Outputs left dirty until their next frame is due */
+  uint16_t held = 0;
+
+  for (uint8_t i = 0; i < config.num_outputs; i++) {
+    if (outputs_dirty & (1 << i)) {
+      if (i == local_pixels_output) {
+        /* Written no faster than the frame rate, see Fire_Control_Frame.h */
+        if (!frame_output(outputs[i], objects[i], pixels.pixels(),
+                          pixels.numPixels() * 3, millis())) {
+          held |= (1 << i);
+        }
+      } else {
+        hmtl_update_output(outputs[i], objects[i]);
+      }
+    } else {
+      outputs_skipped++;
+    }
+  }
+  outputs_dirty = held;
+
+  if (!held && (pixels_dirty_first <= pixels_dirty_last)) {
+    DEBUG5_VALUE("Pixels ", pixels_dirty_first);
+    DEBUG5_VALUELN("-", pixels_dirty_last);
+    pixels_dirty_first = 0xFFFF;
+    pixels_dirty_last = 0;
+  }
+}
+
+/* Programs mark the output dirty when they report a change */
+boolean program_dirty(output_hdr_t *output, boolean changed) {
+  if (changed) {
+    output_dirty(output->output);
+  }
+  return changed;
+}
+
+boolean program_blink_dirty(output_hdr_t *output, void *object,
+                            program_tracker_t *tracker) {
+  return program_dirty(output, program_blink(output, object, tracker));
+}
+
+boolean program_sparkle_dirty(output_hdr_t *output, void *object,
+                              program_tracker_t *tracker) {
+  return program_dirty(output, program_sparkle(output, object, tracker));
+}
+
+boolean program_circular_dirty(output_hdr_t *output, void *object,
+                               program_tracker_t *tracker) {
+  return program_dirty(output, program_circular(output, object, tracker));
+}
 
 /* List of available programs */
 hmtl_program_t program_functions[] = {
         // Programs from HMTLPrograms
         { HMTL_PROGRAM_NONE, NULL, NULL},
-        { HMTL_PROGRAM_BLINK, program_blink, program_blink_init },
+        { HMTL_PROGRAM_BLINK, program_blink_dirty, program_blink_init },
         //{ HMTL_PROGRAM_TIMED_CHANGE, program_timed_change, program_timed_change_init },
         //{ HMTL_PROGRAM_FADE, program_fade, program_fade_init }
-        { HMTL_PROGRAM_SPARKLE, program_sparkle, program_sparkle_init },
-        { HMTL_PROGRAM_CIRCULAR, program_circular, program_circular_init}
+        { HMTL_PROGRAM_SPARKLE, program_sparkle_dirty, program_sparkle_init },
+        { HMTL_PROGRAM_CIRCULAR, program_circular_dirty, program_circular_init},
 
         // Custom programs
+        { FIRE_PROGRAM_SEQUENCE, program_sequence, program_sequence_init },
+        { FIRE_PROGRAM_PATTERN, program_pattern, program_pattern_init }
 };
 #define NUM_PROGRAMS (sizeof (program_functions) / sizeof (hmtl_program_t))
 
@@ -49,6 +186,16 @@ program_tracker_t *active_programs[HMTL_MAX_OUTPUTS];
 ProgramManager manager;
 MessageHandler handler;
 
+/* Entry for a program type, NULL if there's none */
+hmtl_program_t *program_lookup(uint8_t type) {
+  for (uint8_t i = 0; i < NUM_PROGRAMS; i++) {
+    if (program_functions[i].type == type) {
+      return &program_functions[i];
+    }
+  }
+  return NULL;
+}
+
 /* Return the first output of the indicated type */
 uint8_t find_output_type(uint8_t type) {
   for (uint8_t i = 0; i < config.num_outputs; i++) {
@@ -59,28 +206,129 @@ uint8_t find_output_type(uint8_t type) {
   return HMTL_NO_OUTPUT;
 }
 
-/* Construct a sparkle command and run it locally */
+/*******************************************************************************
+ * Local programs
+ *
+ * Programs on this controller's own outputs are started in the program pool
+ * rather than being formatted as a message and passed back through the
+ * MessageHandler, so they never touch the RS485 send buffer.  Each runs on a
+ * layer, see Fire_Control_Pool.h, so the light mode and a sequence can run
+ * together.
+ */
+
+/* Output the local light programs run on, found by init_modes() */
+uint8_t local_pixels_output = HMTL_NO_OUTPUT;
+
+/* Output the stored sequence runs on, it only sends messages to other nodes */
+uint8_t local_bus_output = HMTL_NO_OUTPUT;
+
+/* Parameters of the fixed local programs, formatted once by init_modes() */
+msg_program_t sparkle_program;
+
+/* Size of a program message, used when formatting parameters */
+#define LOCAL_PROGRAM_MSG_SIZE (sizeof (msg_hdr_t) + sizeof (msg_program_t))
+
+/* Start a program on a layer of a local output, replacing any on the layer */
+boolean local_program_start(uint8_t output, uint8_t layer,
+                            const msg_program_t *program) {
+  if (output == HMTL_NO_OUTPUT) {
+    return false;
+  }
+
+  msg_program_t params = *program;
+  params.hdr.type = HMTL_OUTPUT_PROGRAM;
+  params.hdr.output = output;
+  output_dirty(output);
+  return pool_start(output, layer, program_lookup(params.type), &params,
+                    outputs[output], objects[output], &manager);
+}
+
+/* Stop the program on a layer of a local output */
+void local_program_cancel(uint8_t output, uint8_t layer) {
+  if (output == HMTL_NO_OUTPUT) {
+    return;
+  }
+  pool_cancel(output, layer);
+  output_dirty(output);
+}
+
 void setSparkle() {
-  program_sparkle_fmt(rs485.send_buffer, rs485.send_data_size,
-                      config.address, find_output_type(HMTL_OUTPUT_PIXELS),
-                      100, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-  handler.process_msg((msg_hdr_t *)rs485.send_buffer, &rs485, NULL, &config);
+  local_program_start(local_pixels_output, POOL_LAYER_MODE, &sparkle_program);
 }
 
-/* Construct a blink command and run it locally */
 void setBlink(uint32_t color) {
-  hmtl_program_blink_fmt(rs485.send_buffer, rs485.send_data_size,
-                         config.address, find_output_type(HMTL_OUTPUT_PIXELS),
+  /* The parameters are formatted on the stack */
+  byte msg[LOCAL_PROGRAM_MSG_SIZE];
+  hmtl_program_blink_fmt(msg, sizeof (msg),
+                         config.address, local_pixels_output,
                          500, color,
                          250, 0);
-  handler.process_msg((msg_hdr_t *)rs485.send_buffer, &rs485, NULL, &config);
+  local_program_start(local_pixels_output, POOL_LAYER_MODE,
+                      (msg_program_t *)(msg + sizeof (msg_hdr_t)));
 }
 
-/* Cancel any running local command */
 void setCancel() {
-  hmtl_program_cancel_fmt(rs485.send_buffer, rs485.send_data_size,
-                          config.address, find_output_type(HMTL_OUTPUT_PIXELS));
-  handler.process_msg((msg_hdr_t *)rs485.send_buffer, &rs485, NULL, &config);
+  local_program_cancel(local_pixels_output, POOL_LAYER_MODE);
+}
+
+void setSequence() {
+  msg_program_t program;
+  memset(&program, 0, sizeof (program));
+  program.type = FIRE_PROGRAM_SEQUENCE;
+  local_program_start(local_bus_output, POOL_LAYER_SEQUENCE, &program);
+}
+
+void cancelSequence() {
+  seq_stop();
+  local_program_cancel(local_bus_output, POOL_LAYER_SEQUENCE);
+}
+
+/* Find the local outputs and format the fixed program parameters */
+void local_programs_init() {
+  local_pixels_output = find_output_type(HMTL_OUTPUT_PIXELS);
+  local_bus_output = find_output_type(HMTL_OUTPUT_RS485);
+
+  byte msg[LOCAL_PROGRAM_MSG_SIZE];
+  program_sparkle_fmt(msg, sizeof (msg),
+                      config.address, local_pixels_output,
+                      100, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  memcpy(&sparkle_program, msg + sizeof (msg_hdr_t), sizeof (msg_program_t));
+
+  DEBUG3_VALUELN("Local pixels output:", local_pixels_output);
+}
+
+/*
+ * Handle a message received on the bus.  In bridge mode this is used in place
+ * of handler.check(), which would also read the serial port and take the
+ * host's frames before bridge_receive() sees them.
+ */
+static bool bus_check_msg() {
+  unsigned int msglen;
+  const byte *data = bus_socket.getMsg(config.address, &msglen);
+  if (data == NULL) {
+    return false;
+  }
+  return handler.process_msg((msg_hdr_t *)data, &bus_socket, NULL, &config);
+}
+
+void handle_local_msg(msg_hdr_t *msg_hdr) {
+  if (msg_hdr->type == MSG_TYPE_FIRE_CONFIG) {
+    /* Configuration being streamed to a node by the host */
+    cfg_host_msg(msg_hdr);
+    return;
+  }
+  if (msg_hdr->type == MSG_TYPE_FIRE_SEQUENCE) {
+    /* Steps of the stored sequence */
+    seq_host_msg(msg_hdr);
+    return;
+  }
+  if (msg_hdr->type == MSG_TYPE_FIRE_PATTERN) {
+    /* Code of the pattern program */
+    pattern_host_msg(msg_hdr);
+    return;
+  }
+  output_dirty_msg(msg_hdr);
+  handler.process_msg(msg_hdr, &rs485, NULL, &config);
 }
 
 /*
@@ -98,24 +346,132 @@ void init_modes(Socket **sockets, uint8_t num_sockets) {
   /* Setup a message handler with the program manager */
   handler = MessageHandler(config.address, &manager, sockets, num_sockets);
 
+  pool_init();
+  local_programs_init();
+
+  if (local_pixels_output != HMTL_NO_OUTPUT) {
+    frame_init(fire_config.frame_rate, pixels.numPixels() * 3);
+  } else {
+    frame_init(fire_config.frame_rate, 0);
+  }
+
   /* Execute any initial commands */
   startup_commands();
 }
 
+/* Time spent checking for and handling incoming messages */
+#define RX_REPORT_PERIOD_MS (30 * 1000L)
+uint32_t rx_check_micros = 0;
+uint32_t rx_check_calls = 0;
+uint32_t pool_run_micros = 0;
+
+void rx_report() {
+  static unsigned long last_report = 0;
+  if (millis() - last_report < RX_REPORT_PERIOD_MS) {
+    return;
+  }
+  last_report = millis();
+
+  DEBUG3_VALUE("RX recv:", bus_socket.stats.received);
+  DEBUG3_VALUE(" accepted:", bus_socket.stats.accepted);
+  DEBUG3_VALUE(" filtered:", bus_socket.stats.filtered);
+  DEBUG3_VALUE(" malformed:", bus_socket.stats.malformed);
+  DEBUG3_VALUELN(" avg check us:",
+                 rx_check_calls ? rx_check_micros / rx_check_calls : 0);
+  DEBUG3_VALUE("TX frames:", bus_tx_frames);
+  DEBUG3_VALUE(" avg us:", bus_tx_frames ? bus_tx_micros / bus_tx_frames : 0);
+  DEBUG3_VALUELN(" max us:", bus_tx_max_micros);
+  DEBUG3_VALUE("Rate drops ign:", rate_drops[RATE_CLASS_IGNITER]);
+  DEBUG3_VALUE(" pilot:", rate_drops[RATE_CLASS_PILOT]);
+  DEBUG3_VALUE(" accum:", rate_drops[RATE_CLASS_ACCUMULATOR]);
+  DEBUG3_VALUE(" lights:", rate_drops[RATE_CLASS_LIGHTS]);
+  DEBUG3_VALUE(" last a:", rate_drop_address);
+  DEBUG3_VALUELN(" o:", rate_drop_output);
+  DEBUG3_VALUE("Nodes:", disc.num_nodes);
+  DEBUG3_VALUE(" passes:", disc.passes);
+  DEBUG3_VALUELN(" not sent:", disc.dropped);
+  for (uint8_t i = 0; i < LINK_MAX_NODES; i++) {
+    const link_node_t *node = &link_stats.nodes[i];
+    if (node->address == 0) continue;
+    DEBUG3_VALUE("Link a:", node->address);
+    DEBUG3_VALUE(" rtt:", link_rtt(node));
+    DEBUG3_VALUE(" jitter:", node->jitter);
+    DEBUG3_VALUE(" lost:", link_lost(node));
+    DEBUG3_VALUELN(" of:", node->count);
+  }
+  DEBUG3_VALUELN("Link probes deferred:", link_stats.deferred);
+  DEBUG3_VALUELN("Output updates skipped/s:", outputs_skipped_per_sec);
+  DEBUG3_VALUE("Pixel frames/s:", frame.sent_per_sec);
+  DEBUG3_VALUE(" same:", frame.same_per_sec);
+  DEBUG3_VALUE(" held:", frame.held_per_sec);
+  DEBUG3_VALUELN(" cpu us/s:", frame.micros_per_sec);
+  DEBUG3_VALUE("Programs:", pool.used);
+  DEBUG3_VALUE(" peak:", pool.peak);
+  DEBUG3_VALUE(" of:", POOL_SLOTS);
+  DEBUG3_VALUE(" starts:", pool.starts);
+  DEBUG3_VALUELN(" refused:", pool.exhausted);
+  DEBUG3_VALUE("Pattern ops:", pattern.executed);
+  DEBUG3_VALUE(" yields:", pattern.yields);
+  DEBUG3_VALUELN(" faults:", pattern.faults);
+  DEBUG3_VALUE("Program calls:", pool.calls);
+  DEBUG3_VALUELN(" avg run us:",
+                 rx_check_calls ? pool_run_micros / rx_check_calls : 0);
+  DEBUG3_VALUE("LCD cells:", lcd_frame.cells);
+  DEBUG3_VALUE(" moves:", lcd_frame.moves);
+  DEBUG3_VALUELN(" us/cell:", lcd_frame.cell_micros());
+  for (uint8_t i = 0; i < NUM_DISPLAY_MODES; i++) {
+    if (lcd_saved_micros[i] == 0) continue;
+    DEBUG3_VALUE("LCD page:", i);
+    DEBUG3_VALUELN(" saved us/pass:", lcd_saved_micros[i]);
+  }
+
+  rx_check_micros = 0;
+  rx_check_calls = 0;
+  pool_run_micros = 0;
+  pool.calls = 0;
+}
+
 /*
  * Check for and handle incoming messages
  */
 bool messages_and_modes(void) {
+  /* In bridge mode the serial port only carries frames from the host */
+  boolean bridged = bridge_enabled();
+
   // Check and send a serial-ready message if needed
-  handler.serial_ready();
+  if (!bridged) {
+    handler.serial_ready();
+  }
+
+  /* In bridge mode frames from the host are read here rather than by the handler */
+  bridge_receive();
 
   /*
    * Check the serial device and all sockets for messages, forwarding them and
    * processing them if they are for this module.
    */
-  bool update = handler.check(&config);
+  unsigned long check_start = micros();
+  uint32_t bus_accepted = bus_socket.stats.accepted;
+  bool update;
+  if (bridged) {
+    update = bus_check_msg();
+  } else {
+    update = handler.check(&config);
+  }
+  rx_check_micros += micros() - check_start;
+  if (update && (bus_socket.stats.accepted == bus_accepted)) {
+    /* Handled from the serial port, which outputs it changed isn't known */
+    output_dirty(HMTL_ALL_OUTPUTS);
+  }
+  rx_check_calls++;
+  DEBUG_COMMAND(DEBUG_MID, rx_report(););
 
-  /* Execute any active programs */
+  /* Execute local program layers, then programs from the bus */
+  unsigned long programs_start = micros();
+  if (pool_run(outputs, objects, millis())) {
+    update = true;
+  }
+  pool_run_micros += micros() - programs_start;
   if (manager.run()) {
     update = true;
   }
@@ -125,15 +481,28 @@ bool messages_and_modes(void) {
     update = true;
   }
 
-  if (update) {
-    /*
-     * An output may have been updated by message or active program,
-     * update all output states.
-     */
-    for (uint8_t i = 0; i < config.num_outputs; i++) {
-      hmtl_update_output(outputs[i], objects[i]);
-    }
-  }
+  /* Update the outputs changed by messages, programs or followups */
+  output_flush();
+
+  /* Send bursts that were waiting for their supply, see Fire_Control_Stagger.h */
+  tx_stagger_service();
+
+  rate_refresh(millis());
+
+  /* Host frames are forwarded only after local messages have gone out */
+  bridge_forward();
+
+  /* Resend or request configuration chunks being streamed to a node */
+  cfg_service(millis());
+
+  /* Continue any discovery pass */
+  disc_service(millis());
+
+  /* Measure the links to the nodes found */
+  link_service(millis(), micros());
+
+  /* Send anything queued while waiting for the bus */
+  bus_service();
 
   return update;
 }
@@ -143,24 +512,29 @@ bool messages_and_modes(void) {
  * for things like overriding LED values and things of that nature.
  */
 bool followup_actions() {
-  bool changed = false;
-
-  for (uint8_t i = 0; i < 12; i++) {
-    if (touch_sensor.touched(i)) {
-      pixels.setPixelRGB(sensor_to_led(i), 255,0,0);
-      if (touch_sensor.changed(i)) {
-        /* Always set the value in case another method had changed it,
-         * but we only need to force an update if this was a change
-         */
-        changed = true;
-      }
+  if (local_pixels_output == HMTL_NO_OUTPUT) {
+    return false;
+  }
 
-    } else if (touch_sensor.changed(i)) {
-      pixels.setPixelRGB(sensor_to_led(i), 0,0,0);
-      changed = true;
-    }
+  /*
+   * Only sensors that changed are redrawn, unless something has redrawn the
+   * pixels this pass and the touched sensors need to be lit again.  A frame
+   * held from an earlier pass already has them lit.
+   */
+  uint16_t sensors = touch_edges;
+  if (outputs_changed & (1 << local_pixels_output)) {
+    sensors |= touch_states;
+  }
 
+  for (uint8_t i = 0; sensors; i++, sensors >>= 1) {
+    if (sensors & 0x1) {
+      if (touch_states & (1 << i)) {
+        pixel_set(sensor_led_map[i], 255,0,0);
+      } else {
+        pixel_set(sensor_led_map[i], 0,0,0);
+      }
+    }
   }
 
-  return changed;
-}
\ No newline at end of file
+  return (touch_edges != 0);
+}
@@ -17,10 +17,45 @@ void init_modes(Socket **sockets, byte num_sockets);
 /* Check for messages and handle program modes */
 boolean messages_and_modes(void);
 
+/*
+ * Run a program directly on a layer of a local output, program holds the
+ * parameters in the same form as a program message.  Layers are listed in
+ * Fire_Control_Pool.h.
+ */
+boolean local_program_start(uint8_t output, uint8_t layer,
+                            const msg_program_t *program);
+void local_program_cancel(uint8_t output, uint8_t layer);
+
+/* Output local light programs run on, HMTL_NO_OUTPUT if there is none */
+extern uint8_t local_pixels_output;
+
 void setSparkle();
 void setBlink(uint32_t color);
 void setCancel();
 
+/* Run the sequence stored in EEPROM, see Fire_Control_Sequence.h */
+void setSequence();
+void cancelSequence();
+
+/*
+ * Mark an output, or HMTL_ALL_OUTPUTS, to be written out on this pass through
+ * messages_and_modes().  output_dirty_msg() marks the output a message is for.
+ */
+void output_dirty(uint8_t output);
+void output_dirty_msg(const msg_hdr_t *msg_hdr);
+
+/*
+ * Set a pixel on the local pixels output, recording it in the span of pixels
+ * changed since the last flush.
+ */
+void pixel_set(uint16_t led, byte r, byte g, byte b);
+
+/* Outputs not written in the last second while others were */
+extern uint16_t outputs_skipped_per_sec;
+
+/* Handle a message addressed to this controller */
+void handle_local_msg(msg_hdr_t *msg_hdr);
+
 
 boolean followup_actions();
 
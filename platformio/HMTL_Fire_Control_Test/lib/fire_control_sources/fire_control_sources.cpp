@@ -6,8 +6,45 @@
  *
  * Fire_Control_Connect.cpp is NOT included here — sendHMTL* functions are
  * stubbed in test_support.cpp so tests can capture and assert on them.
+ * Fire_Control_Socket.cpp sends through bus_send() and marks outputs through
+ * the output_dirty_msg() stub, tests feed frames to FireSocket through an
+ * RS485Socket of their own.
  * modes.cpp is NOT included — those functions are stubbed in test_support.cpp.
+ * Fire_Control_Config.cpp is included so tests can set groups and settings.
+ * Fire_Control_Arbiter.cpp and Fire_Control_Limit.cpp have no hardware
+ * dependencies and are tested directly.  Fire_Control_Provision.cpp,
+ * Fire_Control_Discovery.cpp and Fire_Control_Link.cpp send through
+ * bus_send(), which test_support.cpp captures.  Fire_Control_Sequence.cpp
+ * reads its steps from the EEPROM stub.  Fire_Control_Tempo.cpp is pure
+ * timing, and Fire_Control_Quantize.cpp sends held bursts through the
+ * sendHMTL* stubs.  Fire_Control_Stagger.cpp only schedules, the send path
+ * that uses it is in Fire_Control_Connect.cpp.  Fire_Control_Looper.cpp only
+ * records and replays masks of presses.  Fire_Control_Pressure.cpp reads the
+ * MPR121 through the no-op Wire stub, so only its mapping and pacing are
+ * exercised.  Fire_Control_Pool.cpp runs whatever program functions it's
+ * given.  Fire_Control_Pattern.cpp draws through the pixel_set() stub and
+ * sends through the sendHMTL* stubs.  Fire_Control_Frame.cpp writes frames
+ * through the hmtl_update_output() stub, the SPI DMA path is ESP32 only.
+ * Fire_Control_LCD.cpp flushes into the emulated screen of the LiquidCrystal
+ * stub.
  */
 
 #include "../../stubs/test_support.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Config.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Arbiter.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Limit.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Provision.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Discovery.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Link.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Sequence.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Tempo.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Quantize.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Stagger.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Looper.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Pressure.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Pool.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Pattern.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Frame.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_LCD.cpp"
 #include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Sensors.cpp"
+#include "../../../../HMTL_Fire_Control_Wickerman/Fire_Control_Socket.cpp"
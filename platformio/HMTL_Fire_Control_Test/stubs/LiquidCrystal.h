@@ -1,14 +1,31 @@
-// No-op LiquidCrystal stub for native tests.
+// LiquidCrystal stub for native tests.
+//
+// Characters written land in an emulated 16x2 screen, and cursor moves and
+// writes are counted, so tests can see what reached the glass.
 #pragma once
 #include "Arduino.h"
+#include <string.h>
 
 class LiquidCrystal {
 public:
-    LiquidCrystal(uint8_t addr) {}
+    LiquidCrystal(uint8_t addr) { reset(); }
     void begin(uint8_t cols, uint8_t rows) {}
-    void clear() {}
-    void setCursor(uint8_t col, uint8_t row) {}
+    void clear() { memset(screen, ' ', sizeof (screen)); col = 0; row = 0; }
+    void setCursor(uint8_t c, uint8_t r) { col = c; row = r; cursor_calls++; }
     void setBacklight(uint8_t val) {}
     template<typename T> void print(T) {}
     template<typename T> void print(T, int) {}
+    size_t write(uint8_t c) {
+        if ((row < 2) && (col < 16)) screen[row][col] = c;
+        col++;
+        write_calls++;
+        return 1;
+    }
+
+    void reset() { clear(); cursor_calls = 0; write_calls = 0; }
+
+    char    screen[2][16];
+    uint8_t col, row;
+    int     cursor_calls;
+    int     write_calls;
 };
@@ -5,6 +5,7 @@
 // can assert on what was called.
 #pragma once
 #include "Arduino.h"
+#include "HMTLMessaging.h"
 
 struct Socket;  // forward-declare; RS485Utils.h defines the real class
 
@@ -13,8 +14,14 @@ boolean messages_and_modes(void);
 void    setSparkle();
 void    setBlink(uint32_t color);
 void    setCancel();
+void    setSequence();
+void    cancelSequence();
 boolean followup_actions();
 
+extern uint8_t local_pixels_output;
+void    output_dirty_msg(const msg_hdr_t *msg_hdr);
+void    pixel_set(uint16_t led, byte r, byte g, byte b);
+
 // pixel_color helper used by handle_poof_enable
 inline uint32_t pixel_color(uint8_t r, uint8_t g, uint8_t b) {
     return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
@@ -15,7 +15,11 @@
 #include "MPR121.h"
 #include "LiquidCrystal.h"
 #include "HMTLTypes.h"
+#include "HMTLMessaging.h"
 #include "Debug.h"
+#include "Fire_Control_Sequence.h"
+#include "Fire_Control_Arbiter.h"
+#include "Fire_Control_Config.h"
 
 #include <vector>
 #include <string>
@@ -194,6 +198,11 @@ void sendHMTLTimedChange(uint16_t address, uint8_t output,
     s_send_call_count++;
 }
 
+void sendHMTLKeepalive(uint16_t address, uint8_t output, uint32_t period) {
+    s_send_timed = { true, address, output, period, 0xFFFFFFFF, 0 };
+    s_send_call_count++;
+}
+
 void sendHMTLCancel(uint16_t address, uint8_t output) {
     s_send_cancel_called = true;
     s_send_call_count++;
@@ -226,6 +235,68 @@ extern "C" {
     int      send_call_count()         { return s_send_call_count; }
 }
 
+// ---------------------------------------------------------------------------
+// bus_send stub — keep every frame so tests can play the other end of the bus
+// ---------------------------------------------------------------------------
+
+static std::vector<std::vector<byte> > s_bus_frames;
+static std::vector<uint16_t>           s_bus_addresses;
+static std::vector<uint8_t>            s_bus_priorities;
+
+void bus_send(uint16_t address, const byte *data, uint8_t len,
+              uint8_t priority) {
+    s_bus_frames.push_back(std::vector<byte>(data, data + len));
+    s_bus_addresses.push_back(address);
+    s_bus_priorities.push_back(priority);
+}
+
+// Same classes as Fire_Control_Connect.cpp, poofers first
+extern uint16_t poofer1_address;
+extern uint16_t poofer2_address;
+
+uint8_t bus_priority(uint16_t address) {
+    if ((address == poofer1_address) || (address == poofer2_address) ||
+        IS_FIRE_GROUP(address)) {
+        return ARB_PRIORITY_FIRE;
+    }
+    return ARB_PRIORITY_COSMETIC;
+}
+
+bus_arbiter_t bus_arbiter;
+boolean       bus_arbitrating = false;
+
+static int s_probe_responses = 0;
+
+boolean bus_probe_response(uint16_t source) {
+    s_probe_responses++;
+    return false;
+}
+
+static bool s_bus_fire_pending = false;
+
+uint32_t bus_baud = RS485Socket::DEFAULT_BAUD;
+
+boolean bus_busy() { return false; }
+boolean bus_fire_pending() { return s_bus_fire_pending; }
+
+extern "C" {
+    void        reset_bus_frames()   {
+        s_bus_frames.clear();
+        s_bus_addresses.clear();
+        s_bus_priorities.clear();
+        s_probe_responses = 0;
+    }
+    int         bus_frame_count()    { return (int)s_bus_frames.size(); }
+    const byte *bus_frame(int n)     { return s_bus_frames[n].data(); }
+    int         bus_frame_length(int n) { return (int)s_bus_frames[n].size(); }
+    uint16_t    bus_frame_address(int n)  { return s_bus_addresses[n]; }
+    uint8_t     bus_frame_priority(int n) { return s_bus_priorities[n]; }
+    int         probe_response_count() { return s_probe_responses; }
+    void        set_bus_fire_pending(bool pending) {
+        s_bus_fire_pending = pending;
+    }
+}
+
 // ---------------------------------------------------------------------------
 // modes.h stub implementations
 // ---------------------------------------------------------------------------
@@ -233,6 +304,7 @@ extern "C" {
 static bool s_sparkle_called = false;
 static bool s_blink_called   = false;
 static bool s_cancel_called  = false;
+static int  s_sequence_starts = 0;
 
 void init_modes(Socket **sockets, byte num_sockets) {}
 boolean messages_and_modes(void) { return false; }
@@ -240,17 +312,62 @@ boolean messages_and_modes(void) { return false; }
 void setSparkle() { s_sparkle_called = true; }
 void setBlink(uint32_t color) { s_blink_called = true; }
 void setCancel() { s_cancel_called = true; }
+void setSequence() { s_sequence_starts++; }
+void cancelSequence() { seq_stop(); }
 boolean followup_actions() { return false; }
 
+uint8_t local_pixels_output = 0;
+static int      s_pixel_set_count = 0;
+static uint16_t s_last_pixel      = 0;
+static uint32_t s_last_pixel_rgb  = 0;
+
+void pixel_set(uint16_t led, byte r, byte g, byte b) {
+    s_pixel_set_count++;
+    s_last_pixel     = led;
+    s_last_pixel_rgb = pixel_color(r, g, b);
+}
+
+// Marks outputs the same way as modes.cpp
+static uint16_t s_outputs_dirty = 0;
+static int      s_dirty_msgs    = 0;
+
+void output_dirty_msg(const msg_hdr_t *msg_hdr) {
+    s_dirty_msgs++;
+    if ((msg_hdr->type == MSG_TYPE_OUTPUT) &&
+        (msg_hdr->length >= sizeof (msg_hdr_t) + sizeof (msg_output_hdr_t))) {
+        uint8_t output = ((const msg_output_hdr_t *)(msg_hdr + 1))->output;
+        if (output == HMTL_ALL_OUTPUTS) {
+            s_outputs_dirty = 0xFFFF;
+        } else if (output < HMTL_MAX_OUTPUTS) {
+            s_outputs_dirty |= (1 << output);
+        }
+    }
+}
+
 extern "C" {
     void reset_mode_captures() {
         s_sparkle_called = false;
         s_blink_called   = false;
         s_cancel_called  = false;
+        s_sequence_starts = 0;
     }
     bool sparkle_was_called() { return s_sparkle_called; }
     bool blink_was_called()   { return s_blink_called; }
     bool cancel_was_called()  { return s_cancel_called; }
+    int  sequence_start_count() { return s_sequence_starts; }
+
+    void reset_pixel_captures() {
+        s_pixel_set_count = 0;
+        s_last_pixel      = 0;
+        s_last_pixel_rgb  = 0;
+    }
+    int      pixel_set_count() { return s_pixel_set_count; }
+
+    void     reset_dirty_captures() { s_outputs_dirty = 0; s_dirty_msgs = 0; }
+    uint16_t outputs_dirty_mask()   { return s_outputs_dirty; }
+    int      dirty_msg_count()      { return s_dirty_msgs; }
+    uint16_t last_pixel()      { return s_last_pixel; }
+    uint32_t last_pixel_rgb()  { return s_last_pixel_rgb; }
 }
 
 // ---------------------------------------------------------------------------
@@ -261,6 +378,34 @@ void    blink_value(int, int, int, int) {}
 boolean pin_is_PWM(int)                 { return false; }
 void    print_hex_string(const byte *, int) {}
 
+// ---------------------------------------------------------------------------
+// HMTLMessaging stubs
+// ---------------------------------------------------------------------------
+
+uint16_t hmtl_msg_fmt(msg_hdr_t *msg_hdr, uint16_t address, uint8_t length,
+                      uint8_t type, uint8_t flags) {
+    msg_hdr->startcode = HMTL_MSG_START;
+    msg_hdr->crc       = 0;
+    msg_hdr->version   = HMTL_MSG_VERSION;
+    msg_hdr->length    = length;
+    msg_hdr->type      = type;
+    msg_hdr->flags     = flags;
+    msg_hdr->address   = address;
+    return length;
+}
+
+static int s_update_output_count = 0;
+
+int hmtl_update_output(output_hdr_t *, void *) {
+    s_update_output_count++;
+    return 0;
+}
+
+extern "C" {
+    void reset_update_captures()    { s_update_output_count = 0; }
+    int  update_output_call_count() { return s_update_output_count; }
+}
+
 // ---------------------------------------------------------------------------
 // EEPromUtils stubs
 // ---------------------------------------------------------------------------
@@ -0,0 +1,368 @@
+/*
+ * Native tests for RS485 bus arbitration.
+ *
+ * Several arbiters share a simulated bus that advances one millisecond per
+ * tick.  A frame sent during a tick is heard by every other node at the start
+ * of the next tick, and two nodes sending during the same tick is a collision.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_arbiter
+ */
+
+#include <unity.h>
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "Fire_Control_Arbiter.h"
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+}
+
+// ============================================================================
+// Bus simulation
+// ============================================================================
+
+#define SIM_NODES 3
+
+typedef struct {
+    uint16_t source;
+    uint16_t dest;
+    uint8_t  type;
+    uint8_t  marker; // First data byte, identifies the frame in tests
+} sim_frame_t;
+
+static bus_arbiter_t nodes[SIM_NODES];
+static bool          node_alive[SIM_NODES];
+static uint8_t       num_nodes;
+static const uint16_t masters[SIM_NODES] = { 0x10, 0x20, 0x30 };
+
+static unsigned long sim_now;
+static uint32_t      sim_collisions;
+static uint32_t      sim_frames[SIM_NODES];
+
+// Frames sent during the previous tick, heard during this one
+static sim_frame_t   in_flight[SIM_NODES * 8];
+static uint8_t       in_flight_count;
+
+// Time each marked frame was sent, by marker
+static long          sent_at[256];
+
+// Off and cancel frames in the order they were sent
+typedef struct {
+    uint16_t address;
+    uint8_t  output;
+    uint8_t  type;
+    bool     zeroed; // Everything after the output header is zero
+    long     at;
+} sim_stop_t;
+
+static sim_stop_t    stops[32];
+static uint8_t       stop_count;
+
+static void sim_init(uint8_t count) {
+    num_nodes = count;
+    sim_now = 0;
+    sim_collisions = 0;
+    in_flight_count = 0;
+    stop_count = 0;
+    memset(sim_frames, 0, sizeof (sim_frames));
+    for (int i = 0; i < 256; i++) sent_at[i] = -1;
+    for (uint8_t i = 0; i < count; i++) {
+        node_alive[i] = true;
+        TEST_ASSERT_TRUE(arb_init(&nodes[i], masters[i], masters, count, 0));
+    }
+}
+
+static void sim_tick() {
+    /* Deliver last tick's frames */
+    for (uint8_t f = 0; f < in_flight_count; f++) {
+        for (uint8_t n = 0; n < num_nodes; n++) {
+            if (node_alive[n] && (masters[n] != in_flight[f].source)) {
+                arb_observe(&nodes[n], in_flight[f].source, in_flight[f].dest,
+                            in_flight[f].type, sim_now);
+            }
+        }
+    }
+    in_flight_count = 0;
+
+    uint8_t senders = 0;
+    for (uint8_t n = 0; n < num_nodes; n++) {
+        if (!node_alive[n]) continue;
+
+        bool sent = false;
+        const byte *data;
+        uint16_t dest;
+        uint8_t len;
+        while ((data = arb_next(&nodes[n], sim_now, &dest, &len)) != NULL) {
+            sim_frame_t *frame = &in_flight[in_flight_count++];
+            frame->source = masters[n];
+            frame->dest = dest;
+            frame->type = ((msg_hdr_t *)data)->type;
+            frame->marker = (len > sizeof (msg_hdr_t)) ?
+                            data[sizeof (msg_hdr_t)] : 0;
+            if (frame->marker) sent_at[frame->marker] = sim_now;
+            if ((frame->type == MSG_TYPE_OUTPUT) && (len > ARB_SAFETY_HEAD)) {
+                const msg_output_hdr_t *out_hdr =
+                    (const msg_output_hdr_t *)(data + sizeof (msg_hdr_t));
+                sim_stop_t *stop = &stops[stop_count++];
+                stop->address = ((const msg_hdr_t *)data)->address;
+                stop->output = out_hdr->output;
+                stop->type = out_hdr->type;
+                stop->zeroed = true;
+                for (uint8_t i = ARB_SAFETY_HEAD; i < len; i++) {
+                    if (data[i]) stop->zeroed = false;
+                }
+                stop->at = sim_now;
+            }
+            sim_frames[n]++;
+            sent = true;
+        }
+        if (sent) senders++;
+    }
+    if (senders > 1) sim_collisions++;
+
+    sim_now++;
+}
+
+static void sim_run(unsigned long ms) {
+    for (unsigned long i = 0; i < ms; i++) sim_tick();
+}
+
+/* Queue a frame whose first data byte is the marker */
+static bool sim_queue(uint8_t node, uint8_t marker, uint8_t priority) {
+    byte data[sizeof (msg_hdr_t) + 1];
+    memset(data, 0, sizeof (data));
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)data;
+    msg_hdr->type = MSG_TYPE_OUTPUT;
+    msg_hdr->length = sizeof (data);
+    data[sizeof (msg_hdr_t)] = marker;
+    return arb_queue(&nodes[node], 0x40, data, sizeof (data), priority,
+                     sim_now);
+}
+
+/* Queue a frame turning an output off, or cancelling its program */
+static bool sim_queue_stop(uint8_t node, uint16_t address, uint8_t output,
+                           bool cancel) {
+    byte data[sizeof (msg_hdr_t) + sizeof (msg_program_t)];
+    memset(data, 0, sizeof (data));
+    msg_output_hdr_t *out_hdr = (msg_output_hdr_t *)(data + sizeof (msg_hdr_t));
+    out_hdr->type = cancel ? HMTL_OUTPUT_PROGRAM : HMTL_OUTPUT_VALUE;
+    out_hdr->output = output;
+    uint8_t len = sizeof (msg_hdr_t) +
+                  (cancel ? sizeof (msg_program_t) : sizeof (msg_value_t));
+    hmtl_msg_fmt((msg_hdr_t *)data, address, len, MSG_TYPE_OUTPUT);
+    return arb_queue(&nodes[node], address, data, len, ARB_PRIORITY_FIRE,
+                     sim_now);
+}
+
+/* Cancel and turn off the poofer group and five valves, as on disable */
+#define SIM_STOP_OUTPUTS 6
+static const uint16_t stop_addresses[SIM_STOP_OUTPUTS] = {
+    0x80, 66, 69, 69, 69, 69
+};
+static const uint8_t stop_outputs[SIM_STOP_OUTPUTS] = {
+    HMTL_ALL_OUTPUTS, 0, 1, 2, 3, 4
+};
+
+static void sim_queue_disable(uint8_t node) {
+    for (uint8_t i = 0; i < SIM_STOP_OUTPUTS; i++) {
+        TEST_ASSERT_TRUE(sim_queue_stop(node, stop_addresses[i],
+                                        stop_outputs[i], true));
+        TEST_ASSERT_TRUE(sim_queue_stop(node, stop_addresses[i],
+                                        stop_outputs[i], false));
+    }
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_arb_single_master_is_disabled() {
+    bus_arbiter_t arb;
+    TEST_ASSERT_FALSE(arb_init(&arb, 0x50, masters, 2, 0));
+    TEST_ASSERT_EQUAL(0, arb.num_masters);
+}
+
+void test_arb_fire_sent_before_cosmetic() {
+    sim_init(2);
+    sim_queue(0, 1, ARB_PRIORITY_COSMETIC);
+    sim_queue(0, 2, ARB_PRIORITY_FIRE);
+
+    uint16_t dest;
+    uint8_t len;
+    const byte *data = arb_next(&nodes[0], 0, &dest, &len);
+    TEST_ASSERT_NOT_NULL(data);
+    TEST_ASSERT_EQUAL(2, data[sizeof (msg_hdr_t)]);
+    data = arb_next(&nodes[0], 0, &dest, &len);
+    TEST_ASSERT_NOT_NULL(data);
+    TEST_ASSERT_EQUAL(1, data[sizeof (msg_hdr_t)]);
+}
+
+void test_arb_no_collisions_under_load() {
+    sim_init(3);
+    for (int i = 0; i < 2000; i++) {
+        /* Every node always has cosmetic traffic waiting */
+        for (uint8_t n = 0; n < 3; n++) {
+            if (arb_pending(&nodes[n]) < ARB_QUEUE_FRAMES) {
+                sim_queue(n, 0, ARB_PRIORITY_COSMETIC);
+            }
+        }
+        sim_tick();
+    }
+
+    TEST_ASSERT_EQUAL(0, sim_collisions);
+    for (uint8_t n = 0; n < 3; n++) {
+        TEST_ASSERT_TRUE(sim_frames[n] > 100);
+        TEST_ASSERT_EQUAL(0, nodes[n].stats.collisions);
+        TEST_ASSERT_EQUAL(0, nodes[n].stats.regenerated);
+    }
+}
+
+void test_arb_fire_latency_bounded() {
+    sim_init(2);
+    sim_run(100);
+
+    /* Node 0 is busy with lighting when node 1 needs to fire */
+    for (int i = 0; i < 50; i++) {
+        if (arb_pending(&nodes[0]) < ARB_QUEUE_FRAMES) {
+            sim_queue(0, 0, ARB_PRIORITY_COSMETIC);
+        }
+        if (i == 10) {
+            sim_queue(1, 7, ARB_PRIORITY_FIRE);
+        }
+        sim_tick();
+    }
+    TEST_ASSERT_TRUE(sent_at[7] >= 0);
+    TEST_ASSERT_TRUE(sent_at[7] - 110 <= ARB_HOLD_MS + 2);
+    TEST_ASSERT_TRUE(nodes[1].stats.wait_max <= ARB_HOLD_MS + 2);
+}
+
+void test_arb_absent_master_skipped() {
+    sim_init(2);
+    node_alive[1] = false;
+
+    sim_run(ARB_PASS_TIMEOUT_MS * (ARB_PASS_RETRIES + 2));
+    TEST_ASSERT_EQUAL(ARB_PASS_RETRIES, nodes[0].stats.retries);
+
+    /* Node 0 keeps sending on its own */
+    sim_queue(0, 9, ARB_PRIORITY_FIRE);
+    sim_tick();
+    TEST_ASSERT_TRUE(sent_at[9] >= 0);
+}
+
+void test_arb_absent_master_rejoins() {
+    sim_init(2);
+    node_alive[1] = false;
+    sim_run(ARB_PASS_TIMEOUT_MS * (ARB_PASS_RETRIES + 2));
+
+    node_alive[1] = true;
+    sim_run(ARB_REJOIN_MS + 100);
+    TEST_ASSERT_TRUE(nodes[1].stats.tokens > 0);
+    TEST_ASSERT_EQUAL(0, sim_collisions);
+}
+
+void test_arb_lost_token_regenerated() {
+    sim_init(3);
+    sim_run(100);
+
+    /* Node 0 accepts the token, sends a frame, and then goes silent */
+    while (nodes[0].state != ARB_HOLDING) {
+        sim_tick();
+    }
+    sim_queue(0, 6, ARB_PRIORITY_FIRE);
+    sim_tick();
+    TEST_ASSERT_TRUE(sent_at[6] >= 0);
+    node_alive[0] = false;
+    sim_run(1000);
+
+    /* The next master in the list recreates it */
+    TEST_ASSERT_EQUAL(1, nodes[1].stats.regenerated);
+    TEST_ASSERT_EQUAL(0, nodes[2].stats.regenerated);
+    TEST_ASSERT_EQUAL(0, sim_collisions);
+
+    sim_queue(2, 5, ARB_PRIORITY_FIRE);
+    sim_run(ARB_HOLD_MS * 3);
+    TEST_ASSERT_TRUE(sent_at[5] >= 0);
+}
+
+void test_arb_full_queue_fire_replaces_cosmetic() {
+    sim_init(2);
+    /* Node 1 doesn't hold the token, so its queue fills */
+    for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+        TEST_ASSERT_TRUE(sim_queue(1, 0, ARB_PRIORITY_COSMETIC));
+    }
+    TEST_ASSERT_FALSE(sim_queue(1, 0, ARB_PRIORITY_COSMETIC));
+    TEST_ASSERT_TRUE(sim_queue(1, 3, ARB_PRIORITY_FIRE));
+    TEST_ASSERT_EQUAL(2, nodes[1].stats.dropped);
+    TEST_ASSERT_EQUAL(ARB_QUEUE_FRAMES, arb_pending(&nodes[1]));
+}
+
+void test_arb_disable_never_dropped() {
+    sim_init(2);
+    /* Node 1 doesn't hold the token, so its queue fills with bursts */
+    for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+        TEST_ASSERT_TRUE(sim_queue(1, 10 + i, ARB_PRIORITY_FIRE));
+    }
+    sim_queue_disable(1);
+    TEST_ASSERT_EQUAL(0, nodes[1].stats.dropped);
+
+    sim_run(ARB_PASS_TIMEOUT_MS * 10);
+    TEST_ASSERT_EQUAL(SIM_STOP_OUTPUTS * 2, stop_count);
+    for (uint8_t i = 0; i < SIM_STOP_OUTPUTS * 2; i++) {
+        sim_stop_t *stop = &stops[i];
+        TEST_ASSERT_EQUAL(stop_addresses[i / 2], stop->address);
+        TEST_ASSERT_EQUAL(stop_outputs[i / 2], stop->output);
+        TEST_ASSERT_EQUAL((i % 2) ? HMTL_OUTPUT_VALUE : HMTL_OUTPUT_PROGRAM,
+                          stop->type);
+        TEST_ASSERT_TRUE(stop->zeroed);
+    }
+
+    /* The bursts queued earlier still go out, after the outputs are off */
+    for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+        TEST_ASSERT_TRUE(sent_at[10 + i] >= stops[stop_count - 1].at);
+    }
+}
+
+void test_arb_repeated_disable_merged() {
+    sim_init(2);
+    for (uint8_t i = 0; i < ARB_QUEUE_FRAMES; i++) {
+        TEST_ASSERT_TRUE(sim_queue(1, 0, ARB_PRIORITY_COSMETIC));
+    }
+    sim_queue_disable(1);
+    sim_queue_disable(1);
+    TEST_ASSERT_EQUAL(SIM_STOP_OUTPUTS * 2, nodes[1].stats.merged);
+    TEST_ASSERT_EQUAL(0, nodes[1].stats.dropped);
+    TEST_ASSERT_EQUAL(ARB_QUEUE_FRAMES + SIM_STOP_OUTPUTS * 2,
+                      arb_pending(&nodes[1]));
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_arb_single_master_is_disabled);
+    RUN_TEST(test_arb_fire_sent_before_cosmetic);
+    RUN_TEST(test_arb_no_collisions_under_load);
+    RUN_TEST(test_arb_fire_latency_bounded);
+    RUN_TEST(test_arb_absent_master_skipped);
+    RUN_TEST(test_arb_absent_master_rejoins);
+    RUN_TEST(test_arb_lost_token_regenerated);
+    RUN_TEST(test_arb_full_queue_fire_replaces_cosmetic);
+    RUN_TEST(test_arb_disable_never_dropped);
+    RUN_TEST(test_arb_repeated_disable_merged);
+
+    return UNITY_END();
+}
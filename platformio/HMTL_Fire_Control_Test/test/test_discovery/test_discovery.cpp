@@ -0,0 +1,358 @@
+/*
+ * Native tests for bus node discovery and role binding.
+ *
+ * Nodes are simulated by answering the polls captured from bus_send().
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_discovery
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Discovery.h"
+
+extern unsigned long _mock_millis;
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void        reset_bus_frames();
+    int         bus_frame_count();
+    const byte *bus_frame(int n);
+}
+
+#define SELF_ADDRESS 64
+
+/* Simulated nodes, indexed by address offset from DISC_FIRST_ADDRESS */
+struct sim_node_t {
+    bool     present;
+    uint16_t object_type;
+    uint8_t  num_outputs;
+    uint8_t  types[HMTL_MAX_OUTPUTS];
+    uint8_t  missed;  // Polls to ignore before answering
+};
+static sim_node_t sim[DISC_NUM_ADDRESSES];
+static int polled;
+
+static void sim_add(uint16_t address, uint16_t object_type,
+                    uint8_t num_outputs, const uint8_t *types) {
+    sim_node_t *node = &sim[address - DISC_FIRST_ADDRESS];
+    node->present = true;
+    node->object_type = object_type;
+    node->num_outputs = num_outputs;
+    memcpy(node->types, types, num_outputs);
+}
+
+static const uint8_t poofer_types[] = { HMTL_OUTPUT_VALUE, HMTL_OUTPUT_VALUE,
+                                        HMTL_OUTPUT_VALUE, HMTL_OUTPUT_RS485 };
+static const uint8_t lights_types[] = { HMTL_OUTPUT_PIXELS, HMTL_OUTPUT_RS485 };
+static const uint8_t controller_types[] = { HMTL_OUTPUT_PIXELS,
+                                            HMTL_OUTPUT_MPR121,
+                                            HMTL_OUTPUT_VALUE };
+
+static void sim_respond(uint16_t address) {
+    const sim_node_t *node = &sim[address - DISC_FIRST_ADDRESS];
+    byte frame[sizeof (msg_hdr_t) + sizeof (msg_poll_response_t) +
+               HMTL_MAX_OUTPUTS];
+    uint8_t len = sizeof (msg_hdr_t) + sizeof (msg_poll_response_t) +
+                  node->num_outputs;
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)frame;
+    hmtl_msg_fmt(msg_hdr, SELF_ADDRESS, len, MSG_TYPE_POLL, MSG_FLAG_RESPONSE);
+    msg_poll_response_t *poll = (msg_poll_response_t *)(msg_hdr + 1);
+    memset(poll, 0, sizeof (*poll));
+    poll->config.num_outputs = node->num_outputs;
+    poll->config.address = address;
+    poll->object_type = node->object_type;
+    poll->data_len = node->num_outputs;
+    memcpy(poll->data, node->types, node->num_outputs);
+    disc_response(address, msg_hdr);
+}
+
+/* Answer any new polls from present nodes */
+static void sim_run() {
+    while (polled < bus_frame_count()) {
+        const msg_hdr_t *msg_hdr = (const msg_hdr_t *)bus_frame(polled++);
+        TEST_ASSERT_EQUAL(MSG_TYPE_POLL, msg_hdr->type);
+        uint16_t address = msg_hdr->address;
+        TEST_ASSERT_TRUE(address >= DISC_FIRST_ADDRESS);
+        TEST_ASSERT_TRUE(address <= DISC_LAST_ADDRESS);
+        sim_node_t *node = &sim[address - DISC_FIRST_ADDRESS];
+        if (node->missed) {
+            node->missed--;
+        } else if (node->present) {
+            sim_respond(address);
+        }
+    }
+}
+
+static unsigned long run_pass() {
+    unsigned long start = _mock_millis;
+    disc_start(SELF_ADDRESS, _mock_millis);
+    while ((disc.state == DISC_POLLING) && (_mock_millis - start < 10000)) {
+        disc_service(_mock_millis);
+        sim_run();
+        _mock_millis++;
+    }
+    return _mock_millis - start;
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    _mock_millis = 1000;
+    memset(&disc, 0, sizeof (disc));
+    memset(sim, 0, sizeof (sim));
+    reset_bus_frames();
+    polled = 0;
+    bus_baud = 9600;
+
+    poofer1_address = POOFER1_ADDRESS;
+    poofer2_address = POOFER2_ADDRESS;
+    lights_address = LIGHTS_ADDRESS;
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_discovery_alive_before_pass() {
+    TEST_ASSERT_TRUE(disc_alive(POOFER1_ADDRESS));
+    TEST_ASSERT_TRUE(disc_alive(DISC_LAST_ADDRESS));
+}
+
+void test_discovery_polls_range_skipping_self() {
+    run_pass();
+    TEST_ASSERT_EQUAL(DISC_IDLE, disc.state);
+    // Every silent address is polled again before moving on
+    TEST_ASSERT_EQUAL((DISC_NUM_ADDRESSES - 1) * (1 + DISC_RETRIES),
+                      bus_frame_count());
+    for (int i = 0; i < bus_frame_count(); i++) {
+        TEST_ASSERT_NOT_EQUAL(SELF_ADDRESS,
+                              ((const msg_hdr_t *)bus_frame(i))->address);
+    }
+}
+
+void test_discovery_builds_cache() {
+    sim_add(66, 1, 4, poofer_types);
+    sim_add(67, 1, 2, lights_types);
+    sim_add(69, 1, 4, poofer_types);
+    run_pass();
+
+    TEST_ASSERT_EQUAL(3, disc.num_nodes);
+    const disc_node_t *node = disc_node(67);
+    TEST_ASSERT_NOT_NULL(node);
+    TEST_ASSERT_EQUAL(2, node->num_outputs);
+    TEST_ASSERT_EQUAL((1 << HMTL_OUTPUT_PIXELS) | (1 << HMTL_OUTPUT_RS485),
+                      node->output_types);
+    TEST_ASSERT_NULL(disc_node(68));
+
+    TEST_ASSERT_TRUE(disc_alive(66));
+    TEST_ASSERT_FALSE(disc_alive(68));
+    // Addresses outside the range and groups aren't filtered
+    TEST_ASSERT_TRUE(disc_alive(DISC_LAST_ADDRESS + 1));
+    TEST_ASSERT_TRUE(disc_alive(SOCKET_ADDR_ANY));
+}
+
+void test_discovery_answers_move_on_early() {
+    // With every node answering, the pass takes far less than the windows
+    for (uint16_t a = DISC_FIRST_ADDRESS + 1; a <= DISC_LAST_ADDRESS; a++) {
+        sim_add(a, 1, 4, poofer_types);
+    }
+    unsigned long answered = run_pass();
+
+    setUp();
+    unsigned long silent = run_pass();
+
+    TEST_ASSERT_TRUE(silent >= (DISC_NUM_ADDRESSES - 1) *
+                               (1 + DISC_RETRIES) * disc.window);
+    TEST_ASSERT_TRUE(answered * 4 < silent);
+}
+
+void test_discovery_window_fits_exchange() {
+    // A poll and response is tens of ms at 9600, a few ms at 115200
+    uint16_t slow = disc_window_ms(9600);
+    TEST_ASSERT_TRUE(slow >= 33);
+    TEST_ASSERT_TRUE(slow >= DISC_EXCHANGE_BYTES * 10 * 1000 / 9600);
+
+    uint16_t fast = disc_window_ms(115200);
+    TEST_ASSERT_TRUE(fast < slow / 4);
+    TEST_ASSERT_TRUE(fast > DISC_TURNAROUND_MS);
+
+    bus_baud = 115200;
+    disc_start(SELF_ADDRESS, _mock_millis);
+    TEST_ASSERT_EQUAL(fast, disc.window);
+}
+
+void test_discovery_retries_silent_address() {
+    sim_add(66, 1, 4, poofer_types);
+    sim[66 - DISC_FIRST_ADDRESS].missed = DISC_RETRIES;
+    sim_add(67, 1, 2, lights_types);
+    sim[67 - DISC_FIRST_ADDRESS].missed = DISC_RETRIES + 1;
+    run_pass();
+
+    TEST_ASSERT_TRUE(disc_alive(66));
+    TEST_ASSERT_NOT_NULL(disc_node(66));
+    TEST_ASSERT_FALSE(disc_alive(67));
+}
+
+void test_discovery_keeps_valid_roles() {
+    sim_add(66, 1, 4, poofer_types);
+    sim_add(67, 1, 2, lights_types);
+    sim_add(69, 1, 4, poofer_types);
+    run_pass();
+
+    TEST_ASSERT_EQUAL(66, poofer1_address);
+    TEST_ASSERT_EQUAL(69, poofer2_address);
+    TEST_ASSERT_EQUAL(67, lights_address);
+}
+
+void test_discovery_binds_unset_roles() {
+    // Nothing is configured, the roles go to suitable nodes
+    poofer1_address = 0;
+    poofer2_address = SOCKET_ADDR_INVALID;
+    lights_address = 0;
+    sim_add(70, 1, 4, poofer_types);
+    sim_add(72, 1, 2, lights_types);
+    sim_add(75, 1, 4, poofer_types);
+    sim_add(65, OBJECT_TYPE_FIRE_CONTROLLER, 3, controller_types);
+    run_pass();
+
+    TEST_ASSERT_EQUAL(70, poofer1_address);
+    TEST_ASSERT_EQUAL(75, poofer2_address);
+    TEST_ASSERT_EQUAL(72, lights_address);
+}
+
+void test_discovery_never_moves_set_roles() {
+    // The wiring changed, but configured addresses are left to the operator
+    sim_add(70, 1, 4, poofer_types);
+    sim_add(72, 1, 2, lights_types);
+    sim_add(75, 1, 4, poofer_types);
+    run_pass();
+
+    TEST_ASSERT_EQUAL(POOFER1_ADDRESS, poofer1_address);
+    TEST_ASSERT_EQUAL(POOFER2_ADDRESS, poofer2_address);
+    TEST_ASSERT_EQUAL(LIGHTS_ADDRESS, lights_address);
+    TEST_ASSERT_FALSE(disc_alive(poofer1_address));
+}
+
+void test_discovery_missing_role_unbound() {
+    // With a single poofer the second unset role stays unset
+    poofer1_address = 0;
+    poofer2_address = 0;
+    sim_add(70, 1, 4, poofer_types);
+    run_pass();
+
+    TEST_ASSERT_EQUAL(70, poofer1_address);
+    TEST_ASSERT_EQUAL(0, poofer2_address);
+}
+
+void test_discovery_prunes_gone_nodes() {
+    sim_add(66, 1, 4, poofer_types);
+    sim_add(69, 1, 4, poofer_types);
+    run_pass();
+    TEST_ASSERT_EQUAL(2, disc.num_nodes);
+
+    sim[69 - DISC_FIRST_ADDRESS].present = false;
+    run_pass();
+    TEST_ASSERT_EQUAL(1, disc.num_nodes);
+    TEST_ASSERT_NULL(disc_node(69));
+    TEST_ASSERT_FALSE(disc_alive(69));
+    TEST_ASSERT_EQUAL(2, disc.passes);
+}
+
+void test_discovery_alive_during_rescan() {
+    // Results of the last pass hold until the next completes
+    sim_add(66, 1, 4, poofer_types);
+    run_pass();
+    disc_start(SELF_ADDRESS, _mock_millis);
+    TEST_ASSERT_TRUE(disc_alive(66));
+    TEST_ASSERT_FALSE(disc_alive(67));
+}
+
+void test_discovery_heard_node_alive() {
+    // A node that missed the pass is alive once anything is heard from it
+    sim_add(66, 1, 4, poofer_types);
+    run_pass();
+    TEST_ASSERT_FALSE(disc_alive(69));
+
+    disc_heard(69);
+    TEST_ASSERT_TRUE(disc_alive(69));
+    TEST_ASSERT_TRUE(disc_alive(66));
+}
+
+void test_discovery_revives_absent_nodes() {
+    sim_add(66, 1, 4, poofer_types);
+    run_pass();
+    TEST_ASSERT_FALSE(disc_alive(69));
+
+    // A node powered up after the pass is found by the next poll of absent ones
+    sim_add(69, 1, 4, poofer_types);
+    reset_bus_frames();
+    polled = 0;
+    disc_service(disc.finished + DISC_REVIVE_MS - 1);
+    TEST_ASSERT_EQUAL(DISC_IDLE, disc.state);
+
+    _mock_millis = disc.finished + DISC_REVIVE_MS;
+    unsigned long start = _mock_millis;
+    do {
+        disc_service(_mock_millis);
+        sim_run();
+        _mock_millis++;
+    } while ((disc.state == DISC_POLLING) && (_mock_millis - start < 10000));
+
+    TEST_ASSERT_TRUE(disc_alive(69));
+    TEST_ASSERT_TRUE(disc_alive(66));
+    TEST_ASSERT_NOT_NULL(disc_node(69));
+    // The live node and this controller aren't polled
+    for (int i = 0; i < bus_frame_count(); i++) {
+        uint16_t address = ((const msg_hdr_t *)bus_frame(i))->address;
+        TEST_ASSERT_NOT_EQUAL(66, address);
+        TEST_ASSERT_NOT_EQUAL(SELF_ADDRESS, address);
+    }
+}
+
+void test_discovery_next_alive() {
+    // Before discovery every address in the range is stepped through
+    TEST_ASSERT_EQUAL(67, disc_next_alive(66));
+    TEST_ASSERT_EQUAL(DISC_FIRST_ADDRESS, disc_next_alive(DISC_LAST_ADDRESS));
+
+    sim_add(66, 1, 4, poofer_types);
+    sim_add(70, 1, 4, poofer_types);
+    run_pass();
+    TEST_ASSERT_EQUAL(70, disc_next_alive(66));
+    TEST_ASSERT_EQUAL(66, disc_next_alive(70));
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_discovery_alive_before_pass);
+    RUN_TEST(test_discovery_polls_range_skipping_self);
+    RUN_TEST(test_discovery_builds_cache);
+    RUN_TEST(test_discovery_answers_move_on_early);
+    RUN_TEST(test_discovery_window_fits_exchange);
+    RUN_TEST(test_discovery_retries_silent_address);
+    RUN_TEST(test_discovery_keeps_valid_roles);
+    RUN_TEST(test_discovery_binds_unset_roles);
+    RUN_TEST(test_discovery_never_moves_set_roles);
+    RUN_TEST(test_discovery_missing_role_unbound);
+    RUN_TEST(test_discovery_prunes_gone_nodes);
+    RUN_TEST(test_discovery_alive_during_rescan);
+    RUN_TEST(test_discovery_heard_node_alive);
+    RUN_TEST(test_discovery_revives_absent_nodes);
+    RUN_TEST(test_discovery_next_alive);
+
+    return UNITY_END();
+}
@@ -0,0 +1,146 @@
+/*
+ * Native tests for frame rate limited pixel output.
+ *
+ * The native build has no SPI DMA, so frames are written through the
+ * hmtl_update_output() stub which counts them.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_frame
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "Fire_Control_Frame.h"
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void reset_update_captures();
+    int  update_output_call_count();
+}
+
+#define TEST_LENGTH 36
+
+static output_hdr_t output;
+static byte data[TEST_LENGTH];
+
+static boolean offer(unsigned long now) {
+    return frame_output(&output, NULL, data, sizeof (data), now);
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&frame, 0, sizeof (frame));
+    memset(data, 0, sizeof (data));
+    reset_update_captures();
+    frame_init(0, 0);
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_frame_default_rate() {
+    TEST_ASSERT_EQUAL(1000 / FRAME_RATE_DEFAULT, frame.interval);
+}
+
+void test_frame_rate_clamped() {
+    frame_set_rate(250);
+    TEST_ASSERT_EQUAL(1000 / FRAME_RATE_MAX, frame.interval);
+
+    frame_set_rate(10);
+    TEST_ASSERT_EQUAL(100, frame.interval);
+}
+
+void test_frame_first_sent_immediately() {
+    TEST_ASSERT_TRUE(offer(1000));
+    TEST_ASSERT_EQUAL(1, update_output_call_count());
+    TEST_ASSERT_EQUAL(1, frame.sent);
+}
+
+void test_frame_change_held_until_due() {
+    frame_set_rate(25); // 40ms
+    offer(1000);
+
+    data[0] = 1;
+    TEST_ASSERT_FALSE(offer(1010));
+    TEST_ASSERT_FALSE(offer(1039));
+    TEST_ASSERT_EQUAL(1, update_output_call_count());
+    TEST_ASSERT_EQUAL(2, frame.held);
+
+    TEST_ASSERT_TRUE(offer(1040));
+    TEST_ASSERT_EQUAL(2, update_output_call_count());
+}
+
+void test_frame_rate_capped_under_constant_change() {
+    frame_set_rate(50); // 20ms
+
+    /* A change on every 1ms pass for a second */
+    for (unsigned long now = 0; now < 1000; now++) {
+        data[now % TEST_LENGTH]++;
+        offer(5000 + now);
+    }
+
+    TEST_ASSERT_EQUAL(50, update_output_call_count());
+}
+
+void test_frame_rewritten_pixels_sent() {
+    data[3] = 7;
+    offer(1000);
+
+    /* Without DMA a frame offered is always written, even if it's the same */
+    TEST_ASSERT_TRUE(offer(1100));
+    TEST_ASSERT_EQUAL(2, update_output_call_count());
+    TEST_ASSERT_EQUAL(0, frame.same);
+}
+
+void test_frame_reordered_bytes_not_same() {
+    data[0] = 1;
+    data[1] = 2;
+    offer(1000);
+
+    /* Same bytes, different pixels */
+    data[0] = 2;
+    data[1] = 1;
+    offer(1100);
+    TEST_ASSERT_EQUAL(2, update_output_call_count());
+    TEST_ASSERT_EQUAL(0, frame.same);
+}
+
+void test_frame_second_rolls_counts() {
+    offer(1000);
+    offer(1100);
+    offer(1105);
+
+    frame_second();
+    TEST_ASSERT_EQUAL(2, frame.sent_per_sec);
+    TEST_ASSERT_EQUAL(1, frame.held_per_sec);
+    TEST_ASSERT_EQUAL(0, frame.sent);
+    TEST_ASSERT_EQUAL(0, frame.same);
+    TEST_ASSERT_EQUAL(0, frame.held);
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_frame_default_rate);
+    RUN_TEST(test_frame_rate_clamped);
+    RUN_TEST(test_frame_first_sent_immediately);
+    RUN_TEST(test_frame_change_held_until_due);
+    RUN_TEST(test_frame_rate_capped_under_constant_change);
+    RUN_TEST(test_frame_rewritten_pixels_sent);
+    RUN_TEST(test_frame_reordered_bytes_not_same);
+    RUN_TEST(test_frame_second_rolls_counts);
+
+    return UNITY_END();
+}
@@ -0,0 +1,206 @@
+/*
+ * Native tests for the LCD shadow framebuffer.
+ *
+ * Flushes write into the emulated screen of the LiquidCrystal stub, which
+ * counts the cursor moves and characters that would go over the bus.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_lcd
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "RS485Utils.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Sensors.h"
+#include "Fire_Control_LCD.h"
+
+extern unsigned long _mock_millis;
+extern bool data_changed;
+void lcd_render_page();
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+}
+
+static void assert_row(uint8_t row, const char *expected) {
+    TEST_ASSERT_EQUAL_MEMORY(expected, lcd.screen[row], LCD_COLS);
+}
+
+/* Render the page and write it out, leaving the saved times alone */
+static void render() {
+    lcd_render_page();
+    lcd_frame.flush();
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    lcd_frame = LCDFrame();
+    lcd.reset();
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_lcd_print_formats() {
+    lcd_frame.setCursor(0, 0);
+    lcd_frame.print("A:");
+    lcd_frame.print(0);
+    lcd_frame.print(" ");
+    lcd_frame.print(-42);
+    lcd_frame.print(" ");
+    lcd_frame.print((uint8_t)255);
+    lcd_frame.print(" ");
+    lcd_frame.print(4000000000UL);
+
+    lcd_frame.flush();
+    assert_row(0, "A:0 -42 255 4000");
+}
+
+void test_lcd_print_clipped_at_row_end() {
+    lcd_frame.setCursor(10, 0);
+    lcd_frame.print("0123456789");
+    lcd_frame.flush();
+
+    assert_row(0, "          012345");
+    assert_row(1, "                ");
+}
+
+void test_lcd_first_flush_writes_every_cell() {
+    TEST_ASSERT_EQUAL(LCD_CELLS, lcd_frame.flush());
+    TEST_ASSERT_EQUAL(LCD_CELLS, lcd.write_calls);
+    TEST_ASSERT_EQUAL(2, lcd.cursor_calls);
+}
+
+void test_lcd_unchanged_frame_writes_nothing() {
+    lcd_frame.setCursor(0, 0);
+    lcd_frame.print("BPM1:120");
+    lcd_frame.flush();
+    lcd.reset();
+
+    /* A page redrawing the same contents */
+    for (int i = 0; i < 10; i++) {
+        lcd_frame.setCursor(0, 0);
+        lcd_frame.print("BPM1:120");
+        TEST_ASSERT_EQUAL(0, lcd_frame.flush());
+    }
+    TEST_ASSERT_EQUAL(0, lcd.write_calls);
+    TEST_ASSERT_EQUAL(0, lcd.cursor_calls);
+}
+
+void test_lcd_only_changed_cells_written() {
+    lcd_frame.setCursor(0, 0);
+    lcd_frame.print("BPM1:120 x2");
+    lcd_frame.flush();
+    lcd.reset();
+    memcpy(lcd.screen[0], "BPM1:120 x2     ", LCD_COLS);
+
+    lcd_frame.setCursor(0, 0);
+    lcd_frame.print("BPM1:121 x4");
+    TEST_ASSERT_EQUAL(2, lcd_frame.flush());
+
+    TEST_ASSERT_EQUAL(2, lcd.write_calls);
+    TEST_ASSERT_EQUAL(2, lcd.cursor_calls);
+    assert_row(0, "BPM1:121 x4     ");
+}
+
+void test_lcd_run_needs_one_move() {
+    lcd_frame.flush();
+    lcd.reset();
+
+    lcd_frame.setCursor(4, 1);
+    lcd_frame.print("12345");
+    TEST_ASSERT_EQUAL(5, lcd_frame.flush());
+
+    TEST_ASSERT_EQUAL(1, lcd.cursor_calls);
+    TEST_ASSERT_EQUAL(5, lcd.write_calls);
+}
+
+void test_lcd_clear_blanks_on_flush() {
+    lcd_frame.setCursor(0, 1);
+    lcd_frame.print("LEN:1.5s");
+    lcd_frame.flush();
+
+    lcd_frame.clear();
+    TEST_ASSERT_EQUAL(8, lcd_frame.flush());
+    assert_row(1, "                ");
+}
+
+void test_lcd_invalidate_redraws() {
+    lcd_frame.setCursor(0, 0);
+    lcd_frame.print("P1:66");
+    lcd_frame.flush();
+
+    /* Something was written straight to the LCD */
+    lcd.clear();
+    lcd_frame.invalidate();
+    TEST_ASSERT_EQUAL(LCD_CELLS, lcd_frame.flush());
+    assert_row(0, "P1:66           ");
+}
+
+void test_lcd_page_saves_when_idle() {
+    display_mode = DISPLAY_ADJUST_BRIGHTNESS;
+    lcd_saved_micros[DISPLAY_ADJUST_BRIGHTNESS] = 0;
+
+    /* Stub micros() follows the millis clock, so writes take time */
+    update_lcd();
+    TEST_ASSERT_EQUAL(0, lcd_saved_micros[DISPLAY_ADJUST_BRIGHTNESS]);
+    lcd_frame.write_micros = LCD_CELLS * 100;
+
+    int writes = lcd.write_calls;
+    for (int i = 0; i < 20; i++) {
+        update_lcd();
+    }
+    TEST_ASSERT_EQUAL(writes, lcd.write_calls);
+    TEST_ASSERT_TRUE(lcd_saved_micros[DISPLAY_ADJUST_BRIGHTNESS] > 0);
+    TEST_ASSERT_TRUE(lcd_saved_micros[DISPLAY_ADJUST_BRIGHTNESS] <=
+                     LCD_CELLS * 100);
+}
+
+void test_lcd_saved_shown_on_sensor_page() {
+    display_mode = DISPLAY_CAP_SENSORS;
+    lcd_saved_micros[DISPLAY_CAP_SENSORS] = 1234;
+    data_changed = true;
+    render();
+
+    TEST_ASSERT_EQUAL_MEMORY("LCD1234", &lcd.screen[1][8], 7);
+
+    /* Refreshed no more than once a second */
+    lcd_saved_micros[DISPLAY_CAP_SENSORS] = 99;
+    _mock_millis += 500;
+    render();
+    TEST_ASSERT_EQUAL_MEMORY("LCD1234", &lcd.screen[1][8], 7);
+
+    _mock_millis += 500;
+    render();
+    TEST_ASSERT_EQUAL_MEMORY("LCD99   ", &lcd.screen[1][8], 8);
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_lcd_print_formats);
+    RUN_TEST(test_lcd_print_clipped_at_row_end);
+    RUN_TEST(test_lcd_first_flush_writes_every_cell);
+    RUN_TEST(test_lcd_unchanged_frame_writes_nothing);
+    RUN_TEST(test_lcd_only_changed_cells_written);
+    RUN_TEST(test_lcd_run_needs_one_move);
+    RUN_TEST(test_lcd_clear_blanks_on_flush);
+    RUN_TEST(test_lcd_invalidate_redraws);
+    RUN_TEST(test_lcd_page_saves_when_idle);
+    RUN_TEST(test_lcd_saved_shown_on_sensor_page);
+
+    return UNITY_END();
+}
@@ -0,0 +1,280 @@
+/*
+ * Native tests for per-node link quality probing.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_link
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Link.h"
+
+extern unsigned long _mock_millis;
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void        reset_bus_frames();
+    int         bus_frame_count();
+    const byte *bus_frame(int n);
+    void        set_bus_fire_pending(bool pending);
+}
+
+static void add_node(uint16_t address) {
+    disc_node_t *node = &disc.nodes[disc.num_nodes++];
+    node->address = address;
+    node->output_types = (1 << HMTL_OUTPUT_VALUE);
+}
+
+static uint16_t last_polled() {
+    return ((const msg_hdr_t *)bus_frame(bus_frame_count() - 1))->address;
+}
+
+/* Send the next probe, answering it after rtt_us or not at all */
+static void probe(long rtt_us) {
+    _mock_millis += LINK_PROBE_PERIOD_MS;
+    unsigned long sent_us = _mock_millis * 1000UL;
+    int frames = bus_frame_count();
+    link_service(_mock_millis, sent_us);
+    TEST_ASSERT_EQUAL(frames + 1, bus_frame_count());
+
+    if (rtt_us >= 0) {
+        link_response(last_polled(), sent_us + rtt_us);
+    } else {
+        _mock_millis += link_timeout_ms();
+        link_service(_mock_millis, _mock_millis * 1000UL);
+    }
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    _mock_millis = 1000;
+    memset(&disc, 0, sizeof (disc));
+    memset(&link_stats, 0, sizeof (link_stats));
+    reset_bus_frames();
+    set_bus_fire_pending(false);
+    bus_baud = 115200;
+
+    disc.valid = true;
+    add_node(66);
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_link_no_nodes_no_probes() {
+    disc.num_nodes = 0;
+    _mock_millis += LINK_PROBE_PERIOD_MS;
+    link_service(_mock_millis, 0);
+    TEST_ASSERT_EQUAL(0, bus_frame_count());
+}
+
+void test_link_probe_rate() {
+    // Nothing goes out faster than the probe period
+    for (int i = 0; i < 1000; i++) {
+        link_service(_mock_millis, _mock_millis * 1000UL);
+        if (link_stats.probing) {
+            link_response(link_stats.probing, _mock_millis * 1000UL + 500);
+        }
+        _mock_millis++;
+    }
+    TEST_ASSERT_INT_WITHIN(1, 1000 / LINK_PROBE_PERIOD_MS, bus_frame_count());
+}
+
+void test_link_round_robin() {
+    add_node(69);
+    add_node(70);
+    probe(500);
+    TEST_ASSERT_EQUAL(66, last_polled());
+    probe(500);
+    TEST_ASSERT_EQUAL(69, last_polled());
+    probe(500);
+    TEST_ASSERT_EQUAL(70, last_polled());
+    probe(500);
+    TEST_ASSERT_EQUAL(66, last_polled());
+}
+
+void test_link_records_rtt() {
+    probe(1200);
+    probe(1400);
+    const link_node_t *node = link_node(66);
+    TEST_ASSERT_NOT_NULL(node);
+    TEST_ASSERT_EQUAL(2, node->count);
+    TEST_ASSERT_EQUAL(13, link_rtt(node));
+    TEST_ASSERT_EQUAL(0, link_lost(node));
+    TEST_ASSERT_FALSE(node->degraded);
+    TEST_ASSERT_EQUAL(0, link_stats.warning);
+}
+
+void test_link_ignores_other_responses() {
+    probe(-1);
+    link_response(69, 0);
+    TEST_ASSERT_NULL(link_node(69));
+}
+
+void test_link_loss_degrades() {
+    probe(1000);
+    probe(-1);
+    TEST_ASSERT_FALSE(link_node(66)->degraded);
+    probe(-1);
+
+    const link_node_t *node = link_node(66);
+    TEST_ASSERT_EQUAL(2, link_lost(node));
+    TEST_ASSERT_TRUE(node->degraded);
+    TEST_ASSERT_EQUAL(66, link_stats.warning);
+
+    // Recovers once the losses leave the window
+    for (int i = 0; i < LINK_WINDOW; i++) {
+        probe(1000);
+    }
+    TEST_ASSERT_EQUAL(0, link_lost(node));
+    TEST_ASSERT_FALSE(node->degraded);
+    TEST_ASSERT_EQUAL(0, link_stats.warning);
+}
+
+void test_link_slow_degrades() {
+    for (int i = 0; i < LINK_WINDOW; i++) {
+        probe(link_warn_rtt() * LINK_RTT_UNIT_US + 500);
+    }
+    TEST_ASSERT_TRUE(link_node(66)->degraded);
+}
+
+void test_link_limits_follow_bus_rate() {
+    uint16_t fast = link_timeout_ms();
+    bus_baud = 9600;
+    TEST_ASSERT_TRUE(link_timeout_ms() > disc_window_ms(9600));
+    TEST_ASSERT_TRUE(link_timeout_ms() > fast);
+    TEST_ASSERT_TRUE(link_warn_rtt() >
+                     disc_window_ms(9600) * (1000 / LINK_RTT_UNIT_US));
+}
+
+void test_link_slow_bus_not_degraded() {
+    // A full exchange at 9600 baud is neither lost nor too slow
+    bus_baud = 9600;
+    long exchange_us = disc_window_ms(bus_baud) * 1000L;
+    for (int i = 0; i < LINK_WINDOW; i++) {
+        probe(exchange_us);
+    }
+    const link_node_t *node = link_node(66);
+    TEST_ASSERT_EQUAL(0, link_lost(node));
+    TEST_ASSERT_EQUAL(exchange_us / LINK_RTT_UNIT_US, link_rtt(node));
+    TEST_ASSERT_FALSE(node->degraded);
+
+    // The same round trip at a fast rate is
+    bus_baud = 115200;
+    probe(exchange_us);
+    TEST_ASSERT_TRUE(node->degraded);
+}
+
+void test_link_jitter() {
+    for (int i = 0; i < LINK_WINDOW; i++) {
+        probe(1000);
+    }
+    TEST_ASSERT_EQUAL(0, link_node(66)->jitter);
+
+    // Alternating 1ms and 9ms round trips
+    for (int i = 0; i < LINK_WINDOW; i++) {
+        probe((i % 2) ? 1000 : 9000);
+    }
+    const link_node_t *node = link_node(66);
+    TEST_ASSERT_TRUE(node->jitter >= LINK_WARN_JITTER);
+    TEST_ASSERT_TRUE(node->degraded);
+}
+
+void test_link_small_jitter_tracked() {
+    // Round trips alternating by a single unit
+    for (int i = 0; i < 4 * LINK_WINDOW; i++) {
+        probe((i % 2) ? 1000 : 1000 + LINK_RTT_UNIT_US);
+    }
+    TEST_ASSERT_EQUAL(1, link_node(66)->jitter);
+
+    // And settles back once steady
+    for (int i = 0; i < 4 * LINK_WINDOW; i++) {
+        probe(1000);
+    }
+    TEST_ASSERT_EQUAL(0, link_node(66)->jitter);
+}
+
+void test_link_saturates() {
+    probe(10000000);
+    TEST_ASSERT_EQUAL(0xFFFF, link_rtt(link_node(66)));
+}
+
+void test_link_waits_for_fire_frames() {
+    set_bus_fire_pending(true);
+    for (int i = 0; i < 10; i++) {
+        _mock_millis += LINK_PROBE_PERIOD_MS;
+        link_service(_mock_millis, 0);
+    }
+    TEST_ASSERT_EQUAL(0, bus_frame_count());
+    TEST_ASSERT_EQUAL(10, link_stats.deferred);
+
+    set_bus_fire_pending(false);
+    link_service(_mock_millis, 0);
+    TEST_ASSERT_EQUAL(1, bus_frame_count());
+}
+
+void test_link_waits_for_discovery() {
+    disc.state = DISC_POLLING;
+    _mock_millis += LINK_PROBE_PERIOD_MS;
+    link_service(_mock_millis, 0);
+    TEST_ASSERT_EQUAL(0, bus_frame_count());
+}
+
+void test_link_reuses_stats_of_gone_nodes() {
+    disc.num_nodes = 0;
+    for (uint16_t a = 80; a < 80 + LINK_MAX_NODES; a++) {
+        add_node(a);
+    }
+    for (int i = 0; i < LINK_MAX_NODES; i++) {
+        probe(1000);
+    }
+    TEST_ASSERT_NOT_NULL(link_node(80));
+
+    // A newly found node takes the place of one no longer known
+    disc.num_nodes = 0;
+    add_node(66);
+    add_node(80 + 1);
+    link_stats.next = 0;
+    probe(1000);
+    TEST_ASSERT_NOT_NULL(link_node(66));
+    TEST_ASSERT_NULL(link_node(80));
+    TEST_ASSERT_NOT_NULL(link_node(80 + 1));
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_link_no_nodes_no_probes);
+    RUN_TEST(test_link_probe_rate);
+    RUN_TEST(test_link_round_robin);
+    RUN_TEST(test_link_records_rtt);
+    RUN_TEST(test_link_ignores_other_responses);
+    RUN_TEST(test_link_loss_degrades);
+    RUN_TEST(test_link_slow_degrades);
+    RUN_TEST(test_link_limits_follow_bus_rate);
+    RUN_TEST(test_link_slow_bus_not_degraded);
+    RUN_TEST(test_link_jitter);
+    RUN_TEST(test_link_small_jitter_tracked);
+    RUN_TEST(test_link_saturates);
+    RUN_TEST(test_link_waits_for_fire_frames);
+    RUN_TEST(test_link_waits_for_discovery);
+    RUN_TEST(test_link_reuses_stats_of_gone_nodes);
+
+    return UNITY_END();
+}
@@ -0,0 +1,230 @@
+/*
+ * Native tests for the live loop recorder.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_looper
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "Fire_Control_Tempo.h"
+#include "Fire_Control_Quantize.h"
+#include "Fire_Control_Looper.h"
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+}
+
+/* Record presses of sensors 1, 2 and 1+3 at 0, 200 and 450 ms from 1000 */
+static void record_riff() {
+    looper_arm();
+    looper_record(0, 900);
+    looper_record(1 << 1, 1000);
+    looper_record(0, 1100);
+    looper_record(1 << 2, 1200);
+    looper_record((1 << 1) | (1 << 3), 1450);
+}
+
+/* Mask played by each ms from one time up to, but not including, another */
+static uint16_t run_until(unsigned long from, unsigned long to,
+                          unsigned long *when) {
+    for (unsigned long now = from; now < to; now++) {
+        uint16_t pressed = looper_run(now);
+        if (pressed) {
+            *when = now;
+            return pressed;
+        }
+    }
+    return 0;
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&looper, 0, sizeof (looper));
+    memset(&tempo, 0, sizeof (tempo));
+    memset(&quant, 0, sizeof (quant));
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_looper_event_is_compact() {
+    TEST_ASSERT_EQUAL(2, sizeof (looper_event_t));
+}
+
+void test_looper_idle_records_nothing() {
+    looper_record(1 << 1, 1000);
+    TEST_ASSERT_EQUAL(0, looper.count);
+    TEST_ASSERT_FALSE(looper_play(2000));
+}
+
+void test_looper_records_deltas() {
+    record_riff();
+    TEST_ASSERT_EQUAL(LOOPER_RECORDING, looper.state);
+    TEST_ASSERT_EQUAL(4, looper.count);
+    TEST_ASSERT_EQUAL(0, looper.events[0].delay);
+    TEST_ASSERT_EQUAL(1, looper.events[0].sensor);
+    TEST_ASSERT_EQUAL(20, looper.events[1].delay);
+    TEST_ASSERT_EQUAL(25, looper.events[2].delay);
+    TEST_ASSERT_EQUAL(1, looper.events[2].sensor);
+
+    // Presses on the same pass share the time
+    TEST_ASSERT_EQUAL(0, looper.events[3].delay);
+    TEST_ASSERT_EQUAL(3, looper.events[3].sensor);
+}
+
+void test_looper_long_gap_waits() {
+    looper_arm();
+    looper_record(1 << 1, 1000);
+    looper_record(1 << 2, 1000 + 6000);
+    TEST_ASSERT_EQUAL(4, looper.count);
+    TEST_ASSERT_EQUAL(LOOPER_WAIT, looper.events[1].sensor);
+    TEST_ASSERT_EQUAL(LOOPER_WAIT, looper.events[2].sensor);
+    TEST_ASSERT_EQUAL(600 - 2 * 0xFF, looper.events[3].delay);
+}
+
+void test_looper_plays_and_repeats() {
+    record_riff();
+    TEST_ASSERT_TRUE(looper_play(1600));
+    TEST_ASSERT_EQUAL(600, looper.length);
+
+    unsigned long when = 0;
+    TEST_ASSERT_EQUAL(1 << 1, run_until(1600, 3000, &when));
+    TEST_ASSERT_EQUAL(1600, when);
+    TEST_ASSERT_EQUAL(1 << 2, run_until(when + 1, 3000, &when));
+    TEST_ASSERT_EQUAL(1800, when);
+    TEST_ASSERT_EQUAL((1 << 1) | (1 << 3), run_until(when + 1, 3000, &when));
+    TEST_ASSERT_EQUAL(2050, when);
+
+    // The second time round starts a loop length after the first
+    TEST_ASSERT_EQUAL(1 << 1, run_until(when + 1, 3000, &when));
+    TEST_ASSERT_EQUAL(2200, when);
+    TEST_ASSERT_EQUAL(1, looper.plays);
+}
+
+void test_looper_late_passes_dont_drift() {
+    record_riff();
+    looper_play(1600);
+
+    // Passes 30ms late still leave the next repetition on time
+    looper_run(1630);
+    looper_run(1830);
+    looper_run(2080);
+    TEST_ASSERT_EQUAL(2200, looper.pass_start);
+
+    unsigned long when = 0;
+    run_until(2081, 3000, &when);
+    TEST_ASSERT_EQUAL(2200, when);
+}
+
+void test_looper_skips_missed_repetitions() {
+    record_riff();
+    looper_play(1600);
+    looper_run(1600);
+
+    // Stale presses are passed over, play resumes in the current repetition
+    TEST_ASSERT_EQUAL(1 << 1, looper_run(1600 + 5 * 600 + 10));
+    TEST_ASSERT_EQUAL(1600 + 5 * 600, looper.pass_start);
+}
+
+void test_looper_quantized_to_tempo() {
+    tempo.period = 500;
+    tempo.next_beat = 1000;
+    quant.grid = QUANT_EIGHTH;
+
+    looper_arm();
+    looper_record(1 << 1, 1010);
+    looper_record(1 << 2, 1260);
+    looper_record(1 << 3, 1490);
+    looper_play(2100);
+
+    // Rounded to two beats, starting on the next tick
+    TEST_ASSERT_EQUAL(1000, looper.length);
+    TEST_ASSERT_EQUAL(250, looper.grid);
+    TEST_ASSERT_EQUAL(2250, looper.pass_start);
+
+    unsigned long when = 0;
+    run_until(2100, 4000, &when);
+    TEST_ASSERT_EQUAL(2250, when);
+    run_until(when + 1, 4000, &when);
+    TEST_ASSERT_EQUAL(2500, when);
+    run_until(when + 1, 4000, &when);
+    TEST_ASSERT_EQUAL(2750, when);
+    run_until(when + 1, 4000, &when);
+    TEST_ASSERT_EQUAL(3250, when);
+}
+
+void test_looper_ring_keeps_latest() {
+    looper_arm();
+    for (int i = 0; i < LOOPER_EVENTS + 2; i++) {
+        looper_record(1 << (i % 12), 1000 + i * 100);
+    }
+    TEST_ASSERT_EQUAL(LOOPER_EVENTS, looper.count);
+    TEST_ASSERT_EQUAL(2, looper.overwritten);
+    TEST_ASSERT_EQUAL(1100, looper.start);
+
+    looper_play(1000 + (LOOPER_EVENTS + 2) * 100);
+    unsigned long when = 0;
+    TEST_ASSERT_EQUAL(1 << 2, run_until(looper.pass_start,
+                                        looper.pass_start + 200, &when));
+}
+
+void test_looper_stop() {
+    record_riff();
+    looper_play(1600);
+    looper_stop(1700);
+    TEST_ASSERT_EQUAL(LOOPER_IDLE, looper.state);
+    TEST_ASSERT_EQUAL(0, looper_run(1800));
+
+    // The recording is kept to play again
+    TEST_ASSERT_TRUE(looper_play(5000));
+    TEST_ASSERT_EQUAL(1 << 1, looper_run(5000));
+}
+
+void test_looper_stop_ends_recording() {
+    record_riff();
+    looper_stop(1700);
+    TEST_ASSERT_EQUAL(LOOPER_IDLE, looper.state);
+    TEST_ASSERT_EQUAL(700, looper.length);
+}
+
+void test_looper_capped_per_run() {
+    looper_arm();
+    looper_record(0x0FFF, 1000);
+    looper_record(0x0FFF, 1010);
+    looper_play(1100);
+
+    uint16_t first = looper_run(1100);
+    TEST_ASSERT_EQUAL(0x0FFF, first);
+    TEST_ASSERT_EQUAL(12, looper.index);
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_looper_event_is_compact);
+    RUN_TEST(test_looper_idle_records_nothing);
+    RUN_TEST(test_looper_records_deltas);
+    RUN_TEST(test_looper_long_gap_waits);
+    RUN_TEST(test_looper_plays_and_repeats);
+    RUN_TEST(test_looper_late_passes_dont_drift);
+    RUN_TEST(test_looper_skips_missed_repetitions);
+    RUN_TEST(test_looper_quantized_to_tempo);
+    RUN_TEST(test_looper_ring_keeps_latest);
+    RUN_TEST(test_looper_stop);
+    RUN_TEST(test_looper_stop_ends_recording);
+    RUN_TEST(test_looper_capped_per_run);
+
+    return UNITY_END();
+}
@@ -0,0 +1,432 @@
+/*
+ * Native tests for the pattern interpreter.
+ *
+ * Patterns are assembled straight into pattern_code, pixels drawn are
+ * captured by the pixel_set() stub and the messages sent by the sendHMTL*
+ * stubs.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_pattern
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "HMTLPrograms.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Sensors.h"
+#include "Fire_Control_Pattern.h"
+
+extern unsigned long _mock_millis;
+extern bool switch_states[];
+extern uint16_t touch_states;
+extern uint8_t local_pixels_output;
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void     reset_send_captures();
+    bool     send_value_was_called();
+    uint16_t last_send_address();
+    int      last_send_value_int();
+    bool     send_timed_was_called();
+    uint16_t last_timed_address();
+    uint32_t last_timed_period();
+    bool     send_cancel_was_called();
+    int      send_call_count();
+
+    void     reset_pixel_captures();
+    int      pixel_set_count();
+    uint16_t last_pixel();
+    uint32_t last_pixel_rgb();
+}
+
+static pattern_header_t *header = (pattern_header_t *)pattern_code;
+static byte *code = pattern_code + sizeof (pattern_header_t);
+
+static void load(const byte *program, uint16_t length) {
+    header->magic = PATTERN_MAGIC;
+    header->length = length;
+    memcpy(code, program, length);
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(pattern_code, 0, sizeof (pattern_code));
+    memset(&pattern, 0, sizeof (pattern));
+    reset_send_captures();
+    reset_pixel_captures();
+    for (int i = 0; i < 4; i++) {
+        switch_states[i] = false;
+    }
+    switch_states[POOFER_ENABLE_SWITCH] = true;
+    switch_states[POOFER_PILOT_SWITCH] = true;
+    touch_states = 0;
+    local_pixels_output = 0;
+    _mock_millis = 1000;
+
+    header->targets[0].address = 69;
+    header->targets[0].output = 0;
+    header->targets[1].address = 66;
+    header->targets[1].output = 2;
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_pattern_none_loaded() {
+    TEST_ASSERT_FALSE(pattern_valid());
+    TEST_ASSERT_FALSE(pattern_start(1000));
+    TEST_ASSERT_FALSE(pattern.running);
+}
+
+void test_pattern_too_long_is_invalid() {
+    header->magic = PATTERN_MAGIC;
+    header->length = PATTERN_SIZE - sizeof (pattern_header_t) + 1;
+    TEST_ASSERT_FALSE(pattern_valid());
+
+    header->length = PATTERN_SIZE - sizeof (pattern_header_t);
+    TEST_ASSERT_TRUE(pattern_valid());
+}
+
+void test_pattern_runs_to_end() {
+    const byte program[] = { PAT_SET, 0, 42, PAT_VALUE, 1, 0, PAT_END };
+    load(program, sizeof (program));
+
+    TEST_ASSERT_TRUE(pattern_start(1000));
+    pattern_run(1000);
+
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_TRUE(send_value_was_called());
+    TEST_ASSERT_EQUAL(66, last_send_address());
+    TEST_ASSERT_EQUAL(42, last_send_value_int());
+    TEST_ASSERT_EQUAL(3, pattern.executed);
+    TEST_ASSERT_EQUAL(0, pattern.faults);
+}
+
+void test_pattern_wait_holds_until_due() {
+    const byte program[] = { PAT_WAIT, 5, PAT_SET, 0, 1, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_TRUE(pattern.running);
+    TEST_ASSERT_EQUAL(1050, pattern.due);
+    TEST_ASSERT_EQUAL(0, pattern.regs[0]);
+
+    pattern_run(1049);
+    TEST_ASSERT_TRUE(pattern.running);
+
+    pattern_run(1050);
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(1, pattern.regs[0]);
+}
+
+void test_pattern_late_pass_does_not_drift() {
+    /* Forever: wait 100ms and count */
+    const byte program[] = { PAT_LOOP, 0, PAT_WAIT, 10, PAT_ADD, 0, 1,
+                             PAT_NEXT };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(1100, pattern.due);
+
+    /* Run late, the next wait is still timed from when this one ended */
+    pattern_run(1130);
+    TEST_ASSERT_EQUAL(1, pattern.regs[0]);
+    TEST_ASSERT_EQUAL(1200, pattern.due);
+
+    pattern_run(1200);
+    TEST_ASSERT_EQUAL(2, pattern.regs[0]);
+    TEST_ASSERT_EQUAL(1300, pattern.due);
+}
+
+void test_pattern_loop_count() {
+    const byte program[] = { PAT_LOOP, 3, PAT_ADD, 0, 2, PAT_NEXT, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(6, pattern.regs[0]);
+    TEST_ASSERT_EQUAL(0, pattern.depth);
+}
+
+void test_pattern_nested_loops() {
+    const byte program[] = { PAT_LOOP, 2, PAT_LOOP, 3, PAT_ADD, 1, 1,
+                             PAT_NEXT, PAT_NEXT, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(6, pattern.regs[1]);
+}
+
+void test_pattern_budget_yields() {
+    /* Loops forever without waiting */
+    const byte program[] = { PAT_LOOP, 0, PAT_ADD, 0, 1, PAT_NEXT };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+
+    TEST_ASSERT_TRUE(pattern.running);
+    TEST_ASSERT_EQUAL(PATTERN_BUDGET, pattern.executed);
+    TEST_ASSERT_EQUAL(1, pattern.yields);
+
+    /* Carries on from where it stopped */
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(2 * PATTERN_BUDGET, pattern.executed);
+    TEST_ASSERT_EQUAL(2, pattern.yields);
+}
+
+void test_pattern_bad_opcode_faults() {
+    const byte program[] = { PAT_SET, 0, 1, 0x7F, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(1, pattern.faults);
+    TEST_ASSERT_EQUAL(1, pattern.executed);
+}
+
+void test_pattern_truncated_instruction_faults() {
+    /* The RGB is missing its blue */
+    const byte program[] = { PAT_RGB, 10, 20 };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(1, pattern.faults);
+    TEST_ASSERT_EQUAL(0, pattern.executed);
+}
+
+void test_pattern_running_off_the_end_faults() {
+    const byte program[] = { PAT_SET, 0, 1 };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(1, pattern.faults);
+}
+
+void test_pattern_bad_operands_fault() {
+    const byte bad_register[] = { PAT_SET, PATTERN_REGISTERS, 1, PAT_END };
+    load(bad_register, sizeof (bad_register));
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(1, pattern.faults);
+
+    const byte bad_target[] = { PAT_OFF, PATTERN_MAX_TARGETS, PAT_END };
+    load(bad_target, sizeof (bad_target));
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(2, pattern.faults);
+    TEST_ASSERT_FALSE(send_cancel_was_called());
+
+    const byte unmatched[] = { PAT_NEXT, PAT_END };
+    load(unmatched, sizeof (unmatched));
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(3, pattern.faults);
+}
+
+void test_pattern_color_ops() {
+    const byte program[] = { PAT_RGB, 200, 100, 0, PAT_SCALE, 127,
+                             PAT_ADD_RGB, 200, 10, 5, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+
+    TEST_ASSERT_EQUAL(255, pattern.color[0]);
+    TEST_ASSERT_EQUAL(60, pattern.color[1]);
+    TEST_ASSERT_EQUAL(5, pattern.color[2]);
+}
+
+void test_pattern_pixel_and_fill() {
+    const byte program[] = { PAT_RGB, 1, 2, 3, PAT_SET, 0, 4, PAT_PIXEL, 0,
+                             PAT_WAIT, 1, PAT_FILL, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    TEST_ASSERT_TRUE(pattern_run(1000));
+    TEST_ASSERT_EQUAL(1, pixel_set_count());
+    TEST_ASSERT_EQUAL(4, last_pixel());
+    TEST_ASSERT_TRUE(0x010203 == last_pixel_rgb());
+
+    TEST_ASSERT_TRUE(pattern_run(1010));
+    TEST_ASSERT_EQUAL(1 + pixels.numPixels(), pixel_set_count());
+}
+
+void test_pattern_pixel_out_of_range_skipped() {
+    const byte program[] = { PAT_SET, 0, 200, PAT_PIXEL, 0, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    TEST_ASSERT_FALSE(pattern_run(1000));
+    TEST_ASSERT_EQUAL(0, pixel_set_count());
+    TEST_ASSERT_EQUAL(0, pattern.faults);
+}
+
+void test_pattern_no_pixels_output() {
+    const byte program[] = { PAT_FILL, PAT_END };
+    load(program, sizeof (program));
+    local_pixels_output = HMTL_NO_OUTPUT;
+
+    pattern_start(1000);
+    TEST_ASSERT_FALSE(pattern_run(1000));
+    TEST_ASSERT_EQUAL(0, pixel_set_count());
+}
+
+void test_pattern_if_touch_skips() {
+    const byte program[] = { PAT_IF_TOUCH, 3, PAT_SET, 0, 9, PAT_ADD, 1, 1,
+                             PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(0, pattern.regs[0]);
+    TEST_ASSERT_EQUAL(1, pattern.regs[1]);
+
+    touch_states = (1 << 3);
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(9, pattern.regs[0]);
+    TEST_ASSERT_EQUAL(1, pattern.regs[1]);
+}
+
+void test_pattern_burst_needs_armed_poofers() {
+    const byte program[] = { PAT_BURST, 0, 5, PAT_END };
+    load(program, sizeof (program));
+
+    switch_states[POOFER_PILOT_SWITCH] = false;
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_FALSE(send_timed_was_called());
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(0, pattern.faults);
+
+    switch_states[POOFER_PILOT_SWITCH] = true;
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_TRUE(send_timed_was_called());
+    TEST_ASSERT_EQUAL(69, last_timed_address());
+    TEST_ASSERT_EQUAL(50, last_timed_period());
+}
+
+void test_pattern_stops_when_disarmed() {
+    const byte program[] = { PAT_LOOP, 0, PAT_BURST, 0, 5, PAT_WAIT, 10,
+                             PAT_NEXT };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+
+    switch_states[POOFER_ENABLE_SWITCH] = false;
+    pattern_run(1100);
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+
+    // Re-arming doesn't carry on with the bursts
+    switch_states[POOFER_ENABLE_SWITCH] = true;
+    pattern_run(1200);
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+}
+
+void test_pattern_off_cancels() {
+    const byte program[] = { PAT_OFF, 1, PAT_END };
+    load(program, sizeof (program));
+
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_TRUE(send_cancel_was_called());
+    TEST_ASSERT_TRUE(send_value_was_called());
+    TEST_ASSERT_EQUAL(0, last_send_value_int());
+}
+
+void test_pattern_host_msg_writes_and_stops() {
+    const byte program[] = { PAT_LOOP, 0, PAT_WAIT, 1, PAT_NEXT };
+    load(program, sizeof (program));
+    pattern_start(1000);
+    pattern_run(1000);
+    TEST_ASSERT_TRUE(pattern.running);
+
+    byte buffer[sizeof (msg_hdr_t) + sizeof (msg_fire_pattern_t) + 2];
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+    msg_fire_pattern_t *msg = (msg_fire_pattern_t *)(msg_hdr + 1);
+    msg_hdr->length = sizeof (buffer);
+    msg->offset = sizeof (pattern_header_t);
+    msg->data[0] = PAT_END;
+    msg->data[1] = PAT_END;
+
+    pattern_host_msg(msg_hdr);
+    TEST_ASSERT_FALSE(pattern.running);
+    TEST_ASSERT_EQUAL(PAT_END, code[0]);
+    TEST_ASSERT_EQUAL(PAT_END, code[1]);
+}
+
+void test_pattern_host_msg_past_end_ignored() {
+    byte buffer[sizeof (msg_hdr_t) + sizeof (msg_fire_pattern_t) + 2];
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+    msg_fire_pattern_t *msg = (msg_fire_pattern_t *)(msg_hdr + 1);
+    msg_hdr->length = sizeof (buffer);
+    msg->offset = PATTERN_SIZE - 1;
+    msg->data[0] = 0xAA;
+    msg->data[1] = 0xAA;
+
+    pattern_host_msg(msg_hdr);
+    TEST_ASSERT_EQUAL(0, pattern_code[PATTERN_SIZE - 1]);
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_pattern_none_loaded);
+    RUN_TEST(test_pattern_too_long_is_invalid);
+    RUN_TEST(test_pattern_runs_to_end);
+    RUN_TEST(test_pattern_wait_holds_until_due);
+    RUN_TEST(test_pattern_late_pass_does_not_drift);
+    RUN_TEST(test_pattern_loop_count);
+    RUN_TEST(test_pattern_nested_loops);
+    RUN_TEST(test_pattern_budget_yields);
+    RUN_TEST(test_pattern_bad_opcode_faults);
+    RUN_TEST(test_pattern_truncated_instruction_faults);
+    RUN_TEST(test_pattern_running_off_the_end_faults);
+    RUN_TEST(test_pattern_bad_operands_fault);
+    RUN_TEST(test_pattern_color_ops);
+    RUN_TEST(test_pattern_pixel_and_fill);
+    RUN_TEST(test_pattern_pixel_out_of_range_skipped);
+    RUN_TEST(test_pattern_no_pixels_output);
+    RUN_TEST(test_pattern_if_touch_skips);
+    RUN_TEST(test_pattern_burst_needs_armed_poofers);
+    RUN_TEST(test_pattern_stops_when_disarmed);
+    RUN_TEST(test_pattern_off_cancels);
+    RUN_TEST(test_pattern_host_msg_writes_and_stops);
+    RUN_TEST(test_pattern_host_msg_past_end_ignored);
+
+    return UNITY_END();
+}
@@ -0,0 +1,413 @@
+/*
+ * Native tests for the program tracker pool.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_pool
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTLPrograms.h"
+#include "Fire_Control_Pool.h"
+
+extern unsigned long _mock_millis;
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+}
+
+/* A layer above those the firmware uses */
+#define LAYER_TOP (POOL_LAYER_SEQUENCE + 1)
+
+/* Layers in the order they ran */
+static uint8_t run_order[POOL_SLOTS];
+static uint8_t run_count;
+static uint8_t finish_layer;
+
+static boolean fake_program(output_hdr_t *output, void *object,
+                            program_tracker_t *tracker) {
+    uint8_t layer = *(uint8_t *)pool_state(tracker);
+    run_order[run_count++] = layer;
+    if (layer == finish_layer) {
+        tracker->done = true;
+    }
+    return true;
+}
+
+/* The layer is passed as the first value and kept in the slot's state */
+static boolean fake_setup(msg_program_t *msg, program_tracker_t *tracker,
+                          output_hdr_t *output, void *object,
+                          ProgramManager *manager) {
+    tracker->state = pool_state(tracker);
+    *(uint8_t *)tracker->state = msg->values[0];
+    return (msg->values[0] != 0xEE);
+}
+
+static hmtl_program_t fake = { 0x42, fake_program, fake_setup };
+
+static boolean start(uint8_t output, uint8_t layer) {
+    msg_program_t msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.values[0] = layer;
+    return pool_start(output, layer, &fake, &msg, NULL, NULL, NULL);
+}
+
+/* Changes every period from when it last changed, like program_blink */
+typedef struct {
+    uint16_t period;
+    unsigned long last;
+    uint16_t changes;
+    uint16_t late_max;
+} fake_blink_t;
+
+static boolean blink_program(output_hdr_t *output, void *object,
+                             program_tracker_t *tracker) {
+    fake_blink_t *state = (fake_blink_t *)tracker->state;
+    if (millis() - state->last < state->period) {
+        return false;
+    }
+    uint16_t late = millis() - state->last - state->period;
+    if (state->changes && (late > state->late_max)) {
+        state->late_max = late;
+    }
+    state->last = millis();
+    state->changes++;
+    return true;
+}
+
+static boolean blink_setup(msg_program_t *msg, program_tracker_t *tracker,
+                           output_hdr_t *output, void *object,
+                           ProgramManager *manager) {
+    fake_blink_t *state = (fake_blink_t *)pool_state(tracker);
+    memset(state, 0, sizeof (*state));
+    state->period = msg->values[0] * 10;
+    state->last = millis() - state->period;
+    tracker->state = state;
+    return true;
+}
+
+static hmtl_program_t blink = { 0x43, blink_program, blink_setup };
+
+static boolean start_blink(uint8_t output, uint16_t period) {
+    msg_program_t msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.values[0] = period / 10;
+    return pool_start(output, POOL_LAYER_MODE, &blink, &msg, NULL, NULL, NULL);
+}
+
+/* Draws its layer each time it's run, stepping on its own period */
+typedef struct {
+    uint16_t period;
+    unsigned long next;
+    uint16_t runs;
+    uint16_t steps;
+} fake_painter_t;
+
+static uint8_t shown[HMTL_MAX_OUTPUTS];
+
+static boolean painter_program(output_hdr_t *output, void *object,
+                               program_tracker_t *tracker) {
+    fake_painter_t *state = (fake_painter_t *)tracker->state;
+    if ((long)(millis() - state->next) >= 0) {
+        state->next += state->period;
+        state->steps++;
+    }
+    state->runs++;
+    shown[((pool_slot_t *)tracker)->output] = ((pool_slot_t *)tracker)->layer;
+    pool_wake(tracker, state->next);
+    return true;
+}
+
+static boolean painter_setup(msg_program_t *msg, program_tracker_t *tracker,
+                             output_hdr_t *output, void *object,
+                             ProgramManager *manager) {
+    fake_painter_t *state = (fake_painter_t *)pool_state(tracker);
+    memset(state, 0, sizeof (*state));
+    state->period = msg->values[0] * 10;
+    state->next = millis();
+    tracker->state = state;
+    return true;
+}
+
+static hmtl_program_t painter = { 0x45, painter_program, painter_setup };
+
+static fake_painter_t *start_painter(uint8_t output, uint8_t layer,
+                                     uint16_t period) {
+    msg_program_t msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.values[0] = period / 10;
+    pool_start(output, layer, &painter, &msg, NULL, NULL, NULL);
+    return (fake_painter_t *)pool_state(pool_find(output, layer));
+}
+
+static output_hdr_t *outputs[HMTL_MAX_OUTPUTS];
+static void *objects[HMTL_MAX_OUTPUTS];
+
+/* Run the pool with the clock at a time */
+static boolean run_at(unsigned long now) {
+    _mock_millis = now;
+    return pool_run(outputs, objects, now);
+}
+
+/* Run the pool every ms up to, but not including, a time */
+static void run_until(unsigned long from, unsigned long to) {
+    for (unsigned long now = from; now < to; now++) {
+        run_at(now);
+    }
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&pool, 0, sizeof (pool));
+    pool_init();
+    _mock_millis = 1000;
+    pool.tick = 1000 / POOL_TICK_MS;
+    run_count = 0;
+    finish_layer = POOL_NONE;
+    memset(shown, POOL_NONE, sizeof (shown));
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_pool_starts_empty() {
+    TEST_ASSERT_EQUAL(0, pool.used);
+    TEST_ASSERT_NULL(pool_find(0, POOL_LAYER_MODE));
+    TEST_ASSERT_FALSE(run_at(1100));
+}
+
+void test_pool_layers_run_in_order() {
+    TEST_ASSERT_TRUE(start(1, LAYER_TOP));
+    TEST_ASSERT_TRUE(start(1, POOL_LAYER_MODE));
+    TEST_ASSERT_TRUE(start(1, POOL_LAYER_SEQUENCE));
+
+    TEST_ASSERT_TRUE(run_at(1100));
+    TEST_ASSERT_EQUAL(3, run_count);
+    TEST_ASSERT_EQUAL(POOL_LAYER_MODE, run_order[0]);
+    TEST_ASSERT_EQUAL(POOL_LAYER_SEQUENCE, run_order[1]);
+    TEST_ASSERT_EQUAL(LAYER_TOP, run_order[2]);
+}
+
+void test_pool_restart_reuses_slot() {
+    start(0, POOL_LAYER_MODE);
+    program_tracker_t *tracker = pool_find(0, POOL_LAYER_MODE);
+
+    TEST_ASSERT_TRUE(start(0, POOL_LAYER_MODE));
+    TEST_ASSERT_TRUE(tracker == pool_find(0, POOL_LAYER_MODE));
+    TEST_ASSERT_EQUAL(1, pool.used);
+    TEST_ASSERT_EQUAL(2, pool.starts);
+}
+
+void test_pool_outputs_separate() {
+    start(0, POOL_LAYER_MODE);
+    start(1, POOL_LAYER_MODE);
+    pool_cancel(0, POOL_LAYER_MODE);
+    TEST_ASSERT_NULL(pool_find(0, POOL_LAYER_MODE));
+    TEST_ASSERT_NOT_NULL(pool_find(1, POOL_LAYER_MODE));
+}
+
+void test_pool_exhausted() {
+    for (uint8_t i = 0; i < POOL_SLOTS; i++) {
+        TEST_ASSERT_TRUE(start(i % HMTL_MAX_OUTPUTS, i));
+    }
+    TEST_ASSERT_FALSE(start(0, 0x80));
+    TEST_ASSERT_EQUAL(1, pool.exhausted);
+    TEST_ASSERT_EQUAL(POOL_SLOTS, pool.peak);
+
+    // A freed slot is taken by the next start
+    pool_cancel(1, 1);
+    TEST_ASSERT_TRUE(start(0, 0x80));
+    TEST_ASSERT_EQUAL(POOL_SLOTS, pool.used);
+}
+
+void test_pool_cancel_all_layers() {
+    start(2, POOL_LAYER_MODE);
+    start(2, POOL_LAYER_SEQUENCE);
+    start(3, POOL_LAYER_MODE);
+    pool_cancel(2, POOL_ALL_LAYERS);
+    TEST_ASSERT_EQUAL(1, pool.used);
+    TEST_ASSERT_NULL(pool_find(2, POOL_LAYER_SEQUENCE));
+}
+
+void test_pool_done_programs_freed() {
+    start(0, POOL_LAYER_MODE);
+    start(0, POOL_LAYER_SEQUENCE);
+    start(0, LAYER_TOP);
+    finish_layer = POOL_LAYER_SEQUENCE;
+
+    run_at(1100);
+    TEST_ASSERT_EQUAL(2, pool.used);
+    TEST_ASSERT_NULL(pool_find(0, POOL_LAYER_SEQUENCE));
+
+    // The rest still run in order
+    run_count = 0;
+    run_at(1200);
+    TEST_ASSERT_EQUAL(2, run_count);
+    TEST_ASSERT_EQUAL(POOL_LAYER_MODE, run_order[0]);
+    TEST_ASSERT_EQUAL(LAYER_TOP, run_order[1]);
+}
+
+void test_pool_failed_setup_frees() {
+    TEST_ASSERT_FALSE(start(0, 0xEE));
+    TEST_ASSERT_EQUAL(0, pool.used);
+    TEST_ASSERT_NULL(pool_find(0, 0xEE));
+}
+
+void test_pool_bad_requests() {
+    hmtl_program_t none = { 0, NULL, NULL };
+    TEST_ASSERT_FALSE(pool_start(0, 0, &none, NULL, NULL, NULL, NULL));
+    TEST_ASSERT_FALSE(pool_start(0, 0, NULL, NULL, NULL, NULL, NULL));
+    TEST_ASSERT_FALSE(start(HMTL_NO_OUTPUT, POOL_LAYER_MODE));
+    TEST_ASSERT_EQUAL(0, pool.used);
+}
+
+void test_pool_same_tick_returns_early() {
+    start(0, POOL_LAYER_MODE);
+    TEST_ASSERT_TRUE(run_at(1008));
+    TEST_ASSERT_EQUAL(1, pool.calls);
+
+    // Nothing more is looked at until the next tick
+    TEST_ASSERT_FALSE(run_at(1009));
+    TEST_ASSERT_EQUAL(1, pool.calls);
+}
+
+void test_pool_new_program_runs_next_tick() {
+    start(0, POOL_LAYER_MODE);
+    TEST_ASSERT_FALSE(run_at(1007));
+    TEST_ASSERT_TRUE(run_at(1008));
+}
+
+void test_pool_idle_programs_rarely_run() {
+    for (uint8_t i = 0; i < 4; i++) {
+        start_blink(i, 500);
+    }
+    run_until(1000, 3000);
+
+    fake_blink_t *state = (fake_blink_t *)pool_state(pool_find(0, 0));
+    TEST_ASSERT_EQUAL(4, state->changes);
+    uint16_t interval = pool.slots[pool.heads[0]].interval;
+    TEST_ASSERT_TRUE((interval >= 500) && (interval < 500 + POOL_TICK_MS));
+
+    // Woken on the learnt interval, never a tick late
+    TEST_ASSERT_TRUE(state->late_max < POOL_TICK_MS);
+
+    // Ticks until the interval is learnt, run every pass would be 8000
+    TEST_ASSERT_TRUE(pool.calls < 4 * 70);
+}
+
+void test_pool_uneven_intervals_still_on_time() {
+    start_blink(0, 100);
+    run_until(1000, 1400);
+
+    // Made slower the program is looked at every tick past the old interval
+    fake_blink_t *state = (fake_blink_t *)pool_state(pool_find(0, 0));
+    state->period = 250;
+    run_until(1400, 2400);
+    TEST_ASSERT_TRUE(state->late_max < POOL_TICK_MS);
+}
+
+static boolean wake_program(output_hdr_t *output, void *object,
+                            program_tracker_t *tracker) {
+    run_order[run_count++] = 0;
+    pool_wake(tracker, millis() + 300);
+    return false;
+}
+
+void test_pool_program_sets_wake() {
+    hmtl_program_t waker = { 0x44, wake_program, fake_setup };
+    msg_program_t msg;
+    memset(&msg, 0, sizeof (msg));
+    pool_start(0, 0, &waker, &msg, NULL, NULL, NULL);
+
+    run_until(1000, 1300);
+    TEST_ASSERT_EQUAL(1, run_count);
+    run_until(1300, 1315);
+    TEST_ASSERT_EQUAL(2, run_count);
+}
+
+void test_pool_higher_layer_drawn_over_lower() {
+    fake_painter_t *top = start_painter(0, LAYER_TOP, 1000);
+    fake_painter_t *mode = start_painter(0, POOL_LAYER_MODE, 50);
+    fake_painter_t *other = start_painter(1, LAYER_TOP, 1000);
+
+    for (unsigned long now = 1000; now < 1900; now++) {
+        run_at(now);
+        if (mode->runs) {
+            TEST_ASSERT_EQUAL(LAYER_TOP, shown[0]);
+        }
+    }
+
+    // Drawn again each time the lower layer changed
+    TEST_ASSERT_TRUE(mode->steps > 10);
+    TEST_ASSERT_EQUAL(mode->runs, top->runs);
+
+    // Its own timing is unchanged, as is a layer on another output
+    TEST_ASSERT_EQUAL(1, top->steps);
+    TEST_ASSERT_EQUAL(2000, top->next);
+    TEST_ASSERT_EQUAL(1, other->runs);
+}
+
+void test_pool_unchanged_lower_layer_no_redraw() {
+    start_blink(0, 500);
+    fake_painter_t *top = start_painter(0, LAYER_TOP, 1000);
+    run_until(1000, 1900);
+
+    // Only drawn over when the layer below changed
+    fake_blink_t *state = (fake_blink_t *)pool_state(pool_find(0, 0));
+    TEST_ASSERT_EQUAL(2, state->changes);
+    TEST_ASSERT_EQUAL(state->changes, top->runs);
+    TEST_ASSERT_TRUE(pool.calls > 2 * state->changes);
+}
+
+void test_pool_wake_ignores_other_trackers() {
+    program_tracker_t tracker;
+    memset(&tracker, 0, sizeof (tracker));
+    pool_wake(&tracker, 5000);
+    TEST_ASSERT_EQUAL(0, pool.used);
+}
+
+void test_pool_cancelled_not_run() {
+    start(0, POOL_LAYER_MODE);
+    start(1, POOL_LAYER_MODE);
+    pool_cancel(0, POOL_LAYER_MODE);
+    run_at(1100);
+    TEST_ASSERT_EQUAL(1, run_count);
+    TEST_ASSERT_EQUAL(1, pool.calls);
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_pool_starts_empty);
+    RUN_TEST(test_pool_layers_run_in_order);
+    RUN_TEST(test_pool_restart_reuses_slot);
+    RUN_TEST(test_pool_outputs_separate);
+    RUN_TEST(test_pool_exhausted);
+    RUN_TEST(test_pool_cancel_all_layers);
+    RUN_TEST(test_pool_done_programs_freed);
+    RUN_TEST(test_pool_failed_setup_frees);
+    RUN_TEST(test_pool_bad_requests);
+    RUN_TEST(test_pool_same_tick_returns_early);
+    RUN_TEST(test_pool_new_program_runs_next_tick);
+    RUN_TEST(test_pool_idle_programs_rarely_run);
+    RUN_TEST(test_pool_uneven_intervals_still_on_time);
+    RUN_TEST(test_pool_program_sets_wake);
+    RUN_TEST(test_pool_higher_layer_drawn_over_lower);
+    RUN_TEST(test_pool_unchanged_lower_layer_no_redraw);
+    RUN_TEST(test_pool_wake_ignores_other_trackers);
+    RUN_TEST(test_pool_cancelled_not_run);
+
+    return UNITY_END();
+}
@@ -0,0 +1,206 @@
+/*
+ * Native tests for pressure-proportional output.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_pressure
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Pressure.h"
+#include "Fire_Control_Sensors.h"
+
+void checkPulse(uint8_t sensor, uint16_t address, uint8_t output,
+                uint16_t onperiod, uint16_t offperiod);
+void handle_pressure();
+
+extern unsigned long _mock_millis;
+extern bool switch_states[];
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+
+    void reset_send_captures();
+    bool send_value_was_called();
+    uint16_t last_send_address();
+    int  last_send_value_int();
+    bool send_blink_was_called();
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&pressure, 0, sizeof (pressure));
+    reset_send_captures();
+    fire_config_defaults();
+    touch_sensor._clearAll();
+    for (int i = 0; i < 4; i++) {
+        switch_states[i] = false;
+    }
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_pressure_curve_is_increasing() {
+    for (int i = 1; i < PRESSURE_CURVE_POINTS; i++) {
+        TEST_ASSERT_TRUE(pressure_curve[i].delta > pressure_curve[i - 1].delta);
+        TEST_ASSERT_TRUE(pressure_curve[i].value >= pressure_curve[i - 1].value);
+    }
+}
+
+void test_pressure_map_interpolates() {
+    TEST_ASSERT_EQUAL(0, pressure_map(0));
+    TEST_ASSERT_EQUAL(0, pressure_map(4));
+    TEST_ASSERT_EQUAL(24, pressure_map(8));
+    TEST_ASSERT_EQUAL(48, pressure_map(12));
+    TEST_ASSERT_EQUAL(104, pressure_map(26));
+}
+
+void test_pressure_map_saturates() {
+    TEST_ASSERT_EQUAL(255, pressure_map(100));
+    TEST_ASSERT_EQUAL(255, pressure_map(1000));
+}
+
+void test_pressure_noise_not_sent() {
+    TEST_ASSERT_FALSE(pressure_update(3, 1000));
+    TEST_ASSERT_FALSE(pressure_update(4, 1100));
+    TEST_ASSERT_EQUAL(0, pressure.updates);
+}
+
+void test_pressure_hysteresis() {
+    TEST_ASSERT_TRUE(pressure_update(12, 1000));
+    TEST_ASSERT_EQUAL(48, pressure.value);
+
+    // Within the hysteresis of the value sent
+    TEST_ASSERT_FALSE(pressure_update(13, 1100));
+    TEST_ASSERT_EQUAL(48, pressure.value);
+
+    TEST_ASSERT_TRUE(pressure_update(14, 1200));
+    TEST_ASSERT_EQUAL(56, pressure.value);
+}
+
+void test_pressure_release_always_sent() {
+    pressure.value = 3;
+    pressure.updates = 1;
+    TEST_ASSERT_TRUE(pressure_update(0, 1000));
+    TEST_ASSERT_EQUAL(0, pressure.value);
+
+    pressure.value = 252;
+    TEST_ASSERT_TRUE(pressure_update(200, 2000));
+    TEST_ASSERT_EQUAL(255, pressure.value);
+}
+
+void test_pressure_rate_bounded() {
+    TEST_ASSERT_TRUE(pressure_update(12, 1000));
+
+    // A change too soon waits for the period, its latency is recorded
+    TEST_ASSERT_FALSE(pressure_update(40, 1010));
+    TEST_ASSERT_FALSE(pressure_update(40, 1020));
+    TEST_ASSERT_TRUE(pressure_update(40, 1000 + PRESSURE_PERIOD_MS));
+    TEST_ASSERT_EQUAL(160, pressure.value);
+    TEST_ASSERT_EQUAL(PRESSURE_PERIOD_MS - 10, pressure.latency_max);
+    TEST_ASSERT_EQUAL(2, pressure.updates);
+    TEST_ASSERT_EQUAL((PRESSURE_PERIOD_MS - 10) / 2,
+                      pressure_latency_average());
+}
+
+void test_pressure_pending_dropped_when_back() {
+    TEST_ASSERT_TRUE(pressure_update(12, 1000));
+    TEST_ASSERT_FALSE(pressure_update(40, 1010));
+    TEST_ASSERT_TRUE(pressure.pending);
+
+    // Returning to the value sent leaves nothing to send
+    TEST_ASSERT_FALSE(pressure_update(12, 1020));
+    TEST_ASSERT_FALSE(pressure.pending);
+    TEST_ASSERT_FALSE(pressure_update(12, 1000 + PRESSURE_PERIOD_MS));
+}
+
+void test_pressure_no_reading_not_sent() {
+    // Nothing answers on the stub I2C bus
+    TEST_ASSERT_EQUAL(PRESSURE_NO_READING, pressure_read_delta(PRESSURE_SENSOR));
+    pressure_service(1000);
+    TEST_ASSERT_FALSE(send_value_was_called());
+    TEST_ASSERT_EQUAL(1000, pressure.sampled);
+}
+
+void test_pressure_stop_turns_off() {
+    pressure_stop();
+    TEST_ASSERT_FALSE(send_value_was_called());
+
+    pressure.value = 100;
+    pressure_stop();
+    TEST_ASSERT_TRUE(send_value_was_called());
+    TEST_ASSERT_EQUAL(lights_address, last_send_address());
+    TEST_ASSERT_EQUAL(0, last_send_value_int());
+    TEST_ASSERT_EQUAL(0, pressure.value);
+}
+
+void test_pressure_sensor_does_not_fire() {
+    TEST_ASSERT_TRUE(sensor_fires(PRESSURE_SENSOR));
+
+    fire_config.flags |= FIRE_FLAG_PRESSURE;
+    TEST_ASSERT_FALSE(sensor_fires(PRESSURE_SENSOR));
+    TEST_ASSERT_TRUE(sensor_fires(PRESSURE_SENSOR - 1));
+
+    touch_sensor._setTouched(PRESSURE_SENSOR, true);
+    checkPulse(PRESSURE_SENSOR, poofer2_address, POOFER2_POOF1, 100, 200);
+    TEST_ASSERT_FALSE(send_blink_was_called());
+}
+
+void test_pressure_to_poofer_needs_armed() {
+    uint16_t saved = lights_address;
+    lights_address = poofer2_address;
+    fire_config.flags |= FIRE_FLAG_PRESSURE;
+    _mock_millis = 1000;
+
+    handle_pressure();
+    TEST_ASSERT_EQUAL(0, pressure.sampled);
+
+    switch_states[POOFER_ENABLE_SWITCH] = true;
+    switch_states[POOFER_PILOT_SWITCH] = true;
+    handle_pressure();
+    TEST_ASSERT_EQUAL(1000, pressure.sampled);
+
+    // Disarming turns the valve off
+    pressure.value = 100;
+    switch_states[POOFER_PILOT_SWITCH] = false;
+    handle_pressure();
+    TEST_ASSERT_TRUE(send_value_was_called());
+    TEST_ASSERT_EQUAL(poofer2_address, last_send_address());
+    TEST_ASSERT_EQUAL(0, last_send_value_int());
+
+    lights_address = saved;
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_pressure_curve_is_increasing);
+    RUN_TEST(test_pressure_map_interpolates);
+    RUN_TEST(test_pressure_map_saturates);
+    RUN_TEST(test_pressure_noise_not_sent);
+    RUN_TEST(test_pressure_hysteresis);
+    RUN_TEST(test_pressure_release_always_sent);
+    RUN_TEST(test_pressure_rate_bounded);
+    RUN_TEST(test_pressure_pending_dropped_when_back);
+    RUN_TEST(test_pressure_no_reading_not_sent);
+    RUN_TEST(test_pressure_stop_turns_off);
+    RUN_TEST(test_pressure_sensor_does_not_fire);
+    RUN_TEST(test_pressure_to_poofer_needs_armed);
+
+    return UNITY_END();
+}
@@ -0,0 +1,270 @@
+/*
+ * Native tests for streaming configuration blobs to nodes.
+ *
+ * The test plays both the USB host, answering the controller's chunk
+ * requests, and the node, acknowledging the frames captured from bus_send().
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_provision
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Provision.h"
+
+extern unsigned long _mock_millis;
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void        reset_bus_frames();
+    int         bus_frame_count();
+    const byte *bus_frame(int n);
+}
+
+#define NODE_ADDRESS 66
+#define BLOB_SIZE    200
+
+static byte blob[BLOB_SIZE];
+
+/* Simulated node */
+static byte     node_data[BLOB_SIZE];
+static uint16_t node_received;
+static boolean  node_committed;
+static int      node_frames;
+static int      node_drop_chunk; // Offset of a chunk to lose once, or -1
+static boolean  node_corrupt_commit;
+
+static byte frame[sizeof (msg_hdr_t) + sizeof (msg_fire_config_t) +
+                  CFG_CHUNK_SIZE];
+
+static msg_hdr_t *make_msg(uint8_t op, uint8_t status, uint16_t offset,
+                           uint16_t length, uint16_t crc,
+                           const byte *data, uint8_t datalen) {
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)frame;
+    hmtl_msg_fmt(msg_hdr, NODE_ADDRESS,
+                 sizeof (msg_hdr_t) + sizeof (msg_fire_config_t) + datalen,
+                 MSG_TYPE_FIRE_CONFIG, 0);
+    msg_fire_config_t *cfg = (msg_fire_config_t *)(msg_hdr + 1);
+    cfg->op = op;
+    cfg->status = status;
+    cfg->target = NODE_ADDRESS;
+    cfg->offset = offset;
+    cfg->length = length;
+    cfg->crc = crc;
+    if (datalen) memcpy(cfg->data, data, datalen);
+    return msg_hdr;
+}
+
+static void node_ack(uint8_t status, uint16_t offset) {
+    cfg_node_msg(NODE_ADDRESS,
+                 make_msg(CFG_OP_ACK, status, offset, 0, 0, NULL, 0));
+}
+
+/* Deliver the frames the controller has sent to the node */
+static void node_run() {
+    while (node_frames < bus_frame_count()) {
+        const msg_hdr_t *msg_hdr = (const msg_hdr_t *)bus_frame(node_frames++);
+        TEST_ASSERT_EQUAL(MSG_TYPE_FIRE_CONFIG, msg_hdr->type);
+        TEST_ASSERT_EQUAL(NODE_ADDRESS, msg_hdr->address);
+        const msg_fire_config_t *cfg = (const msg_fire_config_t *)(msg_hdr + 1);
+
+        switch (cfg->op) {
+            case CFG_OP_START:
+                node_ack(CFG_STATUS_OK, node_received);
+                break;
+            case CFG_OP_CHUNK:
+                if (cfg->offset == node_drop_chunk) {
+                    node_drop_chunk = -1;
+                    break;
+                }
+                if ((cfg->offset == node_received) &&
+                    (cfg_crc(cfg->data, cfg->length) == cfg->crc)) {
+                    memcpy(node_data + cfg->offset, cfg->data, cfg->length);
+                    node_received += cfg->length;
+                }
+                node_ack(CFG_STATUS_OK, node_received);
+                break;
+            case CFG_OP_COMMIT: {
+                uint16_t crc = cfg_crc(node_data, node_received);
+                if (node_corrupt_commit) crc++;
+                node_committed = (crc == cfg->crc);
+                node_ack(node_committed ? CFG_STATUS_OK : CFG_STATUS_CRC,
+                         node_received);
+                break;
+            }
+        }
+    }
+}
+
+/* Answer an outstanding chunk request from the controller */
+static void host_run() {
+    if (cfg_xfer.requested == 0) return;
+    uint16_t offset = cfg_xfer.sent;
+    uint8_t len = cfg_xfer.requested - offset;
+    cfg_host_msg(make_msg(CFG_OP_CHUNK, CFG_STATUS_OK, offset, len,
+                          cfg_crc(blob + offset, len), blob + offset, len));
+}
+
+static void host_start() {
+    cfg_host_msg(make_msg(CFG_OP_START, CFG_STATUS_OK, 0, BLOB_SIZE,
+                          cfg_crc(blob, BLOB_SIZE), NULL, 0));
+}
+
+/* Run the transfer for up to the given time, returning when it finishes */
+static void run_transfer(unsigned long duration) {
+    unsigned long end = _mock_millis + duration;
+    while ((cfg_xfer.state != CFG_IDLE) && (_mock_millis < end)) {
+        node_run();
+        cfg_service(_mock_millis);
+        host_run();
+        _mock_millis++;
+    }
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    _mock_millis = 1000;
+    memset(&cfg_xfer, 0, sizeof (cfg_xfer));
+    reset_bus_frames();
+
+    for (int i = 0; i < BLOB_SIZE; i++) blob[i] = (byte)(i * 7 + 3);
+    memset(node_data, 0, sizeof (node_data));
+    node_received = 0;
+    node_committed = false;
+    node_frames = 0;
+    node_drop_chunk = -1;
+    node_corrupt_commit = false;
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_provision_crc() {
+    // CRC-16/CCITT-FALSE check value
+    const byte check[] = "123456789";
+    TEST_ASSERT_EQUAL_HEX16(0x29B1, cfg_crc(check, 9));
+    // Computing in pieces matches computing at once
+    TEST_ASSERT_EQUAL_HEX16(cfg_crc(check, 9), cfg_crc(check + 4, 5,
+                                                       cfg_crc(check, 4)));
+}
+
+void test_provision_full_transfer() {
+    host_start();
+    TEST_ASSERT_EQUAL(CFG_STARTING, cfg_xfer.state);
+
+    run_transfer(1000);
+    TEST_ASSERT_EQUAL(CFG_IDLE, cfg_xfer.state);
+    TEST_ASSERT_TRUE(node_committed);
+    TEST_ASSERT_EQUAL(BLOB_SIZE, node_received);
+    TEST_ASSERT_EQUAL_MEMORY(blob, node_data, BLOB_SIZE);
+    TEST_ASSERT_EQUAL((BLOB_SIZE + CFG_CHUNK_SIZE - 1) / CFG_CHUNK_SIZE,
+                      cfg_xfer.chunks);
+    TEST_ASSERT_EQUAL(0, cfg_xfer.resends);
+}
+
+void test_provision_lost_chunk_resent() {
+    node_drop_chunk = 2 * CFG_CHUNK_SIZE;
+    host_start();
+
+    run_transfer(2000);
+    TEST_ASSERT_EQUAL(CFG_IDLE, cfg_xfer.state);
+    TEST_ASSERT_TRUE(node_committed);
+    TEST_ASSERT_EQUAL_MEMORY(blob, node_data, BLOB_SIZE);
+    TEST_ASSERT_TRUE(cfg_xfer.resends > 0);
+}
+
+void test_provision_window_limits_requests() {
+    // With no acknowledgements the controller stops asking after a window
+    host_start();
+    node_run();
+    for (int i = 0; i < CFG_WINDOW * 4; i++) {
+        cfg_service(_mock_millis);
+        host_run();
+    }
+    TEST_ASSERT_EQUAL(CFG_WINDOW * CFG_CHUNK_SIZE, cfg_xfer.sent);
+    TEST_ASSERT_EQUAL(0, cfg_xfer.acked);
+}
+
+void test_provision_resume() {
+    // The node already holds the first three chunks of this blob
+    memcpy(node_data, blob, 3 * CFG_CHUNK_SIZE + 5);
+    node_received = 3 * CFG_CHUNK_SIZE + 5;
+    host_start();
+    node_run();
+    TEST_ASSERT_EQUAL(CFG_STREAMING, cfg_xfer.state);
+    TEST_ASSERT_EQUAL(3 * CFG_CHUNK_SIZE, cfg_xfer.sent);
+
+    // The partial chunk is discarded by the node and sent again
+    node_received = 3 * CFG_CHUNK_SIZE;
+    run_transfer(1000);
+    TEST_ASSERT_TRUE(node_committed);
+    TEST_ASSERT_EQUAL_MEMORY(blob, node_data, BLOB_SIZE);
+    TEST_ASSERT_EQUAL((BLOB_SIZE - 1) / CFG_CHUNK_SIZE - 2, cfg_xfer.chunks);
+}
+
+void test_provision_commit_crc_failure() {
+    node_corrupt_commit = true;
+    host_start();
+    run_transfer(1000);
+    TEST_ASSERT_EQUAL(CFG_IDLE, cfg_xfer.state);
+    TEST_ASSERT_FALSE(node_committed);
+}
+
+void test_provision_timeout() {
+    // A node that never answers is given up on after the retries
+    host_start();
+    for (int i = 0; i < 2000; i++) {
+        cfg_service(_mock_millis++);
+    }
+    TEST_ASSERT_EQUAL(CFG_IDLE, cfg_xfer.state);
+    const msg_hdr_t *last = (const msg_hdr_t *)bus_frame(bus_frame_count() - 1);
+    TEST_ASSERT_EQUAL(CFG_OP_ABORT, ((msg_fire_config_t *)(last + 1))->op);
+    TEST_ASSERT_EQUAL(1 + CFG_MAX_RETRIES + 1, bus_frame_count());
+}
+
+void test_provision_busy() {
+    host_start();
+    msg_hdr_t *other = make_msg(CFG_OP_START, CFG_STATUS_OK, 0, 10, 0, NULL, 0);
+    ((msg_fire_config_t *)(other + 1))->target = NODE_ADDRESS + 1;
+    cfg_host_msg(other);
+    TEST_ASSERT_EQUAL(NODE_ADDRESS, cfg_xfer.target);
+    TEST_ASSERT_EQUAL(1, bus_frame_count());
+}
+
+void test_provision_ignores_other_nodes() {
+    host_start();
+    cfg_node_msg(NODE_ADDRESS + 1,
+                 make_msg(CFG_OP_ACK, CFG_STATUS_OK, 0, 0, 0, NULL, 0));
+    TEST_ASSERT_EQUAL(CFG_STARTING, cfg_xfer.state);
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_provision_crc);
+    RUN_TEST(test_provision_full_transfer);
+    RUN_TEST(test_provision_lost_chunk_resent);
+    RUN_TEST(test_provision_window_limits_requests);
+    RUN_TEST(test_provision_resume);
+    RUN_TEST(test_provision_commit_crc_failure);
+    RUN_TEST(test_provision_timeout);
+    RUN_TEST(test_provision_busy);
+    RUN_TEST(test_provision_ignores_other_nodes);
+
+    return UNITY_END();
+}
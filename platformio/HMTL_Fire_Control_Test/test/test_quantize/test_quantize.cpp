@@ -0,0 +1,196 @@
+/*
+ * Native tests for quantizing manual bursts to the beat grid.
+ *
+ * Released bursts are captured by the sendHMTLTimedChange stub.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_quantize
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "Fire_Control_Tempo.h"
+#include "Fire_Control_Quantize.h"
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void     reset_send_captures();
+    bool     send_timed_was_called();
+    uint16_t last_timed_address();
+    uint32_t last_timed_period();
+    int      send_call_count();
+}
+
+/* A 120 BPM tempo with a beat at 10000 */
+static void set_tempo() {
+    tempo.period = 500;
+    tempo.next_beat = 10000;
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&tempo, 0, sizeof (tempo));
+    memset(&quant, 0, sizeof (quant));
+    reset_send_captures();
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_quantize_off_sends_immediately() {
+    set_tempo();
+    TEST_ASSERT_FALSE(quant_hold(66, 1, 100, 10100));
+    TEST_ASSERT_EQUAL(1, quant.stats.immediate);
+    TEST_ASSERT_EQUAL(0, quant.count);
+}
+
+void test_quantize_needs_tempo() {
+    quant.grid = QUANT_EIGHTH;
+    TEST_ASSERT_EQUAL(0, quant_period());
+    TEST_ASSERT_FALSE(quant_hold(66, 1, 100, 10100));
+}
+
+void test_quantize_grid_periods() {
+    set_tempo();
+    quant.grid = QUANT_QUARTER;
+    TEST_ASSERT_EQUAL(500, quant_period());
+    quant.grid = QUANT_EIGHTH;
+    TEST_ASSERT_EQUAL(250, quant_period());
+    quant.grid = QUANT_SIXTEENTH;
+    TEST_ASSERT_EQUAL(125, quant_period());
+}
+
+void test_quantize_next_tick() {
+    set_tempo();
+    quant.grid = QUANT_SIXTEENTH;
+    TEST_ASSERT_EQUAL(10125, quant_next_tick(10001));
+    TEST_ASSERT_EQUAL(10250, quant_next_tick(10250));
+
+    // Ticks before the last beat follow the same grid
+    TEST_ASSERT_EQUAL(9875, quant_next_tick(9800));
+
+    // A stale beat clock still gives ticks on its grid
+    TEST_ASSERT_EQUAL(20000, quant_next_tick(19999));
+}
+
+void test_quantize_held_until_tick() {
+    set_tempo();
+    quant.grid = QUANT_EIGHTH;
+    TEST_ASSERT_TRUE(quant_hold(66, 1, 100, 10100));
+    TEST_ASSERT_EQUAL(1, quant.count);
+
+    quant_release(10249);
+    TEST_ASSERT_FALSE(send_timed_was_called());
+
+    quant_release(10252);
+    TEST_ASSERT_TRUE(send_timed_was_called());
+    TEST_ASSERT_EQUAL(66, last_timed_address());
+    TEST_ASSERT_EQUAL(100, last_timed_period());
+    TEST_ASSERT_EQUAL(0, quant.count);
+
+    TEST_ASSERT_EQUAL(1, quant.stats.released);
+    TEST_ASSERT_EQUAL(152, quant.stats.wait_max);
+    TEST_ASSERT_EQUAL(2, quant.stats.late_max);
+}
+
+void test_quantize_on_tick_sent_now() {
+    set_tempo();
+    quant.grid = QUANT_QUARTER;
+    TEST_ASSERT_TRUE(quant_hold(66, 1, 100, 10500));
+    TEST_ASSERT_EQUAL(1, send_call_count());
+    TEST_ASSERT_EQUAL(0, quant.count);
+    TEST_ASSERT_EQUAL(0, quant.stats.wait_max);
+}
+
+void test_quantize_same_output_combined() {
+    set_tempo();
+    quant.grid = QUANT_QUARTER;
+    quant_hold(66, 1, 100, 10100);
+    quant_hold(66, 1, 300, 10200);
+    quant_hold(66, 2, 50, 10200);
+    TEST_ASSERT_EQUAL(2, quant.count);
+
+    quant_release(10500);
+    TEST_ASSERT_EQUAL(2, send_call_count());
+    TEST_ASSERT_EQUAL(2, quant.stats.released);
+    TEST_ASSERT_EQUAL(400, quant.stats.wait_max);
+    TEST_ASSERT_EQUAL(350, quant_wait_average());
+}
+
+void test_quantize_full_sends_immediately() {
+    set_tempo();
+    quant.grid = QUANT_QUARTER;
+    for (uint8_t i = 0; i < QUANT_SLOTS; i++) {
+        TEST_ASSERT_TRUE(quant_hold(66, i, 100, 10100));
+    }
+    TEST_ASSERT_FALSE(quant_hold(69, 0, 100, 10100));
+    TEST_ASSERT_EQUAL(1, quant.stats.immediate);
+}
+
+void test_quantize_immediate_override() {
+    set_tempo();
+    quant.grid = QUANT_QUARTER;
+    quant_hold(66, 1, 100, 10100);
+
+    // Engaging the override sends what's held
+    quant_set_immediate(true, 10150);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+    TEST_ASSERT_EQUAL(0, quant.count);
+    TEST_ASSERT_EQUAL(50, quant.stats.wait_max);
+    TEST_ASSERT_EQUAL(0, quant.stats.late_max);
+
+    TEST_ASSERT_FALSE(quant_hold(66, 1, 100, 10200));
+    quant_set_immediate(false, 10200);
+    TEST_ASSERT_TRUE(quant_hold(66, 1, 100, 10200));
+}
+
+void test_quantize_cancel_drops() {
+    set_tempo();
+    quant.grid = QUANT_QUARTER;
+    quant_hold(66, 1, 100, 10100);
+    quant_cancel();
+    TEST_ASSERT_EQUAL(1, quant.stats.dropped);
+
+    quant_release(11000);
+    TEST_ASSERT_EQUAL(0, send_call_count());
+}
+
+void test_quantize_step_grid() {
+    quant_step_grid();
+    TEST_ASSERT_EQUAL(QUANT_QUARTER, quant.grid);
+    quant_step_grid();
+    TEST_ASSERT_EQUAL(QUANT_EIGHTH, quant.grid);
+    quant_step_grid();
+    TEST_ASSERT_EQUAL(QUANT_SIXTEENTH, quant.grid);
+    quant_step_grid();
+    TEST_ASSERT_EQUAL(QUANT_OFF, quant.grid);
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_quantize_off_sends_immediately);
+    RUN_TEST(test_quantize_needs_tempo);
+    RUN_TEST(test_quantize_grid_periods);
+    RUN_TEST(test_quantize_next_tick);
+    RUN_TEST(test_quantize_held_until_tick);
+    RUN_TEST(test_quantize_on_tick_sent_now);
+    RUN_TEST(test_quantize_same_output_combined);
+    RUN_TEST(test_quantize_full_sends_immediately);
+    RUN_TEST(test_quantize_immediate_override);
+    RUN_TEST(test_quantize_cancel_drops);
+    RUN_TEST(test_quantize_step_grid);
+
+    return UNITY_END();
+}
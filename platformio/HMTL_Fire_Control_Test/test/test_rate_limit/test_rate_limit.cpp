@@ -0,0 +1,126 @@
+/*
+ * Native tests for per-output send rate limiting.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_rate_limit
+ */
+
+#include <unity.h>
+#include "HMTLTypes.h"
+#include "RS485Utils.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Limit.h"
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    fire_config_defaults();
+    rate_reset();
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_rate_classes() {
+    TEST_ASSERT_EQUAL(RATE_CLASS_IGNITER,
+                      rate_class(poofer1_address, POOFER1_IGNITER));
+    TEST_ASSERT_EQUAL(RATE_CLASS_PILOT,
+                      rate_class(poofer1_address, POOFER1_PILOT));
+    TEST_ASSERT_EQUAL(RATE_CLASS_ACCUMULATOR,
+                      rate_class(poofer1_address, POOFER1_LARGE));
+    TEST_ASSERT_EQUAL(RATE_CLASS_ACCUMULATOR,
+                      rate_class(poofer2_address, POOFER2_POOF1));
+    TEST_ASSERT_EQUAL(RATE_CLASS_LIGHTS,
+                      rate_class(lights_address, HMTL_ALL_OUTPUTS));
+}
+
+void test_rate_burst_then_limited() {
+    // Accumulators default to 20/s with a burst of 5
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_TRUE(rate_allow(poofer2_address, POOFER2_POOF1, 1000));
+    }
+    TEST_ASSERT_FALSE(rate_allow(poofer2_address, POOFER2_POOF1, 1000));
+    TEST_ASSERT_EQUAL(1, rate_drops[RATE_CLASS_ACCUMULATOR]);
+    TEST_ASSERT_EQUAL(poofer2_address, rate_drop_address);
+    TEST_ASSERT_EQUAL(POOFER2_POOF1, rate_drop_output);
+}
+
+void test_rate_refills_over_time() {
+    for (int i = 0; i < 5; i++) {
+        rate_allow(poofer2_address, POOFER2_POOF1, 1000);
+    }
+    TEST_ASSERT_FALSE(rate_allow(poofer2_address, POOFER2_POOF1, 1000));
+
+    // One message per 50ms interval
+    TEST_ASSERT_TRUE(rate_allow(poofer2_address, POOFER2_POOF1, 1050));
+    TEST_ASSERT_FALSE(rate_allow(poofer2_address, POOFER2_POOF1, 1050));
+}
+
+void test_rate_sustained_loop_resend() {
+    // A message every 1ms for one second is held to the configured rate
+    int allowed = 0;
+    for (unsigned long t = 5000; t < 6000; t++) {
+        if (rate_allow(poofer2_address, POOFER2_POOF2, t)) allowed++;
+    }
+    TEST_ASSERT_INT_WITHIN(1, 20 + 5, allowed);
+}
+
+void test_rate_outputs_independent() {
+    for (int i = 0; i < 5; i++) {
+        rate_allow(poofer2_address, POOFER2_POOF1, 1000);
+    }
+    TEST_ASSERT_FALSE(rate_allow(poofer2_address, POOFER2_POOF1, 1000));
+    TEST_ASSERT_TRUE(rate_allow(poofer2_address, POOFER2_POOF2, 1000));
+    TEST_ASSERT_TRUE(rate_allow(poofer1_address, POOFER1_LARGE, 1000));
+}
+
+void test_rate_zero_is_unlimited() {
+    fire_config.rate_limits[RATE_CLASS_LIGHTS].per_second = 0;
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_TRUE(rate_allow(lights_address, 0, 1000));
+    }
+    TEST_ASSERT_EQUAL(0, rate_drops[RATE_CLASS_LIGHTS]);
+}
+
+void test_rate_idle_past_wrap_is_full() {
+    for (int i = 0; i < 5; i++) {
+        rate_allow(poofer2_address, POOFER2_POOF1, 1000);
+    }
+    // Over 16 bits of milliseconds later the refreshed bucket is full
+    unsigned long later = 1000 + 65536UL + 10;
+    for (unsigned long t = 1000; t < later; t += 1000) {
+        rate_refresh(t);
+    }
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_TRUE(rate_allow(poofer2_address, POOFER2_POOF1, later));
+    }
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_rate_classes);
+    RUN_TEST(test_rate_burst_then_limited);
+    RUN_TEST(test_rate_refills_over_time);
+    RUN_TEST(test_rate_sustained_loop_resend);
+    RUN_TEST(test_rate_outputs_independent);
+    RUN_TEST(test_rate_zero_is_unlimited);
+    RUN_TEST(test_rate_idle_past_wrap_is_full);
+
+    return UNITY_END();
+}
@@ -13,13 +13,22 @@
 #include "RS485Utils.h"
 #include "HMTL_Fire_Control.h"
 #include "Fire_Control_Sensors.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Tempo.h"
+#include "Fire_Control_Sequence.h"
+#include "Fire_Control_Pattern.h"
+#include "EEPROM.h"
 
 // Functions defined in Fire_Control_Sensors.cpp but not in any public header
 void checkPulse(uint8_t sensor, uint16_t address, uint8_t output,
                 uint16_t onperiod, uint16_t offperiod);
 void sendLEDMode();
+void sendPulseWithLights(uint8_t role, uint16_t address, uint8_t output,
+                         uint16_t onperiod, uint16_t offperiod);
+void cancelPulseWithLights(uint8_t role, uint16_t address, uint8_t output);
 void handle_ignition();
 void handle_poof_enable();
+void handle_single_quint();
 
 // Controllable clock
 extern unsigned long _mock_millis;
@@ -46,6 +55,7 @@ extern "C" {
     void reset_mode_captures();
     bool sparkle_was_called();
     bool blink_was_called();
+    int  sequence_start_count();
 
     // debug log
     void debug_log_begin_test(const char *name);
@@ -78,6 +88,11 @@ void setUp() {
     reset_mode_captures();
     clear_all_pins();
     touch_sensor._clearAll();
+    touch_states = 0;
+    touch_edges = 0;
+    memset(&tempo, 0, sizeof (tempo));
+    memset(EEPROM.data, 0xFF, sizeof (EEPROM.data));
+    fire_config_defaults();
 
     // Default pulse globals to known values
     pulse_bpm_1 = 60;   pulse_length_1 = 25;
@@ -174,6 +189,37 @@ void test_sensor_to_led_boundary_at_6() {
     TEST_ASSERT_EQUAL(11, sensor_to_led(5));
 }
 
+void test_sensor_led_map_covers_leds() {
+    // Every LED is driven by exactly one sensor
+    uint16_t leds = 0;
+    for (uint8_t i = 0; i < MPR121::MAX_SENSORS; i++) {
+        leds |= (1 << sensor_led_map[i]);
+    }
+    TEST_ASSERT_EQUAL_HEX16(0x0FFF, leds);
+}
+
+// ============================================================================
+// sensor_cap tests — touch and edge masks
+// ============================================================================
+
+void test_sensor_cap_edge_masks() {
+    touch_sensor._setTouched(3, true);
+    sensor_cap();
+    TEST_ASSERT_EQUAL_HEX16(1 << 3, touch_edges);
+    TEST_ASSERT_EQUAL_HEX16(1 << 3, touch_states);
+
+    // A read with nothing new clears the edges but keeps the touches
+    touch_sensor._setNoChange();
+    sensor_cap();
+    TEST_ASSERT_EQUAL_HEX16(0, touch_edges);
+    TEST_ASSERT_EQUAL_HEX16(1 << 3, touch_states);
+
+    touch_sensor._setTouched(3, false);
+    sensor_cap();
+    TEST_ASSERT_EQUAL_HEX16(1 << 3, touch_edges);
+    TEST_ASSERT_EQUAL_HEX16(0, touch_states);
+}
+
 // ============================================================================
 // sensor_switches tests — mocked digitalRead
 // ============================================================================
@@ -254,6 +300,110 @@ void test_checkPulse_no_change_sends_nothing() {
     TEST_ASSERT_EQUAL(0, send_call_count());
 }
 
+void test_checkPulse_waits_for_beat() {
+    // 120 BPM with a beat at 1000
+    tempo.period = 500;
+    tempo.next_beat = 1000;
+    tempo_beat(1000);
+
+    touch_sensor._setTouched(0, true);
+    sensor_cap();
+    align_pulses(1200);
+    checkPulse(0, poofer1_address, POOFER2_POOF1, 100, 200);
+    TEST_ASSERT_FALSE(send_blink_was_called());
+
+    // Still held at the beat
+    touch_sensor._setNoChange();
+    sensor_cap();
+    align_pulses(1500);
+    checkPulse(0, poofer1_address, POOFER2_POOF1, 100, 200);
+    TEST_ASSERT_TRUE(send_blink_was_called());
+
+    // Only started once
+    reset_send_captures();
+    align_pulses(2000);
+    checkPulse(0, poofer1_address, POOFER2_POOF1, 100, 200);
+    TEST_ASSERT_EQUAL(0, send_call_count());
+}
+
+void test_checkPulse_released_before_beat() {
+    tempo.period = 500;
+    tempo.next_beat = 1500;
+
+    touch_sensor._setTouched(0, true);
+    sensor_cap();
+    align_pulses(1200);
+    touch_sensor._setTouched(0, false);
+    sensor_cap();
+    align_pulses(1500);
+    checkPulse(0, poofer1_address, POOFER2_POOF1, 100, 200);
+    TEST_ASSERT_FALSE(send_blink_was_called());
+    TEST_ASSERT_TRUE(send_cancel_was_called());
+}
+
+void test_stored_sequence_replaces_program_2_pulses() {
+    // 120 BPM with a beat at 1500
+    tempo.period = 500;
+    tempo.next_beat = 1500;
+
+    seq_header_t header;
+    memset(&header, 0, sizeof (header));
+    header.magic = SEQ_MAGIC;
+    header.num_steps = 1;
+    EEPROM.put(SEQ_EEPROM_ADDR, header);
+    switch_states[PROGRAM_MODE_SWITCH] = true;
+
+    // Press between beats starts the sequence
+    touch_sensor._setTouched(POOFER_PROGRAM_2_SENSOR, true);
+    sensor_cap();
+    align_pulses(1200);
+    handle_single_quint();
+    TEST_ASSERT_EQUAL(1, sequence_start_count());
+
+    // Still held across the beat, no pulses start
+    touch_sensor._setTouched(POOFER_PROGRAM_2_SENSOR, true);
+    sensor_cap();
+    align_pulses(1500);
+    handle_single_quint();
+    TEST_ASSERT_FALSE(send_blink_was_called());
+
+    // Release
+    touch_sensor._setTouched(POOFER_PROGRAM_2_SENSOR, false);
+    sensor_cap();
+    align_pulses(1600);
+    handle_single_quint();
+    TEST_ASSERT_FALSE(send_blink_was_called());
+    TEST_ASSERT_EQUAL(1, sequence_start_count());
+}
+
+void test_calculate_pulse_locked_to_tempo() {
+    tempo.period = 500;
+    tempo.ratio[1] = 2;
+    tempo.ratio[2] = -2;
+    calculate_pulse();
+
+    TEST_ASSERT_EQUAL(120, pulse_bpm(0, pulse_bpm_1));
+    TEST_ASSERT_EQUAL(500 - 25, pulse_delay_1);
+    TEST_ASSERT_EQUAL(240, pulse_bpm(1, pulse_bpm_2));
+    TEST_ASSERT_EQUAL(250 - 25, pulse_delay_2);
+    TEST_ASSERT_EQUAL(60, pulse_bpm(2, pulse_bpm_3));
+    TEST_ASSERT_EQUAL(1000 - 25, pulse_delay_3);
+}
+
+void test_calculate_pulse_tempo_clear_restores_rates() {
+    tempo.period = 500;
+    calculate_pulse();
+    TEST_ASSERT_EQUAL(500 - 25, pulse_delay_1);
+
+    tempo_clear();
+    calculate_pulse();
+    TEST_ASSERT_EQUAL(60, pulse_bpm_1);
+    TEST_ASSERT_EQUAL(60, pulse_bpm(0, pulse_bpm_1));
+    TEST_ASSERT_EQUAL(1000 - 25, pulse_delay_1);
+    TEST_ASSERT_EQUAL(200, pulse_bpm_4);
+    TEST_ASSERT_EQUAL(300 - 25, pulse_delay_4);
+}
+
 // ============================================================================
 // sendLEDMode tests — light output based on lights_on / led_mode state
 // ============================================================================
@@ -378,6 +528,61 @@ void test_poof_enable_off_sends_cancel_to_all_poofers() {
     TEST_ASSERT_TRUE(send_call_count() > 0);
 }
 
+void test_poof_enable_off_stops_pattern() {
+    pattern.running = true;
+    switch_states[POOFER_ENABLE_SWITCH]  = false;
+    switch_changed[POOFER_ENABLE_SWITCH] = true;
+    handle_poof_enable();
+    TEST_ASSERT_FALSE(pattern.running);
+}
+
+void test_poof_enable_off_uses_poofer_group() {
+    fire_config.group_roles[GROUP_ROLE_POOFERS] = 2;
+    switch_states[POOFER_ENABLE_SWITCH]  = false;
+    switch_changed[POOFER_ENABLE_SWITCH] = true;
+    handle_poof_enable();
+    // A cancel and off to the group, then to each of the 5 poofers
+    TEST_ASSERT_EQUAL(12, send_call_count());
+    TEST_ASSERT_EQUAL(poofer2_address, last_send_address());
+    TEST_ASSERT_EQUAL(POOFER2_POOF4, last_send_output());
+}
+
+void test_pulse_with_group_also_pulses_poofer() {
+    fire_config.group_roles[GROUP_ROLE_PULSE_1] = 3;
+    sendPulseWithLights(GROUP_ROLE_PULSE_1, poofer2_address, POOFER2_POOF1,
+                        25, 975);
+    // The group, then the poofer directly
+    TEST_ASSERT_EQUAL(2, send_call_count());
+}
+
+void test_pulse_cancel_with_group_also_cancels_poofer() {
+    fire_config.group_roles[GROUP_ROLE_PULSE_1] = 3;
+    lights_on = true;
+    led_mode = LED_MODE_BLINK;
+    cancelPulseWithLights(GROUP_ROLE_PULSE_1, poofer2_address, POOFER2_POOF1);
+    // A cancel and off to the group and the poofer, then the lights blink
+    TEST_ASSERT_EQUAL(5, send_call_count());
+    TEST_ASSERT_EQUAL(poofer2_address, last_send_address());
+    TEST_ASSERT_EQUAL(POOFER2_POOF1, last_send_output());
+    TEST_ASSERT_EQUAL(0, last_send_value_int());
+}
+
+// ============================================================================
+// Group address tests
+// ============================================================================
+
+void test_group_address_unset_is_invalid() {
+    TEST_ASSERT_EQUAL(SOCKET_ADDR_INVALID, fire_group_address(GROUP_ROLE_POOFERS));
+}
+
+void test_group_outputs_from_membership() {
+    fire_config.group_members[1].group   = 3;
+    fire_config.group_members[1].outputs = 0x05;
+    TEST_ASSERT_EQUAL(0x05, fire_group_outputs(3));
+    TEST_ASSERT_EQUAL(0, fire_group_outputs(4));
+    TEST_ASSERT_EQUAL(0, fire_group_outputs(0));
+}
+
 // ============================================================================
 // main
 // ============================================================================
@@ -395,6 +600,8 @@ int main(int argc, char **argv) {
     RUN_TEST(test_sensor_to_led_upper_half);
     RUN_TEST(test_sensor_to_led_lower_half);
     RUN_TEST(test_sensor_to_led_boundary_at_6);
+    RUN_TEST(test_sensor_led_map_covers_leds);
+    RUN_TEST(test_sensor_cap_edge_masks);
 
     // sensor_switches
     RUN_TEST(test_sensor_switches_detects_press);
@@ -407,6 +614,11 @@ int main(int argc, char **argv) {
     RUN_TEST(test_checkPulse_touched_sends_blink);
     RUN_TEST(test_checkPulse_released_sends_cancel_and_off);
     RUN_TEST(test_checkPulse_no_change_sends_nothing);
+    RUN_TEST(test_checkPulse_waits_for_beat);
+    RUN_TEST(test_checkPulse_released_before_beat);
+    RUN_TEST(test_stored_sequence_replaces_program_2_pulses);
+    RUN_TEST(test_calculate_pulse_locked_to_tempo);
+    RUN_TEST(test_calculate_pulse_tempo_clear_restores_rates);
 
     // sendLEDMode
     RUN_TEST(test_send_led_mode_off_sends_cancel_and_off);
@@ -423,6 +635,14 @@ int main(int argc, char **argv) {
     RUN_TEST(test_poof_enable_on_calls_blink);
     RUN_TEST(test_poof_enable_off_calls_sparkle);
     RUN_TEST(test_poof_enable_off_sends_cancel_to_all_poofers);
+    RUN_TEST(test_poof_enable_off_stops_pattern);
+    RUN_TEST(test_poof_enable_off_uses_poofer_group);
+    RUN_TEST(test_pulse_with_group_also_pulses_poofer);
+    RUN_TEST(test_pulse_cancel_with_group_also_cancels_poofer);
+
+    // group addresses
+    RUN_TEST(test_group_address_unset_is_invalid);
+    RUN_TEST(test_group_outputs_from_membership);
 
     return UNITY_END();
 }
@@ -0,0 +1,312 @@
+/*
+ * Native tests for the stored poofer sequence.
+ *
+ * Sequences are written straight into the EEPROM stub, or through the host
+ * message, and the messages sent for each step are captured by the sendHMTL*
+ * stubs.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_sequence
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "EEPROM.h"
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "HMTLPrograms.h"
+#include "RS485Utils.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Sequence.h"
+
+extern unsigned long _mock_millis;
+extern bool switch_states[];
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void     reset_send_captures();
+    bool     send_value_was_called();
+    int      last_send_value_int();
+    bool     send_timed_was_called();
+    uint16_t last_timed_address();
+    uint32_t last_timed_period();
+    bool     send_cancel_was_called();
+    int      send_call_count();
+}
+
+static seq_header_t header;
+
+static void store_header(uint16_t num_steps, uint8_t flags) {
+    header.magic = SEQ_MAGIC;
+    header.flags = flags;
+    header.num_steps = num_steps;
+    EEPROM.put(SEQ_EEPROM_ADDR, header);
+}
+
+static void store_step(uint16_t index, uint8_t delay, uint8_t op,
+                       uint8_t value) {
+    seq_step_t step = { delay, op, value };
+    EEPROM.put(SEQ_STEP_ADDR(index), step);
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(EEPROM.data, 0xFF, sizeof (EEPROM.data));
+    memset(&seq, 0, sizeof (seq));
+    memset(&header, 0, sizeof (header));
+    reset_send_captures();
+
+    // Sequences only run with the poofers armed
+    switch_states[POOFER_ENABLE_SWITCH] = true;
+    switch_states[POOFER_PILOT_SWITCH] = true;
+
+    header.targets[0].address = 69;
+    header.targets[0].output = 0;
+    header.targets[1].address = 66;
+    header.targets[1].output = 2;
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_sequence_step_is_compact() {
+    TEST_ASSERT_EQUAL(3, sizeof (seq_step_t));
+}
+
+void test_sequence_none_stored() {
+    TEST_ASSERT_FALSE(seq_valid());
+    TEST_ASSERT_FALSE(seq_start(1000));
+    TEST_ASSERT_FALSE(seq.running);
+}
+
+void test_sequence_too_long_invalid() {
+    store_header((EEPROM.length() - SEQ_EEPROM_ADDR) / sizeof (seq_step_t),
+                 0);
+    TEST_ASSERT_FALSE(seq_valid());
+
+    store_header(0, 0);
+    TEST_ASSERT_FALSE(seq_valid());
+}
+
+void test_sequence_steps_sent_when_due() {
+    store_header(3, 0);
+    store_step(0, 0,  SEQ_OP(0, SEQ_ACTION_BURST), 5);
+    store_step(1, 10, SEQ_OP(1, SEQ_ACTION_BURST), 8);
+    store_step(2, 0,  SEQ_OP(0, SEQ_ACTION_VALUE), 128);
+
+    TEST_ASSERT_TRUE(seq_start(1000));
+    TEST_ASSERT_TRUE(seq_run(1000));
+    TEST_ASSERT_EQUAL(1, send_call_count());
+    TEST_ASSERT_EQUAL(69, last_timed_address());
+    TEST_ASSERT_EQUAL(5 * SEQ_TICK_MS, last_timed_period());
+
+    seq_run(1099);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+
+    // The last two steps are due together
+    TEST_ASSERT_FALSE(seq_run(1100));
+    TEST_ASSERT_EQUAL(3, send_call_count());
+    TEST_ASSERT_EQUAL(66, last_timed_address());
+    TEST_ASSERT_EQUAL(8 * SEQ_TICK_MS, last_timed_period());
+    TEST_ASSERT_EQUAL(128, last_send_value_int());
+    TEST_ASSERT_EQUAL(1, seq.plays);
+}
+
+void test_sequence_late_run_keeps_schedule() {
+    store_header(3, 0);
+    store_step(0, 0,  SEQ_OP(0, SEQ_ACTION_BURST), 5);
+    store_step(1, 10, SEQ_OP(0, SEQ_ACTION_BURST), 5);
+    store_step(2, 10, SEQ_OP(0, SEQ_ACTION_BURST), 5);
+
+    seq_start(1000);
+    seq_run(1030);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+
+    // Following steps are timed from when the first was due
+    seq_run(1100);
+    TEST_ASSERT_EQUAL(2, send_call_count());
+    TEST_ASSERT_EQUAL(1200, seq.due);
+}
+
+void test_sequence_wait_sends_nothing() {
+    store_header(2, 0);
+    store_step(0, 0,   SEQ_OP(0, SEQ_ACTION_WAIT), 0);
+    store_step(1, 200, SEQ_OP(0, SEQ_ACTION_CANCEL), 0);
+
+    seq_start(1000);
+    seq_run(1000);
+    TEST_ASSERT_EQUAL(0, send_call_count());
+
+    seq_run(3000);
+    TEST_ASSERT_TRUE(send_cancel_was_called());
+    TEST_ASSERT_TRUE(send_value_was_called());
+    TEST_ASSERT_EQUAL(0, last_send_value_int());
+}
+
+void test_sequence_capped_per_run() {
+    store_header(20, 0);
+    for (uint16_t i = 0; i < 20; i++) {
+        store_step(i, 0, SEQ_OP(0, SEQ_ACTION_VALUE), i);
+    }
+
+    seq_start(1000);
+    seq_run(1000);
+    TEST_ASSERT_EQUAL(SEQ_MAX_PER_RUN, send_call_count());
+    seq_run(1000);
+    seq_run(1000);
+    TEST_ASSERT_EQUAL(20, send_call_count());
+    TEST_ASSERT_FALSE(seq.running);
+}
+
+void test_sequence_loops() {
+    store_header(2, SEQ_FLAG_LOOP);
+    store_step(0, 5, SEQ_OP(0, SEQ_ACTION_BURST), 5);
+    store_step(1, 5, SEQ_OP(1, SEQ_ACTION_BURST), 5);
+
+    seq_start(1000);
+    for (unsigned long now = 1000; now <= 1200; now++) {
+        TEST_ASSERT_TRUE(seq_run(now));
+    }
+    // A step every 50ms from 1050
+    TEST_ASSERT_EQUAL(4, send_call_count());
+    TEST_ASSERT_EQUAL(2, seq.plays);
+}
+
+void test_sequence_stop() {
+    store_header(2, 0);
+    store_step(0, 0,  SEQ_OP(0, SEQ_ACTION_BURST), 5);
+    store_step(1, 10, SEQ_OP(0, SEQ_ACTION_BURST), 5);
+
+    seq_start(1000);
+    seq_run(1000);
+    seq_stop();
+    TEST_ASSERT_FALSE(seq_run(2000));
+    TEST_ASSERT_EQUAL(1, send_call_count());
+}
+
+void test_sequence_stops_when_disarmed() {
+    store_header(2, 0);
+    store_step(0, 0,  SEQ_OP(0, SEQ_ACTION_BURST), 5);
+    store_step(1, 10, SEQ_OP(0, SEQ_ACTION_BURST), 5);
+
+    seq_start(1000);
+    seq_run(1000);
+    switch_states[POOFER_PILOT_SWITCH] = false;
+    TEST_ASSERT_FALSE(seq_run(1100));
+    TEST_ASSERT_FALSE(seq.running);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+
+    // Rearming doesn't resume it
+    switch_states[POOFER_PILOT_SWITCH] = true;
+    TEST_ASSERT_FALSE(seq_run(1200));
+    TEST_ASSERT_EQUAL(1, send_call_count());
+}
+
+void test_sequence_program_done() {
+    store_header(1, 0);
+    store_step(0, 0, SEQ_OP(0, SEQ_ACTION_BURST), 5);
+
+    program_tracker_t tracker;
+    memset(&tracker, 0, sizeof (tracker));
+    msg_program_t msg;
+    memset(&msg, 0, sizeof (msg));
+
+    _mock_millis = 1000;
+    TEST_ASSERT_TRUE(program_sequence_init(&msg, &tracker, NULL, NULL, NULL));
+    TEST_ASSERT_NULL(tracker.state);
+
+    // The program never reports a change to its own output
+    TEST_ASSERT_FALSE(program_sequence(NULL, NULL, &tracker));
+    TEST_ASSERT_TRUE(tracker.done);
+    TEST_ASSERT_EQUAL(1, send_call_count());
+}
+
+void test_sequence_host_write() {
+    store_step(0, 0, SEQ_OP(1, SEQ_ACTION_BURST), 7);
+    header.magic = SEQ_MAGIC;
+    header.num_steps = 1;
+
+    byte frame[sizeof (msg_hdr_t) + sizeof (msg_fire_sequence_t) +
+               sizeof (seq_header_t)];
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)frame;
+    hmtl_msg_fmt(msg_hdr, 64, sizeof (frame), MSG_TYPE_FIRE_SEQUENCE);
+    msg_fire_sequence_t *msg = (msg_fire_sequence_t *)(msg_hdr + 1);
+    msg->offset = 0;
+    memcpy(msg->data, &header, sizeof (header));
+
+    // Writing stops the running sequence
+    seq.running = true;
+    seq_host_msg(msg_hdr);
+    TEST_ASSERT_FALSE(seq.running);
+    TEST_ASSERT_TRUE(seq_valid());
+
+    seq_start(1000);
+    seq_run(1000);
+    TEST_ASSERT_EQUAL(66, last_timed_address());
+}
+
+void test_sequence_host_write_past_end() {
+    byte frame[sizeof (msg_hdr_t) + sizeof (msg_fire_sequence_t) + 4];
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)frame;
+    hmtl_msg_fmt(msg_hdr, 64, sizeof (frame), MSG_TYPE_FIRE_SEQUENCE);
+    msg_fire_sequence_t *msg = (msg_fire_sequence_t *)(msg_hdr + 1);
+    msg->offset = EEPROM.length() - SEQ_EEPROM_ADDR - 2;
+    memset(msg->data, 0, 4);
+
+    seq_host_msg(msg_hdr);
+    TEST_ASSERT_EQUAL(0xFF, EEPROM.read(EEPROM.length() - 2));
+}
+
+void test_sequence_config_overlap_refused() {
+    store_header(1, 0);
+    store_step(0, 0, SEQ_OP(0, SEQ_ACTION_BURST), 5);
+
+    seq_config_end(SEQ_EEPROM_ADDR);
+    TEST_ASSERT_TRUE(seq_valid());
+
+    seq_config_end(SEQ_EEPROM_ADDR + 1);
+    TEST_ASSERT_FALSE(seq_valid());
+    TEST_ASSERT_FALSE(seq_start(1000));
+
+    // Host writes would overwrite the config
+    byte frame[sizeof (msg_hdr_t) + sizeof (msg_fire_sequence_t) + 1];
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)frame;
+    hmtl_msg_fmt(msg_hdr, 64, sizeof (frame), MSG_TYPE_FIRE_SEQUENCE);
+    msg_fire_sequence_t *msg = (msg_fire_sequence_t *)(msg_hdr + 1);
+    msg->offset = 0;
+    msg->data[0] = 0;
+    seq_host_msg(msg_hdr);
+    TEST_ASSERT_EQUAL(SEQ_MAGIC, EEPROM.read(SEQ_EEPROM_ADDR));
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_sequence_step_is_compact);
+    RUN_TEST(test_sequence_none_stored);
+    RUN_TEST(test_sequence_too_long_invalid);
+    RUN_TEST(test_sequence_steps_sent_when_due);
+    RUN_TEST(test_sequence_late_run_keeps_schedule);
+    RUN_TEST(test_sequence_wait_sends_nothing);
+    RUN_TEST(test_sequence_capped_per_run);
+    RUN_TEST(test_sequence_loops);
+    RUN_TEST(test_sequence_stop);
+    RUN_TEST(test_sequence_stops_when_disarmed);
+    RUN_TEST(test_sequence_program_done);
+    RUN_TEST(test_sequence_host_write);
+    RUN_TEST(test_sequence_host_write_past_end);
+    RUN_TEST(test_sequence_config_overlap_refused);
+
+    return UNITY_END();
+}
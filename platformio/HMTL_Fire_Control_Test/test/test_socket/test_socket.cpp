@@ -0,0 +1,306 @@
+/*
+ * Native tests for the FireSocket receive path.
+ *
+ * Messages are sent through the FireSocket and captured from bus_send(), then
+ * fed back through it reading from a socket the test fills, along with hand
+ * made truncated and over-length frames.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_socket
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTLMessaging.h"
+#include "RS485Utils.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Arbiter.h"
+#include "Fire_Control_Socket.h"
+#include "Fire_Control_Discovery.h"
+#include "Fire_Control_Link.h"
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+    void        reset_bus_frames();
+    int         bus_frame_count();
+    const byte *bus_frame(int n);
+    int         bus_frame_length(int n);
+    uint16_t    bus_frame_address(int n);
+    uint8_t     bus_frame_priority(int n);
+    int         probe_response_count();
+    void        reset_dirty_captures();
+    uint16_t    outputs_dirty_mask();
+    int         dirty_msg_count();
+}
+
+#define NODE_ADDRESS   66  // poofer1, sent at fire priority
+#define LIGHTS_NODE    67
+#define OTHER_NODE     69
+#define TEST_GROUP     3
+#define MAX_RECEIVED   8
+
+#define VALUE_LEN (sizeof (msg_hdr_t) + sizeof (msg_value_t))
+#define MSG_MAX   (sizeof (msg_hdr_t) + sizeof (msg_max_t))
+
+/* Socket the FireSocket reads from, holding one frame at a time */
+class TestBus : public RS485Socket {
+public:
+    using RS485Socket::getMsg;
+
+    byte frame[SEND_DATA_SIZE * 2];
+    unsigned int length;
+    uint16_t source;
+    uint16_t dest;
+    boolean pending;
+
+    void put(uint16_t from, uint16_t to, const byte *data, unsigned int len) {
+        memcpy(frame, data, len);
+        length = len;
+        source = from;
+        dest = to;
+        pending = true;
+    }
+
+    const byte *getMsg(unsigned int *retlen) {
+        if (!pending) {
+            *retlen = 0;
+            return NULL;
+        }
+        pending = false;
+        *retlen = length;
+        return frame;
+    }
+
+    socket_addr_t sourceFromData(void *data) { return source; }
+    socket_addr_t destFromData(void *data) { return dest; }
+};
+
+static TestBus bus;
+static FireSocket sock(&bus);
+
+/* Messages handed on by the FireSocket */
+typedef struct {
+    uint16_t address;
+    uint8_t  output;
+    uint16_t value;
+} received_t;
+
+static received_t received[MAX_RECEIVED];
+static int received_count;
+
+static uint16_t value_msg(byte *buffer, uint16_t address, uint8_t output,
+                          uint16_t value) {
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+    msg_value_t *msg_value = (msg_value_t *)(msg_hdr + 1);
+    msg_value->hdr.type = HMTL_OUTPUT_VALUE;
+    msg_value->hdr.output = output;
+    msg_value->value = value;
+    return hmtl_msg_fmt(msg_hdr, address, VALUE_LEN, MSG_TYPE_OUTPUT, 0);
+}
+
+static void send_value(uint16_t address, uint8_t output, uint16_t value) {
+    byte msg[MSG_MAX];
+    sock.sendMsgTo(address, msg, value_msg(msg, address, output, value));
+}
+
+/* Read every message the current frame holds for this node */
+static void drain() {
+    unsigned int len;
+    const byte *data;
+    while ((data = sock.getMsg(NODE_ADDRESS, &len)) != NULL) {
+        TEST_ASSERT_TRUE(received_count < MAX_RECEIVED);
+        const msg_hdr_t *msg_hdr = (const msg_hdr_t *)data;
+        const msg_value_t *msg_value = (const msg_value_t *)(msg_hdr + 1);
+        TEST_ASSERT_EQUAL(msg_hdr->length, len);
+        received[received_count].address = msg_hdr->address;
+        received[received_count].output = msg_value->hdr.output;
+        received[received_count].value = msg_value->value;
+        received_count++;
+    }
+}
+
+/* Feed a frame captured from bus_send() back in */
+static void receive_sent(int n) {
+    bus.put(config.address, bus_frame_address(n), bus_frame(n),
+            bus_frame_length(n));
+    drain();
+}
+
+static void assert_received(int n, uint16_t address, uint8_t output,
+                            uint16_t value) {
+    TEST_ASSERT_EQUAL(address, received[n].address);
+    TEST_ASSERT_EQUAL(output, received[n].output);
+    TEST_ASSERT_EQUAL(value, received[n].value);
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&fire_config, 0, sizeof (fire_config));
+    fire_config.group_members[0].group = TEST_GROUP;
+    fire_config.group_members[0].outputs = 0x05;
+
+    memset(&disc, 0, sizeof (disc));
+    memset(&link_stats, 0, sizeof (link_stats));
+
+    bus.pending = false;
+    sock = FireSocket(&bus);
+    received_count = 0;
+    reset_bus_frames();
+    reset_dirty_captures();
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Receiving
+// ============================================================================
+
+void test_socket_message_round_trip() {
+    send_value(NODE_ADDRESS, 4, 40);
+    receive_sent(0);
+
+    TEST_ASSERT_EQUAL(1, received_count);
+    assert_received(0, NODE_ADDRESS, 4, 40);
+    TEST_ASSERT_EQUAL(1 << 4, outputs_dirty_mask());
+}
+
+void test_socket_other_node_filtered() {
+    byte msg[MSG_MAX];
+    bus.put(1, OTHER_NODE, msg, value_msg(msg, OTHER_NODE, 1, 10));
+    drain();
+
+    TEST_ASSERT_EQUAL(0, received_count);
+    TEST_ASSERT_EQUAL(1, sock.stats.filtered);
+    TEST_ASSERT_EQUAL(0, dirty_msg_count());
+}
+
+void test_socket_frame_shorter_than_header() {
+    byte msg[MSG_MAX];
+    value_msg(msg, NODE_ADDRESS, 1, 10);
+    bus.put(1, NODE_ADDRESS, msg, VALUE_LEN - 1);
+    drain();
+
+    TEST_ASSERT_EQUAL(0, received_count);
+    TEST_ASSERT_EQUAL(1, sock.stats.malformed);
+    TEST_ASSERT_EQUAL(0, dirty_msg_count());
+
+    bus.put(1, NODE_ADDRESS, msg, sizeof (msg_hdr_t) - 1);
+    drain();
+    TEST_ASSERT_EQUAL(0, received_count);
+    TEST_ASSERT_EQUAL(2, sock.stats.malformed);
+}
+
+void test_socket_group_all_outputs_each_member() {
+    byte msg[MSG_MAX];
+    uint16_t group = FIRE_GROUP_ADDRESS(TEST_GROUP);
+    bus.put(1, group, msg, value_msg(msg, group, HMTL_ALL_OUTPUTS, 99));
+    drain();
+
+    /* Once for each output in the group, as if sent directly */
+    TEST_ASSERT_EQUAL(2, received_count);
+    assert_received(0, NODE_ADDRESS, 0, 99);
+    assert_received(1, NODE_ADDRESS, 2, 99);
+    TEST_ASSERT_EQUAL(2, sock.stats.accepted);
+    TEST_ASSERT_EQUAL(0x05, outputs_dirty_mask());
+}
+
+void test_socket_group_specific_output() {
+    byte msg[MSG_MAX];
+    uint16_t group = FIRE_GROUP_ADDRESS(TEST_GROUP);
+    bus.put(1, group, msg, value_msg(msg, group, 1, 99));
+    drain();
+
+    TEST_ASSERT_EQUAL(1, received_count);
+    assert_received(0, NODE_ADDRESS, 1, 99);
+    TEST_ASSERT_EQUAL(1 << 1, outputs_dirty_mask());
+}
+
+void test_socket_group_not_member_filtered() {
+    byte msg[MSG_MAX];
+    uint16_t group = FIRE_GROUP_ADDRESS(TEST_GROUP + 1);
+    bus.put(1, group, msg, value_msg(msg, group, HMTL_ALL_OUTPUTS, 99));
+    drain();
+
+    TEST_ASSERT_EQUAL(0, received_count);
+    TEST_ASSERT_EQUAL(1, sock.stats.filtered);
+    TEST_ASSERT_EQUAL(0, dirty_msg_count());
+}
+
+void test_socket_group_frame_without_output() {
+    byte msg[MSG_MAX];
+    uint16_t group = FIRE_GROUP_ADDRESS(TEST_GROUP);
+    hmtl_msg_fmt((msg_hdr_t *)msg, group, sizeof (msg_hdr_t),
+                 MSG_TYPE_OUTPUT, 0);
+    bus.put(1, group, msg, sizeof (msg_hdr_t));
+    drain();
+
+    TEST_ASSERT_EQUAL(0, received_count);
+    TEST_ASSERT_EQUAL(1, sock.stats.malformed);
+    TEST_ASSERT_EQUAL(0, dirty_msg_count());
+}
+
+void test_socket_poll_response_consumed() {
+    // The answer to this controller's link probe
+    link_stats.probing = OTHER_NODE;
+    byte msg[MSG_MAX];
+    hmtl_msg_fmt((msg_hdr_t *)msg, NODE_ADDRESS, sizeof (msg_hdr_t),
+                 MSG_TYPE_POLL, MSG_FLAG_RESPONSE);
+    bus.put(OTHER_NODE, NODE_ADDRESS, msg, sizeof (msg_hdr_t));
+    drain();
+
+    TEST_ASSERT_EQUAL(0, received_count);
+    TEST_ASSERT_EQUAL(0, link_stats.probing);
+    TEST_ASSERT_EQUAL(1, probe_response_count());
+    TEST_ASSERT_EQUAL(0, dirty_msg_count());
+}
+
+void test_socket_unexpected_poll_response_passed_on() {
+    // Nothing was probed, the answer is to a poll forwarded for the host
+    link_stats.probing = LIGHTS_NODE;
+    byte msg[MSG_MAX];
+    hmtl_msg_fmt((msg_hdr_t *)msg, NODE_ADDRESS, sizeof (msg_hdr_t),
+                 MSG_TYPE_POLL, MSG_FLAG_RESPONSE);
+    bus.put(OTHER_NODE, NODE_ADDRESS, msg, sizeof (msg_hdr_t));
+    drain();
+
+    TEST_ASSERT_EQUAL(1, received_count);
+    TEST_ASSERT_EQUAL(1, sock.stats.accepted);
+    TEST_ASSERT_EQUAL(LIGHTS_NODE, link_stats.probing);
+}
+
+void test_socket_send_through_bus() {
+    byte msg[MSG_MAX];
+    sock.sendMsgTo(NODE_ADDRESS, msg, value_msg(msg, NODE_ADDRESS, 1, 1));
+    sock.sendMsgTo(LIGHTS_NODE, msg, value_msg(msg, LIGHTS_NODE, 1, 1));
+
+    TEST_ASSERT_EQUAL(2, bus_frame_count());
+    TEST_ASSERT_EQUAL(ARB_PRIORITY_FIRE, bus_frame_priority(0));
+    TEST_ASSERT_EQUAL(ARB_PRIORITY_COSMETIC, bus_frame_priority(1));
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_socket_message_round_trip);
+    RUN_TEST(test_socket_other_node_filtered);
+    RUN_TEST(test_socket_frame_shorter_than_header);
+    RUN_TEST(test_socket_group_all_outputs_each_member);
+    RUN_TEST(test_socket_group_specific_output);
+    RUN_TEST(test_socket_group_not_member_filtered);
+    RUN_TEST(test_socket_group_frame_without_output);
+    RUN_TEST(test_socket_poll_response_consumed);
+    RUN_TEST(test_socket_unexpected_poll_response_passed_on);
+    RUN_TEST(test_socket_send_through_bus);
+
+    return UNITY_END();
+}
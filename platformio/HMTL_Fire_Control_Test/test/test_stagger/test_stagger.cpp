@@ -0,0 +1,187 @@
+/*
+ * Native tests for staggering bursts on a shared supply.
+ *
+ * Built with CONTROL_MODE set to CONTROL_SINGLE_QUINT, where all five
+ * accumulators share one supply.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_stagger
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "HMTLTypes.h"
+#include "HMTL_Fire_Control.h"
+#include "Fire_Control_Config.h"
+#include "Fire_Control_Stagger.h"
+
+extern unsigned long _mock_millis;
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+}
+
+/* Open as many valves as the supply allows, all at the same time */
+static void open_all(unsigned long now, uint32_t duration) {
+    for (uint8_t i = 0; i < STAGGER_MAX_OPEN; i++) {
+        TEST_ASSERT_FALSE(stagger_defer(poofer2_address, i, duration, now));
+    }
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&stagger, 0, sizeof (stagger));
+    _mock_millis = 1000;
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_stagger_supplies() {
+    TEST_ASSERT_EQUAL(0, stagger_supply(poofer2_address, POOFER2_POOF4));
+    TEST_ASSERT_EQUAL(0, stagger_supply(poofer1_address, POOFER1_LARGE));
+    TEST_ASSERT_EQUAL(STAGGER_NO_SUPPLY,
+                      stagger_supply(poofer1_address, POOFER1_IGNITER));
+    TEST_ASSERT_EQUAL(STAGGER_NO_SUPPLY, stagger_supply(lights_address, 0));
+}
+
+void test_stagger_not_accumulator_never_held() {
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_FALSE(stagger_defer(poofer1_address, POOFER1_IGNITER,
+                                        30000, 1000));
+    }
+}
+
+void test_stagger_within_limit_sent() {
+    open_all(1000, 200);
+    TEST_ASSERT_EQUAL(0, stagger.count);
+}
+
+void test_stagger_over_limit_held_until_first_close() {
+    stagger_defer(poofer2_address, POOFER2_POOF1, 100, 1000);
+    stagger_defer(poofer2_address, POOFER2_POOF2, 300, 1000);
+    stagger_defer(poofer2_address, POOFER2_POOF3, 200, 1000);
+
+    // The fourth waits only until the shortest burst ends
+    TEST_ASSERT_TRUE(stagger_defer(poofer2_address, POOFER2_POOF4, 200, 1000));
+    TEST_ASSERT_EQUAL(1, stagger.deferred);
+    TEST_ASSERT_EQUAL(100, stagger.offset_max);
+
+    stagger_burst_t burst;
+    TEST_ASSERT_FALSE(stagger_next(1099, &burst));
+    TEST_ASSERT_TRUE(stagger_next(1100, &burst));
+    TEST_ASSERT_EQUAL(poofer2_address, burst.address);
+    TEST_ASSERT_EQUAL(POOFER2_POOF4, burst.output);
+    TEST_ASSERT_EQUAL(200, burst.duration);
+    TEST_ASSERT_FALSE(stagger_next(1100, &burst));
+}
+
+void test_stagger_held_bursts_chain() {
+    open_all(1000, 100);
+
+    // Each held burst takes the next slot to free up
+    TEST_ASSERT_TRUE(stagger_defer(poofer2_address, POOFER2_POOF4, 100, 1000));
+    TEST_ASSERT_TRUE(stagger_defer(poofer1_address, POOFER1_LARGE, 100, 1000));
+    TEST_ASSERT_EQUAL(2, stagger.count);
+    TEST_ASSERT_EQUAL(1100, stagger.held[0].start);
+    TEST_ASSERT_EQUAL(1100, stagger.held[1].start);
+
+    // The last slot free at 1100 goes, then the next waits for 1200
+    TEST_ASSERT_TRUE(stagger_defer(poofer2_address, POOFER2_POOF1, 100, 1050));
+    TEST_ASSERT_EQUAL(1100, stagger.held[2].start);
+    TEST_ASSERT_TRUE(stagger_defer(poofer2_address, POOFER2_POOF2, 100, 1050));
+    TEST_ASSERT_EQUAL(1200, stagger.held[3].start);
+}
+
+void test_stagger_open_output_extended() {
+    open_all(1000, 100);
+
+    // Another burst to an open valve doesn't open a second one
+    TEST_ASSERT_FALSE(stagger_defer(poofer2_address, POOFER2_POOF1, 300,
+                                    1050));
+    TEST_ASSERT_EQUAL(0, stagger.count);
+    TEST_ASSERT_TRUE(stagger_defer(poofer2_address, POOFER2_POOF4, 100, 1060));
+    TEST_ASSERT_EQUAL(1100, stagger.held[0].start);
+}
+
+void test_stagger_held_output_combined() {
+    open_all(1000, 100);
+    stagger_defer(poofer2_address, POOFER2_POOF4, 100, 1000);
+    TEST_ASSERT_TRUE(stagger_defer(poofer2_address, POOFER2_POOF4, 250, 1010));
+    TEST_ASSERT_EQUAL(1, stagger.count);
+    TEST_ASSERT_EQUAL(250, stagger.held[0].duration);
+}
+
+void test_stagger_full_sends_immediately() {
+    open_all(1000, 1000);
+    stagger.count = STAGGER_HELD;
+    TEST_ASSERT_FALSE(stagger_defer(poofer2_address, POOFER2_POOF4, 10, 1000));
+    TEST_ASSERT_EQUAL(1, stagger.overflow);
+    TEST_ASSERT_EQUAL(0, stagger.deferred);
+}
+
+void test_stagger_cancel_drops_and_frees() {
+    open_all(1000, 500);
+    stagger_defer(poofer2_address, POOFER2_POOF4, 100, 1000);
+
+    _mock_millis = 1010;
+    stagger_cancel(poofer2_address, POOFER2_POOF4);
+    TEST_ASSERT_EQUAL(0, stagger.count);
+
+    // The slot it was held for is free again
+    TEST_ASSERT_FALSE(stagger_defer(poofer2_address, POOFER2_POOF4, 100,
+                                    1020));
+}
+
+void test_stagger_cancel_group_drops_all() {
+    open_all(1000, 500);
+    stagger_defer(poofer2_address, POOFER2_POOF4, 100, 1000);
+    stagger_defer(poofer1_address, POOFER1_LARGE, 100, 1000);
+
+    stagger_cancel(FIRE_GROUP_ADDRESS(1), HMTL_ALL_OUTPUTS);
+    TEST_ASSERT_EQUAL(0, stagger.count);
+    TEST_ASSERT_FALSE(stagger_defer(poofer2_address, POOFER2_POOF4, 100,
+                                    1010));
+}
+
+void test_stagger_clear_drops_all_held() {
+    open_all(1000, 500);
+    stagger_defer(poofer2_address, POOFER2_POOF4, 100, 1000);
+    stagger_defer(poofer1_address, POOFER1_LARGE, 100, 1000);
+
+    stagger_clear();
+    TEST_ASSERT_EQUAL(0, stagger.count);
+    TEST_ASSERT_EQUAL(2, stagger.dropped);
+
+    stagger_burst_t burst;
+    TEST_ASSERT_FALSE(stagger_next(2000, &burst));
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_stagger_supplies);
+    RUN_TEST(test_stagger_not_accumulator_never_held);
+    RUN_TEST(test_stagger_within_limit_sent);
+    RUN_TEST(test_stagger_over_limit_held_until_first_close);
+    RUN_TEST(test_stagger_held_bursts_chain);
+    RUN_TEST(test_stagger_open_output_extended);
+    RUN_TEST(test_stagger_held_output_combined);
+    RUN_TEST(test_stagger_full_sends_immediately);
+    RUN_TEST(test_stagger_cancel_drops_and_frees);
+    RUN_TEST(test_stagger_cancel_group_drops_all);
+    RUN_TEST(test_stagger_clear_drops_all_held);
+
+    return UNITY_END();
+}
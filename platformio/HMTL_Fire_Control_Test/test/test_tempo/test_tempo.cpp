@@ -0,0 +1,171 @@
+/*
+ * Native tests for tap tempo and the beat clock.
+ *
+ *   cd platformio/HMTL_Fire_Control_Test
+ *   pio test -e native -f test_tempo
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "Fire_Control_Tempo.h"
+
+extern "C" {
+    void debug_log_begin_test(const char *name);
+}
+
+static unsigned long now;
+
+/* Tap count times at an interval, returning the result of the last tap */
+static bool taps(int count, unsigned long interval) {
+    bool updated = false;
+    for (int i = 0; i < count; i++) {
+        now += interval;
+        updated = tempo_tap(now);
+    }
+    return updated;
+}
+
+// ============================================================================
+// setUp / tearDown
+// ============================================================================
+
+void setUp() {
+    debug_log_begin_test(Unity.CurrentTestName);
+    memset(&tempo, 0, sizeof (tempo));
+    now = 10000;
+}
+
+void tearDown() {}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+void test_tempo_needs_three_taps() {
+    TEST_ASSERT_FALSE(taps(2, 500));
+    TEST_ASSERT_EQUAL(0, tempo.period);
+    TEST_ASSERT_TRUE(taps(1, 500));
+    TEST_ASSERT_EQUAL(500, tempo.period);
+    TEST_ASSERT_EQUAL(120, tempo_bpm());
+}
+
+void test_tempo_averages_intervals() {
+    now += 500;
+    tempo_tap(now);
+    taps(1, 490);
+    taps(1, 510);
+    taps(1, 500);
+    TEST_ASSERT_EQUAL(500, tempo.period);
+}
+
+void test_tempo_rejects_outlier() {
+    taps(4, 500);
+
+    // A missed tap doubles one interval
+    TEST_ASSERT_FALSE(taps(1, 1000));
+    TEST_ASSERT_EQUAL(1, tempo.rejected);
+    TEST_ASSERT_EQUAL(500, tempo.period);
+
+    TEST_ASSERT_TRUE(taps(1, 505));
+    TEST_ASSERT_INT_WITHIN(2, 500, tempo.period);
+}
+
+void test_tempo_ignores_bounce() {
+    taps(3, 500);
+    now += 20;
+    TEST_ASSERT_FALSE(tempo_tap(now));
+    TEST_ASSERT_EQUAL(1, tempo.rejected);
+
+    // The bounce doesn't move the last tap
+    now -= 20;
+    TEST_ASSERT_TRUE(taps(1, 500));
+    TEST_ASSERT_EQUAL(500, tempo.period);
+}
+
+void test_tempo_change_after_two_agreeing() {
+    taps(4, 500);
+    TEST_ASSERT_FALSE(taps(1, 400));
+    TEST_ASSERT_TRUE(taps(1, 400));
+    TEST_ASSERT_EQUAL(400, tempo.period);
+    TEST_ASSERT_EQUAL(150, tempo_bpm());
+}
+
+void test_tempo_long_gap_restarts() {
+    taps(3, 500);
+    TEST_ASSERT_FALSE(taps(1, TEMPO_MAX_MS + 1));
+    TEST_ASSERT_EQUAL(0, tempo.count);
+
+    // The existing tempo holds until replaced
+    TEST_ASSERT_EQUAL(500, tempo.period);
+    taps(2, 600);
+    TEST_ASSERT_EQUAL(600, tempo.period);
+}
+
+void test_tempo_beats_from_last_tap() {
+    taps(3, 500);
+    unsigned long tap = now;
+
+    TEST_ASSERT_TRUE(tempo_beat(tap));
+    TEST_ASSERT_FALSE(tempo_beat(tap + 499));
+    TEST_ASSERT_TRUE(tempo_beat(tap + 500));
+    TEST_ASSERT_FALSE(tempo_beat(tap + 501));
+
+    // Missed beats are skipped rather than reported late
+    TEST_ASSERT_TRUE(tempo_beat(tap + 2200));
+    TEST_ASSERT_FALSE(tempo_beat(tap + 2400));
+    TEST_ASSERT_TRUE(tempo_beat(tap + 2500));
+}
+
+void test_tempo_no_beats_without_tempo() {
+    TEST_ASSERT_FALSE(tempo_beat(now));
+    taps(3, 500);
+    tempo_clear();
+    TEST_ASSERT_FALSE(tempo_beat(now + 1000));
+}
+
+void test_tempo_channel_ratios() {
+    taps(3, 600);
+    TEST_ASSERT_EQUAL(600, tempo_channel_period(0));
+    TEST_ASSERT_EQUAL(100, tempo_channel_bpm(0));
+
+    tempo_step_ratio(0, true);
+    TEST_ASSERT_EQUAL(2, tempo_channel_ratio(0));
+    TEST_ASSERT_EQUAL(300, tempo_channel_period(0));
+
+    tempo_step_ratio(1, false);
+    TEST_ASSERT_EQUAL(-2, tempo_channel_ratio(1));
+    TEST_ASSERT_EQUAL(1200, tempo_channel_period(1));
+    TEST_ASSERT_EQUAL(50, tempo_channel_bpm(1));
+    tempo_step_ratio(1, true);
+    TEST_ASSERT_EQUAL(1, tempo_channel_ratio(1));
+}
+
+void test_tempo_ratio_limits() {
+    for (int i = 0; i < 10; i++) {
+        tempo_step_ratio(0, true);
+        tempo_step_ratio(1, false);
+    }
+    TEST_ASSERT_EQUAL(TEMPO_MAX_RATIO, tempo_channel_ratio(0));
+    TEST_ASSERT_EQUAL(-TEMPO_MAX_RATIO, tempo_channel_ratio(1));
+}
+
+// ============================================================================
+// main
+// ============================================================================
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_tempo_needs_three_taps);
+    RUN_TEST(test_tempo_averages_intervals);
+    RUN_TEST(test_tempo_rejects_outlier);
+    RUN_TEST(test_tempo_ignores_bounce);
+    RUN_TEST(test_tempo_change_after_two_agreeing);
+    RUN_TEST(test_tempo_long_gap_restarts);
+    RUN_TEST(test_tempo_beats_from_last_tap);
+    RUN_TEST(test_tempo_no_beats_without_tempo);
+    RUN_TEST(test_tempo_channel_ratios);
+    RUN_TEST(test_tempo_ratio_limits);
+
+    return UNITY_END();
+}